@@ -24,15 +24,34 @@
 // TASSE global settings
 // set from command line
 
+// log_level values
+#define LOG_LEVEL_SUMMARY	0		// setup, warnings and final statistics
+#define LOG_LEVEL_SNAPSHOTS	1		// also a record for every snapshot
+
 typedef struct {
 	int			thread_count;
+	int			frames_in_flight;
+	int			log_level;
 	bool		low_prio;
 	bool		pacifier;
 	bool		verbose;
 	bool		convert_only;
 	bool		read_charges;
 	bool		group_bonds;
+	bool		resume;
+	bool		occupancy;
+	bool		water_chains;
+	bool		density_microsets;
+	bool		single_precision;
+	bool		precision_report;
+	bool		tabulated_energy;
 	size_t		first_snap;
+	size_t		last_snap;
+	size_t		snap_stride;
+	size_t		checkpoint_frames;
+	size_t		block_length;
+	size_t		microset_cap;
+	real		checkpoint_minutes;
 	real		dielectric_const;
 	real		electrostatic_radius;
 	real		electrostatic_coeff;
@@ -41,15 +60,29 @@ typedef struct {
 	real		hbond_126_coeff;
 	real		occurence_cutoff;
 	real		vdw_tolerance;
+	real		density_spacing;
 	int			input_topology_nature;
 	int			input_coordinate_nature;
 	int			input_trajectory_nature;
 	char		input_topology[MAX_OSPATH];
 	char		input_coordinate[MAX_OSPATH];
 	char		input_trajectory[MAX_OSPATH];
+	char		trajectory_list[MAX_OSPATH];
 	char		output_pdbname[MAX_OSPATH];
 	char		output_tuples[MAX_OSPATH];
+	char		partial_state[MAX_OSPATH];
+	char		merge_list[MAX_OSPATH];
+	char		results_state[MAX_OSPATH];
+	char		results_query[MAX_OSPATH];
+	char		checkpoint_file[MAX_OSPATH];
+	char		bridge_capture[MAX_OSPATH];
+	char		bridge_replay[MAX_OSPATH];
+	char		density_map[MAX_OSPATH];
+	char		fit_atoms[16];
 	char		solvent_title[8];
+	char		thread_affinity[256];
+	char		hbond_sweep[256];
+	char		occurence_sweep[256];
 #if !defined(_QTASSE)
 	jmp_buf		abort_marker;
 #endif
@@ -24,6 +24,8 @@
 // TASSE log file interface
 // prints formatted messages to the log file
 // color codes will be stripped
+// between BeginAsync and EndAsync, PrintAsync only queues the message for
+// a background thread, which writes it in order with the other messages
 
 interface ILogFile
 {
@@ -33,6 +35,9 @@ interface ILogFile
 	virtual void Write( const char *msg ) = 0;
 	virtual void Close() = 0;
 	virtual void LogTimeElapsed( double elapsed_time ) = 0;
+	virtual void BeginAsync( uint32 numThreads ) = 0;
+	virtual void PrintAsync( uint32 threadNum, const char *fmt, ... ) = 0;
+	virtual void EndAsync() = 0;
 };
 
 extern ILogFile *logfile;
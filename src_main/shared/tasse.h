@@ -63,6 +63,7 @@
 #include <errno.h>
 #include <setjmp.h>
 #include <time.h>
+#include <math.h>
 
 // system-specific includes
 #if defined(_WIN32)
@@ -75,6 +76,7 @@
 #include <unistd.h>
 #include <dirent.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <sys/time.h>
 #include <sys/resource.h>
@@ -90,6 +92,7 @@
 #include <algorithm>
 #include <memory>
 #include <stdexcept>
+#include <atomic>
 
 #if defined(_LINUX)
 #define _stricmp	strcasecmp
@@ -25,29 +25,51 @@
 
 #if defined(_WIN32)
 #define USE_WIN32_THREADS
-#define MAX_THREADS		32
 #elif defined(_LINUX)
 #define USE_POSIX_THREADS
-#define MAX_THREADS		32
 #else
 //single-threaded otherwise
-#define MAX_THREADS		1
 #endif
 
+// per-thread data is aligned to this to avoid false sharing
+#define CACHE_LINE_SIZE	64
+
 // RunThreadsOn flags
 #define RF_PROGRESS		BIT( 0 )
 #define RF_PACIFIER		BIT( 1 )
 
 typedef void (*ThreadStub_t)( uint32, uint32 );
+typedef void (*TaskStub_t)( uint32, uint32, void* );
+typedef void (*JobStub_t)( void* );
 
 extern void ThreadInterrupt();
 extern bool ThreadInterrupted();
 extern void ThreadSetDefault( int count, bool low_priority );
+extern void ThreadSetAffinity( const char *mode );
 extern void ThreadLock();
 extern void ThreadUnlock();
 extern int  ThreadCount();
+extern int  ThreadHardwareCount();
+extern int  ThreadAvailableCount();
 extern void ThreadCleanup();
 extern void RunThreadsOn( uint32 workcnt, uint32 flags, ThreadStub_t func );
 extern void RunThreadsOnIndividual( uint32 workcnt, uint32 flags, ThreadStub_t func );
 
+// intra-frame task scheduling (work stealing)
+extern void ThreadSetFramesInFlight( int count );
+extern int  ThreadFramesInFlight();
+extern bool ThreadTasking();
+extern void RunTasksOn( uint32 threadnum, uint32 taskcnt, TaskStub_t func, void *param );
+
+// single background job (e.g. writing files while the workers continue)
+extern bool ThreadStartJob( JobStub_t func, void *param );
+extern bool ThreadJobRunning();
+extern void ThreadWaitJob();
+
+// background service running until its function returns (e.g. draining the log)
+extern bool ThreadStartService( JobStub_t func, void *param );
+extern void ThreadWaitService();
+extern void ThreadYield();
+extern void ThreadSleep( int milliseconds );
+
 #endif //TASSE_THREADS_H
@@ -29,6 +29,8 @@ interface IUtils
 {
 	virtual void *Alloc( size_t numbytes ) = 0;
 	virtual void Free( void *ptr ) = 0;
+	virtual void *AllocAligned( size_t numbytes, size_t alignment ) = 0;
+	virtual void FreeAligned( void *ptr ) = 0;
 	virtual char *StrDup( const char *s ) = 0;
 	virtual void Warning( const char *fmt, ... ) = 0;
 	virtual void Fatal( const char *fmt, ... ) = 0;
@@ -42,6 +44,7 @@ interface IUtils
 	virtual int ExtractFilePath( char *dst, size_t size, const char *src ) = 0;
 	virtual	int ExtractFileExtension( char *dest, size_t size, const char *path ) = 0;
 	virtual int GetMainDirectory( char *out, size_t outSize ) = 0;
+	virtual bool WriteFileAtomic( const char *path, const void *data, size_t size ) = 0;
 };
 
 extern IUtils *utils;
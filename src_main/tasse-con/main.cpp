@@ -45,9 +45,22 @@ static void usage()
 					" -cn  : source coordinate nature (0 = autodetect)\n"
 					" -trf : coordinate trajectory filename\n"
 					" -trn : coordinate trajectory nature (0 = autodetect)\n"
+					" -trl : process trajectories listed in file (one per line) together as replicas\n"
 					" -n   : starting snapshot of the trajectory (skip N previous snapshots)\n"
+					" -ne  : ending snapshot of the trajectory (stop before snapshot N; default is all)\n"
+					" -ns  : snapshot stride (process every Nth snapshot; default 1)\n"
 					" -o   : output PDB filename\n"
 					" -i   : output information filename\n"
+					" -ps  : save partial state to file instead of writing output (to merge later)\n"
+					" -mrg : merge partial state files listed in file (one per line) and write output\n"
+					" -rs  : save results state to file along with the output (for -rq)\n"
+					" -rq  : rebuild output from results state file for other -p/-vdw (no trajectory)\n"
+					" -cp  : checkpoint filename (state is saved periodically in background)\n"
+					" -cpn : write checkpoint every N snapshots\n"
+					" -cpt : write checkpoint every N minutes (default 10 if -cpn is not given)\n"
+					" -resume : load checkpoint and process only the snapshots missing in it\n"
+					" -inc : incremental mode for a growing trajectory: keep state in file between runs\n"
+					"        and process only new snapshots (same as -cp file -resume)\n"
 					" -e   : relative dielectric permittivity of the medium (default 80)\n"
 					" -r   : electrostatic cut-off radius, in angstroms (default 15.0)\n"
 					" -ce  : electrostatic scale coefficient (default 0.25)\n"
@@ -55,13 +68,32 @@ static void usage()
 					" -h   : h-bond cut-off absolute energy, in kcal/mol (default 1)\n"
 					" -ch  : h-bond scale coefficient (default 0.75)\n"
 					" -p   : probability (trajectory occurence) cut-off (default 0.9)\n"
+					" -hsw : sweep h-bond cut-off energies in one pass, e.g. 0.5,1,1.5 (output per value)\n"
+					" -psw : sweep occurence cut-offs, e.g. 0.5,0.7,0.9 (output per value)\n"
+					" -bc  : capture per-snapshot bridge lists to file\n"
+					" -br  : replay captured bridge lists instead of processing the trajectory\n"
 					" -ng  : don't group similar donor/acceptor atoms\n"
+					" -mcap: keep only the N strongest bridges of a microset (default 0 = all, else at least 3)\n"
+					" -occ : track snapshots of every pair/triplet (residence time, longest run, autocorrelation);\n"
+					"        a switch, an optional 1 or 0 turns it on or off\n"
+					" -blk : block length in snapshots for block-averaged occurence statistics (default 0 = off)\n"
+					" -ww  : detect second-order bridges (biopolymer-solvent-solvent-biopolymer)\n"
+					" -dx  : write solvent heavy atom density around the biopolymer to OpenDX file\n"
+					" -dxs : density grid spacing, in angstroms (default 0.5)\n"
+					" -dxm : count only the solvent molecules of the microsets in the density\n"
+					" -fit : fit every frame onto the source coordinates by atoms: ca, bb (backbone) or heavy\n"
+					" -fp32: compute h-bond energies in single precision (float32)\n"
+					" -fpr : single precision with a report of the difference from double precision\n"
+					" -tab : tabulated angular and 12-6 h-bond terms instead of exp() and powers\n"
 					" -q   : read atomic charges from source (not applicable to PDB nature)\n"
 					" -s   : solvent residue title (default HOH)\n"
-					" -t   : number of threads (default is autodetect)\n"
+					" -t   : number of threads (default is autodetect, respecting CPU affinity and cgroup quota)\n"
+					" -fif : number of frames processed at once (default = threads); fewer frames split each frame among idle threads\n"
+					" -aff : pin threads to CPUs: compact, scatter or a CPU list like 0-7,16-23 (default is not pinned)\n"
 					" -low : low thread priority (yield resources to other programs)\n"
 					" -est : show progress pacifier (estimate completion time)\n"
 					" -v   : verbose mode (print log messages to the console)\n"
+					" -log : log file detail: 0 = summary only, 1 = also a record for every snapshot (default 1)\n"
 					" -x   : don't process trajectory, only convert source to output PDB\n"
 					" -?   : print help for arguments (this message)\n"
 					"\n" );
@@ -72,6 +104,15 @@ static const char *bool_to_string( bool value )
 	return value ? "true" : "false";
 }
 
+#define MAX_SWEEP_VALUES	16
+
+static real sweep_h[MAX_SWEEP_VALUES];
+static real sweep_p[MAX_SWEEP_VALUES];
+static uint32 sweep_h_count = 0;
+static uint32 sweep_p_count = 0;
+static std::vector<char*> traj_files;
+static std::vector<int> traj_natures;
+
 static void print_globals()
 {
 	console->Print( CC_WHITE "Settings:\n" );
@@ -81,9 +122,32 @@ static void print_globals()
 	console->Print( " %-20s : %s\n", "coordinate nature", NatureHelper( gGlobals.input_coordinate_nature ).toString() );
 	console->Print( " %-20s : %s\n", "trajectory file", gGlobals.input_trajectory );
 	console->Print( " %-20s : %s\n", "trajectory nature", NatureHelper( gGlobals.input_trajectory_nature ).toString() );
+	if ( gGlobals.trajectory_list[0] )
+		console->Print( " %-20s : %s\n", "trajectory list file", gGlobals.trajectory_list );
 	console->Print( " %-20s : %u\n", "start from snapshot", static_cast<uint32>( gGlobals.first_snap ) );
+	if ( gGlobals.last_snap > 0 )
+		console->Print( " %-20s : %u\n", "stop at snapshot", static_cast<uint32>( gGlobals.last_snap ) );
+	else
+		console->Print( " %-20s : %s\n", "stop at snapshot", "End" );
+	console->Print( " %-20s : %u\n", "snapshot stride", static_cast<uint32>( gGlobals.snap_stride ) );
 	console->Print( " %-20s : %s\n", "output PDB file", gGlobals.output_pdbname );
 	console->Print( " %-20s : %s\n", "output info file", gGlobals.output_tuples );
+	if ( gGlobals.partial_state[0] )
+		console->Print( " %-20s : %s\n", "partial state file", gGlobals.partial_state );
+	if ( gGlobals.merge_list[0] )
+		console->Print( " %-20s : %s\n", "merge list file", gGlobals.merge_list );
+	if ( gGlobals.results_state[0] )
+		console->Print( " %-20s : %s\n", "results state file", gGlobals.results_state );
+	if ( gGlobals.results_query[0] )
+		console->Print( " %-20s : %s\n", "results query file", gGlobals.results_query );
+	if ( gGlobals.checkpoint_file[0] ) {
+		console->Print( " %-20s : %s\n", "checkpoint file", gGlobals.checkpoint_file );
+		if ( gGlobals.checkpoint_frames > 0 )
+			console->Print( " %-20s : %u\n", "checkpoint snapshots", static_cast<uint32>( gGlobals.checkpoint_frames ) );
+		if ( gGlobals.checkpoint_minutes > 0 )
+			console->Print( " %-20s : %g\n", "checkpoint minutes", gGlobals.checkpoint_minutes );
+		console->Print( " %-20s : %s\n", "resume", bool_to_string( gGlobals.resume ) );
+	}
 	console->Print( " %-20s : %s\n", "solvent residue name", gGlobals.solvent_title );
 	console->Print( " %-20s : %g\n", "dielectric constant", gGlobals.dielectric_const );
 	console->Print( " %-20s : %g\n", "electrostatic radius", gGlobals.electrostatic_radius );
@@ -92,38 +156,112 @@ static void print_globals()
 	console->Print( " %-20s : %g\n", "h-bond coeff", gGlobals.hbond_126_coeff );
 	console->Print( " %-20s : %g\n", "h-bond cutoff energy", gGlobals.hbond_cutoff_energy );
 	console->Print( " %-20s : %g%%\n", "occurence cutoff", gGlobals.occurence_cutoff * 100.0 );
+	if ( gGlobals.hbond_sweep[0] )
+		console->Print( " %-20s : %s\n", "h-bond cutoff sweep", gGlobals.hbond_sweep );
+	if ( gGlobals.occurence_sweep[0] )
+		console->Print( " %-20s : %s\n", "occurence sweep", gGlobals.occurence_sweep );
+	if ( gGlobals.bridge_capture[0] )
+		console->Print( " %-20s : %s\n", "bridge capture", gGlobals.bridge_capture );
+	if ( gGlobals.bridge_replay[0] )
+		console->Print( " %-20s : %s\n", "bridge replay", gGlobals.bridge_replay );
+	if ( gGlobals.fit_atoms[0] )
+		console->Print( " %-20s : %s\n", "fit atoms", gGlobals.fit_atoms );
+	if ( gGlobals.density_map[0] ) {
+		console->Print( " %-20s : %s\n", "density map", gGlobals.density_map );
+		console->Print( " %-20s : %g\n", "density spacing", gGlobals.density_spacing );
+		console->Print( " %-20s : %s\n", "density of microsets", bool_to_string( gGlobals.density_microsets ) );
+	}
 	console->Print( " %-20s : %g%%\n", "VdW tolerance", gGlobals.vdw_tolerance * 100.0 );
 	console->Print( " %-20s : %s\n", "h-bond grouping", bool_to_string( gGlobals.group_bonds ) );
+	if ( gGlobals.microset_cap > 0 )
+		console->Print( " %-20s : %u bridges\n", "microset cap", static_cast<uint32>( gGlobals.microset_cap ) );
+	console->Print( " %-20s : %s\n", "occupancy tracking", bool_to_string( gGlobals.occupancy ) );
+	if ( gGlobals.block_length > 0 )
+		console->Print( " %-20s : %u\n", "block length", static_cast<uint32>( gGlobals.block_length ) );
+	console->Print( " %-20s : %s\n", "second-order bridges", bool_to_string( gGlobals.water_chains ) );
+	if ( gGlobals.precision_report )
+		console->Print( " %-20s : %s\n", "precision", "Single (compared with double)" );
+	else
+		console->Print( " %-20s : %s\n", "precision", gGlobals.single_precision ? "Single" : "Double" );
+	console->Print( " %-20s : %s\n", "tabulated energy", bool_to_string( gGlobals.tabulated_energy ) );
 	console->Print( " %-20s : %s\n", "read charges", bool_to_string( gGlobals.read_charges ) );
 	if ( gGlobals.thread_count > 0 )
 		console->Print( " %-20s : %i\n", "threads", gGlobals.thread_count );
 	else
 		console->Print( " %-20s : %s\n", "threads", "Autodetect" );
+	if ( gGlobals.frames_in_flight > 0 )
+		console->Print( " %-20s : %i\n", "frames in flight", gGlobals.frames_in_flight );
+	else
+		console->Print( " %-20s : %s\n", "frames in flight", "One per thread" );
+	console->Print( " %-20s : %s\n", "thread affinity", gGlobals.thread_affinity[0] ? gGlobals.thread_affinity : "None" );
 	console->Print( " %-20s : %s\n", "priority", gGlobals.low_prio ? "Low" : "Normal" );
 	console->Print( " %-20s : %s\n", "estimate", bool_to_string ( gGlobals.pacifier ) );
 	console->Print( " %-20s : %s\n", "convert only", bool_to_string( gGlobals.convert_only ) );
 	console->Print( " %-20s : %s\n", "verbose mode", bool_to_string( gGlobals.verbose ) );
+	console->Print( " %-20s : %s\n", "log level", ( gGlobals.log_level >= LOG_LEVEL_SNAPSHOTS ) ? "Snapshots" : "Summary" );
 	console->Print( "\n" );
 }
 
+static uint32 parse_sweep_list( const char *list, real *values, real minValue, real maxValue )
+{
+	// comma-separated list of values, clamped to the valid range
+	uint32 count = 0;
+	for ( const char *s = list; *s && count < MAX_SWEEP_VALUES; ) {
+		const char *e = strchr( s, ',' );
+		const size_t len = e ? static_cast<size_t>( e - s ) : strlen( s );
+		if ( len )
+			values[count++] = std::min( std::max( utils->Atof( s, len ), minValue ), maxValue );
+		s += e ? len + 1 : len;
+	}
+	return count;
+}
+
 static bool parse_cmdline( int argc, char *argv[] )
 {
 	memset( gGlobals.input_topology, 0, sizeof(gGlobals.input_topology) );
 	memset( gGlobals.input_coordinate, 0, sizeof(gGlobals.input_coordinate) );
 	memset( gGlobals.input_trajectory, 0, sizeof(gGlobals.input_trajectory) );
+	memset( gGlobals.trajectory_list, 0, sizeof(gGlobals.trajectory_list) );
 	memset( gGlobals.output_pdbname, 0, sizeof(gGlobals.output_pdbname) );
 	memset( gGlobals.output_tuples, 0, sizeof(gGlobals.output_tuples) );
+	memset( gGlobals.partial_state, 0, sizeof(gGlobals.partial_state) );
+	memset( gGlobals.merge_list, 0, sizeof(gGlobals.merge_list) );
+	memset( gGlobals.results_state, 0, sizeof(gGlobals.results_state) );
+	memset( gGlobals.results_query, 0, sizeof(gGlobals.results_query) );
+	memset( gGlobals.checkpoint_file, 0, sizeof(gGlobals.checkpoint_file) );
 	memset( gGlobals.solvent_title, 0, sizeof(gGlobals.solvent_title) );
+	memset( gGlobals.thread_affinity, 0, sizeof(gGlobals.thread_affinity) );
+	memset( gGlobals.hbond_sweep, 0, sizeof(gGlobals.hbond_sweep) );
+	memset( gGlobals.occurence_sweep, 0, sizeof(gGlobals.occurence_sweep) );
+	memset( gGlobals.bridge_capture, 0, sizeof(gGlobals.bridge_capture) );
+	memset( gGlobals.bridge_replay, 0, sizeof(gGlobals.bridge_replay) );
+	memset( gGlobals.density_map, 0, sizeof(gGlobals.density_map) );
+	memset( gGlobals.fit_atoms, 0, sizeof(gGlobals.fit_atoms) );
 
 	// init defaults
 	gGlobals.thread_count = -1;
+	gGlobals.frames_in_flight = 0;
+	gGlobals.log_level = LOG_LEVEL_SNAPSHOTS;
 	gGlobals.low_prio = false;
 	gGlobals.pacifier = false;
 	gGlobals.verbose = false;
 	gGlobals.convert_only = false;
 	gGlobals.read_charges = false;
 	gGlobals.group_bonds = true;
+	gGlobals.resume = false;
+	gGlobals.occupancy = false;
+	gGlobals.water_chains = false;
+	gGlobals.density_microsets = false;
+	gGlobals.single_precision = false;
+	gGlobals.precision_report = false;
+	gGlobals.tabulated_energy = false;
 	gGlobals.first_snap = 0;
+	gGlobals.last_snap = 0;
+	gGlobals.snap_stride = 1;
+	gGlobals.checkpoint_frames = 0;
+	gGlobals.block_length = 0;
+	gGlobals.microset_cap = 0;
+	gGlobals.checkpoint_minutes = 0;
 	gGlobals.dielectric_const = real( 80 );
 	gGlobals.electrostatic_radius = real( 15 );
 	gGlobals.hbond_cutoff_energy = real( 1.0 );
@@ -132,6 +270,7 @@ static bool parse_cmdline( int argc, char *argv[] )
 	gGlobals.hbond_126_coeff = real( 0.75 );
 	gGlobals.occurence_cutoff = real( 0.9 );
 	gGlobals.vdw_tolerance = real( 0.25 );
+	gGlobals.density_spacing = real( 0.5 );
 	gGlobals.input_topology_nature = TYP_AUTO;
 	gGlobals.input_coordinate_nature = TYP_AUTO;
 	gGlobals.input_trajectory_nature = TYP_AUTO;
@@ -147,6 +286,14 @@ static bool parse_cmdline( int argc, char *argv[] )
 		if ( argv[i][0] == '-' ) {
 			if ( !strcmp( &argv[i][1], "v" ) ) {
 				gGlobals.verbose = true;
+			} else if ( !strcmp( &argv[i][1], "log" ) ) {
+				if ( i < argc - 1 && argv[i+1][0] != '-' ) {
+					gGlobals.log_level = std::min( std::max( utils->Atoi( argv[i+1] ), LOG_LEVEL_SUMMARY ), LOG_LEVEL_SNAPSHOTS );
+					++i;
+				} else {
+					utils->Warning( "missing value for argument \"%s\"!\n" ,argv[i] );
+					args_valid = false;
+				}
 			} else if ( !strcmp( &argv[i][1], "low" ) ) {
 				gGlobals.low_prio = true;
 			} else if ( !strcmp( &argv[i][1], "est" ) ) {
@@ -159,12 +306,42 @@ static bool parse_cmdline( int argc, char *argv[] )
 					utils->Warning( "missing value for argument \"%s\"!\n" ,argv[i] );
 					args_valid = false;
 				}
+			} else if ( !strcmp( &argv[i][1], "fif" ) ) {
+				if ( i < argc - 1 && argv[i+1][0] != '-' ) {
+					gGlobals.frames_in_flight = utils->Atoi( argv[i+1] );
+					if ( gGlobals.frames_in_flight < 0 )
+						gGlobals.frames_in_flight = 0;
+					++i;
+				} else {
+					utils->Warning( "missing value for argument \"%s\"!\n" ,argv[i] );
+					args_valid = false;
+				}
+			} else if ( !strcmp( &argv[i][1], "aff" ) ) {
+				if ( i < argc - 1 && argv[i+1][0] != '-' ) {
+					memset( gGlobals.thread_affinity, 0, sizeof(gGlobals.thread_affinity) );
+					strncat_s( gGlobals.thread_affinity, argv[i+1], sizeof(gGlobals.thread_affinity)-1 );
+					++i;
+				} else {
+					utils->Warning( "missing value for argument \"%s\"!\n" ,argv[i] );
+					args_valid = false;
+				}
 			} else if ( !strcmp( &argv[i][1], "x" ) ) {
 				gGlobals.convert_only = true;
 			} else if ( !strcmp( &argv[i][1], "q" ) ) {
 				gGlobals.read_charges = true;
 			} else if ( !strcmp( &argv[i][1], "ng" ) ) {
 				gGlobals.group_bonds = false;
+			} else if ( !strcmp( &argv[i][1], "occ" ) ) {
+				// a plain switch, but an explicit 1 or 0 is accepted too
+				gGlobals.occupancy = true;
+				if ( i < argc - 1 && ( !strcmp( argv[i+1], "1" ) || !strcmp( argv[i+1], "0" ) ) ) {
+					gGlobals.occupancy = ( argv[i+1][0] == '1' );
+					++i;
+				}
+			} else if ( !strcmp( &argv[i][1], "ww" ) ) {
+				gGlobals.water_chains = true;
+			} else if ( !strcmp( &argv[i][1], "resume" ) ) {
+				gGlobals.resume = true;
 			} else if ( !strcmp( &argv[i][1], "?" ) ) {
 				usage();
 			} else if ( !strcmp( &argv[i][1], "s" ) ) {
@@ -194,6 +371,97 @@ static bool parse_cmdline( int argc, char *argv[] )
 					utils->Warning( "missing value for argument \"%s\"!\n" ,argv[i] );
 					args_valid = false;
 				}
+			} else if ( !strcmp( &argv[i][1], "ps" ) ) {
+				if ( i < argc - 1 && argv[i+1][0] != '-' ) {
+					memset( gGlobals.partial_state, 0, sizeof(gGlobals.partial_state) );
+					strncat_s( gGlobals.partial_state, argv[i+1], sizeof(gGlobals.partial_state)-1 );
+					++i;
+				} else {
+					utils->Warning( "missing value for argument \"%s\"!\n" ,argv[i] );
+					args_valid = false;
+				}
+			} else if ( !strcmp( &argv[i][1], "mrg" ) ) {
+				if ( i < argc - 1 && argv[i+1][0] != '-' ) {
+					memset( gGlobals.merge_list, 0, sizeof(gGlobals.merge_list) );
+					strncat_s( gGlobals.merge_list, argv[i+1], sizeof(gGlobals.merge_list)-1 );
+					++i;
+				} else {
+					utils->Warning( "missing value for argument \"%s\"!\n" ,argv[i] );
+					args_valid = false;
+				}
+			} else if ( !strcmp( &argv[i][1], "rs" ) ) {
+				if ( i < argc - 1 && argv[i+1][0] != '-' ) {
+					memset( gGlobals.results_state, 0, sizeof(gGlobals.results_state) );
+					strncat_s( gGlobals.results_state, argv[i+1], sizeof(gGlobals.results_state)-1 );
+					++i;
+				} else {
+					utils->Warning( "missing value for argument \"%s\"!\n" ,argv[i] );
+					args_valid = false;
+				}
+			} else if ( !strcmp( &argv[i][1], "rq" ) ) {
+				if ( i < argc - 1 && argv[i+1][0] != '-' ) {
+					memset( gGlobals.results_query, 0, sizeof(gGlobals.results_query) );
+					strncat_s( gGlobals.results_query, argv[i+1], sizeof(gGlobals.results_query)-1 );
+					++i;
+				} else {
+					utils->Warning( "missing value for argument \"%s\"!\n" ,argv[i] );
+					args_valid = false;
+				}
+			} else if ( !strcmp( &argv[i][1], "cp" ) ) {
+				if ( i < argc - 1 && argv[i+1][0] != '-' ) {
+					memset( gGlobals.checkpoint_file, 0, sizeof(gGlobals.checkpoint_file) );
+					strncat_s( gGlobals.checkpoint_file, argv[i+1], sizeof(gGlobals.checkpoint_file)-1 );
+					++i;
+				} else {
+					utils->Warning( "missing value for argument \"%s\"!\n" ,argv[i] );
+					args_valid = false;
+				}
+			} else if ( !strcmp( &argv[i][1], "inc" ) ) {
+				if ( i < argc - 1 && argv[i+1][0] != '-' ) {
+					memset( gGlobals.checkpoint_file, 0, sizeof(gGlobals.checkpoint_file) );
+					strncat_s( gGlobals.checkpoint_file, argv[i+1], sizeof(gGlobals.checkpoint_file)-1 );
+					gGlobals.resume = true;
+					++i;
+				} else {
+					utils->Warning( "missing value for argument \"%s\"!\n" ,argv[i] );
+					args_valid = false;
+				}
+			} else if ( !strcmp( &argv[i][1], "cpn" ) ) {
+				if ( i < argc - 1 && argv[i+1][0] != '-' ) {
+					gGlobals.checkpoint_frames = static_cast<size_t>( std::max( utils->Atoi( argv[i+1] ), 0 ) );
+					++i;
+				} else {
+					utils->Warning( "missing value for argument \"%s\"!\n" ,argv[i] );
+					args_valid = false;
+				}
+			} else if ( !strcmp( &argv[i][1], "blk" ) ) {
+				if ( i < argc - 1 && argv[i+1][0] != '-' ) {
+					gGlobals.block_length = static_cast<size_t>( std::max( utils->Atoi( argv[i+1] ), 0 ) );
+					++i;
+				} else {
+					utils->Warning( "missing value for argument \"%s\"!\n" ,argv[i] );
+					args_valid = false;
+				}
+			} else if ( !strcmp( &argv[i][1], "mcap" ) ) {
+				if ( i < argc - 1 && argv[i+1][0] != '-' ) {
+					gGlobals.microset_cap = static_cast<size_t>( std::max( utils->Atoi( argv[i+1] ), 0 ) );
+					if ( gGlobals.microset_cap > 0 && gGlobals.microset_cap < 3 ) {
+						utils->Warning( "microset cap must be at least 3 bridges!\n" );
+						args_valid = false;
+					}
+					++i;
+				} else {
+					utils->Warning( "missing value for argument \"%s\"!\n" ,argv[i] );
+					args_valid = false;
+				}
+			} else if ( !strcmp( &argv[i][1], "cpt" ) ) {
+				if ( i < argc - 1 && argv[i+1][0] != '-' ) {
+					gGlobals.checkpoint_minutes = std::max( utils->Atof( argv[i+1] ), real( 0 ) );
+					++i;
+				} else {
+					utils->Warning( "missing value for argument \"%s\"!\n" ,argv[i] );
+					args_valid = false;
+				}
 			} else if ( !strcmp( &argv[i][1], "tf" ) ) {
 				if ( i < argc - 1 && argv[i+1][0] != '-' ) {
 					memset( gGlobals.input_topology, 0, sizeof(gGlobals.input_topology) );
@@ -221,6 +489,15 @@ static bool parse_cmdline( int argc, char *argv[] )
 					utils->Warning( "missing value for argument \"%s\"!\n" ,argv[i] );
 					args_valid = false;
 				}
+			} else if ( !strcmp( &argv[i][1], "trl" ) ) {
+				if ( i < argc - 1 && argv[i+1][0] != '-' ) {
+					memset( gGlobals.trajectory_list, 0, sizeof(gGlobals.trajectory_list) );
+					strncat_s( gGlobals.trajectory_list, argv[i+1], sizeof(gGlobals.trajectory_list)-1 );
+					++i;
+				} else {
+					utils->Warning( "missing value for argument \"%s\"!\n" ,argv[i] );
+					args_valid = false;
+				}
 			} else if ( !strcmp( &argv[i][1], "tn" ) ) {
 				if ( i < argc - 1 && argv[i+1][0] != '-' ) {
 					gGlobals.input_topology_nature = utils->Atoi( argv[i+1] );
@@ -253,6 +530,22 @@ static bool parse_cmdline( int argc, char *argv[] )
 					utils->Warning( "missing value for argument \"%s\"!\n" ,argv[i] );
 					args_valid = false;
 				}
+			} else if ( !strcmp( &argv[i][1], "ne" ) ) {
+				if ( i < argc - 1 && argv[i+1][0] != '-' ) {
+					gGlobals.last_snap = static_cast<size_t>( utils->Atoi( argv[i+1] ) );
+					++i;
+				} else {
+					utils->Warning( "missing value for argument \"%s\"!\n" ,argv[i] );
+					args_valid = false;
+				}
+			} else if ( !strcmp( &argv[i][1], "ns" ) ) {
+				if ( i < argc - 1 && argv[i+1][0] != '-' ) {
+					gGlobals.snap_stride = static_cast<size_t>( std::max( utils->Atoi( argv[i+1] ), 1 ) );
+					++i;
+				} else {
+					utils->Warning( "missing value for argument \"%s\"!\n" ,argv[i] );
+					args_valid = false;
+				}
 			} else if ( !strcmp( &argv[i][1], "e" ) ) {
 				if ( i < argc - 1 && argv[i+1][0] != '-' ) {
 					gGlobals.dielectric_const = utils->Atof( argv[i+1] );
@@ -305,6 +598,84 @@ static bool parse_cmdline( int argc, char *argv[] )
 					utils->Warning( "missing value for argument \"%s\"!\n" ,argv[i] );
 					args_valid = false;
 				}
+			} else if ( !strcmp( &argv[i][1], "hsw" ) ) {
+				if ( i < argc - 1 && argv[i+1][0] != '-' ) {
+					memset( gGlobals.hbond_sweep, 0, sizeof(gGlobals.hbond_sweep) );
+					strncat_s( gGlobals.hbond_sweep, argv[i+1], sizeof(gGlobals.hbond_sweep)-1 );
+					++i;
+				} else {
+					utils->Warning( "missing value for argument \"%s\"!\n" ,argv[i] );
+					args_valid = false;
+				}
+			} else if ( !strcmp( &argv[i][1], "psw" ) ) {
+				if ( i < argc - 1 && argv[i+1][0] != '-' ) {
+					memset( gGlobals.occurence_sweep, 0, sizeof(gGlobals.occurence_sweep) );
+					strncat_s( gGlobals.occurence_sweep, argv[i+1], sizeof(gGlobals.occurence_sweep)-1 );
+					++i;
+				} else {
+					utils->Warning( "missing value for argument \"%s\"!\n" ,argv[i] );
+					args_valid = false;
+				}
+			} else if ( !strcmp( &argv[i][1], "bc" ) ) {
+				if ( i < argc - 1 && argv[i+1][0] != '-' ) {
+					memset( gGlobals.bridge_capture, 0, sizeof(gGlobals.bridge_capture) );
+					strncat_s( gGlobals.bridge_capture, argv[i+1], sizeof(gGlobals.bridge_capture)-1 );
+					++i;
+				} else {
+					utils->Warning( "missing value for argument \"%s\"!\n" ,argv[i] );
+					args_valid = false;
+				}
+			} else if ( !strcmp( &argv[i][1], "dx" ) ) {
+				if ( i < argc - 1 && argv[i+1][0] != '-' ) {
+					memset( gGlobals.density_map, 0, sizeof(gGlobals.density_map) );
+					strncat_s( gGlobals.density_map, argv[i+1], sizeof(gGlobals.density_map)-1 );
+					++i;
+				} else {
+					utils->Warning( "missing value for argument \"%s\"!\n" ,argv[i] );
+					args_valid = false;
+				}
+			} else if ( !strcmp( &argv[i][1], "dxs" ) ) {
+				if ( i < argc - 1 && argv[i+1][0] != '-' ) {
+					gGlobals.density_spacing = utils->Atof( argv[i+1] );
+					if ( gGlobals.density_spacing < real( 0.1 ) )
+						gGlobals.density_spacing = real( 0.1 );
+					++i;
+				} else {
+					utils->Warning( "missing value for argument \"%s\"!\n" ,argv[i] );
+					args_valid = false;
+				}
+			} else if ( !strcmp( &argv[i][1], "dxm" ) ) {
+				gGlobals.density_microsets = true;
+			} else if ( !strcmp( &argv[i][1], "fp32" ) ) {
+				gGlobals.single_precision = true;
+			} else if ( !strcmp( &argv[i][1], "fpr" ) ) {
+				gGlobals.single_precision = true;
+				gGlobals.precision_report = true;
+			} else if ( !strcmp( &argv[i][1], "tab" ) ) {
+				gGlobals.tabulated_energy = true;
+			} else if ( !strcmp( &argv[i][1], "fit" ) ) {
+				if ( i < argc - 1 && argv[i+1][0] != '-' ) {
+					memset( gGlobals.fit_atoms, 0, sizeof(gGlobals.fit_atoms) );
+					strncat_s( gGlobals.fit_atoms, argv[i+1], sizeof(gGlobals.fit_atoms)-1 );
+					if ( _stricmp( gGlobals.fit_atoms, "ca" ) && _stricmp( gGlobals.fit_atoms, "bb" ) && _stricmp( gGlobals.fit_atoms, "heavy" ) ) {
+						utils->Warning( "unknown fit selection \"%s\"!\n", gGlobals.fit_atoms );
+						gGlobals.fit_atoms[0] = 0;
+						args_valid = false;
+					}
+					++i;
+				} else {
+					utils->Warning( "missing value for argument \"%s\"!\n" ,argv[i] );
+					args_valid = false;
+				}
+			} else if ( !strcmp( &argv[i][1], "br" ) ) {
+				if ( i < argc - 1 && argv[i+1][0] != '-' ) {
+					memset( gGlobals.bridge_replay, 0, sizeof(gGlobals.bridge_replay) );
+					strncat_s( gGlobals.bridge_replay, argv[i+1], sizeof(gGlobals.bridge_replay)-1 );
+					++i;
+				} else {
+					utils->Warning( "missing value for argument \"%s\"!\n" ,argv[i] );
+					args_valid = false;
+				}
 			} else if ( !strcmp( &argv[i][1], "vdw" ) ) {
 				if ( i < argc - 1 && argv[i+1][0] != '-' ) {
 					gGlobals.vdw_tolerance = utils->Atof( argv[i+1] );
@@ -363,6 +734,78 @@ static bool parse_cmdline( int argc, char *argv[] )
 		gGlobals.input_trajectory_nature = DEFAULT_TRAJECTORY_NATURE;
 		args_valid = false;
 	}
+	if ( gGlobals.checkpoint_file[0] && !gGlobals.checkpoint_frames && !( gGlobals.checkpoint_minutes > 0 ) )
+		gGlobals.checkpoint_minutes = real( 10 );
+	if ( gGlobals.resume && !gGlobals.checkpoint_file[0] ) {
+		utils->Warning( "-resume requires a checkpoint file (-cp)\n" );
+		gGlobals.resume = false;
+		args_valid = false;
+	}
+	if ( ( gGlobals.hbond_sweep[0] || gGlobals.occurence_sweep[0] ) && 
+		 ( gGlobals.partial_state[0] || gGlobals.merge_list[0] || gGlobals.checkpoint_file[0] ) ) {
+		utils->Warning( "cut-off sweep can't be used with partial state or checkpoint files\n" );
+		gGlobals.hbond_sweep[0] = gGlobals.occurence_sweep[0] = 0;
+		args_valid = false;
+	}
+	if ( gGlobals.bridge_replay[0] && 
+		 ( gGlobals.bridge_capture[0] || gGlobals.partial_state[0] || gGlobals.merge_list[0] || gGlobals.checkpoint_file[0] ) ) {
+		utils->Warning( "bridge replay can't be used with bridge capture, partial state or checkpoint files\n" );
+		gGlobals.bridge_replay[0] = 0;
+		args_valid = false;
+	}
+	if ( gGlobals.water_chains && ( gGlobals.bridge_capture[0] || gGlobals.bridge_replay[0] ) ) {
+		// captured bridges have no solvent-solvent h-bonds
+		utils->Warning( "second-order bridges can't be used with bridge capture/replay\n" );
+		gGlobals.water_chains = false;
+		args_valid = false;
+	}
+	if ( gGlobals.density_map[0] && 
+		 ( gGlobals.bridge_replay[0] || gGlobals.results_query[0] || 
+		   gGlobals.partial_state[0] || gGlobals.merge_list[0] || gGlobals.checkpoint_file[0] ) ) {
+		// the density is not kept in state files
+		utils->Warning( "density map can't be used with bridge replay, results query, partial state or checkpoint files\n" );
+		gGlobals.density_map[0] = 0;
+		args_valid = false;
+	}
+	if ( gGlobals.precision_report && 
+		 ( gGlobals.bridge_capture[0] || gGlobals.bridge_replay[0] || gGlobals.results_query[0] || 
+		   gGlobals.partial_state[0] || gGlobals.merge_list[0] || gGlobals.checkpoint_file[0] ) ) {
+		// double-precision results are not kept in capture or state files
+		utils->Warning( "precision report can't be used with bridge capture/replay, results query, partial state or checkpoint files\n" );
+		gGlobals.precision_report = false;
+		args_valid = false;
+	}
+	if ( gGlobals.results_query[0] && 
+		 ( gGlobals.hbond_sweep[0] || gGlobals.bridge_capture[0] || gGlobals.bridge_replay[0] || 
+		   gGlobals.partial_state[0] || gGlobals.merge_list[0] || gGlobals.checkpoint_file[0] ) ) {
+		utils->Warning( "results query can't be used with h-bond cut-off sweep, bridge capture/replay, partial state or checkpoint files\n" );
+		gGlobals.results_query[0] = 0;
+		args_valid = false;
+	}
+	if ( gGlobals.results_state[0] && ( gGlobals.hbond_sweep[0] || gGlobals.partial_state[0] ) ) {
+		utils->Warning( "results state can't be saved with h-bond cut-off sweep or partial state file\n" );
+		gGlobals.results_state[0] = 0;
+		args_valid = false;
+	}
+	if ( gGlobals.hbond_sweep[0] ) {
+		// the weakest cut-off is used to find the bridges
+		sweep_h_count = parse_sweep_list( gGlobals.hbond_sweep, sweep_h, real( 0 ), real( 1e6 ) );
+		if ( sweep_h_count ) {
+			gGlobals.hbond_cutoff_energy = *std::min_element( sweep_h, sweep_h + sweep_h_count );
+		} else {
+			utils->Warning( "invalid h-bond cut-off sweep \"%s\"\n", gGlobals.hbond_sweep );
+			gGlobals.hbond_sweep[0] = 0;
+			args_valid = false;
+		}
+	}
+	if ( gGlobals.occurence_sweep[0] ) {
+		sweep_p_count = parse_sweep_list( gGlobals.occurence_sweep, sweep_p, real( 0 ), real( 1 ) );
+		if ( !sweep_p_count ) {
+			utils->Warning( "invalid occurence cut-off sweep \"%s\"\n", gGlobals.occurence_sweep );
+			gGlobals.occurence_sweep[0] = 0;
+			args_valid = false;
+		}
+	}
 
 	return args_valid;
 }
@@ -387,7 +830,7 @@ static void check_natures()
 			console->Print( "Auto-detected input coordinate nature: %s\n", NatureHelper( gGlobals.input_coordinate_nature ).toString() );
 		}
 	}
-	if ( gGlobals.input_trajectory_nature == TYP_AUTO ) {
+	if ( gGlobals.input_trajectory_nature == TYP_AUTO && !gGlobals.trajectory_list[0] ) {
 		gGlobals.input_trajectory_nature = NatureHelper()[gGlobals.input_trajectory]();
 		if ( gGlobals.input_trajectory_nature == TYP_AUTO ) {
 			utils->Warning( "failed to autodetect input trajectory nature, using default \"%s\" (%i)\n", NatureHelper( DEFAULT_TRAJECTORY_NATURE ).toString(), DEFAULT_TRAJECTORY_NATURE );
@@ -398,12 +841,173 @@ static void check_natures()
 	}
 }
 
+static void load_trajectory_list( const char *listFile )
+{
+	FILE *fp;
+	char line[MAX_OSPATH], trimline[MAX_OSPATH];
+	char listpath[MAX_OSPATH], fullpath[MAX_OSPATH];
+
+	if ( fopen_s( &fp, listFile, "r" ) )
+		utils->Fatal( "failed to open \"%s\" for reading!\n", listFile );
+
+	utils->ExtractFilePath( listpath, sizeof(listpath), listFile );
+	if ( !0[listpath] ) strcpy_s( listpath, "." );
+
+	while ( fgets( line, sizeof(line), fp ) ) {
+		// skip empty lines
+		if ( static_cast<uint8>( line[0] ) <= 32 )
+			continue;
+		// relative names are relative to the list file
+		utils->Trim( trimline, sizeof(trimline), line );
+		if ( trimline[0] == '/' || trimline[0] == '\\' || trimline[1] == ':' ) {
+			strcpy_s( fullpath, trimline );
+		} else {
+			strcpy_s( fullpath, listpath );
+			strcat_s( fullpath, "/" );
+			strcat_s( fullpath, trimline );
+		}
+		// replicas may come in different natures
+		int nature = gGlobals.input_trajectory_nature;
+		if ( nature == TYP_AUTO ) {
+			nature = NatureHelper()[fullpath]();
+			if ( nature == TYP_AUTO ) {
+				utils->Warning( "failed to autodetect nature of \"%s\", using default \"%s\" (%i)\n", fullpath, NatureHelper( DEFAULT_TRAJECTORY_NATURE ).toString(), DEFAULT_TRAJECTORY_NATURE );
+				nature = DEFAULT_TRAJECTORY_NATURE;
+			}
+		}
+		console->Print( "Replica %u: %s (%s)\n", static_cast<uint32>( traj_files.size() + 1 ), fullpath, NatureHelper( nature ).toString() );
+		traj_files.push_back( utils->StrDup( fullpath ) );
+		traj_natures.push_back( nature );
+	}
+
+	fclose( fp );
+
+	if ( traj_files.empty() )
+		utils->Fatal( "no trajectories listed in \"%s\"!\n", listFile );
+}
+
+static uint32 process_trajectories( size_t firstSnap, size_t lastSnap, size_t snapStride, ITopology::TrajectoryCallback_t func )
+{
+	// trajectories of a list are processed together as replicas
+	if ( !traj_files.empty() )
+		return topology->ProcessTrajectories( static_cast<uint32>( traj_files.size() ), &traj_files[0], &traj_natures[0], 
+											  firstSnap, lastSnap, snapStride, func, gGlobals.pacifier );
+	return topology->ProcessTrajectory( gGlobals.input_trajectory, gGlobals.input_trajectory_nature, 
+										firstSnap, lastSnap, snapStride, func, gGlobals.pacifier );
+}
+
 static void process_trajectory_snapshot( uint32 threadNum, uint32 snapshotNum, const coord3_t *coords )
 {
 	// this function can be called concurrently and therefore must be reenterant!
 	hbonds->CalcMicrosets( threadNum, snapshotNum, coords );
 }
 
+static bool is_snapshot_missing( uint32 snapshotNum )
+{
+	return !hbonds->IsSnapshotDone( snapshotNum );
+}
+
+static bool is_fetch_snapshot( uint32 snapshotNum )
+{
+	return hbonds->IsFetchSnapshot( snapshotNum );
+}
+
+static void fetch_snapshot_coords( uint32 threadNum, uint32 snapshotNum, const coord3_t *coords )
+{
+	hbonds->FetchCoords( threadNum, snapshotNum, coords );
+}
+
+static void fetch_replay_coords( uint32 total )
+{
+	// coordinates are needed only for the blocks that make it to the output
+	real cutoffOccurence = gGlobals.occurence_cutoff;
+	if ( sweep_p_count )
+		cutoffOccurence = *std::min_element( sweep_p, sweep_p + sweep_p_count );
+
+	if ( !hbonds->PrepareCoordsFetch( total, cutoffOccurence ) )
+		return;
+
+	topology->SetTrajectoryFilter( is_fetch_snapshot );
+	process_trajectories( 0, 0, 1, fetch_snapshot_coords );
+	topology->SetTrajectoryFilter( nullptr );
+}
+
+static uint32 merge_partial_states( const char *listFile )
+{
+	FILE *fp;
+	char line[MAX_OSPATH], trimline[MAX_OSPATH];
+	char listpath[MAX_OSPATH], fullpath[MAX_OSPATH];
+
+	if ( fopen_s( &fp, listFile, "r" ) ) {
+		utils->Warning( "failed to open \"%s\" for reading\n", listFile );
+		return 0;
+	}
+
+	utils->ExtractFilePath( listpath, sizeof(listpath), listFile );
+	if ( !0[listpath] ) strcpy_s( listpath, "." );
+
+	uint32 total = 0, count = 0;
+	while ( fgets( line, sizeof(line), fp ) ) {
+		// skip empty lines
+		if ( static_cast<uint8>( line[0] ) <= 32 )
+			continue;
+		// relative names are relative to the list file
+		utils->Trim( trimline, sizeof(trimline), line );
+		if ( trimline[0] == '/' || trimline[0] == '\\' || trimline[1] == ':' ) {
+			strcpy_s( fullpath, trimline );
+		} else {
+			strcpy_s( fullpath, listpath );
+			strcat_s( fullpath, "/" );
+			strcat_s( fullpath, trimline );
+		}
+		total += hbonds->MergeState( fullpath );
+		++count;
+	}
+
+	fclose( fp );
+
+	console->Print( "Merged %u partial state file(s), %u snapshot(s) total\n", count, total );
+	return total;
+}
+
+static void make_sweep_filename( char *out, const char *name, real h, real p )
+{
+	// insert cut-off values before the extension: "out.pdb" -> "out_h1.5_p0.9.pdb"
+	// (out is MAX_OSPATH in size)
+	char ext[MAX_OSPATH];
+	const int extLen = utils->ExtractFileExtension( ext, sizeof(ext), name );
+	sprintf_s( out, MAX_OSPATH, "%.*s_h%g_p%g%s", static_cast<int>( strlen( name ) - extLen ), name, h, p, ext );
+}
+
+static void write_sweep_output( uint32 total )
+{
+	const real cutoffEnergy = gGlobals.hbond_cutoff_energy;
+	const real cutoffOccurence = gGlobals.occurence_cutoff;
+	if ( !sweep_p_count ) {
+		sweep_p[0] = cutoffOccurence;
+		sweep_p_count = 1;
+	}
+
+	char pdbname[MAX_OSPATH], tuplename[MAX_OSPATH];
+	for ( uint32 i = 0; i < hbonds->GetCutoffLevels(); ++i ) {
+		gGlobals.hbond_cutoff_energy = hbonds->SelectCutoffLevel( i );
+		for ( uint32 j = 0; j < sweep_p_count; ++j ) {
+			gGlobals.occurence_cutoff = sweep_p[j];
+			make_sweep_filename( pdbname, gGlobals.output_pdbname, gGlobals.hbond_cutoff_energy, gGlobals.occurence_cutoff );
+			hbonds->BuildFinalSolvent( total );
+			topology->Save( pdbname );
+			if ( *gGlobals.output_tuples ) {
+				make_sweep_filename( tuplename, gGlobals.output_tuples, gGlobals.hbond_cutoff_energy, gGlobals.occurence_cutoff );
+				hbonds->PrintFinalTuples( total, tuplename );
+			}
+		}
+	}
+
+	hbonds->SelectCutoffLevel( 0 );
+	gGlobals.hbond_cutoff_energy = cutoffEnergy;
+	gGlobals.occurence_cutoff = cutoffOccurence;
+}
+
 static void cleanup()
 {
 	// clear H-bond information
@@ -415,6 +1019,12 @@ static void cleanup()
 	// unload config files
 	configs->Unload();
 
+	// free the trajectory list
+	for ( auto it = traj_files.begin(); it != traj_files.end(); ++it )
+		utils->Free( *it );
+	traj_files.clear();
+	traj_natures.clear();
+
 	// cleanup threads
 	ThreadCleanup();
 }
@@ -442,8 +1052,14 @@ int main( int argc, char *argv[] )
 		return 1;
 	}
 
+	// read the list of trajectories processed together
+	if ( gGlobals.trajectory_list[0] )
+		load_trajectory_list( gGlobals.trajectory_list );
+
 	// init threads
 	ThreadSetDefault( gGlobals.thread_count, gGlobals.low_prio );
+	ThreadSetFramesInFlight( gGlobals.frames_in_flight );
+	ThreadSetAffinity( gGlobals.thread_affinity );
 
 	// remember start time
 	double startTime = utils->FloatMilliseconds();
@@ -468,12 +1084,63 @@ int main( int argc, char *argv[] )
 			// just save the PDB
 			topology->Save( gGlobals.output_pdbname );
 		} else {
-			// build lists of donors and acceptors
-			hbonds->BuildAtomLists();
-			// process the trajectory
-			uint32 total = topology->ProcessTrajectory( gGlobals.input_trajectory, gGlobals.input_trajectory_nature, 
-														gGlobals.first_snap, process_trajectory_snapshot, gGlobals.pacifier );
-			if ( total ) {
+			// build lists of donors and acceptors (saved results don't need them)
+			if ( !*gGlobals.results_query )
+				hbonds->BuildAtomLists();
+			// stricter cut-off energies to accumulate in the same pass
+			if ( sweep_h_count )
+				hbonds->SetCutoffSweep( sweep_h, sweep_h_count );
+			uint32 total;
+			if ( *gGlobals.results_query ) {
+				// rebuild output from saved results instead of processing the trajectory
+				total = hbonds->LoadResults( gGlobals.results_query );
+			} else if ( *gGlobals.merge_list ) {
+				// merge partial states of other runs instead of processing the trajectory
+				total = merge_partial_states( gGlobals.merge_list );
+			} else if ( *gGlobals.bridge_replay ) {
+				// replay captured bridge lists, read only the snapshots needed for output
+				total = hbonds->ReplayBridges( gGlobals.bridge_replay );
+				if ( total )
+					fetch_replay_coords( total );
+			} else {
+				total = 0;
+				if ( *gGlobals.checkpoint_file ) {
+					hbonds->SetCheckpoint( gGlobals.checkpoint_file, static_cast<uint32>( gGlobals.checkpoint_frames ), gGlobals.checkpoint_minutes );
+					FILE *fp;
+					if ( gGlobals.resume && !fopen_s( &fp, gGlobals.checkpoint_file, "rb" ) ) {
+						// continue from the checkpoint, skip the snapshots already there
+						fclose( fp );
+						total = hbonds->MergeState( gGlobals.checkpoint_file );
+						topology->SetTrajectoryFilter( is_snapshot_missing );
+					} else if ( gGlobals.resume ) {
+						console->Print( "Checkpoint \"%s\" not found, starting from the beginning\n", gGlobals.checkpoint_file );
+					}
+				}
+				if ( *gGlobals.bridge_capture )
+					hbonds->BeginBridgeCapture( gGlobals.bridge_capture );
+				// process the trajectory
+				total += process_trajectories( gGlobals.first_snap, gGlobals.last_snap, gGlobals.snap_stride, process_trajectory_snapshot );
+				topology->SetTrajectoryFilter( nullptr );
+				hbonds->FinishCheckpoint();
+				hbonds->EndBridgeCapture();
+				// write the solvent density accumulated along the way
+				if ( total && *gGlobals.density_map )
+					hbonds->WriteDensityMap( total, gGlobals.density_map );
+			}
+			if ( total && *gGlobals.partial_state ) {
+				// save accumulated state, output is written when the states are merged
+				hbonds->SaveState( total, gGlobals.partial_state );
+			} else if ( total && ( sweep_h_count || sweep_p_count ) ) {
+				// write output for every combination of the cut-offs
+				if ( *gGlobals.results_state )
+					hbonds->SaveState( total, gGlobals.results_state );
+				write_sweep_output( total );
+				hbonds->PrintPerformanceCounters();
+				hbonds->PrintPrecisionReport( total );
+			} else if ( total ) {
+				// save results to rebuild the output with other cut-offs later
+				if ( *gGlobals.results_state )
+					hbonds->SaveState( total, gGlobals.results_state );
 				// build final solvent info
 				hbonds->BuildFinalSolvent( total );
 				// save final PDB
@@ -483,6 +1150,8 @@ int main( int argc, char *argv[] )
 					hbonds->PrintFinalTuples( total, gGlobals.output_tuples );
 				// write performance counters
 				hbonds->PrintPerformanceCounters();
+				// compare with double precision (-fpr)
+				hbonds->PrintPrecisionReport( total );
 			}
 		}
 	}
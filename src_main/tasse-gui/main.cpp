@@ -40,16 +40,25 @@ static void parse_cmdline( int argc, char *argv[] )
 	memset( gGlobals.output_pdbname, 0, sizeof(gGlobals.output_pdbname) );
 	memset( gGlobals.output_tuples, 0, sizeof(gGlobals.output_tuples) );
 	memset( gGlobals.solvent_title, 0, sizeof(gGlobals.solvent_title) );
+	memset( gGlobals.thread_affinity, 0, sizeof(gGlobals.thread_affinity) );
+	memset( gGlobals.checkpoint_file, 0, sizeof(gGlobals.checkpoint_file) );
 
 	// init defaults
 	gGlobals.thread_count = -1;
+	gGlobals.frames_in_flight = 0;
+	gGlobals.log_level = LOG_LEVEL_SNAPSHOTS;
 	gGlobals.low_prio = true;
 	gGlobals.pacifier = false;
 	gGlobals.verbose = false;
 	gGlobals.convert_only = false;
 	gGlobals.read_charges = false;
 	gGlobals.group_bonds = true;
+	gGlobals.resume = false;
 	gGlobals.first_snap = 0;
+	gGlobals.last_snap = 0;
+	gGlobals.snap_stride = 1;
+	gGlobals.checkpoint_frames = 0;
+	gGlobals.checkpoint_minutes = 0;
 	gGlobals.dielectric_const = real( 80 );
 	gGlobals.electrostatic_radius = real( 15 );
 	gGlobals.hbond_cutoff_energy = real( 1.0 );
@@ -81,12 +90,27 @@ static void parse_cmdline( int argc, char *argv[] )
 					gGlobals.thread_count = utils->Atoi( argv[i+1] );
 					++i;
 				}
+			} else if ( !strcmp( &argv[i][1], "fif" ) ) {
+				if ( i < argc - 1 && argv[i+1][0] != '-' ) {
+					gGlobals.frames_in_flight = utils->Atoi( argv[i+1] );
+					if ( gGlobals.frames_in_flight < 0 )
+						gGlobals.frames_in_flight = 0;
+					++i;
+				}
+			} else if ( !strcmp( &argv[i][1], "aff" ) ) {
+				if ( i < argc - 1 && argv[i+1][0] != '-' ) {
+					memset( gGlobals.thread_affinity, 0, sizeof(gGlobals.thread_affinity) );
+					strncat_s( gGlobals.thread_affinity, argv[i+1], sizeof(gGlobals.thread_affinity)-1 );
+					++i;
+				}
 			} else if ( !strcmp( &argv[i][1], "x" ) ) {
 				gGlobals.convert_only = true;
 			} else if ( !strcmp( &argv[i][1], "q" ) ) {
 				gGlobals.read_charges = true;
 			} else if ( !strcmp( &argv[i][1], "ng" ) ) {
 				gGlobals.group_bonds = false;
+			} else if ( !strcmp( &argv[i][1], "resume" ) ) {
+				gGlobals.resume = true;
 			} else if ( !strcmp( &argv[i][1], "?" ) ) {
 				//ignore
 			} else if ( !strcmp( &argv[i][1], "s" ) ) {
@@ -145,6 +169,39 @@ static void parse_cmdline( int argc, char *argv[] )
 					gGlobals.first_snap = static_cast<size_t>( utils->Atoi( argv[i+1] ) );
 					++i;
 				}
+			} else if ( !strcmp( &argv[i][1], "ne" ) ) {
+				if ( i < argc - 1 && argv[i+1][0] != '-' ) {
+					gGlobals.last_snap = static_cast<size_t>( utils->Atoi( argv[i+1] ) );
+					++i;
+				}
+			} else if ( !strcmp( &argv[i][1], "ns" ) ) {
+				if ( i < argc - 1 && argv[i+1][0] != '-' ) {
+					gGlobals.snap_stride = static_cast<size_t>( std::max( utils->Atoi( argv[i+1] ), 1 ) );
+					++i;
+				}
+			} else if ( !strcmp( &argv[i][1], "cp" ) ) {
+				if ( i < argc - 1 && argv[i+1][0] != '-' ) {
+					memset( gGlobals.checkpoint_file, 0, sizeof(gGlobals.checkpoint_file) );
+					strncat_s( gGlobals.checkpoint_file, argv[i+1], sizeof(gGlobals.checkpoint_file)-1 );
+					++i;
+				}
+			} else if ( !strcmp( &argv[i][1], "inc" ) ) {
+				if ( i < argc - 1 && argv[i+1][0] != '-' ) {
+					memset( gGlobals.checkpoint_file, 0, sizeof(gGlobals.checkpoint_file) );
+					strncat_s( gGlobals.checkpoint_file, argv[i+1], sizeof(gGlobals.checkpoint_file)-1 );
+					gGlobals.resume = true;
+					++i;
+				}
+			} else if ( !strcmp( &argv[i][1], "cpn" ) ) {
+				if ( i < argc - 1 && argv[i+1][0] != '-' ) {
+					gGlobals.checkpoint_frames = static_cast<size_t>( std::max( utils->Atoi( argv[i+1] ), 0 ) );
+					++i;
+				}
+			} else if ( !strcmp( &argv[i][1], "cpt" ) ) {
+				if ( i < argc - 1 && argv[i+1][0] != '-' ) {
+					gGlobals.checkpoint_minutes = std::max( utils->Atof( argv[i+1] ), real( 0 ) );
+					++i;
+				}
 			} else if ( !strcmp( &argv[i][1], "e" ) ) {
 				if ( i < argc - 1 && argv[i+1][0] != '-' ) {
 					gGlobals.dielectric_const = utils->Atof( argv[i+1] );
@@ -217,6 +274,11 @@ static void parse_cmdline( int argc, char *argv[] )
 
 	if ( gGlobals.input_trajectory_nature < TYP_AUTO || gGlobals.input_trajectory_nature >= TYP_MAX_ )
 		gGlobals.input_trajectory_nature = DEFAULT_TRAJECTORY_NATURE;
+
+	if ( gGlobals.checkpoint_file[0] && !gGlobals.checkpoint_frames && !( gGlobals.checkpoint_minutes > 0 ) )
+		gGlobals.checkpoint_minutes = real( 10 );
+	if ( !gGlobals.checkpoint_file[0] )
+		gGlobals.resume = false;
 }
 
 static int QTASSE_Main( int argc, char *argv[] )
@@ -83,6 +83,8 @@ static struct LayoutControlDesc s_BasicControls[] = {
 	DEFINE_CONTROL( "Output Information File", CTRL_FILE_ANY, CVAR_CHARS, 0, 0, gpGlobals->output_tuples ),
 	DEFINE_CONTROL( "Solvent Residue Name", CTRL_INPUT, CVAR_CHARS, 0, 0, &gpGlobals->solvent_title ),
 	DEFINE_CONTROL( "Initial Snapshot", CTRL_INPUT, CVAR_SIZET, 0, 0, &gpGlobals->first_snap ),
+	DEFINE_CONTROL( "Final Snapshot (0 = all)", CTRL_INPUT, CVAR_SIZET, 0, 0, &gpGlobals->last_snap ),
+	DEFINE_CONTROL( "Snapshot Stride", CTRL_INPUT, CVAR_SIZET, 0, 0, &gpGlobals->snap_stride ),
 	DEFINE_CONTROL( "Minimum Occurence Cutoff", CTRL_SLIDER, CVAR_REAL, 0, 1, &gpGlobals->occurence_cutoff ),
 	DEFINE_CONTROL( "Electrostatics Weight Factor", CTRL_SLIDER, CVAR_REAL, 0, 1, &gpGlobals->electrostatic_coeff ),
 	DEFINE_CONTROL("Hydrogen Bonds Weight Factor", CTRL_SLIDER, CVAR_REAL, 0, 1, &gpGlobals->hbond_126_coeff )
@@ -97,8 +99,8 @@ static LayoutControlDesc s_AdvancedControls[] =
 	DEFINE_CONTROL( "VdW Overlapping Tolerance", CTRL_SLIDER, CVAR_REAL, 0, 1, &gpGlobals->vdw_tolerance ),
 	DEFINE_CONTROL( "Group Hydrogen Bonds Formed by the same Donor/Acceptor", CTRL_CHECKBOX, CVAR_BOOL, 0, 0, &gpGlobals->group_bonds ),
 	DEFINE_CONTROL( "Read Charges from the Input (not applicable to PDB)", CTRL_CHECKBOX, CVAR_BOOL, 0, 0, &gpGlobals->read_charges ),
-#if MAX_THREADS > 1
-	DEFINE_CONTROL( "Number of Threads", CTRL_SLIDER, CVAR_INT, 1, MAX_THREADS, &gpGlobals->thread_count ),
+#if defined(USE_WIN32_THREADS) || defined(USE_POSIX_THREADS)
+	DEFINE_CONTROL( "Number of Threads", CTRL_SLIDER, CVAR_INT, 1, static_cast<real>( ThreadHardwareCount() ), &gpGlobals->thread_count ),
 #endif
 	DEFINE_CONTROL( "Yield Resources to Other Applications", CTRL_CHECKBOX, CVAR_BOOL, 0, 0, &gpGlobals->low_prio ),
 	DEFINE_CONTROL( "Verbose Mode", CTRL_CHECKBOX, CVAR_BOOL, 0, 0, &gpGlobals->verbose )
@@ -644,6 +646,11 @@ void CMainWindow :: onCmdHelpAbout()
 
 //////////////////////////////////////////////////////////////////////////
 
+static bool is_snapshot_missing( uint32 snapshotNum )
+{
+	return !hbonds->IsSnapshotDone( snapshotNum );
+}
+
 static void process_trajectory_snapshot( uint32 threadNum, uint32 snapshotNum, const coord3_t *coords )
 {
 	// this function can be called concurrently and therefore must be reenterant!
@@ -694,6 +701,8 @@ void CMainWindow :: startThreads()
 
 	// init threads
 	ThreadSetDefault( gpGlobals->thread_count, gpGlobals->low_prio );
+	ThreadSetFramesInFlight( gpGlobals->frames_in_flight );
+	ThreadSetAffinity( gpGlobals->thread_affinity );
 
 	// initialize H-bond information
 	hbonds->Initialize();
@@ -721,11 +730,26 @@ void CMainWindow :: startThreads()
 		progress_->setVisible( true );
 		progress_->setEnabled( true );
 		progress_->setValue( 0 );
+		uint32 total = 0;
+		if ( *gpGlobals->checkpoint_file ) {
+			hbonds->SetCheckpoint( gpGlobals->checkpoint_file, static_cast<uint32>( gpGlobals->checkpoint_frames ), gpGlobals->checkpoint_minutes );
+			FILE *fp;
+			if ( gpGlobals->resume && !fopen_s( &fp, gpGlobals->checkpoint_file, "rb" ) ) {
+				// continue from the checkpoint, skip the snapshots already there
+				fclose( fp );
+				total = hbonds->MergeState( gpGlobals->checkpoint_file );
+				topology->SetTrajectoryFilter( is_snapshot_missing );
+			}
+		}
 		// process the trajectory
 		QApplication::restoreOverrideCursor();
 		threaded_ = true;
-		uint32 total = topology->ProcessTrajectory( gpGlobals->input_trajectory, gpGlobals->input_trajectory_nature, 
-													gpGlobals->first_snap, process_trajectory_snapshot, gpGlobals->pacifier );
+		total += topology->ProcessTrajectory( gpGlobals->input_trajectory, gpGlobals->input_trajectory_nature, 
+											  gpGlobals->first_snap, gpGlobals->last_snap, gpGlobals->snap_stride,
+											  process_trajectory_snapshot, gpGlobals->pacifier );
+		topology->SetTrajectoryFilter( nullptr );
+		// keep the frames done so far (even if interrupted)
+		hbonds->FinishCheckpoint();
 		// disable progress bar
 		progress_->setValue( 0 );
 		progress_->setEnabled( false );
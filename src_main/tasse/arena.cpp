@@ -0,0 +1,243 @@
+/***************************************************************************
+* Copyright (C) 2015-2016 Alexander V. Popov.
+* 
+* This file is part of Tightly Associated Solvent Shell Extractor (TASSE) 
+* source code.
+* 
+* TASSE is free software; you can redistribute it and/or modify it under 
+* the terms of the GNU General Public License as published by the Free 
+* Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+* 
+* TASSE is distributed in the hope that it will be useful, but WITHOUT 
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or 
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+* for more details.
+* 
+* You should have received a copy of the GNU General Public License along
+* with this program; if not, write to the Free Software Foundation, Inc.,
+* 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+***************************************************************************/
+#include <tasse.h>
+#include <arena.h>
+
+// block sizes are rounded up to keep the blocks aligned
+#define ARENA_GRANULARITY	16
+// slab size, in bytes, and min number of blocks per slab
+#define ARENA_SLAB_BYTES	( 512 * 1024 )
+#define ARENA_SLAB_MIN		64
+// a cache keeps this many slabs' worth of free blocks before it spills
+#define ARENA_CACHE_SLABS	2
+
+CBlockArena :: CBlockArena() : blockSize_( 0 ),
+							   slabBlocks_( 0 ),
+							   cacheLimit_( 0 ),
+							   caches_( nullptr ),
+							   numCaches_( 0 ),
+							   slabsBlocks_( 0 ),
+							   retiredBlocks_( 0 ),
+							   depot_( nullptr ),
+							   depotCount_( 0 ),
+							   spills_( 0 ),
+							   refills_( 0 ),
+							   compactions_( 0 ),
+							   liveBlocks_( 0 ),
+							   peakBlocks_( 0 )
+{
+	lock_.clear();
+}
+
+CBlockArena :: ~CBlockArena()
+{
+	Clear();
+}
+
+void CBlockArena :: Setup( size_t blockSize, uint32 numCaches )
+{
+	assert( blockSize > 0 );
+	assert( numCaches > 0 );
+	Clear();
+
+	blockSize_ = ( std::max( blockSize, sizeof(FreeBlock) ) + ARENA_GRANULARITY - 1 ) & ~size_t( ARENA_GRANULARITY - 1 );
+	slabBlocks_ = static_cast<uint32>( std::max( ARENA_SLAB_BYTES / blockSize_, size_t( ARENA_SLAB_MIN ) ) );
+	cacheLimit_ = slabBlocks_ * ARENA_CACHE_SLABS;
+
+	caches_ = reinterpret_cast<Cache*>( utils->AllocAligned( sizeof(Cache) * numCaches, CACHE_LINE_SIZE ) );
+	if ( !caches_ )
+		utils->Fatal( "failed to allocate %u block caches!\n", numCaches );
+	memset( caches_, 0, sizeof(Cache) * numCaches );
+	numCaches_ = numCaches;
+}
+
+void CBlockArena :: Clear()
+{
+	for ( auto it = slabs_.begin(); it != slabs_.end(); ++it )
+		utils->Free( *it );
+	for ( auto it = retired_.begin(); it != retired_.end(); ++it )
+		utils->Free( *it );
+	slabs_.clear();
+	retired_.clear();
+	slabsBlocks_ = retiredBlocks_ = 0;
+	if ( caches_ )
+		utils->FreeAligned( caches_ );
+	caches_ = nullptr;
+	numCaches_ = 0;
+	depot_ = nullptr;
+	depotCount_ = 0;
+	spills_ = refills_ = compactions_ = 0;
+	liveBlocks_ = 0;
+	peakBlocks_ = 0;
+}
+
+void CBlockArena :: Lock()
+{
+	while ( lock_.test_and_set( std::memory_order_acquire ) )
+		;
+}
+
+void CBlockArena :: Unlock()
+{
+	lock_.clear( std::memory_order_release );
+}
+
+void *CBlockArena :: Alloc( uint32 cache )
+{
+	assert( cache < numCaches_ );
+	Cache *c = &caches_[cache];
+	if ( !c->head )
+		Refill( c );
+
+	FreeBlock *block = c->head;
+	c->head = block->next;
+	--c->count;
+
+	const size_t live = liveBlocks_.fetch_add( 1, std::memory_order_relaxed ) + 1;
+	size_t peak = peakBlocks_.load( std::memory_order_relaxed );
+	while ( live > peak && !peakBlocks_.compare_exchange_weak( peak, live, std::memory_order_relaxed ) )
+		;
+	return block;
+}
+
+void CBlockArena :: Free( uint32 cache, void *block )
+{
+	assert( cache < numCaches_ );
+	assert( block != nullptr );
+	Cache *c = &caches_[cache];
+	FreeBlock *fb = reinterpret_cast<FreeBlock*>( block );
+	fb->next = c->head;
+	c->head = fb;
+	++c->count;
+	liveBlocks_.fetch_sub( 1, std::memory_order_relaxed );
+
+	if ( c->count > cacheLimit_ )
+		Spill( c );
+}
+
+void CBlockArena :: Refill( Cache *c )
+{
+	assert( c->head == nullptr );
+
+	// take a half of the cache limit from the depot
+	Lock();
+	if ( depot_ ) {
+		FreeBlock *first = depot_, *last = depot_;
+		uint32 count = 1;
+		for ( ; count < cacheLimit_ / 2 && last->next; ++count )
+			last = last->next;
+		depot_ = last->next;
+		depotCount_ -= count;
+		++refills_;
+		Unlock();
+		last->next = nullptr;
+		c->head = first;
+		c->count = count;
+		return;
+	}
+	Unlock();
+
+	// depot is empty, allocate a new slab
+	AllocateSlab( c, slabBlocks_ );
+}
+
+void CBlockArena :: AllocateSlab( Cache *c, uint32 numBlocks )
+{
+	uint8 *slab = reinterpret_cast<uint8*>( utils->Alloc( numBlocks * blockSize_ ) );
+	if ( !slab )
+		utils->Fatal( "failed to allocate a slab of %u blocks (%.1f kb)!\n", numBlocks, ( numBlocks * blockSize_ ) / 1024.0 );
+
+	// blocks are given out in address order
+	for ( uint32 i = numBlocks; i > 0; --i ) {
+		FreeBlock *fb = reinterpret_cast<FreeBlock*>( slab + ( i - 1 ) * blockSize_ );
+		fb->next = c->head;
+		c->head = fb;
+	}
+	c->count += numBlocks;
+
+	Lock();
+	slabs_.push_back( slab );
+	slabsBlocks_ += numBlocks;
+	Unlock();
+}
+
+void CBlockArena :: Spill( Cache *c )
+{
+	// keep a half of the cache limit, hand the rest to the depot
+	FreeBlock *last = c->head;
+	for ( uint32 i = 1; i < cacheLimit_ / 2; ++i )
+		last = last->next;
+	FreeBlock *first = last->next;
+	FreeBlock *tail = first;
+	while ( tail->next )
+		tail = tail->next;
+	const uint32 count = c->count - cacheLimit_ / 2;
+	last->next = nullptr;
+	c->count = cacheLimit_ / 2;
+
+	Lock();
+	tail->next = depot_;
+	depot_ = first;
+	depotCount_ += count;
+	++spills_;
+	Unlock();
+}
+
+void CBlockArena :: BeginCompaction( uint32 numBlocks )
+{
+	// blocks of the retired slabs stay readable until EndCompaction
+	assert( retired_.empty() );
+	retired_.swap( slabs_ );
+	retiredBlocks_ = slabsBlocks_;
+	slabsBlocks_ = 0;
+	for ( uint32 i = 0; i < numCaches_; ++i ) {
+		caches_[i].head = nullptr;
+		caches_[i].count = 0;
+	}
+	depot_ = nullptr;
+	depotCount_ = 0;
+	liveBlocks_ = 0;
+
+	// the surviving blocks are copied into the first cache
+	if ( numBlocks )
+		AllocateSlab( &caches_[0], numBlocks );
+}
+
+void CBlockArena :: EndCompaction()
+{
+	for ( auto it = retired_.begin(); it != retired_.end(); ++it )
+		utils->Free( *it );
+	retired_.clear();
+	retiredBlocks_ = 0;
+	++compactions_;
+}
+
+void CBlockArena :: GetStats( Stats &stats ) const
+{
+	stats.blockSize = blockSize_;
+	stats.liveBytes = liveBlocks_.load( std::memory_order_relaxed ) * blockSize_;
+	stats.peakBytes = peakBlocks_.load( std::memory_order_relaxed ) * blockSize_;
+	stats.reservedBytes = ( slabsBlocks_ + retiredBlocks_ ) * blockSize_;
+	stats.numSlabs = static_cast<uint32>( slabs_.size() + retired_.size() );
+	stats.spills = spills_;
+	stats.refills = refills_;
+	stats.compactions = compactions_;
+}
@@ -0,0 +1,96 @@
+/***************************************************************************
+* Copyright (C) 2015-2016 Alexander V. Popov.
+* 
+* This file is part of Tightly Associated Solvent Shell Extractor (TASSE) 
+* source code.
+* 
+* TASSE is free software; you can redistribute it and/or modify it under 
+* the terms of the GNU General Public License as published by the Free 
+* Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+* 
+* TASSE is distributed in the hope that it will be useful, but WITHOUT 
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or 
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+* for more details.
+* 
+* You should have received a copy of the GNU General Public License along
+* with this program; if not, write to the Free Software Foundation, Inc.,
+* 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+***************************************************************************/
+#ifndef TASSE_ARENA_H
+#define TASSE_ARENA_H
+
+// Arena of fixed-size blocks.
+// Blocks are carved from large slabs of a single size class (the block size
+// rounded up to ARENA_GRANULARITY). Every thread has a cache of free blocks
+// of its own; a cache that grows too long hands half of its blocks to the 
+// shared depot, and an empty cache takes blocks from the depot before a new 
+// slab is allocated, so blocks freed by one thread are reused by the others.
+// Slabs are allocated by the thread that needs them first, so the memory is
+// local to its node. Compaction retires all slabs at once: the owner copies
+// the surviving blocks into a single slab of their exact count between 
+// BeginCompaction and EndCompaction, then the retired slabs are released.
+
+class CBlockArena
+{
+	typedef struct stFreeBlock {
+		struct stFreeBlock	*next;		// Next free block of the list
+	} FreeBlock;
+
+	typedef struct alignas( CACHE_LINE_SIZE ) {
+		FreeBlock		*head;			// Free blocks of the cache
+		uint32			count;			// Number of free blocks in the cache
+	} Cache;
+
+public:
+	typedef struct {
+		size_t			blockSize;		// Size class of the blocks, in bytes
+		size_t			liveBytes;		// Bytes in the blocks given out
+		size_t			peakBytes;		// Max of liveBytes since Setup
+		size_t			reservedBytes;	// Bytes in the slabs
+		uint32			numSlabs;		// Number of slabs
+		uint32			spills;			// Caches that handed blocks to the depot
+		uint32			refills;		// Caches refilled from the depot
+		uint32			compactions;	// Number of compactions
+	} Stats;
+
+	CBlockArena();
+	~CBlockArena();
+
+	void Setup( size_t blockSize, uint32 numCaches );
+	void Clear();
+	void *Alloc( uint32 cache );
+	void Free( uint32 cache, void *block );
+	void BeginCompaction( uint32 numBlocks );
+	void EndCompaction();
+	size_t BlockSize() const { return blockSize_; }
+	void GetStats( Stats &stats ) const;
+
+private:
+	void Refill( Cache *c );
+	void AllocateSlab( Cache *c, uint32 numBlocks );
+	void Spill( Cache *c );
+	void Lock();
+	void Unlock();
+
+	size_t				blockSize_;		// Size class of the blocks
+	uint32				slabBlocks_;	// Number of blocks per slab
+	uint32				cacheLimit_;	// Max free blocks kept by a cache
+	Cache				*caches_;		// Per-thread caches of free blocks
+	uint32				numCaches_;
+	std::vector<uint8*>	slabs_;			// Slabs in use
+	std::vector<uint8*>	retired_;		// Slabs being compacted
+	size_t				slabsBlocks_;	// Number of blocks in the slabs in use
+	size_t				retiredBlocks_;	// Number of blocks in the retired slabs
+	FreeBlock			*depot_;		// Free blocks shared by the caches
+	uint32				depotCount_;	// Number of free blocks in the depot
+	uint32				spills_;
+	uint32				refills_;
+	uint32				compactions_;
+	std::atomic_flag	lock_;			// Spin lock guarding the slabs and the depot
+	std::atomic<size_t>	liveBlocks_;
+	std::atomic<size_t>	peakBlocks_;
+};
+
+#endif //TASSE_ARENA_H
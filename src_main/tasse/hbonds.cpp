@@ -21,6 +21,10 @@
 #include <tasse.h>
 #include <topology.h>
 #include <hbonds.h>
+#include <occupancy.h>
+#include <arena.h>
+#include <superpose.h>
+#include <latency.h>
 
 #define DAF_PROTEIN		BIT( 0 )
 #define DAF_NUCLEIC		BIT( 1 )
@@ -35,8 +39,60 @@
 #define UINT32_BAD		uint32( ~0 )
 
 // HBSolvent flags
-#define HBSF_ALLOC		BIT( 0 )
-#define HBSF_VALID		BIT( 1 )
+#define HBSF_VALID		BIT( 0 )
+
+// Min biopolymer atoms per intra-frame task
+#define MIN_TILE_ATOMS	32
+// Number of intra-frame tasks per thread (more tasks give better balance)
+#define TILES_PER_THREAD	4
+// Min bridges per frame for the radix sort (fewer are sorted with std::sort)
+#define MIN_RADIX_SORT		64
+// Max key bits per radix sort pass
+#define RADIX_SORT_BITS		11
+// Max points of the solvent density grid
+#define DENSITY_MAX_CELLS	( 1u << 26 )
+
+// Partial state file identification
+#define HBSTATE_MAGIC		"TASSEHBS"
+#define HBSTATE_VERSION		1
+#define HBSTATE_NUM_PARMS	8
+
+#define HBSTATE_SECTION_BLOCKS		1	// Snapshots per block
+#define HBSTATE_SECTION_REPLICAS	2	// Snapshots per replica
+#define HBSTATE_SECTION_CHAINS		3	// Second-order bridges
+
+// Bridge capture file identification
+#define HBCAPTURE_MAGIC		"TASSEBRG"
+#define HBCAPTURE_VERSION	1
+
+// Energy terms computed by a specialised kernel
+#define HBTERMS_ALL		0	// Electrostatics and 12-6
+#define HBTERMS_ELEC	1	// Electrostatics only (h-bond coefficient is zero)
+#define HBTERMS_HBOND	2	// 12-6 only (electrostatic coefficient is zero)
+
+// Intervals of the tabulated energy terms
+#define HBTABLE_INTERVALS	256
+// 1+cos(theta) beyond which the tabulated angular term is zero (exp(-1/0.018) < 1e-24)
+#define HBTABLE_MAX_COST	1.0
+// Samples per interval for the accuracy report of the tables
+#define HBTABLE_SAMPLES		8
+
+// lags of the occupancy autocorrelation, in snapshots
+#define HBOCC_NUM_LAGS		3
+static const uint32 hbOccupancyLags[HBOCC_NUM_LAGS] = { 1, 10, 100 };
+
+// pipeline phases timed for every frame
+#define HBPHASE_READ		0	// Reading the frame (topology)
+#define HBPHASE_PARSE		1	// Parsing the coordinates (topology)
+#define HBPHASE_SEARCH		2	// Fit and bridge search, the energy kernel included
+#define HBPHASE_SORT		3	// Sorting (and capturing) the bridges
+#define HBPHASE_LOCAL		4	// Second-order bridges and solvent density
+#define HBPHASE_MERGE_WAIT	5	// Waiting for the global lock
+#define HBPHASE_MERGE		6	// Accumulating the frame into the global maps
+#define HBPHASE_FINAL		7	// Completing the frame (checkpoints, compaction)
+#define HBPHASE_TOTAL		8	// Whole frame, reading and parsing excluded
+#define HBPHASE_COUNT		9
+static const char *hbPhaseNames[HBPHASE_COUNT] = { "Read", "Parse", "Bridge search", "Sort", "Chains/density", "Merge wait", "Merge", "Final", "Total" };
 
 typedef struct {
 	name_t	rtitle;					// Residue title
@@ -64,6 +120,44 @@ class CHBonds : public IHBonds
 		real			b;				// B6
 	} TripletParms;
 
+	template<typename T> struct HBTable {
+		T				x0;				// First node
+		T				x1;				// Last node
+		T				invStep;		// Intervals per unit of the argument
+		int				intervals;		// Number of intervals
+		std::vector<T>	nodes;			// Value and slope (per interval) of every node
+
+		bool Contains( T x ) const { return x >= x0 && x < x1; }
+		T Eval( T x ) const {
+			// cubic Hermite interpolation
+			const T t = ( x - x0 ) * invStep;
+			const int i = std::min( static_cast<int>( t ), intervals - 1 );
+			const T u = t - i;
+			const T *p = &nodes[i*2];
+			return p[0] + u * ( p[1] + u * ( T( 3 ) * ( p[2] - p[0] ) - T( 2 ) * p[1] - p[3] + u * ( T( 2 ) * ( p[0] - p[2] ) + p[1] + p[3] ) ) );
+		}
+	};
+
+	template<typename T> struct HBKernel {
+		struct Parms {
+			T			r;				// Rmin
+			T			e;				// Em
+			T			a;				// A12
+			T			b;				// B6
+		};
+		T				rc_sq;			// Squared cut-off radius
+		T				crf_a;			// Reaction field constants
+		T				crf_b;
+		T				scale_e;		// Scale of the electrostatic energy
+		T				scale_h;		// Scale of the 12-6 energy
+		int				maxY;			// Row length of the triplet parms
+		std::vector<T>	charges;		// Charges of all atoms
+		std::vector<Parms>	parms;		// Triplet parms, indexed by [code_h*maxY + code_y]
+		bool			tabulated;		// Use the tables instead of exp() and the 12-6 powers
+		HBTable<T>		angular;		// exp((1+cos(theta))^2/-sigma^2)
+		std::vector<HBTable<T>>	hb126;	// 12-6 energy over Y-H distance, indexed as parms
+	};
+
 	typedef struct {
 		uint32			xy_index;		// Donor/acceptor atom index
 		uint32			xy_remap;		// Remapped donor/acceptor atom index (for grouping)
@@ -72,6 +166,7 @@ class CHBonds : public IHBonds
 		uint16			y_code;			// FF code for acceptor (UINT32_BAD if not an acceptor)
 		uint32			h_indices[MAX_H];	// Hydrogen atom indices for donor (UINT32_BAD means end-of-list)
 		uint8			codes[MAX_H];	// FF codes for corresponding hydrogens
+		uint8			numH;			// Number of hydrogens (0 if not a donor)
 	} HBAtom;
 
 	typedef struct {
@@ -86,15 +181,48 @@ class CHBonds : public IHBonds
 		real			energy;			// Energy value
 	} HBBridge;
 
+	typedef struct {
+		uint32			first;			// First bridge of the microset
+		uint32			count;			// Number of bridges in the microset
+	} HBMicroset;
+
+	typedef struct {
+		uint64			key;			// Packed cell coordinates
+		int32			cell[3];		// Cell coordinates
+		uint32			microset;		// Microset of the solvent atom
+		uint32			atom;			// Solvent donor/acceptor (index in the solvent list)
+	} HBCellEntry;
+
+	typedef struct {
+		uint32			microset0;		// First microset (lower index)
+		uint32			microset1;		// Second microset
+		real			energy;			// Energy of the solvent-solvent h-bond
+	} HBChainBond;
+
+	typedef struct {
+		uint32			index0;			// First biopolymer atom index
+		uint32			index1;			// Second biopolymer atom index
+		real			energy;			// Bonding energy averaged over the three h-bonds
+		real			weakest;		// Energy of the weakest of the three h-bonds
+	} HBChain;
+
+	typedef struct stHBSolventCoords {
+		struct stHBSolventCoords *moved;	// New location while the store is compacted
+		uint32			refs;			// Number of references (solvent blocks and the frame store)
+		uint32			snapshot;		// Snapshot the coordinates come from
+		uint32			s_index;		// Solvent atom index
+		coord4_t		coords[1];		// Coordinates for all atoms (variable sized)
+	} HBSolventCoords;
+
 	typedef struct stHBSolvent {
-		struct stHBSolvent *next;		// Next solvent atom info in thread chain
 		struct stHBSolvent *chain;		// Next solvent atom info in score chain
 		struct stHBSolvent *gblock;		// Precached pointer to the global block
+		HBSolventCoords	*crd;			// Best coordinates (nullptr until captured or fetched)
 		uint32			flags;			// Flags (HBSF_xxx)
 		uint32			snaps;			// Number of snapshots where this solvent occurs
 		uint32			s_index;		// Solvent atom index
+		uint32			snapshot;		// Snapshot of the best position/orientation
 		real			energy;			// Energy in the best position/orientation
-		coord4_t		coords[1];		// Best coordinates for all atoms (variable sized)
 	} HBSolvent;
 
 	typedef struct {
@@ -108,11 +236,16 @@ class CHBonds : public IHBonds
 		uint32			index2;			// Third atom index of the triplet
 	} HBTriplet;
 
+	typedef std::vector<uint32> HBBlockCounts;
+
 	typedef struct {
 		uint32			score;			// Sum of local scores for this pair/triplet
 		uint32			snaps;			// Number of snapshots where this pair/triplet occurs
 		real			energy;			// Overall bonding energy
 		HBSolvent		*solv;			// Solvent atoms chain
+		COccupancy		*occ;			// Snapshots where this pair/triplet occurs (nullptr if not tracked)
+		HBBlockCounts	*blocks;		// Number of snapshots per block (nullptr if not tracked)
+		HBBlockCounts	*replicas;		// Number of snapshots per replica (nullptr if not tracked)
 	} HBGlobalScore;
 
 	typedef struct {
@@ -128,6 +261,9 @@ class CHBonds : public IHBonds
 		uint32			score;			// Final score
 		real			occurence;		// Occurence in the trajectory, percentage (0-100)
 		real			energy;			// Bonding energy averaged along the trajectory
+		const COccupancy *occ;			// Snapshots where this pair occurs
+		const HBBlockCounts *blocks;	// Number of snapshots per block
+		const HBBlockCounts *replicas;	// Number of snapshots per replica
 	} HBFinalPair;
 
 	typedef struct {
@@ -137,6 +273,9 @@ class CHBonds : public IHBonds
 		uint32			score;			// Final score
 		real			occurence;		// Occurence in the trajectory, percentage (0-100)
 		real			energy;			// Bonding energy averaged along the trajectory
+		const COccupancy *occ;			// Snapshots where this triplet occurs
+		const HBBlockCounts *blocks;	// Number of snapshots per block
+		const HBBlockCounts *replicas;	// Number of snapshots per replica
 	} HBFinalTriplet;
 
 	typedef struct {
@@ -147,17 +286,87 @@ class CHBonds : public IHBonds
 	} HBFinalSolvent;
 
 	typedef struct {
-		size_t			frames;
-		real			minTime;
-		real			maxTime;
-		real			avgTime;
-	} HBPerfCounter;
+		real			residence;		// Mean residence time (length of a continuous run), in snapshots
+		uint32			longest;		// Longest continuous run, in snapshots
+		real			acf[HBOCC_NUM_LAGS];	// Occupancy autocorrelation at hbOccupancyLags
+	} HBOccupancyStats;
+
+	typedef struct {
+		char			magic[8];		// HBSTATE_MAGIC
+		uint32			version;		// HBSTATE_VERSION
+		uint32			realSize;		// sizeof(real) of the writer
+		uint32			atomCount;		// Number of atoms in the topology
+		uint32			solventSize;	// Number of atoms in the solvent molecule
+		uint32			frames;			// Number of accumulated frames
+		uint32			numPairs;		// Number of pair records
+		uint32			numTriplets;	// Number of triplet records
+		uint32			numRanges;		// Number of completed snapshot ranges (after the records)
+		real			parms[HBSTATE_NUM_PARMS];	// Settings that affect accumulation
+	} HBStateHeader;
+
+	typedef struct {
+		uint32			index[3];		// Atom indices of the pair/triplet (index[2] is UINT32_BAD for pairs)
+		uint32			score;			// Sum of local scores
+		uint32			snaps;			// Number of snapshots where this pair/triplet occurs
+		uint32			numSolvent;		// Number of solvent records that follow
+		real			energy;			// Overall bonding energy
+	} HBStateRecord;
+
+	typedef struct {
+		uint32			s_index;		// Solvent atom index
+		uint32			snaps;			// Number of snapshots where this solvent occurs
+		real			energy;			// Energy in the best position/orientation
+	} HBStateSolvent;					// Followed by best coordinates for all atoms
+
+	typedef struct {
+		uint32			first;			// First completed snapshot of the range
+		uint32			count;			// Number of consecutive completed snapshots
+	} HBStateRange;
+
+	typedef struct {
+		uint32			index;			// Remapped donor/acceptor atom index of the group
+		uint32			reserved;
+		char			title[64];		// Group title
+	} HBStateTitle;
+
+	typedef struct {
+		uint32			kind;			// HBSTATE_SECTION_xxx
+		uint32			parm;			// Block length (HBSTATE_SECTION_BLOCKS only)
+		uint32			count;			// Number of counters per record (number of records for HBSTATE_SECTION_CHAINS)
+		uint32			reserved;
+	} HBStateSection;					// Followed by counters of all records, or by pair records
+
+	typedef struct {
+		char			magic[8];		// HBCAPTURE_MAGIC
+		uint32			version;		// HBCAPTURE_VERSION
+		uint32			realSize;		// sizeof(real) of the writer
+		uint32			atomCount;		// Number of atoms in the topology
+		uint32			reserved;
+		real			parms[HBSTATE_NUM_PARMS];	// Settings of the energy calculation
+	} HBCaptureHeader;
 
 	typedef struct {
-		HBPerfCounter	pcMicroset;
-		HBPerfCounter	pcTuples;
-		HBPerfCounter	pcTotal;
-	} HBPerfCounters;
+		uint32			snapshot;		// Snapshot number
+		uint32			numBridges;		// Number of bridges in the frame
+		uint32			size;			// Size of the encoded bridges, in bytes
+	} HBCaptureFrame;					// Followed by the encoded bridges
+
+	typedef struct {
+		uint32			frames;			// Number of compared frames
+		size_t			common;			// Bridges found in both precisions
+		size_t			onlySingle;		// Bridges found in single precision only
+		size_t			onlyDouble;		// Bridges found in double precision only
+		real			maxDelta;		// Max energy difference of the common bridges
+		real			maxRelDelta;	// Max energy difference relative to the double-precision energy
+	} HBPrecisionStats;
+
+	typedef struct {
+		uint64			large;			// Microsets of more than three bridges
+		uint64			triplets;		// Triplets of the large microsets
+		uint64			capped;			// Microsets cut down to the cap
+		uint64			dropped;		// Bridges dropped by the cap
+		uint32			maxBridges;		// Largest microset processed
+	} HBMicrosetStats;
 
 	typedef std::vector<HBBridge> HBBridgeVec;
 	typedef std::map<uint32,HBGroup> HBGroupMap;
@@ -170,6 +379,23 @@ class CHBonds : public IHBonds
 	typedef std::vector<HBFinalTriplet> HBFinalTripletVec;
 	typedef std::map<uint32,HBFinalSolvent*> HBSolventMap;
 
+	typedef struct {
+		real				cutoff;		// Absolute h-bond cut-off energy of the level
+		HBPairScoreMap		pairs;		// Pairs accumulated at this level
+		HBTripletScoreMap	triplets;	// Triplets accumulated at this level
+		HBPairScoreMap		chains;		// Second-order bridges accumulated at this level
+	} HBSweepLevel;
+
+	typedef std::vector<HBSweepLevel> HBSweepLevelVec;
+
+	typedef struct {
+		coord3_t		mins;			// Lower corner of the grid
+		real			spacing;		// Grid spacing
+		real			invSpacing;		// 1 / spacing
+		uint32			dims[3];		// Number of points along each axis
+		uint32			numCells;		// Total number of points (0 = no density map)
+	} HBDensityGrid;
+
 	friend bool operator < ( const CHBonds::HBPair &x, const CHBonds::HBPair &y );
 	friend bool operator < ( const CHBonds::HBTriplet &x, const CHBonds::HBTriplet &y );
 	friend bool operator < ( const CHBonds::HBBridge &x, const CHBonds::HBBridge &y );
@@ -177,9 +403,41 @@ class CHBonds : public IHBonds
 	friend bool operator < ( const CHBonds::HBFinalTriplet &x, const CHBonds::HBFinalTriplet &y );
 
 	typedef struct {
+		HBBridgeVec		bridges;		// Bridges found in the tile
+		uint32			c_donors;		// Number of biopolymer donor bonds
+		uint32			c_acceptors;	// Number of biopolymer acceptor bonds
+	} HBTile;
+
+	typedef std::vector<HBTile> HBTileVec;
+
+	typedef struct alignas( CACHE_LINE_SIZE ) {
 		HBBridgeVec		bridges;	// Thread-local bridge array (to avoid reallocations and therefore unnecessary syncs)
-		HBSolvent		*solvData;	// Thread-local chain of allocated solvent data
-		HBSolvent		*solvFree;	// Thread-local chain of free solvent data
+		HBTileVec		tiles;		// Thread-local tiles of the intra-frame bridge search
+		const coord3_t	*coords;	// Coordinates of the frame being tiled
+		std::vector<coord3f_t>	coordsF;	// Single-precision copy of the frame (float32 mode)
+		bool			single;		// Tiles use the single-precision kernel
+		HBBridgeVec		shadow;		// Double-precision bridges of the frame (precision report)
+		HBBridgeVec		sortBuffer;	// Scratch buffer of the bridge sort
+		std::vector<uint32>	sortCounts;	// Buckets of the bridge sort
+		HBBridgeVec		microsetBridges;	// Strongest bridges of a capped microset
+		std::vector<real>	microsetEnergy;	// Inverse bridge energies of a large microset
+		bool			microsetStats;	// Large microsets are counted (primary cut-off only)
+		std::vector<std::pair<uint32,HBSolventCoords*>>	frameCoords;	// Solvent coordinates captured in the frame, sorted by solvent index
+		uint32			frames;		// Number of frames processed by the thread
+		uint32			snapshot;	// Snapshot being processed
+		double			busyTime;	// Time spent on the frames, in milliseconds
+		double			firstTime;	// Start of the first frame, reading included
+		double			lastTime;	// End of the last frame
+		uint64			atomPairs;	// Biopolymer-solvent atom pairs evaluated
+		CLatencyHistogram	phases[HBPHASE_COUNT];	// Time of the pipeline phases of the frames
+		std::vector<uint8>	capture;	// Encoded bridges of the frame (if captured)
+		std::vector<HBMicroset>	microsets;	// Microsets of the frame (for second-order bridges)
+		std::vector<HBCellEntry>	cells;	// Cell list of the solvent atoms of the microsets
+		std::vector<HBChainBond>	chainBonds;	// Solvent-solvent h-bonds between the microsets
+		std::vector<HBChain>	chains;		// Second-order bridges of the frame
+		std::vector<uint32>	density;	// Solvent density counts of the thread's frames
+		CSuperposition::Transform	xform;	// Superposition of the frame onto the reference
+		const CSuperposition::Transform	*fit;	// Points to xform if the frame is fitted (nullptr otherwise)
 	} ThreadLocal;
 
 public:
@@ -198,26 +456,101 @@ public:
 	virtual void BuildFinalSolvent( uint32 totalFrames );
 	virtual	bool PrintFinalTuples( uint32 totalFrames, const char *tupleFile ) const;
 	virtual void PrintPerformanceCounters();
+	virtual bool SaveState( uint32 totalFrames, const char *stateFile ) const;
+	virtual uint32 MergeState( const char *stateFile );
+	virtual uint32 LoadResults( const char *resultsFile );
+	virtual void SetCheckpoint( const char *checkpointFile, uint32 everyFrames, real everyMinutes );
+	virtual bool IsSnapshotDone( uint32 snapshotNum ) const;
+	virtual void FinishCheckpoint();
+	virtual void SetCutoffSweep( const real *cutoffs, uint32 count );
+	virtual uint32 GetCutoffLevels() const;
+	virtual real SelectCutoffLevel( uint32 level );
+	virtual bool BeginBridgeCapture( const char *captureFile );
+	virtual void EndBridgeCapture();
+	virtual uint32 ReplayBridges( const char *captureFile );
+	virtual uint32 PrepareCoordsFetch( uint32 totalFrames, real occurenceCutoff );
+	virtual bool IsFetchSnapshot( uint32 snapshotNum ) const;
+	virtual void FetchCoords( const uint32 threadNum, const uint32 snapshotNum, const coord3_t *coords );
+	virtual bool WriteDensityMap( uint32 totalFrames, const char *dxFile );
+	virtual void PrintPrecisionReport( uint32 totalFrames ) const;
+
+	void FindBridgesTile( void *local, uint32 tile );
+	void ReduceDensityPlane( uint32 plane );
+	void WriteCheckpoint();
 
 protected:
 	void PrintInformation();
-	real CalcEnergy( const HBAtom *atX, const HBAtom *atY, const atom_t *atoms, const coord3_t *coords ) const;
+	template<typename T, typename C> void FindBridges( const HBAtom *firstAtom, const HBAtom *lastAtom, const HBKernel<T> &kernel, const C *coords, HBBridgeVec &bridges, uint32 &c_donors, uint32 &c_acceptors ) const;
+	template<int TERMS, typename T, typename C> void FindBridgesTerms( const HBAtom *firstAtom, const HBAtom *lastAtom, const HBKernel<T> &kernel, const C *coords, HBBridgeVec &bridges, uint32 &c_donors, uint32 &c_acceptors ) const;
+	template<int NHB, int TERMS, typename T, typename C> void FindAtomBridges( const HBAtom *itb, const HBKernel<T> &kernel, const C *coords, HBBridgeVec &bridges, uint32 &c_donors, uint32 &c_acceptors ) const;
+	template<int TERMS, typename T, typename C> T CalcEnergy( const HBAtom *atX, const HBAtom *atY, const HBKernel<T> &kernel, const C *coords ) const;
+	template<int NH, int TERMS, typename T, typename C> T EnergyKernel( const HBAtom *atX, const HBAtom *atY, const HBKernel<T> &kernel, const C *coords ) const;
+	template<typename T> void BuildKernel( HBKernel<T> &kernel ) const;
+	template<typename F> void BuildTable( HBTable<real> &table, real x0, real x1, F func, real &maxError, real &maxRelError ) const;
+	void BuildEnergyTables();
+	void SearchBridges( ThreadLocal *tl, uint32 threadNum, const coord3_t *coords, bool single, HBBridgeVec &bridges, uint32 &c_donors, uint32 &c_acceptors );
+	void ComparePrecision( ThreadLocal *tl, const atom_t *atoms, const coord3_t *coords );
 	real AverageEnergy( real e1, real e2 ) const;
 	real AverageEnergy( real e1, real e2, real e3 ) const;
-	void ProcessMicroset( ThreadLocal *tl, const HBBridge *firstBridge, size_t numBridges, const atom_t *atoms, const coord3_t *coords, HBPairMap &localPairMap, HBTripletMap &localTripletMap );
+	void CapMicroset( ThreadLocal *tl, const HBBridge *&firstBridge, size_t &numBridges );
+	void ProcessLargeMicroset( ThreadLocal *tl, const HBBridge *firstBridge, size_t numBridges, const atom_t *atoms, const coord3_t *coords, HBTripletMap &localTripletMap, HBTripletScoreMap &tripletScoreMap );
+	void ProcessMicroset( ThreadLocal *tl, const HBBridge *firstBridge, size_t numBridges, const atom_t *atoms, const coord3_t *coords, HBPairMap &localPairMap, HBTripletMap &localTripletMap, HBPairScoreMap &pairScoreMap, HBTripletScoreMap &tripletScoreMap );
+	uint32 AccumulateBridges( ThreadLocal *tl, const atom_t *atoms, const coord3_t *coords, HBPairScoreMap &pairScoreMap, HBTripletScoreMap &tripletScoreMap, size_t &c_pairs, size_t &c_triplets );
+	uint32 AccumulateLevels( ThreadLocal *tl, const atom_t *atoms, const coord3_t *coords, size_t &c_pairs, size_t &c_triplets, size_t &c_chains );
+	void FindChains( ThreadLocal *tl, const coord3_t *coords ) const;
+	size_t AccumulateChains( ThreadLocal *tl, HBPairScoreMap &chainScoreMap, real cutoff ) const;
+	void EncodeBridges( const HBBridgeVec &bridges, std::vector<uint8> &buffer ) const;
+	bool DecodeBridges( const uint8 *data, size_t size, uint32 numBridges, HBBridgeVec &bridges ) const;
+	void RemapBridges( HBBridgeVec &bridges ) const;
+	void SortBridges( ThreadLocal *tl, HBBridgeVec &bridges ) const;
+	void RadixSortBridges( ThreadLocal *tl, HBBridgeVec &bridges, uint32 HBBridge::*key, uint32 minKey, uint32 maxKey ) const;
+	void RadixPassBridges( const HBBridgeVec &src, HBBridgeVec &dst, uint32 HBBridge::*key, uint32 minKey, uint32 shift, uint32 bits, std::vector<uint32> &counts ) const;
+	void WriteCapturedFrame( ThreadLocal *tl, uint32 snapshotNum );
 	void GetOutputAtomTitle( const atom_t *at, const uint32 index, char *outBuffer, size_t outBufferSize ) const;
 
-	void AllocateSolventBlocks( ThreadLocal *tl, uint32 blockCount ) const;
-	void DeallocateSolventBlocks( ThreadLocal *tl ) const;
-	HBSolvent *GrabSolventBlock( ThreadLocal *tl ) const;
+	HBSolvent *GrabSolventBlock( ThreadLocal *tl );
 	HBSolvent *FindGlobalBlock( HBSolvent *block, HBSolvent *list ) const;
-	void ReturnSolventBlock( ThreadLocal *tl, HBSolvent *block ) const;
-	void BuildBlockInfo( HBSolvent *block, const atom_t *atoms, const coord3_t *coords ) const;
+	void ReturnSolventBlock( ThreadLocal *tl, HBSolvent *block );
+	void CompactSolventBlocks();
+	void CompactSolventChains( HBSolvent *&solv );
+	void BuildBlockInfo( ThreadLocal *tl, HBSolvent *block, HBSolventCoords *sc );
+	HBSolventCoords *CaptureSolventCoords( ThreadLocal *tl, uint32 s_index, const atom_t *atoms, const coord3_t *coords );
+	HBSolventCoords *AllocSolventCoords( uint32 cache, uint32 s_index, uint32 snapshot );
+	void ReleaseSolventCoords( uint32 cache, HBSolventCoords *sc );
+	void ReleaseFrameCoords( ThreadLocal *tl );
+	void SetBlockCoords( ThreadLocal *tl, HBSolvent *block, const coord4_t *coords );
+	void CopySolventCoords( HBSolventCoords *sc, const atom_t *atoms, const coord3_t *coords, const CSuperposition::Transform *fit ) const;
 	void AddFinalSolventBlocks( HBSolventMap &finalSolventMap, atom_t *atoms, const HBSolvent *blocklist ) const;
 	bool TestFinalSolventBlocks( const HBFinalSolvent *s1, const HBFinalSolvent *s2 ) const;
 
-	void UpdatePerformanceCounter( HBPerfCounter *pc, real value ) const;
-	void FinalizePerformanceCounters();
+	void AllocateThreadLocals( uint32 numthreads );
+	void FreeThreadLocals();
+
+	void GetStateParms( real *parms ) const;
+	void WriteStateRecord( std::vector<uint8> &buffer, const uint32 *indices, const HBGlobalScore &gs ) const;
+	void MergeStateRecord( HBGlobalScore &gs, const HBStateRecord *rec, bool hasOccupancy, const std::vector<uint8> &buffer, size_t &pos, const char *stateFile );
+	void SerializeState( std::vector<uint8> &buffer, uint32 totalFrames ) const;
+	uint32 LoadState( const char *stateFile, bool useStateParms );
+	void FrameCompleted( uint32 snapshotNum );
+
+	void AddOccupancy( COccupancy *&occ, uint32 snapshotNum );
+	void GetOccupancyStats( const COccupancy *occ, const std::vector<uint32> &lastIndices, HBOccupancyStats &stats ) const;
+	void PrintOccupancyHeader( FILE *fp ) const;
+	void PrintOccupancyStats( FILE *fp, const COccupancy *occ, const std::vector<uint32> &lastIndices ) const;
+	void AddBlockCount( HBBlockCounts *&blocks, uint32 snapshotNum );
+	void PrintBlockHeader( FILE *fp, const HBBlockCounts &blockFrames ) const;
+	void PrintBlockStats( FILE *fp, const HBBlockCounts *blocks, const HBBlockCounts &blockFrames ) const;
+	uint32 GetReplicaFrame( uint32 snapshotNum ) const;
+	void AddReplicaCount( HBBlockCounts *&replicas, uint32 snapshotNum );
+	void PrintReplicaHeader( FILE *fp, const HBBlockCounts &replicaFrames ) const;
+	void PrintReplicaStats( FILE *fp, const HBBlockCounts *replicas, const HBBlockCounts &replicaFrames ) const;
+	void WriteStateCounters( std::vector<uint8> &buffer, uint32 kind, uint32 parm, HBBlockCounts *HBGlobalScore::*member ) const;
+	void SetupDensityGrid();
+	void SetupSuperposition();
+	void AccumulateDensity( ThreadLocal *tl, const atom_t *atoms, const coord3_t *coords ) const;
+
+	void PhaseCompleted( ThreadLocal *tl, uint32 phase, double &phaseTime ) const;
+	void FrameTimed( ThreadLocal *tl, double baseTime ) const;
 
 public:
 	TitleMap			titleMapH_;
@@ -227,7 +560,6 @@ public:
 	TripletParms		**tripletParms_;
 	DonorInfoVec		donorInfo_;
 	AcceptorInfoVec		acceptorInfo_;
-	HBPerfCounters		perfCounters_;
 
 private:
 	HBAtomVec			hbBiopolyList_;
@@ -235,9 +567,59 @@ private:
 	HBGroupTitleMap		hbGroupTitleMap_;
 	HBPairScoreMap		hbPairScoreMap_;
 	HBTripletScoreMap	hbTripletScoreMap_;
+	HBPairScoreMap		hbChainScoreMap_;	// Second-order bridges (biopolymer-solvent-solvent-biopolymer)
 	uint16				groupIndex_;
 	uint32				numThreads_;
-	ThreadLocal			tl_[MAX_THREADS];
+	ThreadLocal			*tl_;
+	CBlockArena			solventArena_;		// Solvent blocks of all threads
+	CBlockArena			coordsArena_;		// Solvent coordinates referenced by the blocks
+	uint64				coordsCaptured_;	// Coordinate sets captured from the frames
+	uint64				coordsShared_;		// Block references to the captured sets
+
+	std::vector<uint32>	doneFrames_;		// Completed (or merged) snapshot numbers
+	uint32				stateFrames_;		// Number of accumulated frames, including merged ones
+	std::vector<uint8>	checkpointBuffer_;	// Serialized state being written by the background job
+	char				checkpointFile_[MAX_OSPATH];
+	uint32				checkpointFrames_;	// Write a checkpoint every N frames (0 = never)
+	double				checkpointTime_;	// Write a checkpoint every N milliseconds (0 = never)
+	uint32				checkpointLastFrames_;
+	double				checkpointLastTime_;
+	std::atomic<bool>	checkpointFailed_;
+
+	HBSweepLevelVec		sweepLevels_;		// Stricter cut-off energies accumulated in the same pass
+	real				sweepBaseCutoff_;	// Cut-off energy of the main maps
+	uint32				sweepActiveLevel_;	// Level currently swapped into the main maps
+
+	std::vector<uint32>	xyRemap_;			// Group remapping of donor/acceptor atom indices
+	std::vector<uint32>	solventRemap_;		// First solvent list entry of every remapped solvent index
+	bool				waterChains_;		// Detect second-order bridges
+	FILE				*captureFile_;		// Bridge capture file (nullptr if not capturing)
+	bool				captureFailed_;
+	std::vector<std::pair<uint32,HBSolvent*>>	fetchBlocks_;	// Replayed blocks sorted by snapshot
+
+	std::list<COccupancy>	occupancies_;	// Occupancy sets of all pairs/triplets
+	uint32				occupancyStride_;	// Snapshots per occupancy index (0 = not tracked)
+	std::list<HBBlockCounts>	blockCounts_;	// Block and replica counters of all pairs/triplets
+	uint32				blockLength_;		// Block length, in snapshots (0 = not tracked)
+	bool				trackReplicas_;		// Count snapshots per replica (trajectory list)
+	HBDensityGrid		densityGrid_;		// Solvent density grid
+	std::vector<uint32>	densityAtoms_;		// Solvent heavy atoms counted in the density
+	std::vector<uint32>	densitySum_;		// Density counts of all threads (while writing the map)
+	bool				densityMicrosets_;	// Count only the solvent molecules of the microsets
+	CSuperposition		superposition_;		// Fit of the frames onto the base coordinates (no atoms = not fitted)
+	HBKernel<real>		kernel_;			// Constants of the energy kernel
+	HBKernel<float>		kernelF_;			// Constants of the single-precision energy kernel
+	bool				tabulated_;			// Tabulated angular and 12-6 terms
+	HBTable<real>		angularTable_;		// Tabulated angular term
+	std::vector<HBTable<real>>	hb126Tables_;	// Tabulated 12-6 terms, indexed by [code_h*tripletMaxY_ + code_y]
+	bool				singlePrecision_;	// Find the bridges in single precision
+	bool				precisionReport_;	// Also find them in double precision and compare
+	HBPairScoreMap		refPairScoreMap_;	// Pairs accumulated from the double-precision bridges
+	HBTripletScoreMap	refTripletScoreMap_;	// Triplets accumulated from the double-precision bridges
+	HBPrecisionStats	precisionStats_;
+	size_t				microsetCap_;		// Max bridges per microset (0 = all)
+	HBMicrosetStats		microsetStats_;
+	bool				snapshotLog_;		// Log a record for every snapshot
 
 	bool				init_;
 	bool				group_bonds_;
@@ -253,6 +635,23 @@ IHBonds *hbonds = &hbondsLocal;
 
 //////////////////////////////////////////////////////////////////////////
 
+static void Stub_FindBridgesTile( uint32, uint32 tile, void *param )
+{
+	hbondsLocal.FindBridgesTile( param, tile );
+}
+
+static void Stub_WriteCheckpoint( void* )
+{
+	hbondsLocal.WriteCheckpoint();
+}
+
+static void Stub_ReduceDensityPlane( uint32, uint32 plane )
+{
+	hbondsLocal.ReduceDensityPlane( plane );
+}
+
+//////////////////////////////////////////////////////////////////////////
+
 bool operator < ( const CHBonds::HBPair &x, const CHBonds::HBPair &y )
 {
 	return ( x.index0 == y.index0 ) ? ( x.index1 < y.index1 ) : ( x.index0 < y.index0 ); 
@@ -467,66 +866,66 @@ static void HBParms_LoadDonorsAndAcceptors( ICfgFile *cfg )
 	}
 }
 
-CHBonds :: CHBonds() : tripletMaxH_( 0 ), tripletMaxY_( 0 ), tripletParms_( nullptr ), groupIndex_( 0 ), numThreads_( 0 ),
+CHBonds :: CHBonds() : tripletMaxH_( 0 ), tripletMaxY_( 0 ), tripletParms_( nullptr ), groupIndex_( 0 ), numThreads_( 0 ), tl_( nullptr ), coordsCaptured_( 0 ), coordsShared_( 0 ),
+					   stateFrames_( 0 ), checkpointFrames_( 0 ), checkpointTime_( 0 ), checkpointLastFrames_( 0 ), checkpointLastTime_( 0 ), checkpointFailed_( false ),
+					   sweepBaseCutoff_( 0 ), sweepActiveLevel_( 0 ), waterChains_( false ), captureFile_( nullptr ), captureFailed_( false ), occupancyStride_( 0 ), blockLength_( 0 ), trackReplicas_( false ), densityMicrosets_( false ),
+					   tabulated_( false ), singlePrecision_( false ), precisionReport_( false ), microsetCap_( 0 ), snapshotLog_( false ),
 					   init_( false ), group_bonds_( false ), s_siz_( 0 ), rc_sq_( 0 ), crf_a_( 0 ), crf_b_( 0 ), dd_e_( 0 )
 {
-	for ( size_t i = 0; i < MAX_THREADS; ++i )
-		tl_[i].solvData = tl_[i].solvFree = nullptr;
+	checkpointFile_[0] = 0;
+	memset( &densityGrid_, 0, sizeof(densityGrid_) );
+	memset( &precisionStats_, 0, sizeof(precisionStats_) );
+	memset( &microsetStats_, 0, sizeof(microsetStats_) );
 }
 
-void CHBonds :: AllocateSolventBlocks( ThreadLocal *tl, uint32 blockCount ) const
+void CHBonds :: AllocateThreadLocals( uint32 numthreads )
 {
-	assert( tl->solvFree == nullptr );
-	assert( s_siz_ > 0 );
-	const size_t blockSize = sizeof(HBSolvent) + ( s_siz_ - 1 ) * sizeof(coord4_t);
-
-#if defined(_DEBUG)
-	utils->Warning( "ALLOCATING %u solvent blocks! (%.1f kb)\n", blockCount, ( blockCount * blockSize ) / 1024.0 );
-#endif
+	assert( tl_ == nullptr );
 
-	HBSolvent *block = reinterpret_cast<HBSolvent*>( utils->Alloc( blockCount * blockSize ) );
-	if ( !block )
-		utils->Fatal( "failed to allocate %u solvent blocks!\n", blockCount );
-	uint8 *block_data = reinterpret_cast<uint8*>( block ) + blockSize;
-	HBSolvent *curr_block = block;
-	for ( uint32 i = 0; i < blockCount-1; ++i, block_data += blockSize ) {
-		HBSolvent *next_block = reinterpret_cast<HBSolvent*>( block_data );
-		curr_block->next = next_block;
-		curr_block->chain = next_block;
-		curr_block = next_block;
-	}
-	block->flags = HBSF_ALLOC;
-
-	curr_block->next = tl->solvData;
-	curr_block->chain = tl->solvFree;
-
-	tl->solvData = block;
-	tl->solvFree = block;
+	// each thread gets its own cache line(s)
+	tl_ = reinterpret_cast<ThreadLocal*>( utils->AllocAligned( sizeof(ThreadLocal) * numthreads, CACHE_LINE_SIZE ) );
+	for ( uint32 i = 0; i < numthreads; ++i )
+		new ( &tl_[i] ) ThreadLocal();
+	numThreads_ = numthreads;
 }
 
-void CHBonds :: DeallocateSolventBlocks( ThreadLocal *tl ) const
+void CHBonds :: FreeThreadLocals()
 {
-	std::vector<HBSolvent*> blockPtrList;
-	blockPtrList.reserve( 32 );
-
-	for ( auto block = tl->solvData; block; block = block->next )
-		if ( block->flags & HBSF_ALLOC )
-			blockPtrList.push_back( block );
-
-	for ( auto it = blockPtrList.begin(); it != blockPtrList.end(); ++it  )
-		utils->Free( *it );
+	if ( !tl_ )
+		return;
 
-	tl->solvData = tl->solvFree = nullptr;
+	for ( uint32 i = 0; i < numThreads_; ++i )
+		tl_[i].~ThreadLocal();
+	utils->FreeAligned( tl_ );
+	tl_ = nullptr;
+	numThreads_ = 0;
 }
 
-CHBonds::HBSolvent *CHBonds :: GrabSolventBlock( ThreadLocal *tl ) const
+//////////////////////////////////////////////////////////////////////////
+// SOLVENT BLOCKS
+//////////////////////////////////////////////////////////////////////////
+// Solvent blocks come from an arena shared by all threads, every thread 
+// allocating from and freeing to a cache of its own. Blocks of a frame are
+// grabbed by its thread, and those merged into the global chains stay 
+// there, so the caches would get unbalanced: the arena moves the surplus 
+// of one thread to the others. Blocks are only grabbed and returned in the
+// single-threaded block, so at checkpoints and after the last frame all 
+// blocks are in the global chains: they are copied into a single slab 
+// then, in tuple order, and the memory of the free blocks is released.
+//
+// Blocks don't hold the solvent coordinates, they reference a coordinate 
+// set of (snapshot, solvent atom). A solvent molecule shared by many tuples
+// of a frame (e.g. all triplets of a large microset) is captured once into
+// the frame store of the thread, and only when a block of the frame can be 
+// the best one of its tuple. Sets are reference counted: a block that is 
+// beaten hands its reference over to the global block or drops it, so the
+// store keeps only the coordinates that can still make it to the output.
+//////////////////////////////////////////////////////////////////////////
+CHBonds::HBSolvent *CHBonds :: GrabSolventBlock( ThreadLocal *tl )
 {
-	if ( !tl->solvFree )
-		AllocateSolventBlocks( tl, 2048 );
-
-	HBSolvent *block = tl->solvFree;
-	assert( block != nullptr );
-	tl->solvFree = block->chain;
+	HBSolvent *block = reinterpret_cast<HBSolvent*>( solventArena_.Alloc( static_cast<uint32>( tl - tl_ ) ) );
+	block->crd = nullptr;
+	block->flags = 0;
 	return block;
 }
 
@@ -541,33 +940,160 @@ CHBonds :: HBSolvent *CHBonds :: FindGlobalBlock( HBSolvent *block, HBSolvent *l
 	return nullptr;
 }
 
-void CHBonds :: ReturnSolventBlock( ThreadLocal *tl, HBSolvent *block ) const
+void CHBonds :: ReturnSolventBlock( ThreadLocal *tl, HBSolvent *block )
+{
+	const uint32 cache = static_cast<uint32>( tl - tl_ );
+	if ( block->crd )
+		ReleaseSolventCoords( cache, block->crd );
+	solventArena_.Free( cache, block );
+}
+
+CHBonds::HBSolventCoords *CHBonds :: AllocSolventCoords( uint32 cache, uint32 s_index, uint32 snapshot )
+{
+	HBSolventCoords *sc = reinterpret_cast<HBSolventCoords*>( coordsArena_.Alloc( cache ) );
+	sc->moved = nullptr;
+	sc->refs = 0;
+	sc->snapshot = snapshot;
+	sc->s_index = s_index;
+	return sc;
+}
+
+void CHBonds :: ReleaseSolventCoords( uint32 cache, HBSolventCoords *sc )
+{
+	assert( sc->refs > 0 );
+	if ( !--sc->refs )
+		coordsArena_.Free( cache, sc );
+}
+
+CHBonds::HBSolventCoords *CHBonds :: CaptureSolventCoords( ThreadLocal *tl, uint32 s_index, const atom_t *atoms, const coord3_t *coords )
+{
+	// microsets come in solvent index order, so it's usually appended
+	auto it = std::lower_bound( tl->frameCoords.begin(), tl->frameCoords.end(), s_index, 
+		[]( const std::pair<uint32,HBSolventCoords*> &e, uint32 index ) { return e.first < index; } );
+	if ( it != tl->frameCoords.end() && it->first == s_index )
+		return it->second;
+
+	// the frame store holds a reference until the frame is done
+	HBSolventCoords *sc = AllocSolventCoords( static_cast<uint32>( tl - tl_ ), s_index, tl->snapshot );
+	CopySolventCoords( sc, atoms, coords, tl->fit );
+	sc->refs = 1;
+	tl->frameCoords.insert( it, std::make_pair( s_index, sc ) );
+	++coordsCaptured_;
+	return sc;
+}
+
+void CHBonds :: ReleaseFrameCoords( ThreadLocal *tl )
+{
+	const uint32 cache = static_cast<uint32>( tl - tl_ );
+	for ( auto it = tl->frameCoords.begin(); it != tl->frameCoords.end(); ++it )
+		ReleaseSolventCoords( cache, it->second );
+	tl->frameCoords.resize( 0 );
+}
+
+void CHBonds :: SetBlockCoords( ThreadLocal *tl, HBSolvent *block, const coord4_t *coords )
+{
+	// coordinates of the partial state files have no snapshot
+	const uint32 cache = static_cast<uint32>( tl - tl_ );
+	if ( block->crd )
+		ReleaseSolventCoords( cache, block->crd );
+	block->crd = AllocSolventCoords( cache, block->s_index, UINT32_BAD );
+	block->crd->refs = 1;
+	memcpy( block->crd->coords, coords, sizeof(coord4_t) * s_siz_ );
+}
+
+void CHBonds :: CompactSolventChains( HBSolvent *&solv )
+{
+	HBSolvent **link = &solv;
+	for ( HBSolvent *block = solv; block; block = block->chain ) {
+		HBSolvent *dst = reinterpret_cast<HBSolvent*>( solventArena_.Alloc( 0 ) );
+		memcpy( dst, block, sizeof(HBSolvent) );
+		// a coordinate set is moved by the first block referencing it
+		if ( block->crd ) {
+			if ( !block->crd->moved ) {
+				block->crd->moved = reinterpret_cast<HBSolventCoords*>( coordsArena_.Alloc( 0 ) );
+				memcpy( block->crd->moved, block->crd, coordsArena_.BlockSize() );
+				block->crd->moved->moved = nullptr;
+			}
+			dst->crd = block->crd->moved;
+		}
+		*link = dst;
+		link = &dst->chain;
+	}
+	*link = nullptr;
+}
+
+void CHBonds :: CompactSolventBlocks()
 {
-	block->flags &= ~HBSF_VALID;
-	block->chain = tl->solvFree;
-	tl->solvFree = block;
+	if ( !solventArena_.BlockSize() )
+		return;
+
+	CBlockArena::Stats before, after, coordsBefore, coordsAfter;
+	solventArena_.GetStats( before );
+	coordsArena_.GetStats( coordsBefore );
+
+	// all live blocks and coordinate sets are in the global chains 
+	// (old ones are read while the copies are made)
+	solventArena_.BeginCompaction( static_cast<uint32>( before.liveBytes / before.blockSize ) );
+	coordsArena_.BeginCompaction( static_cast<uint32>( coordsBefore.liveBytes / coordsBefore.blockSize ) );
+	for ( size_t level = 0; level <= sweepLevels_.size(); ++level ) {
+		HBPairScoreMap &pairScoreMap = level ? sweepLevels_[level-1].pairs : hbPairScoreMap_;
+		HBTripletScoreMap &tripletScoreMap = level ? sweepLevels_[level-1].triplets : hbTripletScoreMap_;
+		for ( auto it = pairScoreMap.begin(); it != pairScoreMap.end(); ++it )
+			CompactSolventChains( it->second.solv );
+		for ( auto it = tripletScoreMap.begin(); it != tripletScoreMap.end(); ++it )
+			CompactSolventChains( it->second.solv );
+	}
+	for ( auto it = refPairScoreMap_.begin(); it != refPairScoreMap_.end(); ++it )
+		CompactSolventChains( it->second.solv );
+	for ( auto it = refTripletScoreMap_.begin(); it != refTripletScoreMap_.end(); ++it )
+		CompactSolventChains( it->second.solv );
+	solventArena_.EndCompaction();
+	coordsArena_.EndCompaction();
+
+	solventArena_.GetStats( after );
+	coordsArena_.GetStats( coordsAfter );
+	logfile->Print( "CompactSolventBlocks: %u blocks, %u coordinate sets, %.1f kb in %u slabs (was %.1f kb in %u slabs)\n", 
+		static_cast<uint32>( after.liveBytes / after.blockSize ), static_cast<uint32>( coordsAfter.liveBytes / coordsAfter.blockSize ),
+		( after.reservedBytes + coordsAfter.reservedBytes ) / 1024.0, after.numSlabs + coordsAfter.numSlabs,
+		( before.reservedBytes + coordsBefore.reservedBytes ) / 1024.0, before.numSlabs + coordsBefore.numSlabs );
 }
 
-void CHBonds :: BuildBlockInfo( HBSolvent *block, const atom_t *atoms, const coord3_t *coords ) const
+void CHBonds :: BuildBlockInfo( ThreadLocal *tl, HBSolvent *block, HBSolventCoords *sc )
 {
 	assert( block != nullptr );
 	assert( 0 == ( block->flags & HBSF_VALID ) );
-	const atom_t *at = &atoms[block->s_index];
+	assert( block->crd == nullptr );
+
+	// replayed bridges have no coordinates, they are fetched later by snapshot
+	block->snapshot = tl->snapshot;
+	block->flags |= HBSF_VALID;
+	if ( sc ) {
+		block->crd = sc;
+		++sc->refs;
+		++coordsShared_;
+	}
+}
+
+void CHBonds :: CopySolventCoords( HBSolventCoords *sc, const atom_t *atoms, const coord3_t *coords, const CSuperposition::Transform *fit ) const
+{
+	const atom_t *at = &atoms[sc->s_index];
 
 	// store coordinates
 	assert( at->rcount == s_siz_ );
 
 	const atom_t *src_atom = &atoms[at->rfirst];
 	const coord3_t *src_coord = &coords[at->rfirst];
-	coord4_t *dst_coord = block->coords;
+	coord4_t *dst_coord = sc->coords;
 	for ( uint32 i = 0; i < at->rcount; ++i, ++src_atom, ++src_coord, ++dst_coord ) {
-		dst_coord->x = src_coord->x;
-		dst_coord->y = src_coord->y;
-		dst_coord->z = src_coord->z;
+		// fitted frames are moved onto the base coordinates
+		coord3_t crd = *src_coord;
+		if ( fit )
+			CSuperposition::Apply( *fit, *src_coord, crd );
+		dst_coord->x = crd.x;
+		dst_coord->y = crd.y;
+		dst_coord->z = crd.z;
 		dst_coord->r = src_atom->radius;
 	}
-
-	block->flags |= HBSF_VALID;
 }
 
 void CHBonds :: Initialize()
@@ -635,6 +1161,11 @@ void CHBonds :: Initialize()
 	logfile->Print( "CrfA = %12.8f\n", crf_a_ );
 	logfile->Print( "CrfB = %12.8f\n", crf_b_ );
 
+	// tables of the angular and 12-6 terms (depend on the h-bond max length)
+	tabulated_ = gpGlobals->tabulated_energy;
+	if ( tabulated_ )
+		BuildEnergyTables();
+
 	init_ = true;
 }
 
@@ -644,35 +1175,70 @@ void CHBonds :: Setup( uint32 numthreads )
 	s_siz_ = topology->GetSolventSize();
 
 	// initialize multithreading stuff
-	assert( numthreads > 0 && numthreads <= MAX_THREADS );
-	numThreads_ = numthreads;
+	assert( numthreads > 0 );
+	if ( numthreads != numThreads_ ) {
+		FreeThreadLocals();
+		AllocateThreadLocals( numthreads );
+	}
 	ThreadLocal *tl = &tl_[0];
 	for ( uint32 i = 0; i < numthreads; ++i, ++tl ) {
 		tl->bridges.clear();
-		tl->bridges.reserve( 1024 );
-		if ( tl->solvData != nullptr ) {
-			for ( auto block = tl->solvData; block; block = block->next ) {
-				if ( block->flags & HBSF_VALID )
-					ReturnSolventBlock( tl, block );
-			}
-			assert( tl_[i].solvFree != nullptr );
-		}
-		if ( tl->solvFree == nullptr )
-			AllocateSolventBlocks( tl, 4096 );
+		tl->tiles.clear();
+		tl->coords = nullptr;
+		// performance counters start over on every run
+		tl->frames = 0;
+		tl->busyTime = 0;
+		tl->firstTime = tl->lastTime = 0;
+		tl->atomPairs = 0;
+		for ( uint32 j = 0; j < HBPHASE_COUNT; ++j )
+			tl->phases[j].Clear();
+		tl->density.clear();
+		tl->fit = nullptr;
+		tl->single = false;
+		tl->microsetStats = true;
 	}
 
+	// blocks of the previous run are dropped along with the global maps
+	solventArena_.Setup( sizeof(HBSolvent), numthreads );
+	coordsArena_.Setup( sizeof(HBSolventCoords) + ( s_siz_ - 1 ) * sizeof(coord4_t), numthreads );
+	coordsCaptured_ = coordsShared_ = 0;
+	for ( uint32 i = 0; i < numthreads; ++i )
+		tl_[i].frameCoords.clear();
+
 	// clear global data
 	hbPairScoreMap_.clear();
 	hbTripletScoreMap_.clear();
-
-	// clear performance counters
-	memset( &perfCounters_, 0, sizeof(perfCounters_) );
+	hbChainScoreMap_.clear();
+	waterChains_ = gpGlobals->water_chains;
+	sweepLevels_.clear();
+	sweepBaseCutoff_ = gpGlobals->hbond_cutoff_energy;
+	sweepActiveLevel_ = 0;
+	occupancies_.clear();
+	occupancyStride_ = gpGlobals->occupancy ? static_cast<uint32>( std::max( gpGlobals->snap_stride, size_t( 1 ) ) ) : 0;
+	blockCounts_.clear();
+	blockLength_ = static_cast<uint32>( gpGlobals->block_length );
+	trackReplicas_ = ( gpGlobals->trajectory_list[0] != 0 );
+	SetupDensityGrid();
+	SetupSuperposition();
+	singlePrecision_ = gpGlobals->single_precision || gpGlobals->precision_report;
+	precisionReport_ = gpGlobals->precision_report;
+	refPairScoreMap_.clear();
+	refTripletScoreMap_.clear();
+	memset( &precisionStats_, 0, sizeof(precisionStats_) );
+	microsetCap_ = gpGlobals->microset_cap;
+	memset( &microsetStats_, 0, sizeof(microsetStats_) );
+	snapshotLog_ = ( gpGlobals->log_level >= LOG_LEVEL_SNAPSHOTS );
+	doneFrames_.clear();
+	stateFrames_ = 0;
+	checkpointLastFrames_ = 0;
+	checkpointLastTime_ = utils->FloatMilliseconds();
 }
 
 void CHBonds :: Clear()
 {
-	for ( uint32 i = 0; i < numThreads_; ++i )
-		DeallocateSolventBlocks( &tl_[i] );
+	FreeThreadLocals();
+	solventArena_.Clear();
+	coordsArena_.Clear();
 
 	groupIndex_ = 0;
 	if ( tripletParms_ ) {
@@ -845,6 +1411,7 @@ void CHBonds :: BuildAtomLists()
 				da.h_indices[0] = hindex;
 				da.codes[0] = it->code;
 				da.group = 0;
+				da.numH = 0;
 				if ( it->group != 0 ) {
 					uint32 groupIndexKey = ( static_cast<uint32>( it->group ) << 24 ) | resnum;
 					auto gi = groupIndexMap.find( groupIndexKey );
@@ -948,6 +1515,7 @@ void CHBonds :: BuildAtomLists()
 				aa.r_index = at->resnum;
 				aa.y_code = it->code;
 				aa.group = 0;
+				aa.numH = 0;
 				if ( it->group != 0 ) {
 					uint32 groupIndexKey = ( static_cast<uint32>( it->group ) << 24 ) | at->resnum;
 					auto gi = groupIndexMap.find( groupIndexKey );
@@ -1002,6 +1570,7 @@ void CHBonds :: BuildAtomLists()
 
 	// sort internal hydrogens and print donor/acceptor lists
 	uint32 cbd = 0, cba = 0, csd = 0, csa = 0;
+	uint32 cbdH[MAX_H] = { 0 }, csdH[MAX_H] = { 0 };
 //	logfile->Print( "------------------ BIOPOLYMER DONOR/ACCEPTOR LIST ------------------\n" );
 	for ( auto it = hbBiopolyList_.begin(); it != hbBiopolyList_.end(); ++it ) {
 		//const atom_t *at = &atoms[it->xy_index];
@@ -1009,6 +1578,9 @@ void CHBonds :: BuildAtomLists()
 		if ( it->h_indices[0] != UINT32_BAD ) {
 			++cbd;
 			std::sort( &it->h_indices[0], &it->h_indices[MAX_H] );
+			while ( it->numH < MAX_H && it->h_indices[it->numH] != UINT32_BAD )
+				++it->numH;
+			++cbdH[it->numH-1];
 			/*logfile->Print( "%-6s%5u %c%c%c%c %c%c%c%c %c%4u  group=%u\n", "DONOR", 
 				at->serial, 
 				at->title.string[0], at->title.string[1], at->title.string[2], at->title.string[3],
@@ -1039,6 +1611,9 @@ void CHBonds :: BuildAtomLists()
 		if ( it->h_indices[0] != UINT32_BAD ) {
 			++csd;
 			std::sort( &it->h_indices[0], &it->h_indices[MAX_H] );
+			while ( it->numH < MAX_H && it->h_indices[it->numH] != UINT32_BAD )
+				++it->numH;
+			++csdH[it->numH-1];
 			/*logfile->Print( "%-6s%5u %c%c%c%c %c%c%c%c %c%4u  group=%u\n", "DONOR", 
 				at->serial, 
 				at->title.string[0], at->title.string[1], at->title.string[2], at->title.string[3],
@@ -1064,6 +1639,26 @@ void CHBonds :: BuildAtomLists()
 	}
 	//logfile->Print( "--------------------------------------------------------------------\n" );
 
+	// remapping of ungrouped donor/acceptor indices (for captured bridges)
+	xyRemap_.resize( atcount );
+	for ( uint32 i = 0; i < atcount; ++i )
+		xyRemap_[i] = i;
+	for ( auto it = hbBiopolyList_.cbegin(); it != hbBiopolyList_.cend(); ++it )
+		xyRemap_[it->xy_index] = it->xy_remap;
+	for ( auto it = hbSolventList_.cbegin(); it != hbSolventList_.cend(); ++it )
+		xyRemap_[it->xy_index] = it->xy_remap;
+
+	// first solvent list entry of every remapped index (atoms of a group are
+	// adjacent in the sorted list), to get solvent atoms of the microsets
+	solventRemap_.assign( atcount, UINT32_BAD );
+	for ( uint32 i = static_cast<uint32>( hbSolventList_.size() ); i-- > 0; )
+		solventRemap_[hbSolventList_[i].xy_remap] = i;
+
+	// constants of the energy kernels
+	BuildKernel( kernel_ );
+	if ( singlePrecision_ )
+		BuildKernel( kernelF_ );
+
 	console->Print( "%6u hydrogen bond donors in biopolymer\n", cbd );
 	console->Print( "%6u hydrogen bond acceptors in biopolymer\n", cba );
 	console->Print( "%6u hydrogen bond total atoms in biopolymer\n", hbBiopolyList_.size() );
@@ -1072,6 +1667,8 @@ void CHBonds :: BuildAtomLists()
 	console->Print( "%6u hydrogen bond acceptors in solvent\n", csa );
 	console->Print( "%6u hydrogen bond total atoms in solvent\n", hbSolventList_.size() );
 	console->Print( "%6u unique donor/acceptor groups\n", groupIndex_ );
+	logfile->Print( "Donors by number of hydrogens (1/2/3/4): biopolymer %u/%u/%u/%u, solvent %u/%u/%u/%u\n",
+		cbdH[0], cbdH[1], cbdH[2], cbdH[3], csdH[0], csdH[1], csdH[2], csdH[3] );
 
 #if 0
 	logfile->Print( "------- timing -------\n"
@@ -1083,82 +1680,253 @@ void CHBonds :: BuildAtomLists()
 #endif
 }
 
-real CHBonds :: CalcEnergy( const HBAtom *atX, const HBAtom *atY, const atom_t *atoms, const coord3_t *coords ) const
+//////////////////////////////////////////////////////////////////////////
+// ENERGY KERNEL
+//////////////////////////////////////////////////////////////////////////
+// The energy is computed with the scalar type of the kernel: double by
+// default, or float in single-precision mode (-fp32), where the frame is
+// converted to single-precision coordinates once and the bridge search 
+// moves half the data. Charges and triplet parms are copied into flat 
+// tables of the same type. Solvent blocks, second-order bridges and all 
+// the accumulated results stay in double precision.
+//////////////////////////////////////////////////////////////////////////
+static inline float HBSqrt( float x ) { return sqrtf( x ); }
+static inline double HBSqrt( double x ) { return sqrt( x ); }
+static inline float HBExp( float x ) { return expf( x ); }
+static inline double HBExp( double x ) { return exp( x ); }
+
+template<typename T> void CHBonds :: BuildKernel( HBKernel<T> &kernel ) const
+{
+	const atom_t *atoms = topology->GetAtomArray();
+	const size_t atcount = topology->GetAtomCount();
+
+	kernel.rc_sq = static_cast<T>( rc_sq_ );
+	kernel.crf_a = static_cast<T>( crf_a_ );
+	kernel.crf_b = static_cast<T>( crf_b_ );
+	kernel.scale_e = static_cast<T>( dd_e_ * gpGlobals->electrostatic_coeff );
+	kernel.scale_h = static_cast<T>( gpGlobals->hbond_126_coeff );
+
+	kernel.charges.resize( atcount );
+	for ( size_t i = 0; i < atcount; ++i )
+		kernel.charges[i] = static_cast<T>( atoms[i].charge );
+
+	kernel.maxY = tripletMaxY_;
+	kernel.parms.resize( tripletMaxH_ * tripletMaxY_ );
+	for ( int h = 0; h < tripletMaxH_; ++h ) {
+		for ( int y = 0; y < tripletMaxY_; ++y ) {
+			typename HBKernel<T>::Parms *parms = &kernel.parms[h * tripletMaxY_ + y];
+			parms->r = static_cast<T>( tripletParms_[h][y].r );
+			parms->e = static_cast<T>( tripletParms_[h][y].e );
+			parms->a = static_cast<T>( tripletParms_[h][y].a );
+			parms->b = static_cast<T>( tripletParms_[h][y].b );
+		}
+	}
+
+	kernel.tabulated = tabulated_;
+	if ( !tabulated_ )
+		return;
+	auto convert = []( HBTable<T> &dst, const HBTable<real> &src ) {
+		dst.x0 = static_cast<T>( src.x0 );
+		dst.x1 = static_cast<T>( src.x1 );
+		dst.invStep = static_cast<T>( src.invStep );
+		dst.intervals = src.intervals;
+		dst.nodes.resize( src.nodes.size() );
+		for ( size_t i = 0; i < src.nodes.size(); ++i )
+			dst.nodes[i] = static_cast<T>( src.nodes[i] );
+	};
+	convert( kernel.angular, angularTable_ );
+	kernel.hb126.resize( hb126Tables_.size() );
+	for ( size_t i = 0; i < hb126Tables_.size(); ++i )
+		convert( kernel.hb126[i], hb126Tables_[i] );
+}
+
+//////////////////////////////////////////////////////////////////////////
+// TABULATED ENERGY TERMS
+//////////////////////////////////////////////////////////////////////////
+// With -tab the angular term and the 12-6 term of every hydrogen come
+// from tables instead of exp() and the powers of the inverse distance.
+// The energy is separable: the angular term depends on 1+cos(theta) only
+// and the 12-6 term on the Y-H distance only, so the 2D table over both 
+// is the product of two 1D tables. These are cheaper and much smaller 
+// (one shared angular table and one 12-6 table per H/Y code pair, 4 KB
+// each). Both are cubic Hermite splines through the exact values and 
+// slopes at the nodes. The 12-6 tables start at Rmin (where the energy 
+// is the constant minimum) and end at the h-bond max length plus 2 A; 
+// longer distances use the analytic formula. The tables are built and 
+// checked against the analytic terms between the nodes on Initialize.
+//////////////////////////////////////////////////////////////////////////
+template<typename F> void CHBonds :: BuildTable( HBTable<real> &table, real x0, real x1, F func, real &maxError, real &maxRelError ) const
+{
+	table.x0 = x0;
+	table.x1 = x1;
+	table.intervals = HBTABLE_INTERVALS;
+	table.invStep = table.intervals / ( x1 - x0 );
+	table.nodes.resize( ( table.intervals + 1 ) * 2 );
+
+	// values and slopes scaled to the interval
+	const real step = ( x1 - x0 ) / table.intervals;
+	real value, slope;
+	for ( int i = 0; i <= table.intervals; ++i ) {
+		func( x0 + i * step, value, slope );
+		table.nodes[i*2] = value;
+		table.nodes[i*2+1] = slope * step;
+	}
+
+	// compare with the analytic function between the nodes
+	real maxValue = 0;
+	maxError = 0;
+	for ( int i = 0; i < table.intervals * HBTABLE_SAMPLES; ++i ) {
+		const real x = x0 + ( i + real( 0.5 ) ) * step / HBTABLE_SAMPLES;
+		func( x, value, slope );
+		maxValue = std::max( maxValue, static_cast<real>( fabs( value ) ) );
+		maxError = std::max( maxError, static_cast<real>( fabs( table.Eval( x ) - value ) ) );
+	}
+	maxRelError = ( maxValue > 0 ) ? ( maxError / maxValue ) : 0;
+}
+
+void CHBonds :: BuildEnergyTables()
+{
+	// value of -sigma^2 needed for 12-6 model (same as in CalcEnergy)
+	const real hb_minus_sigma2 = real( -0.018 );
+	const real maxLength = gpGlobals->hbond_max_length + real( 2.0 );
+	real maxError, maxRelError;
+
+	logfile->Print( "\n------------ TABULATED ENERGY TERMS -------------\n"
+					"%20s  %12s %12s\n", "", "max error", "relative" );
+
+	BuildTable( angularTable_, real( 0 ), real( HBTABLE_MAX_COST ), [hb_minus_sigma2]( real x, real &value, real &slope ) {
+		value = static_cast<real>( exp( x * x / hb_minus_sigma2 ) );
+		slope = real( 2.0 ) * x / hb_minus_sigma2 * value;
+	}, maxError, maxRelError );
+	logfile->Print( "%20s: %12.3e %12.3e\n", "Angular", maxError, maxRelError );
+
+	real worstError = 0, worstRelError = maxRelError;
+	hb126Tables_.resize( tripletMaxH_ * tripletMaxY_ );
+	for ( int h = 0; h < tripletMaxH_; ++h ) {
+		for ( int y = 0; y < tripletMaxY_; ++y ) {
+			const TripletParms *parms = &tripletParms_[h][y];
+			HBTable<real> *table = &hb126Tables_[h * tripletMaxY_ + y];
+			// unset parms have Rmin of zero, start the table at a sane distance
+			const real x0 = std::max( parms->r, real( 0.5 ) );
+			if ( !( x0 < maxLength ) ) {
+				table->x0 = table->x1 = x0;
+				table->nodes.clear();
+				continue;
+			}
+			const real a = parms->a, b = parms->b;
+			BuildTable( *table, x0, maxLength, [a,b]( real x, real &value, real &slope ) {
+				const real ir = real( 1.0 ) / x;
+				real ir6 = ir * ir * ir;
+				ir6 *= ir6;
+				value = ir6 * ( a * ir6 - b );
+				slope = ir6 * ir * ( real( 6.0 ) * b - real( 12.0 ) * a * ir6 );
+			}, maxError, maxRelError );
+			logfile->Print( "%10s [%3i,%3i]: %12.3e %12.3e\n", "12-6", h, y, maxError, maxRelError );
+			worstError = std::max( worstError, maxError );
+			worstRelError = std::max( worstRelError, maxRelError );
+		}
+	}
+	logfile->Print( "-------------------------------------------------\n" );
+
+	console->Print( "Tabulated energy terms: max 12-6 error %.3g kcal/mol, max relative error %.3g\n", worstError, worstRelError );
+}
+
+template<int TERMS, typename T, typename C> T CHBonds :: CalcEnergy( const HBAtom *atX, const HBAtom *atY, const HBKernel<T> &kernel, const C *coords ) const
+{
+	// select the kernel for the number of hydrogens of the donor
+	switch ( atX->numH ) {
+	case 1: return EnergyKernel<1,TERMS>( atX, atY, kernel, coords );
+	case 2: return EnergyKernel<2,TERMS>( atX, atY, kernel, coords );
+	case 3: return EnergyKernel<3,TERMS>( atX, atY, kernel, coords );
+	default: return EnergyKernel<4,TERMS>( atX, atY, kernel, coords );
+	}
+}
+
+template<int NH, int TERMS, typename T, typename C> T CHBonds :: EnergyKernel( const HBAtom *atX, const HBAtom *atY, const HBKernel<T> &kernel, const C *coords ) const
 {
+	static_assert( NH > 0 && NH <= MAX_H, "invalid number of hydrogens" );
 	assert( atX->xy_index != atY->xy_index );
-	assert( atX->h_indices[0] != UINT32_BAD );
+	assert( atX->numH == NH );
 	assert( atY->y_code != UINT16_BAD );
 
 	// value of -sigma^2 needed for 12-6 model
-	const real hb_minus_sigma2 = real( -0.018 );
+	const T hb_minus_sigma2 = T( -0.018 );
 
 	// get x and y coords
-	const coord3_t *crd_x = &coords[atX->xy_index];
-	const coord3_t *crd_y = &coords[atY->xy_index];
+	const C *crd_x = &coords[atX->xy_index];
+	const C *crd_y = &coords[atY->xy_index];
 
 	// calculate squared x-y distance, x-y distance and inverse x-y distance
 	// immediately apply cut-off, if needed
-	real dxy_x = crd_y->x - crd_x->x;
-	real dxy_y = crd_y->y - crd_x->y;
-	real dxy_z = crd_y->z - crd_x->z;
-	real rxy_2 = dxy_x*dxy_x + dxy_y*dxy_y + dxy_z*dxy_z;
-	if ( rxy_2 > rc_sq_ )
+	T dxy_x = crd_y->x - crd_x->x;
+	T dxy_y = crd_y->y - crd_x->y;
+	T dxy_z = crd_y->z - crd_x->z;
+	T rxy_2 = dxy_x*dxy_x + dxy_y*dxy_y + dxy_z*dxy_z;
+	if ( rxy_2 > kernel.rc_sq )
 		return 0;
 
-	real rxy = static_cast<real>( sqrt( rxy_2 ) );
-	real irxy = real( 1.0 ) / rxy;
-
-	// get y FF code
+	// get y FF code and charge
 	const uint32 code_y = atY->y_code;
-
-	// get charges
-	const real q_x = atoms[atX->xy_index].charge;
-	const real q_y = atoms[atY->xy_index].charge;
+	const T q_y = kernel.charges[atY->xy_index];
 
 	// initialize total energies
-	real total_e = irxy * q_x * q_y * ( irxy + crf_a_ * rxy_2 + crf_b_ );
-	real total_h = 0;
-
-	// now loop through hydrogens
-	for ( size_t i = 0; atX->h_indices[i] != UINT32_BAD && i < MAX_H; ++i ) {
-		// get h coords, charge and FF code
-		const coord3_t *crd_h = &coords[atX->h_indices[i]];
-		const real q_h = atoms[atX->h_indices[i]].charge;
-		const uint32 code_h = atX->codes[i];
+	T total_e = 0;
+	T total_h = 0;
+	if ( TERMS != HBTERMS_HBOND ) {
+		T rxy = static_cast<T>( HBSqrt( rxy_2 ) );
+		T irxy = T( 1.0 ) / rxy;
+		const T q_x = kernel.charges[atX->xy_index];
+		total_e = irxy * q_x * q_y * ( irxy + kernel.crf_a * rxy_2 + kernel.crf_b );
+	}
 
-		// calculate squared x-h distance, x-h distance and inverse x-h distance
-		real dxh_x = crd_x->x - crd_h->x;
-		real dxh_y = crd_x->y - crd_h->y;
-		real dxh_z = crd_x->z - crd_h->z;
-		real rxh_2 = dxh_x*dxh_x + dxh_y*dxh_y + dxh_z*dxh_z;
-		real rxh = static_cast<real>( sqrt( rxh_2 ) );
-		real irxh = real( 1.0 ) / rxh;
+	// now loop through hydrogens (unrolled, their number is known)
+	for ( int i = 0; i < NH; ++i ) {
+		// get h coords and FF code
+		const C *crd_h = &coords[atX->h_indices[i]];
+		const uint32 code_h = atX->codes[i];
 
 		// calculate squared y-h distance, y-h distance and inverse y-h distance
-		real dyh_x = crd_y->x - crd_h->x;
-		real dyh_y = crd_y->y - crd_h->y;
-		real dyh_z = crd_y->z - crd_h->z;
-		real ryh_2 = dyh_x*dyh_x + dyh_y*dyh_y + dyh_z*dyh_z;
-		real ryh = static_cast<real>( sqrt( ryh_2 ) );
-		real iryh = real( 1.0 ) / ryh;
+		T dyh_x = crd_y->x - crd_h->x;
+		T dyh_y = crd_y->y - crd_h->y;
+		T dyh_z = crd_y->z - crd_h->z;
+		T ryh_2 = dyh_x*dyh_x + dyh_y*dyh_y + dyh_z*dyh_z;
+		T ryh = static_cast<T>( HBSqrt( ryh_2 ) );
+		T iryh = T( 1.0 ) / ryh;
 
 		// calculate electrostatics
-		total_e += iryh * q_h * q_y * ( iryh + crf_a_ * ryh_2 + crf_b_ );
+		if ( TERMS != HBTERMS_HBOND ) {
+			const T q_h = kernel.charges[atX->h_indices[i]];
+			total_e += iryh * q_h * q_y * ( iryh + kernel.crf_a * ryh_2 + kernel.crf_b );
+		}
+		if ( TERMS == HBTERMS_ELEC )
+			continue;
+
+		// calculate squared x-h distance, x-h distance and inverse x-h distance
+		T dxh_x = crd_x->x - crd_h->x;
+		T dxh_y = crd_x->y - crd_h->y;
+		T dxh_z = crd_x->z - crd_h->z;
+		T rxh_2 = dxh_x*dxh_x + dxh_y*dxh_y + dxh_z*dxh_z;
+		T rxh = static_cast<T>( HBSqrt( rxh_2 ) );
+		T irxh = T( 1.0 ) / rxh;
 
 		// calculate 1+cos(theta)
-		real cost = real( 1.0 ) + ( dyh_x*dxh_x + dyh_y*dxh_y + dyh_z*dxh_z ) * iryh * irxh;
+		T cost = T( 1.0 ) + ( dyh_x*dxh_x + dyh_y*dxh_y + dyh_z*dxh_z ) * iryh * irxh;
 
 		// calculate exponent
-		real expt = static_cast<real>( exp( cost * cost / hb_minus_sigma2 ) );
+		T expt;
+		if ( !kernel.tabulated ) expt = static_cast<T>( HBExp( cost * cost / hb_minus_sigma2 ) );
+		else expt = ( cost < kernel.angular.x1 ) ? kernel.angular.Eval( std::max( cost, T( 0 ) ) ) : T( 0 );
 
 		// get triplet parms
-		const TripletParms *hbparms = &tripletParms_[code_h][code_y];
+		const size_t parmsIndex = code_h * kernel.maxY + code_y;
+		const typename HBKernel<T>::Parms *hbparms = &kernel.parms[parmsIndex];
 
 		// calculate 12-6 energy
-		real hb126;
+		T hb126;
 		if ( ryh <= hbparms->r ) hb126 = hbparms->e;
+		else if ( kernel.tabulated && kernel.hb126[parmsIndex].Contains( ryh ) ) hb126 = kernel.hb126[parmsIndex].Eval( ryh );
 		else {
-			real ir6 = iryh * iryh * iryh;
+			T ir6 = iryh * iryh * iryh;
 			ir6 *= ir6;
 			hb126 = ir6 * ( hbparms->a * ir6 - hbparms->b );
 		}
@@ -1167,8 +1935,14 @@ real CHBonds :: CalcEnergy( const HBAtom *atX, const HBAtom *atY, const atom_t *
 		total_h += expt * hb126;
 	}
 
-	total_e *= dd_e_ * gpGlobals->electrostatic_coeff;
-	total_h *= gpGlobals->hbond_126_coeff;
+	// a term that is off has a zero coefficient
+	if ( TERMS == HBTERMS_ELEC )
+		return total_e * kernel.scale_e;
+	if ( TERMS == HBTERMS_HBOND )
+		return total_h * kernel.scale_h;
+
+	total_e *= kernel.scale_e;
+	total_h *= kernel.scale_h;
 
 	return total_e + total_h;
 }
@@ -1187,10 +1961,13 @@ real CHBonds :: AverageEnergy( real e1, real e2, real e3 ) const
 	return real( 3.0 ) / ( real( 1.0 ) / e1 + real( 1.0 ) / e2 + real( 1.0 ) / e3 );
 }
 
-void CHBonds :: ProcessMicroset( ThreadLocal *tl, const HBBridge *firstBridge, size_t numBridges, const atom_t *atoms, const coord3_t *coords, HBPairMap &localPairMap, HBTripletMap &localTripletMap )
+void CHBonds :: ProcessMicroset( ThreadLocal *tl, const HBBridge *firstBridge, size_t numBridges, const atom_t *atoms, const coord3_t *coords, HBPairMap &localPairMap, HBTripletMap &localTripletMap, HBPairScoreMap &pairScoreMap, HBTripletScoreMap &tripletScoreMap )
 {
 	assert( firstBridge != nullptr );
 
+	if ( microsetCap_ && numBridges > microsetCap_ )
+		CapMicroset( tl, firstBridge, numBridges );
+
 	if ( numBridges <= 1 ) {
 		// a single atom, ignore
 	} else if ( numBridges == 2 ) {
@@ -1212,8 +1989,8 @@ void CHBonds :: ProcessMicroset( ThreadLocal *tl, const HBBridge *firstBridge, s
 			HBLocalScore ls;
 			ls.score = 1;
 			ls.energy = energy;
-			auto globalIt = hbPairScoreMap_.find( value );
-			ls.global = ( globalIt == hbPairScoreMap_.end() ) ? nullptr : &globalIt->second;
+			auto globalIt = pairScoreMap.find( value );
+			ls.global = ( globalIt == pairScoreMap.end() ) ? nullptr : &globalIt->second;
 			glist = ls.global ? ls.global->solv : nullptr;
 			block->chain = nullptr;
 			ls.solv = block;
@@ -1227,7 +2004,7 @@ void CHBonds :: ProcessMicroset( ThreadLocal *tl, const HBBridge *firstBridge, s
 		}
 		if ( glist ) block->gblock = FindGlobalBlock( block, glist );
 		if ( !block->gblock || energy < block->gblock->energy )
-			BuildBlockInfo( block, atoms, coords );
+			BuildBlockInfo( tl, block, coords ? CaptureSolventCoords( tl, block->s_index, atoms, coords ) : nullptr );
 	} else if ( numBridges == 3 ) {
 		// prepare solvent block
 		assert( firstBridge[0].s_index == firstBridge[1].s_index );
@@ -1249,8 +2026,8 @@ void CHBonds :: ProcessMicroset( ThreadLocal *tl, const HBBridge *firstBridge, s
 			HBLocalScore ls;
 			ls.score = 1;
 			ls.energy = energy;
-			auto globalIt = hbTripletScoreMap_.find( value );
-			ls.global = ( globalIt == hbTripletScoreMap_.end() ) ? nullptr : &globalIt->second;
+			auto globalIt = tripletScoreMap.find( value );
+			ls.global = ( globalIt == tripletScoreMap.end() ) ? nullptr : &globalIt->second;
 			glist = ls.global ? ls.global->solv : nullptr;
 			block->chain = nullptr;
 			ls.solv = block;
@@ -1264,174 +2041,569 @@ void CHBonds :: ProcessMicroset( ThreadLocal *tl, const HBBridge *firstBridge, s
 		}
 		if ( glist ) block->gblock = FindGlobalBlock( block, glist );
 		if ( !block->gblock || energy < block->gblock->energy )
-			BuildBlockInfo( block, atoms, coords );
+			BuildBlockInfo( tl, block, coords ? CaptureSolventCoords( tl, block->s_index, atoms, coords ) : nullptr );
 	} else {
 		// register a bunch of triplets
-		for ( std::size_t i = 0; i < numBridges - 2; ++i ) {
-			for ( std::size_t j = i + 1; j < numBridges - 1; ++j ) {
-				for ( std::size_t k = j + 1; k < numBridges; ++k ) {
-					assert( firstBridge[i].s_index == firstBridge[j].s_index );
-					assert( firstBridge[i].s_index == firstBridge[k].s_index );
-					real energy = AverageEnergy( firstBridge[i].energy, firstBridge[j].energy, firstBridge[k].energy );
-					HBSolvent *glist;
-					HBSolvent *block = GrabSolventBlock( tl );
-					block->gblock = nullptr;
-					block->energy = energy;
-					block->snaps = 1;
-					block->s_index = firstBridge[i].s_index;
-					HBTriplet value;
-					value.index0 = firstBridge[i].b_index;
-					value.index1 = firstBridge[j].b_index;
-					value.index2 = firstBridge[k].b_index;
-					auto existing = localTripletMap.find( value );
-					if ( existing == localTripletMap.end() ) {
-						HBLocalScore ls;
-						ls.score = 1;
-						ls.energy = energy;
-						auto globalIt = hbTripletScoreMap_.find( value );
-						ls.global = ( globalIt == hbTripletScoreMap_.end() ) ? nullptr : &globalIt->second;
-						glist = ls.global ? ls.global->solv : nullptr;
-						block->chain = nullptr;
-						ls.solv = block;
-						localTripletMap.insert( std::make_pair( value, ls ) );
-					} else {
-						++existing->second.score;
-						existing->second.energy += energy;
-						glist = existing->second.global ? existing->second.global->solv : nullptr;
-						block->chain = existing->second.solv;
-						existing->second.solv = block;
-					}
-					if ( glist ) block->gblock = FindGlobalBlock( block, glist );
-					if ( !block->gblock || energy < block->gblock->energy )
-						BuildBlockInfo( block, atoms, coords );
-				}
-			}
-		}
+		ProcessLargeMicroset( tl, firstBridge, numBridges, atoms, coords, localTripletMap, tripletScoreMap );
 	}
 }
 
-void CHBonds :: CalcMicrosets( const uint32 threadNum, const uint32 snapshotNum, const coord3_t *coords )
+//////////////////////////////////////////////////////////////////////////
+// LARGE MICROSETS
+//////////////////////////////////////////////////////////////////////////
+// A solvent atom bridging n biopolymer atoms (e.g. an ion and its 
+// coordinating atoms) gives C(n,3) triplets. They are enumerated in key 
+// order, so every (i,j) prefix takes a single lookup in the local and the
+// global maps, and the triplets of k walk forward from it. The harmonic 
+// mean takes the inverse energies from a table built once per microset, 
+// and the solvent coordinates are captured once for all of the triplets. 
+// With -mcap only the strongest bridges of the microset are kept. The 
+// statistics in the log count the primary cut-off only, not the sweep 
+// levels or the -fpr reference pass.
+//////////////////////////////////////////////////////////////////////////
+void CHBonds :: CapMicroset( ThreadLocal *tl, const HBBridge *&firstBridge, size_t &numBridges )
 {
-	assert( threadNum < numThreads_ );
-	assert( topology->GetAtomCount() != 0 );
-	ThreadLocal *tl = &tl_[threadNum];
-
-	const atom_t *atoms = topology->GetAtomArray();
-	const real cutoff = -gpGlobals->hbond_cutoff_energy;
-	uint32 c_donors = 0, c_acceptors = 0, c_microsets = 0;
+	// strongest first, then back to the biopolymer atom order
+	tl->microsetBridges.assign( firstBridge, firstBridge + numBridges );
+	std::stable_sort( tl->microsetBridges.begin(), tl->microsetBridges.end(), []( const HBBridge &a, const HBBridge &b ) { return a.energy < b.energy; } );
+	tl->microsetBridges.resize( microsetCap_ );
+	std::stable_sort( tl->microsetBridges.begin(), tl->microsetBridges.end(), []( const HBBridge &a, const HBBridge &b ) { return a.b_index < b.b_index; } );
+
+	if ( tl->microsetStats ) {
+		++microsetStats_.capped;
+		microsetStats_.dropped += numBridges - microsetCap_;
+	}
+	firstBridge = tl->microsetBridges.data();
+	numBridges = microsetCap_;
+}
 
-	double startTime = utils->FloatMilliseconds();
-	double baseTime = startTime;
+void CHBonds :: ProcessLargeMicroset( ThreadLocal *tl, const HBBridge *firstBridge, size_t numBridges, const atom_t *atoms, const coord3_t *coords, HBTripletMap &localTripletMap, HBTripletScoreMap &tripletScoreMap )
+{
+	assert( numBridges > 3 );
+	const uint32 s_index = firstBridge[0].s_index;
+	if ( tl->microsetStats ) {
+		++microsetStats_.large;
+		microsetStats_.triplets += numBridges * ( numBridges - 1 ) * ( numBridges - 2 ) / 6;
+		microsetStats_.maxBridges = std::max( microsetStats_.maxBridges, static_cast<uint32>( numBridges ) );
+	}
 
-	//////////////////////////////////////////////////////////////////////////
-	// FIND H-BOND CONNECTIONS AND BUILD MICROSETS
-	//////////////////////////////////////////////////////////////////////////
-	// Build a list of biopolymer-solvent h-bonding pairs ("bridges").
-	// All biopolymer's donors/acceptors that connect to a single solvent 
-	// donor/acceptor, are referred to as "microset". After this list is 
-	// sorted by the solvent atom index, we have a consecutive list of 
-	// microsets and we'll parse it later.
-	//////////////////////////////////////////////////////////////////////////
-	tl->bridges.resize( 0 );
-	// for all biopolymer donor/acceptor atoms
-	const auto itbEnd = hbBiopolyList_.cend();
-	for ( auto itb = hbBiopolyList_.cbegin(); itb != itbEnd && !ThreadInterrupted(); ++itb ) {
-		bool b_is_donor = ( itb->h_indices[0] != UINT32_BAD );
-		bool b_is_accep = ( itb->y_code != UINT16_BAD );
-
-		// for all solvent donor/acceptor atoms
-		const auto itsEnd = hbSolventList_.cend();
-		for ( auto its = hbSolventList_.cbegin(); its != itsEnd && !ThreadInterrupted(); ++its ) {
-			bool s_is_donor = ( its->h_indices[0] != UINT32_BAD );
-			bool s_is_accep = ( its->y_code != UINT16_BAD );
-			bool valid_bond = false;
-			real energy = 0;
-
-			// calculate donor-acceptor energy
-			if ( b_is_donor && s_is_accep ) {
-				energy = CalcEnergy( &(*itb), &(*its), atoms, coords );
-				if ( energy < cutoff ) {
-					valid_bond = true;
-					++c_donors;
-#if 0
-					const atom_t *atX = &atoms[itb->xy_index];
-					const atom_t *atY = &atoms[its->xy_index];
-					logfile->Print( "[%4i] D-A: %s-%i-%c%c%c%c to %s-%i-%c%c%c%c = %f\n", 
-						c_donors,
-						atX->residue.string, atX->resnum, atX->title.string[0], atX->title.string[1], atX->title.string[2], atX->title.string[3],
-						atY->residue.string, atY->resnum, atY->title.string[0], atY->title.string[1], atY->title.string[2], atY->title.string[3],
-						energy );
-#endif
+	// same sum as AverageEnergy, so the energies are the same to the bit
+	tl->microsetEnergy.resize( numBridges );
+	for ( size_t i = 0; i < numBridges; ++i ) {
+		assert( firstBridge[i].s_index == s_index );
+		tl->microsetEnergy[i] = real( 1.0 ) / firstBridge[i].energy;
+	}
+	const real *invEnergy = tl->microsetEnergy.data();
+
+	HBSolventCoords *sc = nullptr;
+	HBTriplet value;
+	for ( size_t i = 0; i < numBridges - 2; ++i ) {
+		value.index0 = firstBridge[i].b_index;
+		for ( size_t j = i + 1; j < numBridges - 1; ++j ) {
+			value.index1 = firstBridge[j].b_index;
+			value.index2 = firstBridge[j+1].b_index;
+			auto localIt = localTripletMap.lower_bound( value );
+			auto globalIt = tripletScoreMap.lower_bound( value );
+			const real invEnergy2 = invEnergy[i] + invEnergy[j];
+			for ( size_t k = j + 1; k < numBridges; ++k ) {
+				value.index2 = firstBridge[k].b_index;
+				while ( localIt != localTripletMap.end() && localIt->first < value )
+					++localIt;
+				while ( globalIt != tripletScoreMap.end() && globalIt->first < value )
+					++globalIt;
+
+				real energy = real( 3.0 ) / ( invEnergy2 + invEnergy[k] );
+				HBSolvent *glist;
+				HBSolvent *block = GrabSolventBlock( tl );
+				block->gblock = nullptr;
+				block->energy = energy;
+				block->snaps = 1;
+				block->s_index = s_index;
+				if ( localIt == localTripletMap.end() || value < localIt->first ) {
+					HBLocalScore ls;
+					ls.score = 1;
+					ls.energy = energy;
+					ls.global = ( globalIt == tripletScoreMap.end() || value < globalIt->first ) ? nullptr : &globalIt->second;
+					glist = ls.global ? ls.global->solv : nullptr;
+					block->chain = nullptr;
+					ls.solv = block;
+					localIt = localTripletMap.insert( localIt, std::make_pair( value, ls ) );
+				} else {
+					++localIt->second.score;
+					localIt->second.energy += energy;
+					glist = localIt->second.global ? localIt->second.global->solv : nullptr;
+					block->chain = localIt->second.solv;
+					localIt->second.solv = block;
+				}
+				if ( glist ) block->gblock = FindGlobalBlock( block, glist );
+				if ( !block->gblock || energy < block->gblock->energy ) {
+					if ( coords && !sc )
+						sc = CaptureSolventCoords( tl, s_index, atoms, coords );
+					BuildBlockInfo( tl, block, sc );
 				}
 			}
+		}
+	}
+}
+
+template<typename T, typename C> void CHBonds :: FindBridges( const HBAtom *firstAtom, const HBAtom *lastAtom, const HBKernel<T> &kernel, const C *coords, HBBridgeVec &bridges, uint32 &c_donors, uint32 &c_acceptors ) const
+{
+	// skip the energy terms with a zero coefficient
+	// (with none of them every energy is zero and there are no bridges)
+	if ( kernel.scale_e != 0 && kernel.scale_h != 0 )
+		FindBridgesTerms<HBTERMS_ALL>( firstAtom, lastAtom, kernel, coords, bridges, c_donors, c_acceptors );
+	else if ( kernel.scale_e != 0 )
+		FindBridgesTerms<HBTERMS_ELEC>( firstAtom, lastAtom, kernel, coords, bridges, c_donors, c_acceptors );
+	else if ( kernel.scale_h != 0 )
+		FindBridgesTerms<HBTERMS_HBOND>( firstAtom, lastAtom, kernel, coords, bridges, c_donors, c_acceptors );
+}
+
+template<int TERMS, typename T, typename C> void CHBonds :: FindBridgesTerms( const HBAtom *firstAtom, const HBAtom *lastAtom, const HBKernel<T> &kernel, const C *coords, HBBridgeVec &bridges, uint32 &c_donors, uint32 &c_acceptors ) const
+{
+	// for all biopolymer donor/acceptor atoms, with the donor kernel for 
+	// their number of hydrogens
+	for ( const HBAtom *itb = firstAtom; itb != lastAtom && !ThreadInterrupted(); ++itb ) {
+		switch ( itb->numH ) {
+		case 0: FindAtomBridges<0,TERMS>( itb, kernel, coords, bridges, c_donors, c_acceptors ); break;
+		case 1: FindAtomBridges<1,TERMS>( itb, kernel, coords, bridges, c_donors, c_acceptors ); break;
+		case 2: FindAtomBridges<2,TERMS>( itb, kernel, coords, bridges, c_donors, c_acceptors ); break;
+		case 3: FindAtomBridges<3,TERMS>( itb, kernel, coords, bridges, c_donors, c_acceptors ); break;
+		default: FindAtomBridges<4,TERMS>( itb, kernel, coords, bridges, c_donors, c_acceptors ); break;
+		}
+	}
+}
 
-			// calculate acceptor-donor energy
-			if ( !valid_bond && s_is_donor && b_is_accep ) {
-				energy = CalcEnergy( &(*its), &(*itb), atoms, coords );
-				if ( energy < cutoff ) {
-					valid_bond = true;
-					++c_acceptors;
+template<int NHB, int TERMS, typename T, typename C> void CHBonds :: FindAtomBridges( const HBAtom *itb, const HBKernel<T> &kernel, const C *coords, HBBridgeVec &bridges, uint32 &c_donors, uint32 &c_acceptors ) const
+{
+	const T cutoff = static_cast<T>( -gpGlobals->hbond_cutoff_energy );
+	const bool b_is_donor = ( NHB > 0 );
+	const bool b_is_accep = ( itb->y_code != UINT16_BAD );
+
+	// for all solvent donor/acceptor atoms
+	const auto itsEnd = hbSolventList_.cend();
+	for ( auto its = hbSolventList_.cbegin(); its != itsEnd && !ThreadInterrupted(); ++its ) {
+		bool s_is_donor = ( its->numH != 0 );
+		bool s_is_accep = ( its->y_code != UINT16_BAD );
+		bool valid_bond = false;
+		T energy = 0;
+
+		// calculate donor-acceptor energy
+		if ( b_is_donor && s_is_accep ) {
+			energy = EnergyKernel<( NHB > 0 ? NHB : 1 ),TERMS>( itb, &(*its), kernel, coords );
+			if ( energy < cutoff ) {
+				valid_bond = true;
+				++c_donors;
 #if 0
-					const atom_t *atX = &atoms[its->xy_index];
-					const atom_t *atY = &atoms[itb->xy_index];
-					logfile->Print( "[%4i] A-D: %s-%i-%c%c%c%c to %s-%i-%c%c%c%c = %f\n", 
-						c_acceptors,
-						atX->residue.string, atX->resnum, atX->title.string[0], atX->title.string[1], atX->title.string[2], atX->title.string[3],
-						atY->residue.string, atY->resnum, atY->title.string[0], atY->title.string[1], atY->title.string[2], atY->title.string[3],
-						energy );
+				const atom_t *atoms = topology->GetAtomArray();
+				const atom_t *atX = &atoms[itb->xy_index];
+				const atom_t *atY = &atoms[its->xy_index];
+				logfile->Print( "[%4i] D-A: %s-%i-%c%c%c%c to %s-%i-%c%c%c%c = %f\n", 
+					c_donors,
+					atX->residue.string, atX->resnum, atX->title.string[0], atX->title.string[1], atX->title.string[2], atX->title.string[3],
+					atY->residue.string, atY->resnum, atY->title.string[0], atY->title.string[1], atY->title.string[2], atY->title.string[3],
+					energy );
 #endif
-				}
 			}
+		}
 
-			// insert into the set of bridges
-			if ( valid_bond ) {
-				HBBridge b;
-				b.s_index = its->xy_remap;
-				b.b_index = itb->xy_remap;
-				b.energy = energy;
-				tl->bridges.push_back( b );
+		// calculate acceptor-donor energy
+		if ( !valid_bond && s_is_donor && b_is_accep ) {
+			energy = CalcEnergy<TERMS>( &(*its), itb, kernel, coords );
+			if ( energy < cutoff ) {
+				valid_bond = true;
+				++c_acceptors;
 #if 0
+				const atom_t *atoms = topology->GetAtomArray();
 				const atom_t *atX = &atoms[its->xy_index];
 				const atom_t *atY = &atoms[itb->xy_index];
-				logfile->Print( "BRIDGE: %s-%5i-%c%c%c%c to %s-%5i-%c%c%c%c = %f\n",
+				logfile->Print( "[%4i] A-D: %s-%i-%c%c%c%c to %s-%i-%c%c%c%c = %f\n", 
+					c_acceptors,
 					atX->residue.string, atX->resnum, atX->title.string[0], atX->title.string[1], atX->title.string[2], atX->title.string[3],
 					atY->residue.string, atY->resnum, atY->title.string[0], atY->title.string[1], atY->title.string[2], atY->title.string[3],
 					energy );
 #endif
-
 			}
 		}
+
+		// insert into the set of bridges
+		if ( valid_bond ) {
+			HBBridge b;
+			// captured bridges are stored ungrouped and remapped later
+			b.s_index = captureFile_ ? its->xy_index : its->xy_remap;
+			b.b_index = captureFile_ ? itb->xy_index : itb->xy_remap;
+			b.energy = energy;
+			bridges.push_back( b );
+#if 0
+			const atom_t *atoms = topology->GetAtomArray();
+			const atom_t *atX = &atoms[its->xy_index];
+			const atom_t *atY = &atoms[itb->xy_index];
+			logfile->Print( "BRIDGE: %s-%5i-%c%c%c%c to %s-%5i-%c%c%c%c = %f\n",
+				atX->residue.string, atX->resnum, atX->title.string[0], atX->title.string[1], atX->title.string[2], atX->title.string[3],
+				atY->residue.string, atY->resnum, atY->title.string[0], atY->title.string[1], atY->title.string[2], atY->title.string[3],
+				energy );
+#endif
+
+		}
 	}
-	// check for degenerate case
-	if ( !tl->bridges.size() )
+}
+
+//////////////////////////////////////////////////////////////////////////
+// BRIDGE SORT
+//////////////////////////////////////////////////////////////////////////
+// Bridges of a frame are sorted by solvent atom index, and by biopolymer
+// atom index next. This is a stable LSD radix sort by the biopolymer index
+// followed by one by the solvent index. Keys are taken relative to their
+// minimum in the frame and split into digits of at most RADIX_SORT_BITS
+// bits, so the buckets stay in cache whatever the atom count. The search
+// runs over the biopolymer atoms in list order, which is mostly ascending,
+// so the biopolymer passes are skipped when the bridges are in order.
+// Very short lists are left to std::sort.
+//////////////////////////////////////////////////////////////////////////
+void CHBonds :: RadixPassBridges( const HBBridgeVec &src, HBBridgeVec &dst, uint32 HBBridge::*key, uint32 minKey, uint32 shift, uint32 bits, std::vector<uint32> &counts ) const
+{
+	const uint32 mask = ( 1u << bits ) - 1;
+	counts.assign( mask + 2, 0 );
+	for ( auto it = src.cbegin(); it != src.cend(); ++it )
+		++counts[( ( (*it).*key - minKey ) >> shift & mask ) + 1];
+	for ( uint32 i = 1; i <= mask; ++i )
+		counts[i] += counts[i-1];
+	dst.resize( src.size() );
+	for ( auto it = src.cbegin(); it != src.cend(); ++it )
+		dst[counts[( (*it).*key - minKey ) >> shift & mask]++] = *it;
+}
+
+void CHBonds :: RadixSortBridges( ThreadLocal *tl, HBBridgeVec &bridges, uint32 HBBridge::*key, uint32 minKey, uint32 maxKey ) const
+{
+	uint32 numBits = 0;
+	for ( uint32 range = maxKey - minKey; range; range >>= 1 )
+		++numBits;
+	if ( !numBits )
 		return;
 
-	// sort bridges
-	std::sort( tl->bridges.begin(), tl->bridges.end() );
+	// spread the bits evenly over the passes
+	const uint32 numPasses = ( numBits + RADIX_SORT_BITS - 1 ) / RADIX_SORT_BITS;
+	const uint32 passBits = ( numBits + numPasses - 1 ) / numPasses;
+	for ( uint32 i = 0; i < numPasses; ++i ) {
+		RadixPassBridges( bridges, tl->sortBuffer, key, minKey, i * passBits, passBits, tl->sortCounts );
+		bridges.swap( tl->sortBuffer );
+	}
+}
 
-	// begin single-threaded block
-	// everything else references global variables (e.g. hbPairScoreMap_) 
-	// and can't be done multithreaded
-	// but the rest is fast, the main time consumer was building microsets
-	ThreadLock();
+void CHBonds :: SortBridges( ThreadLocal *tl, HBBridgeVec &bridges ) const
+{
+	const size_t numBridges = bridges.size();
+	if ( numBridges < MIN_RADIX_SORT ) {
+		std::sort( bridges.begin(), bridges.end() );
+		return;
+	}
 
-	double microsetTime = utils->FloatMilliseconds() - startTime;
-	startTime += microsetTime;
+	// key bounds and order of the biopolymer indices
+	uint32 min_s_index = bridges[0].s_index, max_s_index = min_s_index;
+	uint32 min_b_index = bridges[0].b_index, max_b_index = min_b_index;
+	bool b_sorted = true;
+	for ( size_t i = 1; i < numBridges; ++i ) {
+		min_s_index = std::min( min_s_index, bridges[i].s_index );
+		max_s_index = std::max( max_s_index, bridges[i].s_index );
+		min_b_index = std::min( min_b_index, bridges[i].b_index );
+		max_b_index = std::max( max_b_index, bridges[i].b_index );
+		if ( bridges[i].b_index < bridges[i-1].b_index )
+			b_sorted = false;
+	}
 
-	//////////////////////////////////////////////////////////////////////////
-	// PROCESS MICROSETS
-	//////////////////////////////////////////////////////////////////////////
-	// Now microsets are ready: bridges are sorted by solvent atom index 
-	// first, and biolpolymer atom index next. So, we have a consecutive list
-	// of microsets. Process them, building a tuple of biopolymer donors and
-	// acceptors that belong to a single microset, and then extracting pairs
-	// and triplets from it. Also remember a reference solvent atom, to range
-	// solvent molecules later.
-	//////////////////////////////////////////////////////////////////////////
-	HBPairMap localPairMap;
-	HBTripletMap localTripletMap;
-	uint32 last_s_index = 0;
-	size_t numBridges = 0;
+	if ( !b_sorted )
+		RadixSortBridges( tl, bridges, &HBBridge::b_index, min_b_index, max_b_index );
+	RadixSortBridges( tl, bridges, &HBBridge::s_index, min_s_index, max_s_index );
+}
+
+void CHBonds :: FindBridgesTile( void *local, uint32 tile )
+{
+	ThreadLocal *tl = reinterpret_cast<ThreadLocal*>( local );
+	assert( tl->coords != nullptr );
+	assert( tile < tl->tiles.size() );
+
+	// get the range of biopolymer atoms for this tile
+	const size_t numAtoms = hbBiopolyList_.size();
+	const size_t numTiles = tl->tiles.size();
+	const HBAtom *firstAtom = hbBiopolyList_.data() + ( numAtoms * tile ) / numTiles;
+	const HBAtom *lastAtom = hbBiopolyList_.data() + ( numAtoms * ( tile + 1 ) ) / numTiles;
+
+	HBTile *t = &tl->tiles[tile];
+	t->bridges.resize( 0 );
+	t->c_donors = t->c_acceptors = 0;
+	if ( tl->single )
+		FindBridges( firstAtom, lastAtom, kernelF_, tl->coordsF.data(), t->bridges, t->c_donors, t->c_acceptors );
+	else
+		FindBridges( firstAtom, lastAtom, kernel_, tl->coords, t->bridges, t->c_donors, t->c_acceptors );
+}
+
+void CHBonds :: SearchBridges( ThreadLocal *tl, uint32 threadNum, const coord3_t *coords, bool single, HBBridgeVec &bridges, uint32 &c_donors, uint32 &c_acceptors )
+{
+	bridges.resize( 0 );
+	const uint32 numAtoms = static_cast<uint32>( hbBiopolyList_.size() );
+	const uint32 numTiles = ThreadTasking() ? std::min( numAtoms / MIN_TILE_ATOMS, static_cast<uint32>( ThreadCount() ) * TILES_PER_THREAD ) : 0;
+	if ( numTiles > 1 ) {
+		// split the search into ranges of biopolymer atoms and let idle threads help
+		tl->coords = coords;
+		tl->single = single;
+		tl->tiles.resize( numTiles );
+		RunTasksOn( threadNum, numTiles, Stub_FindBridgesTile, tl );
+		tl->coords = nullptr;
+		// join the tiles
+		size_t numBridges = 0;
+		for ( auto it = tl->tiles.cbegin(); it != tl->tiles.cend(); ++it )
+			numBridges += it->bridges.size();
+		bridges.reserve( numBridges );
+		for ( auto it = tl->tiles.cbegin(); it != tl->tiles.cend(); ++it ) {
+			bridges.insert( bridges.end(), it->bridges.cbegin(), it->bridges.cend() );
+			c_donors += it->c_donors;
+			c_acceptors += it->c_acceptors;
+		}
+	} else if ( single ) {
+		FindBridges( hbBiopolyList_.data(), hbBiopolyList_.data() + numAtoms, kernelF_, tl->coordsF.data(), bridges, c_donors, c_acceptors );
+	} else {
+		FindBridges( hbBiopolyList_.data(), hbBiopolyList_.data() + numAtoms, kernel_, coords, bridges, c_donors, c_acceptors );
+	}
+}
+
+void CHBonds :: ComparePrecision( ThreadLocal *tl, const atom_t *atoms, const coord3_t *coords )
+{
+	// both lists are sorted: count the bridges found in one precision only
+	// and the energy difference of the common ones
+	const HBBridgeVec &single = tl->bridges;
+	const HBBridgeVec &shadow = tl->shadow;
+	size_t i = 0, j = 0;
+	while ( i < single.size() || j < shadow.size() ) {
+		if ( j == shadow.size() || ( i < single.size() && single[i] < shadow[j] ) ) {
+			++precisionStats_.onlySingle;
+			++i;
+		} else if ( i == single.size() || shadow[j] < single[i] ) {
+			++precisionStats_.onlyDouble;
+			++j;
+		} else {
+			++precisionStats_.common;
+			const real delta = static_cast<real>( fabs( single[i].energy - shadow[j].energy ) );
+			precisionStats_.maxDelta = std::max( precisionStats_.maxDelta, delta );
+			precisionStats_.maxRelDelta = std::max( precisionStats_.maxRelDelta, delta / static_cast<real>( fabs( shadow[j].energy ) ) );
+			++i;
+			++j;
+		}
+	}
+	++precisionStats_.frames;
+
+	// accumulate the double-precision bridges into the reference maps
+	if ( !shadow.size() )
+		return;
+	size_t c_pairs, c_triplets;
+	tl->bridges.swap( tl->shadow );
+	tl->microsetStats = false;
+	AccumulateBridges( tl, atoms, coords, refPairScoreMap_, refTripletScoreMap_, c_pairs, c_triplets );
+	tl->microsetStats = true;
+	tl->bridges.swap( tl->shadow );
+	ReleaseFrameCoords( tl );
+}
+
+void CHBonds :: CalcMicrosets( const uint32 threadNum, const uint32 snapshotNum, const coord3_t *coords )
+{
+	assert( threadNum < numThreads_ );
+	assert( topology->GetAtomCount() != 0 );
+	ThreadLocal *tl = &tl_[threadNum];
+
+	const atom_t *atoms = topology->GetAtomArray();
+	uint32 c_donors = 0, c_acceptors = 0, c_microsets = 0;
+
+	const double baseTime = utils->FloatMilliseconds();
+	double phaseTime = baseTime;
+	++tl->frames;
+	tl->snapshot = snapshotNum;
+
+	// the frame was read by this thread right before
+	double readTime, parseTime;
+	topology->GetFrameTimes( threadNum, readTime, parseTime );
+	tl->phases[HBPHASE_READ].Add( readTime );
+	if ( parseTime >= 0 )
+		tl->phases[HBPHASE_PARSE].Add( parseTime );
+	if ( tl->frames == 1 )
+		tl->firstTime = baseTime - readTime - std::max( parseTime, 0.0 );
+
+	// superposition onto the base coordinates, applied to the copied solvent
+	if ( superposition_.Count() ) {
+		superposition_.Fit( coords, tl->xform );
+		tl->fit = &tl->xform;
+	}
+
+	if ( !tl->bridges.capacity() )
+		tl->bridges.reserve( 1024 );
+
+	//////////////////////////////////////////////////////////////////////////
+	// FIND H-BOND CONNECTIONS AND BUILD MICROSETS
+	//////////////////////////////////////////////////////////////////////////
+	// Build a list of biopolymer-solvent h-bonding pairs ("bridges").
+	// All biopolymer's donors/acceptors that connect to a single solvent 
+	// donor/acceptor, are referred to as "microset". After this list is 
+	// sorted by the solvent atom index, we have a consecutive list of 
+	// microsets and we'll parse it later.
+	//////////////////////////////////////////////////////////////////////////
+	if ( singlePrecision_ ) {
+		// single-precision copy of the frame
+		const size_t atcount = topology->GetAtomCount();
+		tl->coordsF.resize( atcount );
+		for ( size_t i = 0; i < atcount; ++i ) {
+			tl->coordsF[i].x = static_cast<float>( coords[i].x );
+			tl->coordsF[i].y = static_cast<float>( coords[i].y );
+			tl->coordsF[i].z = static_cast<float>( coords[i].z );
+		}
+	}
+	SearchBridges( tl, threadNum, coords, singlePrecision_, tl->bridges, c_donors, c_acceptors );
+	if ( precisionReport_ ) {
+		// same search in double precision to compare with
+		uint32 r_donors = 0, r_acceptors = 0;
+		SearchBridges( tl, threadNum, coords, false, tl->shadow, r_donors, r_acceptors );
+		SortBridges( tl, tl->shadow );
+	}
+	tl->atomPairs += static_cast<uint64>( hbBiopolyList_.size() ) * hbSolventList_.size() * ( precisionReport_ ? 2 : 1 );
+	PhaseCompleted( tl, HBPHASE_SEARCH, phaseTime );
+
+	// capture the bridges, then apply the grouping
+	if ( captureFile_ ) {
+		SortBridges( tl, tl->bridges );
+		EncodeBridges( tl->bridges, tl->capture );
+		RemapBridges( tl->bridges );
+	}
+
+	// check for degenerate case
+	if ( !tl->bridges.size() ) {
+		PhaseCompleted( tl, HBPHASE_SORT, phaseTime );
+		if ( densityGrid_.numCells ) {
+			AccumulateDensity( tl, atoms, coords );
+			PhaseCompleted( tl, HBPHASE_LOCAL, phaseTime );
+		}
+		ThreadLock();
+		PhaseCompleted( tl, HBPHASE_MERGE_WAIT, phaseTime );
+		WriteCapturedFrame( tl, snapshotNum );
+		if ( precisionReport_ )
+			ComparePrecision( tl, atoms, coords );
+		PhaseCompleted( tl, HBPHASE_MERGE, phaseTime );
+		FrameCompleted( snapshotNum );
+		PhaseCompleted( tl, HBPHASE_FINAL, phaseTime );
+		ThreadUnlock();
+		FrameTimed( tl, baseTime );
+		return;
+	}
+
+	// sort bridges
+	SortBridges( tl, tl->bridges );
+	PhaseCompleted( tl, HBPHASE_SORT, phaseTime );
+
+	// link the microsets through solvent-solvent h-bonds
+	if ( waterChains_ )
+		FindChains( tl, coords );
+
+	// count solvent atoms into the thread's own density grid
+	if ( densityGrid_.numCells )
+		AccumulateDensity( tl, atoms, coords );
+
+	if ( waterChains_ || densityGrid_.numCells )
+		PhaseCompleted( tl, HBPHASE_LOCAL, phaseTime );
+
+	// begin single-threaded block
+	// everything else references global variables (e.g. hbPairScoreMap_) 
+	// and can't be done multithreaded
+	// but the rest is fast, the main time consumer was building microsets
+	ThreadLock();
+	PhaseCompleted( tl, HBPHASE_MERGE_WAIT, phaseTime );
+
+	WriteCapturedFrame( tl, snapshotNum );
+
+	// the sweep levels drop bridges, so compare the full list first
+	if ( precisionReport_ )
+		ComparePrecision( tl, atoms, coords );
+
+	size_t c_pairs, c_triplets, c_chains;
+	c_microsets = AccumulateLevels( tl, atoms, coords, c_pairs, c_triplets, c_chains );
+
+	PhaseCompleted( tl, HBPHASE_MERGE, phaseTime );
+	FrameCompleted( snapshotNum );
+	PhaseCompleted( tl, HBPHASE_FINAL, phaseTime );
+
+	// end single-threaded block
+	ThreadUnlock();
+
+	// queued for the log's background thread as a single record, so the
+	// records of the frames finishing at the same time don't interleave
+	if ( snapshotLog_ ) {
+		char record[512];
+		int length = sprintf_s( record, sizeof(record), "----- CalcMicrosets (%u) thread %u -----\n"
+														"%6u donors\n"
+														"%6u acceptors\n"
+														"%6u microsets\n"
+														"%6u pairs\n"
+														"%6u triplets\n", 
+														snapshotNum, threadNum, c_donors, c_acceptors, c_microsets, 
+														static_cast<uint32>( c_pairs ), static_cast<uint32>( c_triplets ) );
+		if ( waterChains_ )
+			length += sprintf_s( record + length, sizeof(record) - length, "%6u second-order pairs\n", static_cast<uint32>( c_chains ) );
+		if ( tl->fit )
+			sprintf_s( record + length, sizeof(record) - length, "%6.3f fit RMSD\n", tl->fit->rmsd );
+		logfile->PrintAsync( threadNum, "%s", record );
+	}
+
+	FrameTimed( tl, baseTime );
+}
+
+uint32 CHBonds :: AccumulateLevels( ThreadLocal *tl, const atom_t *atoms, const coord3_t *coords, size_t &c_pairs, size_t &c_triplets, size_t &c_chains )
+{
+	// accumulate the bridges for every h-bond cut-off energy of the sweep
+	// (if any), from the weakest to the strictest: each level takes a subset
+	// of the bridges taken by the previous one
+	uint32 c_microsets = 0;
+	c_pairs = c_triplets = c_chains = 0;
+	for ( size_t level = 0; ; ++level ) {
+		HBPairScoreMap &pairScoreMap = level ? sweepLevels_[level-1].pairs : hbPairScoreMap_;
+		HBTripletScoreMap &tripletScoreMap = level ? sweepLevels_[level-1].triplets : hbTripletScoreMap_;
+		size_t l_pairs, l_triplets;
+		tl->microsetStats = !level;
+		const uint32 l_microsets = AccumulateBridges( tl, atoms, coords, pairScoreMap, tripletScoreMap, l_pairs, l_triplets );
+		// second-order bridges were found with the weakest cut-off
+		const size_t l_chains = AccumulateChains( tl, level ? sweepLevels_[level-1].chains : hbChainScoreMap_, 
+												  level ? -sweepLevels_[level-1].cutoff : -gpGlobals->hbond_cutoff_energy );
+		if ( !level ) {
+			c_microsets = l_microsets;
+			c_pairs = l_pairs;
+			c_triplets = l_triplets;
+			c_chains = l_chains;
+		}
+		if ( level == sweepLevels_.size() )
+			break;
+		// drop the bridges that are too weak for the next level
+		const real cutoff = -sweepLevels_[level].cutoff;
+		tl->bridges.erase( std::remove_if( tl->bridges.begin(), tl->bridges.end(), 
+			[cutoff]( const HBBridge &b ) { return !( b.energy < cutoff ); } ), tl->bridges.end() );
+		if ( !tl->bridges.size() )
+			break;
+	}
+	tl->microsetStats = true;
+	ReleaseFrameCoords( tl );
+	return c_microsets;
+}
+
+uint32 CHBonds :: AccumulateBridges( ThreadLocal *tl, const atom_t *atoms, const coord3_t *coords, HBPairScoreMap &pairScoreMap, HBTripletScoreMap &tripletScoreMap, size_t &c_pairs, size_t &c_triplets )
+{
+	uint32 c_microsets = 0;
+
+	//////////////////////////////////////////////////////////////////////////
+	// PROCESS MICROSETS
+	//////////////////////////////////////////////////////////////////////////
+	// Now microsets are ready: bridges are sorted by solvent atom index 
+	// first, and biolpolymer atom index next. So, we have a consecutive list
+	// of microsets. Process them, building a tuple of biopolymer donors and
+	// acceptors that belong to a single microset, and then extracting pairs
+	// and triplets from it. Also remember a reference solvent atom, to range
+	// solvent molecules later.
+	//////////////////////////////////////////////////////////////////////////
+	HBPairMap localPairMap;
+	HBTripletMap localTripletMap;
+	uint32 last_s_index = 0;
+	size_t numBridges = 0;
 	const HBBridge *pBridge = &tl->bridges.at( 0 );
 	const HBBridge *pFirstBridge = nullptr;
 	const size_t totalBridges = tl->bridges.size();
@@ -1442,7 +2614,7 @@ void CHBonds :: CalcMicrosets( const uint32 threadNum, const uint32 snapshotNum,
 			// new microset started
 			// process the previous microset
 			if ( numBridges != 0 ) {
-				ProcessMicroset( tl, pFirstBridge, numBridges, atoms, coords, localPairMap, localTripletMap );
+				ProcessMicroset( tl, pFirstBridge, numBridges, atoms, coords, localPairMap, localTripletMap, pairScoreMap, tripletScoreMap );
 				++c_microsets;
 			}
 			last_s_index = s_index;
@@ -1454,25 +2626,16 @@ void CHBonds :: CalcMicrosets( const uint32 threadNum, const uint32 snapshotNum,
 	}
 	if ( numBridges != 0 ) {
 		// process the last microset
-		ProcessMicroset( tl, pFirstBridge, numBridges, atoms, coords, localPairMap, localTripletMap );
+		ProcessMicroset( tl, pFirstBridge, numBridges, atoms, coords, localPairMap, localTripletMap, pairScoreMap, tripletScoreMap );
 		++c_microsets;
 	}
 
-	logfile->Print( "----- CalcMicrosets (%u) thread %u -----\n", snapshotNum, threadNum ); 
-	logfile->Print( "%6u donors\n"
-					"%6u acceptors\n"
-					"%6u microsets\n"
-					"%6u pairs\n"
-					"%6u triplets\n", 
-					c_donors, c_acceptors, c_microsets, localPairMap.size(), localTripletMap.size() );
-
+	c_pairs = localPairMap.size();
+	c_triplets = localTripletMap.size();
 
 	// check if we haven't got any pairs or triplets
-	if ( !localPairMap.size() && !localTripletMap.size() ) {
-		// end single-threaded block
-		ThreadUnlock();
-		return;
-	}
+	if ( !c_pairs && !c_triplets )
+		return c_microsets;
 
 	//////////////////////////////////////////////////////////////////////////
 	// ADD GLOBAL PAIR/TRIPLET INFO
@@ -1500,11 +2663,20 @@ void CHBonds :: CalcMicrosets( const uint32 threadNum, const uint32 snapshotNum,
 			scoreInfo.energy = itp->second.energy;
 			scoreInfo.solv = itp->second.solv;
 			scoreInfo.snaps = 1;
-			hbPairScoreMap_.insert( std::make_pair( itp->first, scoreInfo ) );
+			scoreInfo.occ = nullptr;
+			scoreInfo.blocks = nullptr;
+			scoreInfo.replicas = nullptr;
+			AddOccupancy( scoreInfo.occ, tl->snapshot );
+			AddBlockCount( scoreInfo.blocks, tl->snapshot );
+			AddReplicaCount( scoreInfo.replicas, tl->snapshot );
+			pairScoreMap.insert( std::make_pair( itp->first, scoreInfo ) );
 		} else {
 			itp->second.global->score += itp->second.score;
 			itp->second.global->energy += itp->second.energy;
 			++itp->second.global->snaps;
+			AddOccupancy( itp->second.global->occ, tl->snapshot );
+			AddBlockCount( itp->second.global->blocks, tl->snapshot );
+			AddReplicaCount( itp->second.global->replicas, tl->snapshot );
 			// merge solvent information
 			for ( HBSolvent *lblock = itp->second.solv, *nextblock; lblock; lblock = nextblock ) {
 				nextblock = lblock->chain;
@@ -1518,7 +2690,9 @@ void CHBonds :: CalcMicrosets( const uint32 threadNum, const uint32 snapshotNum,
 					if ( lblock->energy < lblock->gblock->energy ) {
 						assert( 0 != ( lblock->flags & HBSF_VALID ) );
 						lblock->gblock->energy = lblock->energy;
-						memcpy( lblock->gblock->coords, lblock->coords, sizeof(*lblock->coords)*s_siz_ );
+						lblock->gblock->snapshot = lblock->snapshot;
+						// the old coordinates are released with the local block
+						std::swap( lblock->gblock->crd, lblock->crd );
 					}
 					ReturnSolventBlock( tl, lblock );
 				}
@@ -1545,11 +2719,20 @@ void CHBonds :: CalcMicrosets( const uint32 threadNum, const uint32 snapshotNum,
 			scoreInfo.energy = itt->second.energy;
 			scoreInfo.solv = itt->second.solv;
 			scoreInfo.snaps = 1;
-			hbTripletScoreMap_.insert( std::make_pair( itt->first, scoreInfo ) );
+			scoreInfo.occ = nullptr;
+			scoreInfo.blocks = nullptr;
+			scoreInfo.replicas = nullptr;
+			AddOccupancy( scoreInfo.occ, tl->snapshot );
+			AddBlockCount( scoreInfo.blocks, tl->snapshot );
+			AddReplicaCount( scoreInfo.replicas, tl->snapshot );
+			tripletScoreMap.insert( std::make_pair( itt->first, scoreInfo ) );
 		} else {
 			itt->second.global->score += itt->second.score;
 			itt->second.global->energy += itt->second.energy;
 			++itt->second.global->snaps;
+			AddOccupancy( itt->second.global->occ, tl->snapshot );
+			AddBlockCount( itt->second.global->blocks, tl->snapshot );
+			AddReplicaCount( itt->second.global->replicas, tl->snapshot );
 			// merge solvent information
 			for ( HBSolvent *lblock = itt->second.solv, *nextblock; lblock; lblock = nextblock ) {
 				nextblock = lblock->chain;
@@ -1563,7 +2746,9 @@ void CHBonds :: CalcMicrosets( const uint32 threadNum, const uint32 snapshotNum,
 					if ( lblock->energy < lblock->gblock->energy ) {
 						assert( 0 != ( lblock->flags & HBSF_VALID ) );
 						lblock->gblock->energy = lblock->energy;
-						memcpy( lblock->gblock->coords, lblock->coords, sizeof(*lblock->coords)*s_siz_ );
+						lblock->gblock->snapshot = lblock->snapshot;
+						// the old coordinates are released with the local block
+						std::swap( lblock->gblock->crd, lblock->crd );
 					}
 					ReturnSolventBlock( tl, lblock );
 				}
@@ -1571,62 +2756,347 @@ void CHBonds :: CalcMicrosets( const uint32 threadNum, const uint32 snapshotNum,
 		}
 	}
 
-	double tupleTime = utils->FloatMilliseconds() - startTime;
-	startTime += tupleTime;
+	return c_microsets;
+}
 
-	// update performance counters
-	UpdatePerformanceCounter( &perfCounters_.pcMicroset, microsetTime );
-	UpdatePerformanceCounter( &perfCounters_.pcTuples, tupleTime );
-	UpdatePerformanceCounter( &perfCounters_.pcTotal, startTime - baseTime );
+//////////////////////////////////////////////////////////////////////////
+// SECOND-ORDER BRIDGES
+//////////////////////////////////////////////////////////////////////////
+// Two biopolymer atoms are also connected through a chain of two solvent
+// molecules h-bonded to each other, each of them bridging one of the 
+// atoms. Both solvent atoms of such a chain belong to microsets, so only
+// these are searched: they are put into a cell list with cells as large 
+// as the h-bond maximum length, and every atom is tested against the 
+// atoms of the 27 neighbouring cells with the usual energy. The cost is
+// proportional to the number of microsets, not to the whole solvent box.
+// Chains are found with the weakest cut-off and keep the energy of their
+// weakest h-bond, so every sweep level takes the chains it allows.
+//////////////////////////////////////////////////////////////////////////
 
-	// end single-threaded block
-	ThreadUnlock();
+static inline uint64 HBCellKey( int32 x, int32 y, int32 z )
+{
+	return ( static_cast<uint64>( x & 0x1FFFFF ) << 42 ) | ( static_cast<uint64>( y & 0x1FFFFF ) << 21 ) | static_cast<uint64>( z & 0x1FFFFF );
 }
 
-void CHBonds :: UpdatePerformanceCounter( HBPerfCounter *pc, real value ) const
+void CHBonds :: FindChains( ThreadLocal *tl, const coord3_t *coords ) const
 {
-	if ( !pc->frames ) {
-		pc->frames = 1;
-		pc->minTime = value;
-		pc->maxTime = value;
-		pc->avgTime = value;
-	} else {
-		++pc->frames;
-		if ( value < pc->minTime ) pc->minTime = value;
-		if ( value > pc->maxTime ) pc->maxTime = value;
-		pc->avgTime += value;
+	const real cutoff = -gpGlobals->hbond_cutoff_energy;
+	const real invCellSize = real( 1.0 ) / gpGlobals->hbond_max_length;
+
+	tl->microsets.resize( 0 );
+	tl->cells.resize( 0 );
+	tl->chainBonds.resize( 0 );
+	tl->chains.resize( 0 );
+
+	// microsets of the frame (bridges are sorted by solvent atom index)
+	const uint32 totalBridges = static_cast<uint32>( tl->bridges.size() );
+	for ( uint32 i = 0; i < totalBridges; ++i ) {
+		if ( !i || tl->bridges[i].s_index != tl->bridges[i-1].s_index ) {
+			HBMicroset m;
+			m.first = i;
+			m.count = 0;
+			tl->microsets.push_back( m );
+		}
+		++tl->microsets.back().count;
+	}
+	if ( tl->microsets.size() < 2 )
+		return;
+
+	// put solvent atoms of the microsets into the cells
+	const uint32 numMicrosets = static_cast<uint32>( tl->microsets.size() );
+	const uint32 numSolvent = static_cast<uint32>( hbSolventList_.size() );
+	for ( uint32 i = 0; i < numMicrosets; ++i ) {
+		const uint32 s_index = tl->bridges[tl->microsets[i].first].s_index;
+		for ( uint32 j = solventRemap_[s_index]; j < numSolvent && hbSolventList_[j].xy_remap == s_index; ++j ) {
+			const coord3_t *crd = &coords[hbSolventList_[j].xy_index];
+			HBCellEntry e;
+			e.cell[0] = static_cast<int32>( floor( crd->x * invCellSize ) );
+			e.cell[1] = static_cast<int32>( floor( crd->y * invCellSize ) );
+			e.cell[2] = static_cast<int32>( floor( crd->z * invCellSize ) );
+			e.key = HBCellKey( e.cell[0], e.cell[1], e.cell[2] );
+			e.microset = i;
+			e.atom = j;
+			tl->cells.push_back( e );
+		}
+	}
+	std::sort( tl->cells.begin(), tl->cells.end(), []( const HBCellEntry &a, const HBCellEntry &b ) { return a.key < b.key; } );
+
+	// solvent-solvent h-bonds between different microsets
+	for ( auto it = tl->cells.cbegin(); it != tl->cells.cend(); ++it ) {
+		const HBAtom *atA = &hbSolventList_[it->atom];
+		for ( int32 dx = -1; dx <= 1; ++dx ) {
+			for ( int32 dy = -1; dy <= 1; ++dy ) {
+				for ( int32 dz = -1; dz <= 1; ++dz ) {
+					const uint64 key = HBCellKey( it->cell[0] + dx, it->cell[1] + dy, it->cell[2] + dz );
+					auto itn = std::lower_bound( tl->cells.cbegin(), tl->cells.cend(), key, []( const HBCellEntry &e, uint64 k ) { return e.key < k; } );
+					for ( ; itn != tl->cells.cend() && itn->key == key; ++itn ) {
+						// every two microsets are tested once
+						if ( itn->microset <= it->microset )
+							continue;
+						const HBAtom *atB = &hbSolventList_[itn->atom];
+						real energy = 0;
+						if ( atA->numH != 0 && atB->y_code != UINT16_BAD )
+							energy = CalcEnergy<HBTERMS_ALL>( atA, atB, kernel_, coords );
+						if ( atB->numH != 0 && atA->y_code != UINT16_BAD )
+							energy = std::min( energy, CalcEnergy<HBTERMS_ALL>( atB, atA, kernel_, coords ) );
+						if ( energy < cutoff ) {
+							HBChainBond b;
+							b.microset0 = it->microset;
+							b.microset1 = itn->microset;
+							b.energy = energy;
+							tl->chainBonds.push_back( b );
+						}
+					}
+				}
+			}
+		}
+	}
+	if ( !tl->chainBonds.size() )
+		return;
+
+	// keep the strongest h-bond between two microsets
+	std::sort( tl->chainBonds.begin(), tl->chainBonds.end(), []( const HBChainBond &a, const HBChainBond &b ) { 
+		return ( a.microset0 != b.microset0 ) ? ( a.microset0 < b.microset0 ) : ( ( a.microset1 != b.microset1 ) ? ( a.microset1 < b.microset1 ) : ( a.energy < b.energy ) ); } );
+	tl->chainBonds.erase( std::unique( tl->chainBonds.begin(), tl->chainBonds.end(), []( const HBChainBond &a, const HBChainBond &b ) { 
+		return a.microset0 == b.microset0 && a.microset1 == b.microset1; } ), tl->chainBonds.end() );
+
+	// join the bridges of both microsets into chains
+	for ( auto it = tl->chainBonds.cbegin(); it != tl->chainBonds.cend(); ++it ) {
+		const HBMicroset *m0 = &tl->microsets[it->microset0];
+		const HBMicroset *m1 = &tl->microsets[it->microset1];
+		for ( uint32 i = m0->first; i < m0->first + m0->count; ++i ) {
+			const HBBridge *b0 = &tl->bridges[i];
+			for ( uint32 j = m1->first; j < m1->first + m1->count; ++j ) {
+				const HBBridge *b1 = &tl->bridges[j];
+				if ( b0->b_index == b1->b_index )
+					continue;
+				HBChain c;
+				c.index0 = std::min( b0->b_index, b1->b_index );
+				c.index1 = std::max( b0->b_index, b1->b_index );
+				c.energy = AverageEnergy( b0->energy, it->energy, b1->energy );
+				c.weakest = std::max( std::max( b0->energy, b1->energy ), it->energy );
+				tl->chains.push_back( c );
+			}
+		}
+	}
+	std::sort( tl->chains.begin(), tl->chains.end(), []( const HBChain &a, const HBChain &b ) { 
+		return ( a.index0 != b.index0 ) ? ( a.index0 < b.index0 ) : ( a.index1 < b.index1 ); } );
+}
+
+size_t CHBonds :: AccumulateChains( ThreadLocal *tl, HBPairScoreMap &chainScoreMap, real cutoff ) const
+{
+	// chains are sorted by the biopolymer atoms, every run is a pair of the frame
+	size_t c_chains = 0;
+	for ( auto it = tl->chains.cbegin(); it != tl->chains.cend(); ) {
+		HBPair value;
+		value.index0 = it->index0;
+		value.index1 = it->index1;
+		uint32 score = 0;
+		real energy = 0;
+		for ( ; it != tl->chains.cend() && it->index0 == value.index0 && it->index1 == value.index1; ++it ) {
+			if ( it->weakest < cutoff ) {
+				++score;
+				energy += it->energy;
+			}
+		}
+		if ( !score )
+			continue;
+		HBGlobalScore empty;
+		memset( &empty, 0, sizeof(empty) );
+		HBGlobalScore &gs = chainScoreMap.insert( std::make_pair( value, empty ) ).first->second;
+		gs.score += score;
+		gs.energy += energy;
+		++gs.snaps;
+		++c_chains;
 	}
+	return c_chains;
+}
+
+void CHBonds :: PhaseCompleted( ThreadLocal *tl, uint32 phase, double &phaseTime ) const
+{
+	// the thread's own histogram, no locking
+	const double currentTime = utils->FloatMilliseconds();
+	tl->phases[phase].Add( currentTime - phaseTime );
+	phaseTime = currentTime;
 }
 
-void CHBonds :: FinalizePerformanceCounters()
+void CHBonds :: FrameTimed( ThreadLocal *tl, double baseTime ) const
 {
-	// calculate average values
-	if ( perfCounters_.pcMicroset.frames )
-		perfCounters_.pcMicroset.avgTime /= perfCounters_.pcMicroset.frames;
-	if ( perfCounters_.pcTuples.frames )
-		perfCounters_.pcTuples.avgTime /= perfCounters_.pcTuples.frames;
-	if ( perfCounters_.pcTotal.frames )
-		perfCounters_.pcTotal.avgTime /= perfCounters_.pcTotal.frames;
+	const double currentTime = utils->FloatMilliseconds();
+	tl->phases[HBPHASE_TOTAL].Add( currentTime - baseTime );
+	tl->busyTime += currentTime - baseTime;
+	tl->lastTime = currentTime;
 }
 
 void CHBonds :: PrintPerformanceCounters()
 {
-	// print results
-	logfile->Print( "\n------------ PERFORMANCE TIMING (ms) ------------\n"
-					"%20s  %8s %8s %8s\n", "", "avg", "min", "max" );
-	logfile->Print( "%20s: %8.1f %8.1f %8.1f\n", "Building microsets", 
-		perfCounters_.pcMicroset.avgTime,
-		perfCounters_.pcMicroset.minTime,
-		perfCounters_.pcMicroset.maxTime );
-	logfile->Print( "%20s: %8.1f %8.1f %8.1f\n", "Find pairs/triplets", 
-		perfCounters_.pcTuples.avgTime,
-		perfCounters_.pcTuples.minTime,
-		perfCounters_.pcTuples.maxTime );
-	logfile->Print( "%20s: %8.1f %8.1f %8.1f\n", "Total microset proc", 
-		perfCounters_.pcTotal.avgTime,
-		perfCounters_.pcTotal.minTime,
-		perfCounters_.pcTotal.maxTime );
+	// merge the phase timings of the threads
+	std::vector<CLatencyHistogram> phases( HBPHASE_COUNT );
+	double firstTime = 0, lastTime = 0;
+	uint64 atomPairs = 0;
+	bool anyFrames = false;
+	for ( uint32 i = 0; i < numThreads_; ++i ) {
+		const ThreadLocal *tl = &tl_[i];
+		if ( !tl->frames )
+			continue;
+		for ( uint32 j = 0; j < HBPHASE_COUNT; ++j )
+			phases[j].Merge( tl->phases[j] );
+		if ( !anyFrames || tl->firstTime < firstTime ) firstTime = tl->firstTime;
+		if ( !anyFrames || tl->lastTime > lastTime ) lastTime = tl->lastTime;
+		atomPairs += tl->atomPairs;
+		anyFrames = true;
+	}
+
+	// print percentiles of every phase and the throughput
+	if ( anyFrames ) {
+		logfile->Print( "\n--------------------- PERFORMANCE TIMING (ms) ---------------------\n"
+						"%20s  %8s %8s %8s %8s %8s\n", "", "frames", "p50", "p90", "p99", "max" );
+		for ( uint32 i = 0; i < HBPHASE_COUNT; ++i ) {
+			const CLatencyHistogram &phase = phases[i];
+			if ( !phase.Count() )
+				continue;
+			logfile->Print( "%20s: %8llu %8.3f %8.3f %8.3f %8.3f\n", hbPhaseNames[i], static_cast<unsigned long long>( phase.Count() ), 
+				phase.Percentile( 50 ), phase.Percentile( 90 ), phase.Percentile( 99 ), phase.Max() );
+		}
+		const double wallSeconds = ( lastTime - firstTime ) * 0.001;
+		if ( wallSeconds > 0 ) {
+			logfile->Print( "%20s: %8.1f\n", "Frames/s", phases[HBPHASE_TOTAL].Count() / wallSeconds );
+			logfile->Print( "%20s: %8.3e\n", "Atom pairs/s", atomPairs / wallSeconds );
+		}
+		logfile->Print( "-------------------------------------------------------------------\n" );
+	}
+
+	// print thread load balance
+	uint32 minFrames = UINT32_BAD, maxFrames = 0, totalFrames = 0;
+	double minBusy = 0, maxBusy = 0, totalBusy = 0;
+	uint32 numOwners = 0;
+	for ( uint32 i = 0; i < numThreads_; ++i ) {
+		const ThreadLocal *tl = &tl_[i];
+		if ( !tl->frames )
+			continue;
+		if ( !numOwners || tl->busyTime < minBusy ) minBusy = tl->busyTime;
+		if ( !numOwners || tl->busyTime > maxBusy ) maxBusy = tl->busyTime;
+		minFrames = std::min( minFrames, tl->frames );
+		maxFrames = std::max( maxFrames, tl->frames );
+		totalFrames += tl->frames;
+		totalBusy += tl->busyTime;
+		++numOwners;
+	}
+	if ( numOwners ) {
+		logfile->Print( "\n--------------- THREAD LOAD ---------------------\n"
+						"%20s  %8s %8s %8s\n", "", "avg", "min", "max" );
+		logfile->Print( "%20s: %8.1f %8u %8u\n", "Frames per thread", 
+			static_cast<double>( totalFrames ) / numOwners, minFrames, maxFrames );
+		logfile->Print( "%20s: %8.1f %8.1f %8.1f\n", "Busy time (ms)", 
+			totalBusy / numOwners, minBusy, maxBusy );
+		logfile->Print( "%20s: %8u of %u\n", "Frame owners", numOwners, numThreads_ );
+		logfile->Print( "-------------------------------------------------\n" );
+	}
+
+	// print large microsets
+	if ( microsetStats_.large || microsetStats_.capped ) {
+		logfile->Print( "\n--------------- LARGE MICROSETS -----------------\n" );
+		logfile->Print( "%20s: %8llu\n", "Microsets", static_cast<unsigned long long>( microsetStats_.large ) );
+		logfile->Print( "%20s: %8llu\n", "Triplets", static_cast<unsigned long long>( microsetStats_.triplets ) );
+		logfile->Print( "%20s: %8u bridges\n", "Largest", microsetStats_.maxBridges );
+		if ( microsetCap_ ) {
+			logfile->Print( "%20s: %8llu of %u bridges\n", "Capped microsets", static_cast<unsigned long long>( microsetStats_.capped ), static_cast<uint32>( microsetCap_ ) );
+			logfile->Print( "%20s: %8llu\n", "Dropped bridges", static_cast<unsigned long long>( microsetStats_.dropped ) );
+		}
+		logfile->Print( "-------------------------------------------------\n" );
+	}
+
+	// print solvent block memory
+	CBlockArena::Stats arenaStats, coordsStats;
+	solventArena_.GetStats( arenaStats );
+	coordsArena_.GetStats( coordsStats );
+	if ( arenaStats.blockSize && coordsStats.blockSize ) {
+		logfile->Print( "\n--------------- SOLVENT BLOCKS ------------------\n" );
+		logfile->Print( "%20s: %8u bytes\n", "Block size", static_cast<uint32>( arenaStats.blockSize ) );
+		logfile->Print( "%20s: %8.1f kb (%u blocks)\n", "Live", arenaStats.liveBytes / 1024.0, static_cast<uint32>( arenaStats.liveBytes / arenaStats.blockSize ) );
+		logfile->Print( "%20s: %8.1f kb (%u blocks)\n", "Peak", arenaStats.peakBytes / 1024.0, static_cast<uint32>( arenaStats.peakBytes / arenaStats.blockSize ) );
+		logfile->Print( "%20s: %8.1f kb (%u slabs)\n", "Reserved", arenaStats.reservedBytes / 1024.0, arenaStats.numSlabs );
+		logfile->Print( "%20s: %8u spills, %u refills\n", "Shared free list", arenaStats.spills, arenaStats.refills );
+		logfile->Print( "%20s: %8u\n", "Compactions", arenaStats.compactions );
+		logfile->Print( "%20s: %8u bytes\n", "Coordinate set size", static_cast<uint32>( coordsStats.blockSize ) );
+		logfile->Print( "%20s: %8.1f kb (%u sets)\n", "Live coordinates", coordsStats.liveBytes / 1024.0, static_cast<uint32>( coordsStats.liveBytes / coordsStats.blockSize ) );
+		logfile->Print( "%20s: %8.1f kb (%u sets)\n", "Peak coordinates", coordsStats.peakBytes / 1024.0, static_cast<uint32>( coordsStats.peakBytes / coordsStats.blockSize ) );
+		logfile->Print( "%20s: %8.1f kb (%u slabs)\n", "Reserved coordinates", coordsStats.reservedBytes / 1024.0, coordsStats.numSlabs );
+		logfile->Print( "%20s: %8llu (for %llu block references)\n", "Captured sets", 
+			static_cast<unsigned long long>( coordsCaptured_ ), static_cast<unsigned long long>( coordsShared_ ) );
+		logfile->Print( "-------------------------------------------------\n" );
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////
+// PRECISION REPORT
+//////////////////////////////////////////////////////////////////////////
+// With -fpr every frame is searched both in single and double precision.
+// The bridges of both are compared frame by frame, and the double ones 
+// are accumulated into separate maps, so the final tuples (those above 
+// the occurence cut-off) can be compared too: tuples that make it to the 
+// output in one precision only, and the largest differences in occurence
+// and average energy of the tuples found in both.
+//////////////////////////////////////////////////////////////////////////
+template<typename M> static void HBCompareTuples( const M &single, const M &reference, uint32 snapCutoff, real invTotalFrames, 
+												  size_t &both, size_t &onlySingle, size_t &onlyDouble, real &maxOccurence, real &maxEnergy )
+{
+	both = onlySingle = onlyDouble = 0;
+	maxOccurence = maxEnergy = 0;
+	for ( auto it = single.cbegin(); it != single.cend(); ++it ) {
+		auto itr = reference.find( it->first );
+		const bool finalSingle = ( it->second.snaps >= snapCutoff );
+		const bool finalDouble = ( itr != reference.cend() && itr->second.snaps >= snapCutoff );
+		if ( finalSingle && !finalDouble ) ++onlySingle;
+		if ( finalSingle && finalDouble ) ++both;
+		if ( itr == reference.cend() || ( !finalSingle && !finalDouble ) )
+			continue;
+		const real occSingle = it->second.snaps * invTotalFrames;
+		const real occDouble = itr->second.snaps * invTotalFrames;
+		maxOccurence = std::max( maxOccurence, static_cast<real>( fabs( occSingle - occDouble ) ) );
+		const real eSingle = it->second.energy / it->second.score;
+		const real eDouble = itr->second.energy / itr->second.score;
+		maxEnergy = std::max( maxEnergy, static_cast<real>( fabs( eSingle - eDouble ) ) );
+	}
+	for ( auto itr = reference.cbegin(); itr != reference.cend(); ++itr ) {
+		if ( itr->second.snaps < snapCutoff )
+			continue;
+		auto it = single.find( itr->first );
+		if ( it == single.cend() || it->second.snaps < snapCutoff )
+			++onlyDouble;
+	}
+}
+
+void CHBonds :: PrintPrecisionReport( uint32 totalFrames ) const
+{
+	if ( !precisionReport_ || !totalFrames )
+		return;
+
+	const uint32 snapCutoff = static_cast<uint32>( ceil( totalFrames * gpGlobals->occurence_cutoff ) );
+	const real invTotalFrames = real( 100 ) / totalFrames;
+	size_t pairsBoth, pairsSingle, pairsDouble, tripletsBoth, tripletsSingle, tripletsDouble;
+	real pairsOccurence, pairsEnergy, tripletsOccurence, tripletsEnergy;
+	HBCompareTuples( hbPairScoreMap_, refPairScoreMap_, snapCutoff, invTotalFrames, pairsBoth, pairsSingle, pairsDouble, pairsOccurence, pairsEnergy );
+	HBCompareTuples( hbTripletScoreMap_, refTripletScoreMap_, snapCutoff, invTotalFrames, tripletsBoth, tripletsSingle, tripletsDouble, tripletsOccurence, tripletsEnergy );
+
+	logfile->Print( "\n------------ PRECISION (float32 vs double) ------\n"
+					"%20s: %8u\n", "Frames compared", precisionStats_.frames );
+	logfile->Print( "%20s  %8s %8s %8s\n", "", "both", "float", "double" );
+	logfile->Print( "%20s: %8u %8u %8u\n", "Bridges", 
+		static_cast<uint32>( precisionStats_.common ), static_cast<uint32>( precisionStats_.onlySingle ), static_cast<uint32>( precisionStats_.onlyDouble ) );
+	logfile->Print( "%20s: %8u %8u %8u\n", "Final pairs", 
+		static_cast<uint32>( pairsBoth ), static_cast<uint32>( pairsSingle ), static_cast<uint32>( pairsDouble ) );
+	logfile->Print( "%20s: %8u %8u %8u\n", "Final triplets", 
+		static_cast<uint32>( tripletsBoth ), static_cast<uint32>( tripletsSingle ), static_cast<uint32>( tripletsDouble ) );
+	logfile->Print( "%20s: %12.3e kcal/mol (relative %.3e)\n", "Max bridge dE", precisionStats_.maxDelta, precisionStats_.maxRelDelta );
+	logfile->Print( "%20s: %12.3e %%, %12.3e kcal/mol\n", "Max pair dP, dE", pairsOccurence, pairsEnergy );
+	logfile->Print( "%20s: %12.3e %%, %12.3e kcal/mol\n", "Max triplet dP, dE", tripletsOccurence, tripletsEnergy );
 	logfile->Print( "-------------------------------------------------\n" );
+
+	console->Print( "Precision: %u/%u pair(s) and %u/%u triplet(s) differ from double precision (float only/double only)\n",
+		static_cast<uint32>( pairsSingle ), static_cast<uint32>( pairsDouble ), static_cast<uint32>( tripletsSingle ), static_cast<uint32>( tripletsDouble ) );
+	console->Print( "Precision: max occurence difference %.3g%%, max energy difference %.3g kcal/mol\n",
+		std::max( pairsOccurence, tripletsOccurence ), std::max( pairsEnergy, tripletsEnergy ) );
 }
 
 void CHBonds :: GetOutputAtomTitle( const atom_t *at, const uint32 index, char *outBuffer, size_t outBufferSize ) const
@@ -1661,6 +3131,7 @@ void CHBonds :: AddFinalSolventBlocks( HBSolventMap &finalSolventMap, atom_t *at
 	assert( bestblock != nullptr );
 	if ( !bestblock )
 		return;
+	assert( bestblock->crd != nullptr );
 
 	// find this solvent block in final map
 	const uint32 resnum = atoms[bestblock->s_index].resnum;
@@ -1671,7 +3142,7 @@ void CHBonds :: AddFinalSolventBlocks( HBSolventMap &finalSolventMap, atom_t *at
 		// check if we should replace it because of better energy
 		HBFinalSolvent *solv = existing->second;
 		if ( bestenergy < solv->energy ) {
-			memcpy( solv->coords, bestblock->coords, sizeof(coord4_t) * s_siz_ );
+			memcpy( solv->coords, bestblock->crd->coords, sizeof(coord4_t) * s_siz_ );
 			solv->snaps = bestblock->snaps;
 			solv->energy = bestenergy;
 		}
@@ -1679,7 +3150,7 @@ void CHBonds :: AddFinalSolventBlocks( HBSolventMap &finalSolventMap, atom_t *at
 		// solvent doesn't exist
 		// add new solvent record
 		HBFinalSolvent *solv = reinterpret_cast<HBFinalSolvent*>( utils->Alloc( blockSize ) );
-		memcpy( solv->coords, bestblock->coords, sizeof(coord4_t) * s_siz_ );
+		memcpy( solv->coords, bestblock->crd->coords, sizeof(coord4_t) * s_siz_ );
 		solv->snaps = bestblock->snaps;
 		solv->atindex = bestblock->s_index;
 		solv->energy = bestenergy;
@@ -1788,8 +3259,6 @@ void CHBonds :: BuildFinalSolvent( uint32 totalFrames )
 
 	for ( auto it = finalSolventMap.begin(); it != finalSolventMap.end(); ++it )
 		utils->Free( it->second );
-
-	FinalizePerformanceCounters();
 }
 
 bool CHBonds :: PrintFinalTuples( uint32 totalFrames, const char *tupleFile ) const
@@ -1832,6 +3301,9 @@ bool CHBonds :: PrintFinalTuples( uint32 totalFrames, const char *tupleFile ) co
 		p.score = it->second.score;
 		p.occurence = it->second.snaps * invTotalFrames;
 		p.energy = it->second.energy / it->second.score;
+		p.occ = it->second.occ;
+		p.blocks = it->second.blocks;
+		p.replicas = it->second.replicas;
 		finalPairs.push_back( p );
 #if 0
 		char localTitle[3][256], localName[64];
@@ -1847,7 +3319,7 @@ bool CHBonds :: PrintFinalTuples( uint32 totalFrames, const char *tupleFile ) co
 			logfile->Print( "SOLVENT: %6u %6u %16.8f   snaps: %6u @", 
 				block->s_index, atoms[block->s_index].resnum, block->energy, block->snaps );
 			for ( size_t i = 0; i < s_siz_; ++i )
-				logfile->Print( " (%6.1f, %6.1f, %6.1f)", block->coords[i].x, block->coords[i].y, block->coords[i].z );
+				logfile->Print( " (%6.1f, %6.1f, %6.1f)", block->crd->coords[i].x, block->crd->coords[i].y, block->crd->coords[i].z );
 			logfile->Print( "\n" );
 		}
 #endif
@@ -1870,6 +3342,9 @@ bool CHBonds :: PrintFinalTuples( uint32 totalFrames, const char *tupleFile ) co
 		p.score = it->second.score;
 		p.occurence = it->second.snaps * invTotalFrames;
 		p.energy = it->second.energy / it->second.score;
+		p.occ = it->second.occ;
+		p.blocks = it->second.blocks;
+		p.replicas = it->second.replicas;
 		finalTriplets.push_back( p );
 #if 0
 		const atom_t *at0 = &atoms[p.index0];
@@ -1891,15 +3366,76 @@ bool CHBonds :: PrintFinalTuples( uint32 totalFrames, const char *tupleFile ) co
 			logfile->Print( "SOLVENT: %6u %6u %16.8f   snaps: %6u @", 
 			block->s_index, atoms[block->s_index].resnum, block->energy, block->snaps );
 			for ( size_t i = 0; i < s_siz_; ++i )
-				logfile->Print( " (%6.1f, %6.1f, %6.1f)", block->coords[i].x, block->coords[i].y, block->coords[i].z );
+				logfile->Print( " (%6.1f, %6.1f, %6.1f)", block->crd->coords[i].x, block->crd->coords[i].y, block->crd->coords[i].z );
 			logfile->Print( "\n" );
 		}
 #endif
 	}
 
+	// second-order bridges have no occupancy, block or replica statistics
+	HBFinalPairVec finalChains;
+	if ( waterChains_ ) {
+		finalChains.reserve( hbChainScoreMap_.size() );
+		for ( auto it = hbChainScoreMap_.cbegin(); it != hbChainScoreMap_.cend(); ++it ) {
+			assert( it->second.score > 0 );
+			if ( it->second.snaps < snap_cutoff )
+				continue;
+			HBFinalPair p;
+			p.index0 = it->first.index0;
+			p.index1 = it->first.index1;
+			p.score = it->second.score;
+			p.occurence = it->second.snaps * invTotalFrames;
+			p.energy = it->second.energy / it->second.score;
+			p.occ = nullptr;
+			p.blocks = nullptr;
+			p.replicas = nullptr;
+			finalChains.push_back( p );
+		}
+	}
+
 	// sort if necessary
 	if ( finalPairs.size() > 1 )	std::sort( finalPairs.begin(), finalPairs.end() );
 	if ( finalTriplets.size() > 1 )	std::sort( finalTriplets.begin(), finalTriplets.end() );
+	if ( finalChains.size() > 1 )	std::sort( finalChains.begin(), finalChains.end() );
+
+	// occupancy correlations are limited by the last snapshot (of every replica)
+	std::vector<uint32> lastIndices( 1, 0 );
+	if ( occupancyStride_ ) {
+		for ( auto it = doneFrames_.cbegin(); it != doneFrames_.cend(); ++it ) {
+			const uint32 replica = trackReplicas_ ? TRAJ_REPLICA( *it ) : 0;
+			if ( lastIndices.size() <= replica )
+				lastIndices.resize( replica + 1, 0 );
+			lastIndices[replica] = std::max( lastIndices[replica], GetReplicaFrame( *it ) / occupancyStride_ );
+		}
+		size_t memoryUsage = 0;
+		for ( auto it = occupancies_.cbegin(); it != occupancies_.cend(); ++it )
+			memoryUsage += it->MemoryUsage();
+		logfile->Print( "Occupancy: %u sets, %.1f kb\n", static_cast<uint32>( occupancies_.size() ), memoryUsage / 1024.0 );
+	}
+
+	// number of snapshots in every block
+	HBBlockCounts blockFrames;
+	if ( blockLength_ ) {
+		for ( auto it = doneFrames_.cbegin(); it != doneFrames_.cend(); ++it ) {
+			const uint32 block = GetReplicaFrame( *it ) / blockLength_;
+			if ( blockFrames.size() <= block )
+				blockFrames.resize( block + 1, 0 );
+			++blockFrames[block];
+		}
+		logfile->Print( "Blocks: %u blocks of %u snapshots\n", static_cast<uint32>( blockFrames.size() ), blockLength_ );
+	}
+
+	// number of snapshots in every replica
+	HBBlockCounts replicaFrames;
+	if ( trackReplicas_ ) {
+		for ( auto it = doneFrames_.cbegin(); it != doneFrames_.cend(); ++it ) {
+			const uint32 replica = TRAJ_REPLICA( *it );
+			if ( replicaFrames.size() <= replica )
+				replicaFrames.resize( replica + 1, 0 );
+			++replicaFrames[replica];
+		}
+		logfile->Print( "Replicas: %u replicas\n", static_cast<uint32>( replicaFrames.size() ) );
+	}
 
 	// write output
 	console->Print( "Writing: \"%s\"...\n", tupleFile );
@@ -1933,10 +3469,14 @@ bool CHBonds :: PrintFinalTuples( uint32 totalFrames, const char *tupleFile ) co
 		fprintf_s( fp, "%s\n", "----------------------------------------------------------------------------------------------------" );
 		fprintf_s( fp, "                                         %8u PAIRS                                            \n", (uint32)finalPairs.size() );
 		fprintf_s( fp, "%s\n", "----------------------------------------------------------------------------------------------------" );
-		fprintf_s( fp, "%5s\t%-20s\t%5s\t%-20s\t%6s\t%6s\t%20s\n",
+		fprintf_s( fp, "%5s\t%-20s\t%5s\t%-20s\t%6s\t%6s\t%20s",
 						"s/n 1", "atom 1",
 						"s/n 2", "atom 2",
 						"score", "occur", "energy, kcal/mol" );
+		PrintOccupancyHeader( fp );
+		PrintBlockHeader( fp, blockFrames );
+		PrintReplicaHeader( fp, replicaFrames );
+		fputc( '\n', fp );
 		fprintf_s( fp, "%s\n", "----------------------------------------------------------------------------------------------------" );
 
 		for ( auto it = finalPairs.cbegin(); it != finalPairs.cend(); ++it ) {
@@ -1946,10 +3486,14 @@ bool CHBonds :: PrintFinalTuples( uint32 totalFrames, const char *tupleFile ) co
 			sprintf_s( localTitle[0], sizeof(localTitle[0]), "%s-%u %s", at0->residue.string, at0->resnum, localName );
 			GetOutputAtomTitle( at1, it->index1, localName, sizeof(localName) );
 			sprintf_s( localTitle[1], sizeof(localTitle[1]), "%s-%u %s", at1->residue.string, at1->resnum, localName );
-			fprintf_s( fp, "%5u\t%-20s\t%5u\t%-20s\t%6u\t%5.1f%%\t%20.6f\n",
+			fprintf_s( fp, "%5u\t%-20s\t%5u\t%-20s\t%6u\t%5.1f%%\t%20.6f",
 				at0->serial, localTitle[0],
 				at1->serial, localTitle[1],
 				it->score, it->occurence, it->energy );
+			PrintOccupancyStats( fp, it->occ, lastIndices );
+			PrintBlockStats( fp, it->blocks, blockFrames );
+			PrintReplicaStats( fp, it->replicas, replicaFrames );
+			fputc( '\n', fp );
 		}
 		fprintf_s( fp, "%s\n\n", "----------------------------------------------------------------------------------------------------" );
 	}
@@ -1957,11 +3501,15 @@ bool CHBonds :: PrintFinalTuples( uint32 totalFrames, const char *tupleFile ) co
 		fprintf_s( fp, "%s\n", "------------------------------------------------------------------------------------------------------------------------------------" );
 		fprintf_s( fp, "                                                 %8u TRIPLETS                                                                 \n", (uint32)finalTriplets.size() );
 		fprintf_s( fp, "%s\n", "------------------------------------------------------------------------------------------------------------------------------------" );
-		fprintf_s( fp, "%5s\t%-20s\t%5s\t%-20s\t%5s\t%-20s\t%6s\t%6s\t%20s\n",
+		fprintf_s( fp, "%5s\t%-20s\t%5s\t%-20s\t%5s\t%-20s\t%6s\t%6s\t%20s",
 						"s/n 1", "atom 1",
 						"s/n 2", "atom 2",
 						"s/n 3", "atom 3",
 						"score", "occur", "energy, kcal/mol" );
+		PrintOccupancyHeader( fp );
+		PrintBlockHeader( fp, blockFrames );
+		PrintReplicaHeader( fp, replicaFrames );
+		fputc( '\n', fp );
 		fprintf_s( fp, "%s\n", "------------------------------------------------------------------------------------------------------------------------------------" );
 
 		for ( auto it = finalTriplets.cbegin(); it != finalTriplets.cend(); ++it ) {
@@ -1974,15 +3522,43 @@ bool CHBonds :: PrintFinalTuples( uint32 totalFrames, const char *tupleFile ) co
 			sprintf_s( localTitle[1], sizeof(localTitle[1]), "%s-%u %s", at1->residue.string, at1->resnum, localName );
 			GetOutputAtomTitle( at2, it->index2, localName, sizeof(localName) );
 			sprintf_s( localTitle[2], sizeof(localTitle[2]), "%s-%u %s", at2->residue.string, at2->resnum, localName );
-			fprintf_s( fp, "%5u\t%-20s\t%5u\t%-20s\t%5u\t%-20s\t%6u\t%5.1f%%\t%20.6f\n",
+			fprintf_s( fp, "%5u\t%-20s\t%5u\t%-20s\t%5u\t%-20s\t%6u\t%5.1f%%\t%20.6f",
 				at0->serial, localTitle[0],
 				at1->serial, localTitle[1],
 				at2->serial, localTitle[2],
 				it->score, it->occurence, it->energy );
+			PrintOccupancyStats( fp, it->occ, lastIndices );
+			PrintBlockStats( fp, it->blocks, blockFrames );
+			PrintReplicaStats( fp, it->replicas, replicaFrames );
+			fputc( '\n', fp );
 		}
 
 		fprintf_s( fp, "%s\n\n", "------------------------------------------------------------------------------------------------------------------------------------" );
 	}
+	if ( finalChains.size() > 0 ) {
+		fprintf_s( fp, "%s\n", "----------------------------------------------------------------------------------------------------" );
+		fprintf_s( fp, "                                   %8u SECOND-ORDER PAIRS                                       \n", (uint32)finalChains.size() );
+		fprintf_s( fp, "%s\n", "----------------------------------------------------------------------------------------------------" );
+		fprintf_s( fp, "%5s\t%-20s\t%5s\t%-20s\t%6s\t%6s\t%20s\n",
+						"s/n 1", "atom 1",
+						"s/n 2", "atom 2",
+						"score", "occur", "energy, kcal/mol" );
+		fprintf_s( fp, "%s\n", "----------------------------------------------------------------------------------------------------" );
+
+		for ( auto it = finalChains.cbegin(); it != finalChains.cend(); ++it ) {
+			const atom_t *at0 = &atoms[it->index0];
+			const atom_t *at1 = &atoms[it->index1];
+			GetOutputAtomTitle( at0, it->index0, localName, sizeof(localName) );
+			sprintf_s( localTitle[0], sizeof(localTitle[0]), "%s-%u %s", at0->residue.string, at0->resnum, localName );
+			GetOutputAtomTitle( at1, it->index1, localName, sizeof(localName) );
+			sprintf_s( localTitle[1], sizeof(localTitle[1]), "%s-%u %s", at1->residue.string, at1->resnum, localName );
+			fprintf_s( fp, "%5u\t%-20s\t%5u\t%-20s\t%6u\t%5.1f%%\t%20.6f\n",
+				at0->serial, localTitle[0],
+				at1->serial, localTitle[1],
+				it->score, it->occurence, it->energy );
+		}
+		fprintf_s( fp, "%s\n\n", "----------------------------------------------------------------------------------------------------" );
+	}
 
 	if ( total_pairs == 0 )
 		fprintf_s( fp, "%s\n", "No pairs or triplets found!" );
@@ -1990,3 +3566,1358 @@ bool CHBonds :: PrintFinalTuples( uint32 totalFrames, const char *tupleFile ) co
 	fclose( fp );
 	return true;
 }
+
+//////////////////////////////////////////////////////////////////////////
+// OCCUPANCY
+//////////////////////////////////////////////////////////////////////////
+// Optionally every pair/triplet keeps a compressed set of the snapshots
+// it was seen in (see COccupancy). Snapshots are stored in units of the 
+// snapshot stride, so consecutive processed snapshots are consecutive 
+// indices; replicas keep their index in the high bits, so runs never
+// cross from one replica to another. The set tells a continuously bound
+// solvent from a flickering one with the same occurence: mean residence
+// time and the longest run are taken from the runs of the set, and the
+// intermittent autocorrelation C(t) = <h(0)h(t)>/<h> is computed from
+// overlaps of the runs with themselves shifted by t.
+//////////////////////////////////////////////////////////////////////////
+
+void CHBonds :: AddOccupancy( COccupancy *&occ, uint32 snapshotNum )
+{
+	// called inside the single-threaded block
+	if ( !occupancyStride_ )
+		return;
+	if ( !occ ) {
+		occupancies_.push_back( COccupancy() );
+		occ = &occupancies_.back();
+	}
+	if ( trackReplicas_ )
+		occ->Add( TRAJ_SNAPSHOT( TRAJ_REPLICA( snapshotNum ), TRAJ_FRAME( snapshotNum ) / occupancyStride_ ) );
+	else
+		occ->Add( snapshotNum / occupancyStride_ );
+}
+
+void CHBonds :: GetOccupancyStats( const COccupancy *occ, const std::vector<uint32> &lastIndices, HBOccupancyStats &stats ) const
+{
+	memset( &stats, 0, sizeof(stats) );
+	if ( !occ )
+		return;
+
+	std::vector<COccupancy::Run> runs;
+	occ->GetRuns( runs );
+	if ( !runs.size() )
+		return;
+
+	uint64 total = 0;
+	for ( auto it = runs.cbegin(); it != runs.cend(); ++it ) {
+		total += it->count;
+		stats.longest = std::max( stats.longest, it->count );
+	}
+	stats.residence = static_cast<real>( total ) / runs.size();
+
+	for ( uint32 i = 0; i < HBOCC_NUM_LAGS; ++i ) {
+		const int64 lag = hbOccupancyLags[i];
+		// count snapshots present both at t and t+lag, and the ones 
+		// that have t+lag inside the trajectory
+		uint64 both = 0, base = 0;
+		auto it1 = runs.cbegin(), it2 = runs.cbegin();
+		while ( it1 != runs.cend() && it2 != runs.cend() ) {
+			const int64 first1 = it1->first, end1 = first1 + it1->count;
+			const int64 first2 = it2->first - lag, end2 = first2 + it2->count;
+			const int64 overlap = std::min( end1, end2 ) - std::max( first1, first2 );
+			if ( overlap > 0 )
+				both += overlap;
+			if ( end1 < end2 ) ++it1; else ++it2;
+		}
+		for ( auto it = runs.cbegin(); it != runs.cend(); ++it ) {
+			const uint32 replica = trackReplicas_ ? TRAJ_REPLICA( it->first ) : 0;
+			const int64 lastIndex = ( replica < lastIndices.size() ) ? TRAJ_SNAPSHOT( replica, lastIndices[replica] ) : 0;
+			const int64 overlap = std::min( static_cast<int64>( it->first ) + it->count, lastIndex - lag + 1 ) - it->first;
+			if ( overlap > 0 )
+				base += overlap;
+		}
+		stats.acf[i] = base ? static_cast<real>( both ) / base : real( 0 );
+	}
+}
+
+void CHBonds :: PrintOccupancyHeader( FILE *fp ) const
+{
+	// append occupancy column titles to the tuple table header
+	if ( occupancyStride_ )
+		fprintf_s( fp, "\t%8s\t%8s\t%6s\t%6s\t%6s", "resid", "maxrun", "acf1", "acf10", "acf100" );
+}
+
+void CHBonds :: PrintOccupancyStats( FILE *fp, const COccupancy *occ, const std::vector<uint32> &lastIndices ) const
+{
+	// append occupancy columns to the tuple line
+	if ( occupancyStride_ ) {
+		HBOccupancyStats stats;
+		GetOccupancyStats( occ, lastIndices, stats );
+		fprintf_s( fp, "\t%8.1f\t%8u", stats.residence, stats.longest );
+		for ( uint32 i = 0; i < HBOCC_NUM_LAGS; ++i )
+			fprintf_s( fp, "\t%6.3f", stats.acf[i] );
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////
+// BLOCK AVERAGING
+//////////////////////////////////////////////////////////////////////////
+// For convergence checks the trajectory is split into blocks of a fixed
+// number of snapshots (counted from snapshot 0 of every replica), and
+// every pair/triplet counts its snapshots per block. The tuple tables 
+// then show occurence in every block, the block-averaged occurence with
+// its standard error, and the drift: least-squares change of the 
+// occurence from the first block to the last one. Blocks without 
+// processed snapshots are skipped.
+//////////////////////////////////////////////////////////////////////////
+
+void CHBonds :: AddBlockCount( HBBlockCounts *&blocks, uint32 snapshotNum )
+{
+	// called inside the single-threaded block
+	if ( !blockLength_ )
+		return;
+	if ( !blocks ) {
+		blockCounts_.push_back( HBBlockCounts() );
+		blocks = &blockCounts_.back();
+	}
+	const uint32 block = GetReplicaFrame( snapshotNum ) / blockLength_;
+	if ( blocks->size() <= block )
+		blocks->resize( block + 1, 0 );
+	++(*blocks)[block];
+}
+
+void CHBonds :: PrintBlockHeader( FILE *fp, const HBBlockCounts &blockFrames ) const
+{
+	// append block column titles to the tuple table header
+	if ( !blockLength_ )
+		return;
+	fprintf_s( fp, "\t%6s\t%6s\t%6s", "blkavg", "blkerr", "drift" );
+	for ( size_t i = 0; i < blockFrames.size(); ++i ) {
+		if ( !blockFrames[i] )
+			continue;
+		char title[16];
+		sprintf_s( title, sizeof(title), "b%u", static_cast<uint32>( i + 1 ) );
+		fprintf_s( fp, "\t%6s", title );
+	}
+}
+
+void CHBonds :: PrintBlockStats( FILE *fp, const HBBlockCounts *blocks, const HBBlockCounts &blockFrames ) const
+{
+	// append block columns to the tuple line
+	if ( !blockLength_ )
+		return;
+
+	std::vector<real> values;
+	values.reserve( blockFrames.size() );
+	for ( size_t i = 0; i < blockFrames.size(); ++i ) {
+		if ( !blockFrames[i] )
+			continue;
+		const uint32 count = ( blocks && i < blocks->size() ) ? (*blocks)[i] : 0;
+		values.push_back( real( 100 ) * count / blockFrames[i] );
+	}
+
+	const size_t n = values.size();
+	real mean = 0, error = 0, drift = 0;
+	if ( n ) {
+		real sumX = 0, sumY = 0, sumXX = 0, sumXY = 0, sumYY = 0;
+		for ( size_t i = 0; i < n; ++i ) {
+			const real x = static_cast<real>( i );
+			sumX += x;
+			sumY += values[i];
+			sumXX += x * x;
+			sumXY += x * values[i];
+			sumYY += values[i] * values[i];
+		}
+		mean = sumY / n;
+		if ( n > 1 ) {
+			const real variance = std::max( ( sumYY - n * mean * mean ) / ( n - 1 ), real( 0 ) );
+			error = sqrt( variance / n );
+			drift = ( n * sumXY - sumX * sumY ) / ( n * sumXX - sumX * sumX ) * ( n - 1 );
+		}
+	}
+
+	fprintf_s( fp, "\t%5.1f%%\t%5.1f%%\t%+5.1f%%", mean, error, drift );
+	for ( auto it = values.cbegin(); it != values.cend(); ++it )
+		fprintf_s( fp, "\t%5.1f%%", *it );
+}
+
+//////////////////////////////////////////////////////////////////////////
+// REPLICAS
+//////////////////////////////////////////////////////////////////////////
+// Trajectories of a list are processed together as replicas of the same
+// system, and snapshot numbers carry the replica index (TRAJ_SNAPSHOT).
+// Tuple tables show the occurence over all replicas, and with replicas 
+// tracked every pair/triplet also counts its snapshots per replica, so 
+// the tables get the occurence in each of them: a tuple found in one 
+// replica only is a feature of that run rather than of the system.
+//////////////////////////////////////////////////////////////////////////
+
+uint32 CHBonds :: GetReplicaFrame( uint32 snapshotNum ) const
+{
+	// frame number within the replica (blocks are counted per replica)
+	return trackReplicas_ ? TRAJ_FRAME( snapshotNum ) : snapshotNum;
+}
+
+void CHBonds :: AddReplicaCount( HBBlockCounts *&replicas, uint32 snapshotNum )
+{
+	// called inside the single-threaded block
+	if ( !trackReplicas_ )
+		return;
+	if ( !replicas ) {
+		blockCounts_.push_back( HBBlockCounts() );
+		replicas = &blockCounts_.back();
+	}
+	const uint32 replica = TRAJ_REPLICA( snapshotNum );
+	if ( replicas->size() <= replica )
+		replicas->resize( replica + 1, 0 );
+	++(*replicas)[replica];
+}
+
+void CHBonds :: PrintReplicaHeader( FILE *fp, const HBBlockCounts &replicaFrames ) const
+{
+	// append replica column titles to the tuple table header
+	if ( !trackReplicas_ )
+		return;
+	for ( size_t i = 0; i < replicaFrames.size(); ++i ) {
+		if ( !replicaFrames[i] )
+			continue;
+		char title[16];
+		sprintf_s( title, sizeof(title), "r%u", static_cast<uint32>( i + 1 ) );
+		fprintf_s( fp, "\t%6s", title );
+	}
+}
+
+void CHBonds :: PrintReplicaStats( FILE *fp, const HBBlockCounts *replicas, const HBBlockCounts &replicaFrames ) const
+{
+	// append replica columns to the tuple line
+	if ( !trackReplicas_ )
+		return;
+	for ( size_t i = 0; i < replicaFrames.size(); ++i ) {
+		if ( !replicaFrames[i] )
+			continue;
+		const uint32 count = ( replicas && i < replicas->size() ) ? (*replicas)[i] : 0;
+		fprintf_s( fp, "\t%5.1f%%", real( 100 ) * count / replicaFrames[i] );
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////
+// SUPERPOSITION
+//////////////////////////////////////////////////////////////////////////
+// Best solvent coordinates are taken from different frames and put into
+// the base structure, so a tumbling or drifting biopolymer would leave 
+// them away from their site. Optionally every frame is fitted onto the 
+// base coordinates by the selected atoms (C-alpha/P, backbone or all 
+// heavy atoms of the biopolymer); the fit is calculated once per frame by
+// the owning thread, and only the copied solvent coordinates are moved.
+//////////////////////////////////////////////////////////////////////////
+
+void CHBonds :: SetupSuperposition()
+{
+	static const name_t cAtName_Protein_CA = { { 'C', 'A', ' ', ' ' } };
+	static const name_t cAtName_Protein_Backbone[] = { 
+		{ { 'N', ' ', ' ', ' ' } }, { { 'C', 'A', ' ', ' ' } }, { { 'C', ' ', ' ', ' ' } }, { { 'O', ' ', ' ', ' ' } } };
+	static const name_t cAtName_Nucleic_P = { { 'P', ' ', ' ', ' ' } };
+	static const name_t cAtName_Nucleic_Backbone[] = { 
+		{ { 'P', ' ', ' ', ' ' } }, { { 'O', '5', '\'', ' ' } }, { { 'C', '5', '\'', ' ' } }, 
+		{ { 'C', '4', '\'', ' ' } }, { { 'C', '3', '\'', ' ' } }, { { 'O', '3', '\'', ' ' } } };
+
+	std::vector<uint32> indices;
+	const char *selection = gpGlobals->fit_atoms;
+	if ( selection[0] ) {
+		const uint32 atcount = static_cast<uint32>( topology->GetAtomCount() );
+		const atom_t *atoms = topology->GetAtomArray();
+		const bool heavy = !_stricmp( selection, "heavy" );
+		const bool backbone = !_stricmp( selection, "bb" );
+		for ( uint32 i = 0; i < atcount; ++i ) {
+			const atom_t *at = &atoms[i];
+			if ( at->flags & ( AF_SOLVENT | AF_HYDROGEN ) )
+				continue;
+			bool selected = heavy;
+			if ( !selected && ( at->flags & AF_PROTEIN ) ) {
+				if ( backbone ) {
+					for ( size_t j = 0; j < sizeof(cAtName_Protein_Backbone) / sizeof(cAtName_Protein_Backbone[0]); ++j )
+						selected |= ( at->xtitle.integer == cAtName_Protein_Backbone[j].integer );
+				} else {
+					selected = ( at->xtitle.integer == cAtName_Protein_CA.integer );
+				}
+			} else if ( !selected && ( at->flags & AF_NUCLEIC ) ) {
+				if ( backbone ) {
+					for ( size_t j = 0; j < sizeof(cAtName_Nucleic_Backbone) / sizeof(cAtName_Nucleic_Backbone[0]); ++j )
+						selected |= ( at->xtitle.integer == cAtName_Nucleic_Backbone[j].integer );
+				} else {
+					selected = ( at->xtitle.integer == cAtName_Nucleic_P.integer );
+				}
+			}
+			if ( selected )
+				indices.push_back( i );
+		}
+		// three points define the orientation
+		if ( indices.size() < 3 ) {
+			utils->Warning( "only %u atoms match fit selection \"%s\", frames are not fitted\n", static_cast<uint32>( indices.size() ), selection );
+			indices.clear();
+		} else {
+			logfile->Print( "SetupSuperposition: %u atoms (%s)\n", static_cast<uint32>( indices.size() ), selection );
+		}
+	}
+	superposition_.SetReference( topology->GetBaseCoords(), indices );
+}
+
+//////////////////////////////////////////////////////////////////////////
+// DENSITY MAP
+//////////////////////////////////////////////////////////////////////////
+// Optionally solvent heavy atoms are counted on a regular grid around the
+// biopolymer (its bounding box in the source coordinates, expanded by two
+// h-bond lengths), either all of them or only the ones of the microset 
+// solvent molecules (in the fitted position, if frames are fitted). Every
+// thread counts its frames into its own grid, so no locking is needed; the
+// grids are summed plane by plane in parallel when the map is written. 
+// The map is written as OpenDX, in number of atoms per cubic angstrom
+// averaged over the trajectory.
+//////////////////////////////////////////////////////////////////////////
+
+void CHBonds :: SetupDensityGrid()
+{
+	memset( &densityGrid_, 0, sizeof(densityGrid_) );
+	densityAtoms_.clear();
+	densitySum_.clear();
+	densityMicrosets_ = gpGlobals->density_microsets;
+	if ( !gpGlobals->density_map[0] )
+		return;
+
+	const uint32 atcount = static_cast<uint32>( topology->GetAtomCount() );
+	const atom_t *atoms = topology->GetAtomArray();
+	const coord3_t *coords = topology->GetBaseCoords();
+
+	// bounding box of the biopolymer
+	coord3_t mins, maxs;
+	memset( &mins, 0, sizeof(mins) );
+	memset( &maxs, 0, sizeof(maxs) );
+	bool hasBiopolymer = false;
+	for ( uint32 i = 0; i < atcount; ++i ) {
+		if ( atoms[i].flags & AF_SOLVENT ) {
+			if ( !( atoms[i].flags & AF_HYDROGEN ) )
+				densityAtoms_.push_back( i );
+			continue;
+		}
+		if ( !hasBiopolymer ) {
+			mins = maxs = coords[i];
+			hasBiopolymer = true;
+		}
+		mins.x = std::min( mins.x, coords[i].x );	maxs.x = std::max( maxs.x, coords[i].x );
+		mins.y = std::min( mins.y, coords[i].y );	maxs.y = std::max( maxs.y, coords[i].y );
+		mins.z = std::min( mins.z, coords[i].z );	maxs.z = std::max( maxs.z, coords[i].z );
+	}
+	if ( !hasBiopolymer ) {
+		utils->Warning( "no biopolymer atoms, density map is not written\n" );
+		densityAtoms_.clear();
+		return;
+	}
+
+	const real spacing = gpGlobals->density_spacing;
+	const real margin = gpGlobals->hbond_max_length * 2;
+	const real lengths[3] = { maxs.x - mins.x + margin * 2, maxs.y - mins.y + margin * 2, maxs.z - mins.z + margin * 2 };
+	uint64 numCells = 1;
+	for ( int i = 0; i < 3; ++i ) {
+		densityGrid_.dims[i] = static_cast<uint32>( ceil( lengths[i] / spacing ) );
+		numCells *= densityGrid_.dims[i];
+	}
+	if ( numCells > DENSITY_MAX_CELLS ) {
+		utils->Warning( "density grid of %u x %u x %u points is too large, density map is not written (increase the spacing)\n",
+			densityGrid_.dims[0], densityGrid_.dims[1], densityGrid_.dims[2] );
+		memset( &densityGrid_, 0, sizeof(densityGrid_) );
+		densityAtoms_.clear();
+		return;
+	}
+	densityGrid_.mins.x = mins.x - margin;
+	densityGrid_.mins.y = mins.y - margin;
+	densityGrid_.mins.z = mins.z - margin;
+	densityGrid_.spacing = spacing;
+	densityGrid_.invSpacing = real( 1.0 ) / spacing;
+	densityGrid_.numCells = static_cast<uint32>( numCells );
+
+	logfile->Print( "SetupDensityGrid: %u x %u x %u points, %.1f kb per thread\n", 
+		densityGrid_.dims[0], densityGrid_.dims[1], densityGrid_.dims[2], numCells * sizeof(uint32) / 1024.0 );
+}
+
+void CHBonds :: AccumulateDensity( ThreadLocal *tl, const atom_t *atoms, const coord3_t *coords ) const
+{
+	// the grid is allocated by the owning thread on its first frame
+	if ( tl->density.size() != densityGrid_.numCells )
+		tl->density.assign( densityGrid_.numCells, 0 );
+
+	auto addAtom = [&]( uint32 index ) {
+		coord3_t fitted;
+		const coord3_t *crd = &coords[index];
+		if ( tl->fit ) {
+			CSuperposition::Apply( *tl->fit, *crd, fitted );
+			crd = &fitted;
+		}
+		const int32 ix = static_cast<int32>( floor( ( crd->x - densityGrid_.mins.x ) * densityGrid_.invSpacing ) );
+		const int32 iy = static_cast<int32>( floor( ( crd->y - densityGrid_.mins.y ) * densityGrid_.invSpacing ) );
+		const int32 iz = static_cast<int32>( floor( ( crd->z - densityGrid_.mins.z ) * densityGrid_.invSpacing ) );
+		if ( ix < 0 || iy < 0 || iz < 0 || 
+			 ix >= static_cast<int32>( densityGrid_.dims[0] ) || iy >= static_cast<int32>( densityGrid_.dims[1] ) || iz >= static_cast<int32>( densityGrid_.dims[2] ) )
+			return;
+		// z runs fastest, as in OpenDX
+		++tl->density[( static_cast<size_t>( ix ) * densityGrid_.dims[1] + iy ) * densityGrid_.dims[2] + iz];
+	};
+
+	if ( !densityMicrosets_ ) {
+		for ( auto it = densityAtoms_.cbegin(); it != densityAtoms_.cend(); ++it )
+			addAtom( *it );
+		return;
+	}
+
+	// heavy atoms of the solvent molecules of the microsets (bridges are 
+	// sorted by solvent atom index, so a molecule is never counted twice)
+	uint32 lastResidue = UINT32_BAD;
+	for ( auto it = tl->bridges.cbegin(); it != tl->bridges.cend(); ++it ) {
+		const atom_t *at = &atoms[it->s_index];
+		if ( at->rfirst == lastResidue )
+			continue;
+		lastResidue = at->rfirst;
+		for ( uint32 i = at->rfirst; i < at->rfirst + at->rcount; ++i ) {
+			if ( !( atoms[i].flags & AF_HYDROGEN ) )
+				addAtom( i );
+		}
+	}
+}
+
+void CHBonds :: ReduceDensityPlane( uint32 plane )
+{
+	const size_t planeSize = static_cast<size_t>( densityGrid_.dims[1] ) * densityGrid_.dims[2];
+	uint32 *dst = densitySum_.data() + plane * planeSize;
+	for ( uint32 i = 0; i < numThreads_; ++i ) {
+		// threads that never got a frame have no grid
+		if ( tl_[i].density.size() != densityGrid_.numCells )
+			continue;
+		const uint32 *src = tl_[i].density.data() + plane * planeSize;
+		for ( size_t j = 0; j < planeSize; ++j )
+			dst[j] += src[j];
+	}
+}
+
+bool CHBonds :: WriteDensityMap( uint32 totalFrames, const char *dxFile )
+{
+	assert( totalFrames > 0 );
+	assert( dxFile[0] != 0 );
+
+	if ( !densityGrid_.numCells )
+		return false;
+
+	// sum the per-thread grids
+	densitySum_.assign( densityGrid_.numCells, 0 );
+	RunThreadsOnIndividual( densityGrid_.dims[0], 0, Stub_ReduceDensityPlane );
+
+	FILE *fp;
+	if ( fopen_s( &fp, dxFile, "w" ) ) {
+		utils->Warning( "failed to open \"%s\" for writing\n", dxFile );
+		densitySum_.clear();
+		return false;
+	}
+
+	console->Print( "Writing: \"%s\"...\n", dxFile );
+
+	// grid points are in the centers of the cells
+	const real spacing = densityGrid_.spacing;
+	const double scale = 1.0 / ( static_cast<double>( totalFrames ) * spacing * spacing * spacing );
+	fprintf_s( fp, "# %s solvent %s density, atoms/A^3 averaged over %u snapshots\n", PROGRAM_LARGE_NAME, densityMicrosets_ ? "microset" : "heavy atom", totalFrames );
+	fprintf_s( fp, "object 1 class gridpositions counts %u %u %u\n", densityGrid_.dims[0], densityGrid_.dims[1], densityGrid_.dims[2] );
+	fprintf_s( fp, "origin %.4f %.4f %.4f\n", densityGrid_.mins.x + spacing * 0.5, densityGrid_.mins.y + spacing * 0.5, densityGrid_.mins.z + spacing * 0.5 );
+	fprintf_s( fp, "delta %.4f 0 0\n", spacing );
+	fprintf_s( fp, "delta 0 %.4f 0\n", spacing );
+	fprintf_s( fp, "delta 0 0 %.4f\n", spacing );
+	fprintf_s( fp, "object 2 class gridconnections counts %u %u %u\n", densityGrid_.dims[0], densityGrid_.dims[1], densityGrid_.dims[2] );
+	fprintf_s( fp, "object 3 class array type double rank 0 items %u data follows\n", densityGrid_.numCells );
+	double maxDensity = 0;
+	for ( uint32 i = 0; i < densityGrid_.numCells; ++i ) {
+		const double value = densitySum_[i] * scale;
+		maxDensity = std::max( maxDensity, value );
+		fprintf_s( fp, ( i % 3 == 2 || i + 1 == densityGrid_.numCells ) ? "%g\n" : "%g ", value );
+	}
+	fprintf_s( fp, "%s\n", "attribute \"dep\" string \"positions\"" );
+	fprintf_s( fp, "%s\n", "object \"density\" class field" );
+	fprintf_s( fp, "%s\n", "component \"positions\" value 1" );
+	fprintf_s( fp, "%s\n", "component \"connections\" value 2" );
+	fprintf_s( fp, "%s\n", "component \"data\" value 3" );
+	fclose( fp );
+
+	logfile->Print( "WriteDensityMap: \"%s\": %u points, max density %.4f\n", dxFile, densityGrid_.numCells, maxDensity );
+	densitySum_.clear();
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// PARTIAL STATE
+//////////////////////////////////////////////////////////////////////////
+// Accumulated pairs/triplets together with their best solvent blocks can
+// be saved to a binary file and merged later. This allows a trajectory 
+// to be split into snapshot ranges processed by separate runs; merging 
+// all partial files gives the same final output as a single run.
+// A state file saved along with the output of a complete run holds all
+// that is needed to rebuild the output for another occurence cut-off 
+// or VdW tolerance, without the trajectory and the atom lists.
+//////////////////////////////////////////////////////////////////////////
+
+static void StateWrite( std::vector<uint8> &buffer, const void *data, size_t size )
+{
+	const uint8 *bytes = reinterpret_cast<const uint8*>( data );
+	buffer.insert( buffer.end(), bytes, bytes + size );
+}
+
+static const uint8 *StateRead( const std::vector<uint8> &buffer, size_t &pos, size_t size, const char *stateFile )
+{
+	if ( pos + size > buffer.size() )
+		utils->Fatal( "unexpected end of partial state file \"%s\"!\n", stateFile );
+	const uint8 *data = &buffer[pos];
+	pos += size;
+	return data;
+}
+
+void CHBonds :: GetStateParms( real *parms ) const
+{
+	// occurence cutoff and VdW tolerance only affect the final output,
+	// so they may differ between the partial runs and the merge
+	memset( parms, 0, sizeof(real) * HBSTATE_NUM_PARMS );
+	parms[0] = gpGlobals->dielectric_const;
+	parms[1] = gpGlobals->electrostatic_radius;
+	parms[2] = gpGlobals->electrostatic_coeff;
+	parms[3] = gpGlobals->hbond_max_length;
+	parms[4] = gpGlobals->hbond_cutoff_energy;
+	parms[5] = gpGlobals->hbond_126_coeff;
+	parms[6] = gpGlobals->group_bonds ? real( 1 ) : real( 0 );
+	parms[7] = static_cast<real>( occupancyStride_ );
+}
+
+void CHBonds :: WriteStateRecord( std::vector<uint8> &buffer, const uint32 *indices, const HBGlobalScore &gs ) const
+{
+	HBStateRecord rec;
+	memset( &rec, 0, sizeof(rec) );
+	rec.index[0] = indices[0];
+	rec.index[1] = indices[1];
+	rec.index[2] = indices[2];
+	rec.score = gs.score;
+	rec.snaps = gs.snaps;
+	rec.energy = gs.energy;
+	for ( const HBSolvent *block = gs.solv; block; block = block->chain )
+		++rec.numSolvent;
+	StateWrite( buffer, &rec, sizeof(rec) );
+
+	for ( const HBSolvent *block = gs.solv; block; block = block->chain ) {
+		HBStateSolvent s;
+		memset( &s, 0, sizeof(s) );
+		s.s_index = block->s_index;
+		s.snaps = block->snaps;
+		s.energy = block->energy;
+		StateWrite( buffer, &s, sizeof(s) );
+		if ( block->crd ) {
+			StateWrite( buffer, block->crd->coords, sizeof(coord4_t) * s_siz_ );
+		} else {
+			// replayed block that was never fetched
+			const coord4_t empty = { 0, 0, 0, 0 };
+			for ( size_t i = 0; i < s_siz_; ++i )
+				StateWrite( buffer, &empty, sizeof(empty) );
+		}
+	}
+
+	if ( occupancyStride_ ) {
+		// occupancy set, padded to keep the records aligned
+		std::vector<uint8> occ;
+		if ( gs.occ )
+			gs.occ->Serialize( occ );
+		else
+			COccupancy().Serialize( occ );
+		const uint32 size[2] = { static_cast<uint32>( occ.size() ), 0 };
+		occ.resize( ( occ.size() + sizeof(real) - 1 ) & ~( sizeof(real) - 1 ) );
+		StateWrite( buffer, size, sizeof(size) );
+		StateWrite( buffer, occ.data(), occ.size() );
+	}
+}
+
+void CHBonds :: SerializeState( std::vector<uint8> &buffer, uint32 totalFrames ) const
+{
+	// pack completed snapshots into ranges
+	std::vector<uint32> frames( doneFrames_ );
+	std::vector<HBStateRange> ranges;
+	std::sort( frames.begin(), frames.end() );
+	for ( auto it = frames.cbegin(); it != frames.cend(); ++it ) {
+		if ( ranges.size() && ranges.back().first + ranges.back().count == *it ) {
+			++ranges.back().count;
+		} else if ( !ranges.size() || ranges.back().first + ranges.back().count < *it ) {
+			HBStateRange range;
+			range.first = *it;
+			range.count = 1;
+			ranges.push_back( range );
+		}
+	}
+
+	buffer.clear();
+	HBStateHeader header;
+	memset( &header, 0, sizeof(header) );
+	memcpy( header.magic, HBSTATE_MAGIC, sizeof(header.magic) );
+	header.version = HBSTATE_VERSION;
+	header.realSize = sizeof(real);
+	header.atomCount = static_cast<uint32>( topology->GetAtomCount() );
+	header.solventSize = static_cast<uint32>( s_siz_ );
+	header.frames = totalFrames;
+	header.numPairs = static_cast<uint32>( hbPairScoreMap_.size() );
+	header.numTriplets = static_cast<uint32>( hbTripletScoreMap_.size() );
+	header.numRanges = static_cast<uint32>( ranges.size() );
+	GetStateParms( header.parms );
+	StateWrite( buffer, &header, sizeof(header) );
+
+	uint32 indices[3];
+	for ( auto it = hbPairScoreMap_.cbegin(); it != hbPairScoreMap_.cend(); ++it ) {
+		indices[0] = it->first.index0;
+		indices[1] = it->first.index1;
+		indices[2] = UINT32_BAD;
+		WriteStateRecord( buffer, indices, it->second );
+	}
+	for ( auto it = hbTripletScoreMap_.cbegin(); it != hbTripletScoreMap_.cend(); ++it ) {
+		indices[0] = it->first.index0;
+		indices[1] = it->first.index1;
+		indices[2] = it->first.index2;
+		WriteStateRecord( buffer, indices, it->second );
+	}
+	if ( ranges.size() )
+		StateWrite( buffer, &ranges[0], sizeof(HBStateRange) * ranges.size() );
+
+	// group titles, so the output can be rebuilt without the atom lists
+	uint32 numTitles[2] = { static_cast<uint32>( hbGroupTitleMap_.size() ), 0 };
+	StateWrite( buffer, numTitles, sizeof(numTitles) );
+	for ( auto it = hbGroupTitleMap_.cbegin(); it != hbGroupTitleMap_.cend(); ++it ) {
+		HBStateTitle title;
+		memset( &title, 0, sizeof(title) );
+		title.index = it->first;
+		strncpy_s( title.title, sizeof(title.title), it->second.c_str(), sizeof(title.title)-1 );
+		StateWrite( buffer, &title, sizeof(title) );
+	}
+
+	// block and replica counters of all records in the same order
+	if ( blockLength_ )
+		WriteStateCounters( buffer, HBSTATE_SECTION_BLOCKS, blockLength_, &HBGlobalScore::blocks );
+	if ( trackReplicas_ )
+		WriteStateCounters( buffer, HBSTATE_SECTION_REPLICAS, 0, &HBGlobalScore::replicas );
+
+	// second-order bridges, as pair records without solvent
+	if ( waterChains_ ) {
+		HBStateSection section;
+		memset( &section, 0, sizeof(section) );
+		section.kind = HBSTATE_SECTION_CHAINS;
+		section.count = static_cast<uint32>( hbChainScoreMap_.size() );
+		StateWrite( buffer, &section, sizeof(section) );
+		for ( auto it = hbChainScoreMap_.cbegin(); it != hbChainScoreMap_.cend(); ++it ) {
+			HBStateRecord rec;
+			memset( &rec, 0, sizeof(rec) );
+			rec.index[0] = it->first.index0;
+			rec.index[1] = it->first.index1;
+			rec.index[2] = UINT32_BAD;
+			rec.score = it->second.score;
+			rec.snaps = it->second.snaps;
+			rec.energy = it->second.energy;
+			StateWrite( buffer, &rec, sizeof(rec) );
+		}
+	}
+}
+
+void CHBonds :: WriteStateCounters( std::vector<uint8> &buffer, uint32 kind, uint32 parm, HBBlockCounts *HBGlobalScore::*member ) const
+{
+	HBStateSection header;
+	memset( &header, 0, sizeof(header) );
+	header.kind = kind;
+	header.parm = parm;
+	auto countersSize = [&]( const HBGlobalScore &gs ) {
+		if ( gs.*member )
+			header.count = std::max( header.count, static_cast<uint32>( ( gs.*member )->size() ) );
+	};
+	for ( auto it = hbPairScoreMap_.cbegin(); it != hbPairScoreMap_.cend(); ++it )
+		countersSize( it->second );
+	for ( auto it = hbTripletScoreMap_.cbegin(); it != hbTripletScoreMap_.cend(); ++it )
+		countersSize( it->second );
+	StateWrite( buffer, &header, sizeof(header) );
+
+	std::vector<uint32> counts( header.count );
+	auto writeCounts = [&]( const HBGlobalScore &gs ) {
+		std::fill( counts.begin(), counts.end(), 0 );
+		if ( gs.*member )
+			std::copy( ( gs.*member )->cbegin(), ( gs.*member )->cend(), counts.begin() );
+		if ( counts.size() )
+			StateWrite( buffer, counts.data(), sizeof(uint32) * counts.size() );
+	};
+	for ( auto it = hbPairScoreMap_.cbegin(); it != hbPairScoreMap_.cend(); ++it )
+		writeCounts( it->second );
+	for ( auto it = hbTripletScoreMap_.cbegin(); it != hbTripletScoreMap_.cend(); ++it )
+		writeCounts( it->second );
+}
+
+bool CHBonds :: SaveState( uint32 totalFrames, const char *stateFile ) const
+{
+	assert( stateFile[0] != 0 );
+
+	// serialize to memory first, so the file is written at once
+	std::vector<uint8> buffer;
+	SerializeState( buffer, totalFrames );
+
+	console->Print( "Writing: \"%s\"...\n", stateFile );
+
+	if ( !utils->WriteFileAtomic( stateFile, &buffer[0], buffer.size() ) ) {
+		utils->Warning( "failed to write \"%s\"\n", stateFile );
+		return false;
+	}
+
+	logfile->Print( "SaveState: %u frames, %u pairs, %u triplets (%.1f kb)\n", 
+		totalFrames, static_cast<uint32>( hbPairScoreMap_.size() ), static_cast<uint32>( hbTripletScoreMap_.size() ), buffer.size() / 1024.0 );
+	return true;
+}
+
+void CHBonds :: MergeStateRecord( HBGlobalScore &gs, const HBStateRecord *rec, bool hasOccupancy, const std::vector<uint8> &buffer, size_t &pos, const char *stateFile )
+{
+	const uint32 atomCount = static_cast<uint32>( topology->GetAtomCount() );
+	ThreadLocal *tl = &tl_[0];
+
+	gs.score += rec->score;
+	gs.snaps += rec->snaps;
+	gs.energy += rec->energy;
+
+	for ( uint32 i = 0; i < rec->numSolvent; ++i ) {
+		const HBStateSolvent *s = reinterpret_cast<const HBStateSolvent*>( StateRead( buffer, pos, sizeof(HBStateSolvent), stateFile ) );
+		const coord4_t *coords = reinterpret_cast<const coord4_t*>( StateRead( buffer, pos, sizeof(coord4_t) * s_siz_, stateFile ) );
+		if ( s->s_index >= atomCount )
+			utils->Fatal( "invalid solvent index %u in partial state file \"%s\"!\n", s->s_index, stateFile );
+
+		// same rules as merging a frame into the global maps
+		HBSolvent *gblock = gs.solv;
+		for ( ; gblock; gblock = gblock->chain ) {
+			if ( gblock->s_index == s->s_index )
+				break;
+		}
+		if ( gblock ) {
+			gblock->snaps += s->snaps;
+			if ( s->energy < gblock->energy ) {
+				gblock->energy = s->energy;
+				gblock->snapshot = UINT32_BAD;
+				SetBlockCoords( tl, gblock, coords );
+			}
+		} else {
+			HBSolvent *block = GrabSolventBlock( tl );
+			block->gblock = nullptr;
+			block->flags |= HBSF_VALID;
+			block->snaps = s->snaps;
+			block->s_index = s->s_index;
+			block->snapshot = UINT32_BAD;
+			block->energy = s->energy;
+			SetBlockCoords( tl, block, coords );
+			block->chain = gs.solv;
+			gs.solv = block;
+		}
+	}
+
+	if ( hasOccupancy ) {
+		const uint32 size = reinterpret_cast<const uint32*>( StateRead( buffer, pos, sizeof(uint32) * 2, stateFile ) )[0];
+		const uint8 *data = StateRead( buffer, pos, ( size + sizeof(real) - 1 ) & ~( sizeof(real) - 1 ), stateFile );
+		if ( occupancyStride_ ) {
+			if ( !gs.occ ) {
+				occupancies_.push_back( COccupancy() );
+				gs.occ = &occupancies_.back();
+			}
+			if ( !gs.occ->Merge( data, size ) )
+				utils->Fatal( "invalid occupancy record in partial state file \"%s\"!\n", stateFile );
+		}
+	}
+}
+
+uint32 CHBonds :: MergeState( const char *stateFile )
+{
+	return LoadState( stateFile, false );
+}
+
+uint32 CHBonds :: LoadResults( const char *resultsFile )
+{
+	const uint32 frames = LoadState( resultsFile, true );
+	sweepBaseCutoff_ = gpGlobals->hbond_cutoff_energy;
+	return frames;
+}
+
+uint32 CHBonds :: LoadState( const char *stateFile, bool useStateParms )
+{
+	assert( numThreads_ > 0 );
+
+	console->Print( "Loading: \"%s\"...\n", stateFile );
+
+	FILE *fp;
+	if ( fopen_s( &fp, stateFile, "rb" ) )
+		utils->Fatal( "failed to open \"%s\" for reading!\n", stateFile );
+
+	// read the whole file
+	std::vector<uint8> buffer;
+	uint8 chunk[65536];
+	size_t numread;
+	while ( ( numread = fread( chunk, 1, sizeof(chunk), fp ) ) > 0 )
+		buffer.insert( buffer.end(), chunk, chunk + numread );
+	fclose( fp );
+
+	size_t pos = 0;
+	const HBStateHeader *header = reinterpret_cast<const HBStateHeader*>( StateRead( buffer, pos, sizeof(HBStateHeader), stateFile ) );
+	if ( memcmp( header->magic, HBSTATE_MAGIC, sizeof(header->magic) ) )
+		utils->Fatal( "\"%s\" is not a partial state file!\n", stateFile );
+	if ( header->version != HBSTATE_VERSION || header->realSize != sizeof(real) )
+		utils->Fatal( "partial state file \"%s\" has incompatible version %u (%u-byte reals)!\n", stateFile, header->version, header->realSize );
+	if ( header->atomCount != topology->GetAtomCount() || header->solventSize != s_siz_ )
+		utils->Fatal( "partial state file \"%s\" was made for a different topology (%u atoms, solvent size %u)!\n", stateFile, header->atomCount, header->solventSize );
+
+	real parms[HBSTATE_NUM_PARMS];
+	GetStateParms( parms );
+	if ( useStateParms ) {
+		// the output must describe the settings the results were accumulated with
+		if ( memcmp( parms, header->parms, sizeof(parms) ) )
+			console->Print( "Using h-bond settings of \"%s\"\n", stateFile );
+		gpGlobals->dielectric_const = header->parms[0];
+		gpGlobals->electrostatic_radius = header->parms[1];
+		gpGlobals->electrostatic_coeff = header->parms[2];
+		gpGlobals->hbond_max_length = header->parms[3];
+		gpGlobals->hbond_cutoff_energy = header->parms[4];
+		gpGlobals->hbond_126_coeff = header->parms[5];
+		gpGlobals->group_bonds = ( header->parms[6] != 0 );
+		gpGlobals->occupancy = ( header->parms[7] != 0 );
+		occupancyStride_ = static_cast<uint32>( header->parms[7] );
+	} else if ( memcmp( parms, header->parms, sizeof(parms) ) ) {
+		utils->Warning( "partial state file \"%s\" was made with different h-bond settings\n", stateFile );
+	}
+
+	const uint32 atomCount = header->atomCount;
+	const uint32 numPairs = header->numPairs;
+	const uint32 numTriplets = header->numTriplets;
+	const uint32 frames = header->frames;
+	const uint32 numRanges = header->numRanges;
+	const bool hasOccupancy = ( header->parms[7] != 0 );
+	std::vector<HBGlobalScore*> records;
+	records.reserve( numPairs + numTriplets );
+
+	for ( uint32 i = 0; i < numPairs + numTriplets; ++i ) {
+		// all records are multiples of sizeof(real) in size, so they stay aligned
+		const HBStateRecord *rec = reinterpret_cast<const HBStateRecord*>( StateRead( buffer, pos, sizeof(HBStateRecord), stateFile ) );
+		const bool isPair = ( i < numPairs );
+		if ( rec->index[0] >= atomCount || rec->index[1] >= atomCount || ( !isPair && rec->index[2] >= atomCount ) )
+			utils->Fatal( "invalid atom index in partial state file \"%s\"!\n", stateFile );
+
+		HBGlobalScore empty;
+		memset( &empty, 0, sizeof(empty) );
+		if ( isPair ) {
+			HBPair value;
+			value.index0 = rec->index[0];
+			value.index1 = rec->index[1];
+			auto it = hbPairScoreMap_.insert( std::make_pair( value, empty ) ).first;
+			MergeStateRecord( it->second, rec, hasOccupancy, buffer, pos, stateFile );
+			records.push_back( &it->second );
+		} else {
+			HBTriplet value;
+			value.index0 = rec->index[0];
+			value.index1 = rec->index[1];
+			value.index2 = rec->index[2];
+			auto it = hbTripletScoreMap_.insert( std::make_pair( value, empty ) ).first;
+			MergeStateRecord( it->second, rec, hasOccupancy, buffer, pos, stateFile );
+			records.push_back( &it->second );
+		}
+	}
+
+	// completed snapshots (files of older runs may have none)
+	const size_t oldFrames = doneFrames_.size();
+	size_t loadedFrames = 0;
+	for ( uint32 i = 0; i < numRanges; ++i ) {
+		const HBStateRange *range = reinterpret_cast<const HBStateRange*>( StateRead( buffer, pos, sizeof(HBStateRange), stateFile ) );
+		for ( uint32 j = 0; j < range->count; ++j )
+			doneFrames_.push_back( range->first + j );
+		loadedFrames += range->count;
+	}
+	std::sort( doneFrames_.begin(), doneFrames_.end() );
+	doneFrames_.erase( std::unique( doneFrames_.begin(), doneFrames_.end() ), doneFrames_.end() );
+	if ( doneFrames_.size() - oldFrames != loadedFrames ) {
+		utils->Warning( "%u snapshots of partial state file \"%s\" were already merged, they are counted twice\n", 
+			static_cast<uint32>( oldFrames + loadedFrames - doneFrames_.size() ), stateFile );
+	}
+	stateFrames_ += frames;
+	checkpointLastFrames_ += frames;
+
+	// group titles (files of older runs may have none)
+	if ( pos < buffer.size() ) {
+		const uint32 numTitles = reinterpret_cast<const uint32*>( StateRead( buffer, pos, sizeof(uint32) * 2, stateFile ) )[0];
+		for ( uint32 i = 0; i < numTitles; ++i ) {
+			const HBStateTitle *title = reinterpret_cast<const HBStateTitle*>( StateRead( buffer, pos, sizeof(HBStateTitle), stateFile ) );
+			hbGroupTitleMap_.insert( std::make_pair( title->index, std::string( title->title, strnlen( title->title, sizeof(title->title) ) ) ) );
+		}
+	}
+
+	// block and replica counters, second-order bridges (files of runs without them have none)
+	while ( pos < buffer.size() ) {
+		const HBStateSection *section = reinterpret_cast<const HBStateSection*>( StateRead( buffer, pos, sizeof(HBStateSection), stateFile ) );
+		if ( section->kind == HBSTATE_SECTION_CHAINS ) {
+			const uint32 numChains = section->count;
+			for ( uint32 i = 0; i < numChains; ++i ) {
+				const HBStateRecord *rec = reinterpret_cast<const HBStateRecord*>( StateRead( buffer, pos, sizeof(HBStateRecord), stateFile ) );
+				if ( rec->index[0] >= atomCount || rec->index[1] >= atomCount )
+					utils->Fatal( "invalid atom index in partial state file \"%s\"!\n", stateFile );
+				HBPair value;
+				value.index0 = rec->index[0];
+				value.index1 = rec->index[1];
+				HBGlobalScore empty;
+				memset( &empty, 0, sizeof(empty) );
+				HBGlobalScore &gs = hbChainScoreMap_.insert( std::make_pair( value, empty ) ).first->second;
+				gs.score += rec->score;
+				gs.snaps += rec->snaps;
+				gs.energy += rec->energy;
+			}
+			waterChains_ = true;
+			continue;
+		}
+		const uint32 numCounters = section->count;
+		const uint32 *counts = reinterpret_cast<const uint32*>( StateRead( buffer, pos, sizeof(uint32) * numCounters * records.size(), stateFile ) );
+		HBBlockCounts *HBGlobalScore::*member = nullptr;
+		if ( section->kind == HBSTATE_SECTION_BLOCKS ) {
+			if ( useStateParms )
+				blockLength_ = section->parm;
+			if ( blockLength_ && section->parm != blockLength_ )
+				utils->Warning( "partial state file \"%s\" has blocks of %u snapshots, block counters are ignored\n", stateFile, section->parm );
+			else if ( blockLength_ )
+				member = &HBGlobalScore::blocks;
+		} else if ( section->kind == HBSTATE_SECTION_REPLICAS ) {
+			// snapshots of the file are tagged with replicas
+			trackReplicas_ = true;
+			member = &HBGlobalScore::replicas;
+		}
+		if ( !member || !numCounters )
+			continue;
+		for ( size_t i = 0; i < records.size(); ++i, counts += numCounters ) {
+			HBBlockCounts *&values = records[i]->*member;
+			if ( !values ) {
+				blockCounts_.push_back( HBBlockCounts() );
+				values = &blockCounts_.back();
+			}
+			if ( values->size() < numCounters )
+				values->resize( numCounters, 0 );
+			for ( uint32 j = 0; j < numCounters; ++j )
+				(*values)[j] += counts[j];
+		}
+	}
+
+	logfile->Print( "MergeState: \"%s\": %u frames, %u pairs, %u triplets\n", stateFile, frames, numPairs, numTriplets );
+	return frames;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// CHECKPOINTS
+//////////////////////////////////////////////////////////////////////////
+// Checkpoint is a partial state file written periodically during the 
+// run. The state is serialized to memory under the global lock (so it's 
+// consistent with the completed snapshots list), and written to disk by 
+// a background job while the frames are still processed. The file is 
+// replaced atomically, so a crash leaves either the previous or the new 
+// checkpoint, but never a broken one.
+//////////////////////////////////////////////////////////////////////////
+
+void CHBonds :: SetCheckpoint( const char *checkpointFile, uint32 everyFrames, real everyMinutes )
+{
+	memset( checkpointFile_, 0, sizeof(checkpointFile_) );
+	strncat_s( checkpointFile_, checkpointFile, sizeof(checkpointFile_)-1 );
+	checkpointFrames_ = everyFrames;
+	checkpointTime_ = everyMinutes * 60000.0;
+}
+
+bool CHBonds :: IsSnapshotDone( uint32 snapshotNum ) const
+{
+	// the list is only sorted between MergeState and processing
+	return std::binary_search( doneFrames_.cbegin(), doneFrames_.cend(), snapshotNum );
+}
+
+void CHBonds :: FrameCompleted( uint32 snapshotNum )
+{
+	// called inside the single-threaded block
+	doneFrames_.push_back( snapshotNum );
+	++stateFrames_;
+
+	if ( checkpointFailed_.exchange( false ) )
+		utils->Warning( "failed to write checkpoint \"%s\"\n", checkpointFile_ );
+	if ( !checkpointFile_[0] )
+		return;
+
+	const double currentTime = utils->FloatMilliseconds();
+	const bool checkpointDue = ( checkpointFrames_ && stateFrames_ - checkpointLastFrames_ >= checkpointFrames_ ) ||
+							   ( checkpointTime_ > 0 && currentTime - checkpointLastTime_ >= checkpointTime_ );
+
+	// if the previous checkpoint is still being written, try on the next frame
+	if ( !checkpointDue || ThreadJobRunning() )
+		return;
+
+	SerializeState( checkpointBuffer_, stateFrames_ );
+	checkpointLastFrames_ = stateFrames_;
+	checkpointLastTime_ = currentTime;
+	logfile->Print( "Checkpoint: %u frames (%.1f kb)\n", stateFrames_, checkpointBuffer_.size() / 1024.0 );
+
+	ThreadStartJob( Stub_WriteCheckpoint, nullptr );
+	CompactSolventBlocks();
+}
+
+void CHBonds :: WriteCheckpoint()
+{
+	// runs on the background thread, so don't print anything here
+	if ( !utils->WriteFileAtomic( checkpointFile_, &checkpointBuffer_[0], checkpointBuffer_.size() ) )
+		checkpointFailed_ = true;
+}
+
+void CHBonds :: FinishCheckpoint()
+{
+	ThreadWaitJob();
+
+	// no more frames, so the solvent blocks are final
+	CompactSolventBlocks();
+
+	// write the frames completed since the last checkpoint
+	if ( checkpointFile_[0] && stateFrames_ != checkpointLastFrames_ ) {
+		SerializeState( checkpointBuffer_, stateFrames_ );
+		checkpointLastFrames_ = stateFrames_;
+		logfile->Print( "Checkpoint: %u frames (%.1f kb)\n", stateFrames_, checkpointBuffer_.size() / 1024.0 );
+		WriteCheckpoint();
+	}
+
+	if ( checkpointFailed_.exchange( false ) )
+		utils->Warning( "failed to write checkpoint \"%s\"\n", checkpointFile_ );
+}
+
+//////////////////////////////////////////////////////////////////////////
+// CUT-OFF SWEEP
+//////////////////////////////////////////////////////////////////////////
+// The energies are calculated once per frame with the weakest cut-off,
+// then the bridges are accumulated once per sweep level, dropping those
+// that don't pass the next (stricter) cut-off. Each level has its own
+// pair/triplet maps; output functions work with the main maps, so the 
+// selected level is swapped into them.
+//////////////////////////////////////////////////////////////////////////
+
+void CHBonds :: SetCutoffSweep( const real *cutoffs, uint32 count )
+{
+	assert( !sweepActiveLevel_ );
+
+	// levels must be stricter than the main cut-off, sorted and unique
+	std::vector<real> values( cutoffs, cutoffs + count );
+	std::sort( values.begin(), values.end() );
+	values.erase( std::unique( values.begin(), values.end() ), values.end() );
+
+	sweepBaseCutoff_ = gpGlobals->hbond_cutoff_energy;
+	sweepLevels_.clear();
+	for ( auto it = values.cbegin(); it != values.cend(); ++it ) {
+		if ( *it <= sweepBaseCutoff_ )
+			continue;
+		sweepLevels_.push_back( HBSweepLevel() );
+		sweepLevels_.back().cutoff = *it;
+	}
+}
+
+uint32 CHBonds :: GetCutoffLevels() const
+{
+	return static_cast<uint32>( sweepLevels_.size() + 1 );
+}
+
+real CHBonds :: SelectCutoffLevel( uint32 level )
+{
+	assert( level <= sweepLevels_.size() );
+
+	// put the active level back first
+	if ( sweepActiveLevel_ ) {
+		hbPairScoreMap_.swap( sweepLevels_[sweepActiveLevel_-1].pairs );
+		hbTripletScoreMap_.swap( sweepLevels_[sweepActiveLevel_-1].triplets );
+		hbChainScoreMap_.swap( sweepLevels_[sweepActiveLevel_-1].chains );
+	}
+	sweepActiveLevel_ = level;
+	if ( !level )
+		return sweepBaseCutoff_;
+
+	hbPairScoreMap_.swap( sweepLevels_[level-1].pairs );
+	hbTripletScoreMap_.swap( sweepLevels_[level-1].triplets );
+	hbChainScoreMap_.swap( sweepLevels_[level-1].chains );
+	return sweepLevels_[level-1].cutoff;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// BRIDGE CAPTURE AND REPLAY
+//////////////////////////////////////////////////////////////////////////
+// Sorted per-frame bridges can be written to a capture file: indices 
+// are delta-encoded as variable-length integers (the solvent index is
+// relative to the previous bridge, biopolymer index too if the solvent
+// is the same), energies are stored as is. Bridges are captured before
+// grouping, so a replay may use a different grouping or a stricter 
+// cut-off energy. Replayed solvent blocks only remember the snapshot of
+// the best position; coordinates are fetched later for the blocks of
+// the tuples that pass the occurence cut-off.
+//////////////////////////////////////////////////////////////////////////
+
+static void CaptureWriteVarint( std::vector<uint8> &buffer, uint32 value )
+{
+	while ( value >= 0x80 ) {
+		buffer.push_back( static_cast<uint8>( value | 0x80 ) );
+		value >>= 7;
+	}
+	buffer.push_back( static_cast<uint8>( value ) );
+}
+
+static bool CaptureReadVarint( const uint8 *&data, const uint8 *end, uint32 &value )
+{
+	value = 0;
+	for ( uint32 shift = 0; data < end && shift < 35; shift += 7 ) {
+		const uint8 byte = *data++;
+		value |= static_cast<uint32>( byte & 0x7F ) << shift;
+		if ( !( byte & 0x80 ) )
+			return true;
+	}
+	return false;
+}
+
+void CHBonds :: EncodeBridges( const HBBridgeVec &bridges, std::vector<uint8> &buffer ) const
+{
+	uint32 last_s_index = 0, last_b_index = 0;
+	buffer.clear();
+	for ( auto it = bridges.cbegin(); it != bridges.cend(); ++it ) {
+		const uint32 ds = it->s_index - last_s_index;
+		CaptureWriteVarint( buffer, ds );
+		CaptureWriteVarint( buffer, ds ? it->b_index : it->b_index - last_b_index );
+		StateWrite( buffer, &it->energy, sizeof(it->energy) );
+		last_s_index = it->s_index;
+		last_b_index = it->b_index;
+	}
+}
+
+bool CHBonds :: DecodeBridges( const uint8 *data, size_t size, uint32 numBridges, HBBridgeVec &bridges ) const
+{
+	const uint8 *end = data + size;
+	const uint32 atomCount = static_cast<uint32>( xyRemap_.size() );
+	uint32 last_s_index = 0, last_b_index = 0;
+	bridges.resize( numBridges );
+	for ( auto it = bridges.begin(); it != bridges.end(); ++it ) {
+		uint32 ds, db;
+		if ( !CaptureReadVarint( data, end, ds ) || !CaptureReadVarint( data, end, db ) )
+			return false;
+		if ( data + sizeof(it->energy) > end )
+			return false;
+		it->s_index = last_s_index + ds;
+		it->b_index = ds ? db : last_b_index + db;
+		memcpy( &it->energy, data, sizeof(it->energy) );
+		data += sizeof(it->energy);
+		if ( it->s_index >= atomCount || it->b_index >= atomCount )
+			return false;
+		last_s_index = it->s_index;
+		last_b_index = it->b_index;
+	}
+	return ( data == end );
+}
+
+void CHBonds :: RemapBridges( HBBridgeVec &bridges ) const
+{
+	if ( !group_bonds_ )
+		return;
+	for ( auto it = bridges.begin(); it != bridges.end(); ++it ) {
+		it->s_index = xyRemap_[it->s_index];
+		it->b_index = xyRemap_[it->b_index];
+	}
+}
+
+bool CHBonds :: BeginBridgeCapture( const char *captureFile )
+{
+	assert( captureFile_ == nullptr );
+	assert( xyRemap_.size() == topology->GetAtomCount() );
+
+	if ( fopen_s( &captureFile_, captureFile, "wb" ) ) {
+		utils->Warning( "failed to open \"%s\" for writing\n", captureFile );
+		captureFile_ = nullptr;
+		return false;
+	}
+
+	HBCaptureHeader header;
+	memset( &header, 0, sizeof(header) );
+	memcpy( header.magic, HBCAPTURE_MAGIC, sizeof(header.magic) );
+	header.version = HBCAPTURE_VERSION;
+	header.realSize = sizeof(real);
+	header.atomCount = static_cast<uint32>( topology->GetAtomCount() );
+	GetStateParms( header.parms );
+	captureFailed_ = ( fwrite( &header, sizeof(header), 1, captureFile_ ) != 1 );
+	if ( captureFailed_ )
+		utils->Warning( "failed to write bridge capture file\n" );
+	return !captureFailed_;
+}
+
+void CHBonds :: WriteCapturedFrame( ThreadLocal *tl, uint32 snapshotNum )
+{
+	// called inside the single-threaded block
+	if ( !captureFile_ || captureFailed_ )
+		return;
+
+	HBCaptureFrame frame;
+	frame.snapshot = snapshotNum;
+	frame.numBridges = static_cast<uint32>( tl->bridges.size() );
+	frame.size = static_cast<uint32>( tl->capture.size() );
+	if ( fwrite( &frame, sizeof(frame), 1, captureFile_ ) != 1 ||
+		 ( frame.size && fwrite( &tl->capture[0], 1, frame.size, captureFile_ ) != frame.size ) ) {
+		utils->Warning( "failed to write bridge capture file, capture is stopped\n" );
+		captureFailed_ = true;
+	}
+}
+
+void CHBonds :: EndBridgeCapture()
+{
+	if ( !captureFile_ )
+		return;
+
+	const long size = ftell( captureFile_ );
+	if ( fclose( captureFile_ ) )
+		captureFailed_ = true;
+	captureFile_ = nullptr;
+
+	if ( captureFailed_ )
+		utils->Warning( "bridge capture file is incomplete\n" );
+	else
+		logfile->Print( "EndBridgeCapture: %.1f kb\n", size / 1024.0 );
+}
+
+uint32 CHBonds :: ReplayBridges( const char *captureFile )
+{
+	assert( numThreads_ > 0 );
+	assert( xyRemap_.size() == topology->GetAtomCount() );
+
+	console->Print( "Replaying: \"%s\"...\n", captureFile );
+
+	FILE *fp;
+	if ( fopen_s( &fp, captureFile, "rb" ) )
+		utils->Fatal( "failed to open \"%s\" for reading!\n", captureFile );
+
+	HBCaptureHeader header;
+	if ( fread( &header, sizeof(header), 1, fp ) != 1 || memcmp( header.magic, HBCAPTURE_MAGIC, sizeof(header.magic) ) ) {
+		fclose( fp );
+		utils->Fatal( "\"%s\" is not a bridge capture file!\n", captureFile );
+	}
+	if ( header.version != HBCAPTURE_VERSION || header.realSize != sizeof(real) ) {
+		fclose( fp );
+		utils->Fatal( "bridge capture file \"%s\" has incompatible version %u (%u-byte reals)!\n", captureFile, header.version, header.realSize );
+	}
+	if ( header.atomCount != topology->GetAtomCount() ) {
+		fclose( fp );
+		utils->Fatal( "bridge capture file \"%s\" was made for a different topology (%u atoms)!\n", captureFile, header.atomCount );
+	}
+
+	// cut-off energy (parms[4]) and grouping (parms[6]) may be changed,
+	// everything else affects the energies
+	real parms[HBSTATE_NUM_PARMS];
+	GetStateParms( parms );
+	if ( memcmp( parms, header.parms, sizeof(real) * 4 ) || parms[5] != header.parms[5] )
+		utils->Warning( "bridge capture file \"%s\" was made with different energy settings\n", captureFile );
+	if ( gpGlobals->hbond_cutoff_energy < header.parms[4] )
+		utils->Warning( "bridges were captured with cut-off energy %g, weaker cut-off has no effect\n", header.parms[4] );
+
+	ThreadLocal *tl = &tl_[0];
+	const atom_t *atoms = topology->GetAtomArray();
+	const real cutoff = -gpGlobals->hbond_cutoff_energy;
+	HBCaptureFrame frame;
+	std::vector<uint8> data;
+	uint32 frames = 0;
+
+	while ( fread( &frame, sizeof(frame), 1, fp ) == 1 ) {
+		data.resize( frame.size );
+		if ( frame.size && fread( &data[0], 1, frame.size, fp ) != frame.size ) {
+			fclose( fp );
+			utils->Fatal( "unexpected end of bridge capture file \"%s\"!\n", captureFile );
+		}
+		if ( !DecodeBridges( data.data(), frame.size, frame.numBridges, tl->bridges ) ) {
+			fclose( fp );
+			utils->Fatal( "bridge capture file \"%s\" is corrupt (snapshot %u)!\n", captureFile, frame.snapshot );
+		}
+
+		// apply the current cut-off and grouping
+		tl->bridges.erase( std::remove_if( tl->bridges.begin(), tl->bridges.end(), 
+			[cutoff]( const HBBridge &b ) { return !( b.energy < cutoff ); } ), tl->bridges.end() );
+		RemapBridges( tl->bridges );
+		SortBridges( tl, tl->bridges );
+
+		// no other threads are running, so no locking
+		tl->snapshot = frame.snapshot;
+		++tl->frames;
+		if ( tl->bridges.size() ) {
+			size_t c_pairs, c_triplets, c_chains;
+			AccumulateLevels( tl, atoms, nullptr, c_pairs, c_triplets, c_chains );
+		}
+		FrameCompleted( frame.snapshot );
+		++frames;
+	}
+
+	fclose( fp );
+	CompactSolventBlocks();
+
+	logfile->Print( "ReplayBridges: \"%s\": %u frames\n", captureFile, frames );
+	return frames;
+}
+
+uint32 CHBonds :: PrepareCoordsFetch( uint32 totalFrames, real occurenceCutoff )
+{
+	assert( !sweepActiveLevel_ );
+
+	// collect the replayed blocks of the tuples that pass the cut-off
+	const uint32 snap_cutoff = static_cast<uint32>( ceil( totalFrames * occurenceCutoff ) );
+	fetchBlocks_.clear();
+	for ( size_t level = 0; level <= sweepLevels_.size(); ++level ) {
+		const HBPairScoreMap &pairScoreMap = level ? sweepLevels_[level-1].pairs : hbPairScoreMap_;
+		const HBTripletScoreMap &tripletScoreMap = level ? sweepLevels_[level-1].triplets : hbTripletScoreMap_;
+		for ( auto it = pairScoreMap.cbegin(); it != pairScoreMap.cend(); ++it ) {
+			if ( it->second.snaps < snap_cutoff )
+				continue;
+			for ( HBSolvent *block = it->second.solv; block; block = block->chain ) {
+				if ( block->snapshot != UINT32_BAD )
+					fetchBlocks_.push_back( std::make_pair( block->snapshot, block ) );
+			}
+		}
+		for ( auto it = tripletScoreMap.cbegin(); it != tripletScoreMap.cend(); ++it ) {
+			if ( it->second.snaps < snap_cutoff )
+				continue;
+			for ( HBSolvent *block = it->second.solv; block; block = block->chain ) {
+				if ( block->snapshot != UINT32_BAD )
+					fetchBlocks_.push_back( std::make_pair( block->snapshot, block ) );
+			}
+		}
+	}
+	// blocks of the same solvent in a snapshot share the coordinates
+	std::sort( fetchBlocks_.begin(), fetchBlocks_.end(), []( const std::pair<uint32,HBSolvent*> &a, const std::pair<uint32,HBSolvent*> &b ) {
+		return ( a.first != b.first ) ? ( a.first < b.first ) : ( a.second->s_index < b.second->s_index ); } );
+
+	uint32 numSnapshots = 0;
+	for ( size_t i = 0; i < fetchBlocks_.size(); ++i ) {
+		if ( !i || fetchBlocks_[i].first != fetchBlocks_[i-1].first )
+			++numSnapshots;
+	}
+
+	logfile->Print( "PrepareCoordsFetch: %u solvent blocks from %u snapshots\n", static_cast<uint32>( fetchBlocks_.size() ), numSnapshots );
+	return numSnapshots;
+}
+
+bool CHBonds :: IsFetchSnapshot( uint32 snapshotNum ) const
+{
+	auto it = std::lower_bound( fetchBlocks_.cbegin(), fetchBlocks_.cend(), snapshotNum, 
+		[]( const std::pair<uint32,HBSolvent*> &e, uint32 snapshot ) { return e.first < snapshot; } );
+	return ( it != fetchBlocks_.cend() && it->first == snapshotNum );
+}
+
+void CHBonds :: FetchCoords( const uint32 threadNum, const uint32 snapshotNum, const coord3_t *coords )
+{
+	// every block belongs to a single snapshot, so threads never share them
+	const atom_t *atoms = topology->GetAtomArray();
+	auto it = std::lower_bound( fetchBlocks_.cbegin(), fetchBlocks_.cend(), snapshotNum, 
+		[]( const std::pair<uint32,HBSolvent*> &e, uint32 snapshot ) { return e.first < snapshot; } );
+	if ( it == fetchBlocks_.cend() || it->first != snapshotNum )
+		return;
+	CSuperposition::Transform xform;
+	if ( superposition_.Count() )
+		superposition_.Fit( coords, xform );
+	HBSolventCoords *sc = nullptr;
+	for ( ; it != fetchBlocks_.cend() && it->first == snapshotNum; ++it ) {
+		HBSolvent *block = it->second;
+		assert( block->crd == nullptr );
+		if ( !sc || sc->s_index != block->s_index ) {
+			sc = AllocSolventCoords( threadNum, block->s_index, snapshotNum );
+			CopySolventCoords( sc, atoms, coords, superposition_.Count() ? &xform : nullptr );
+		}
+		block->crd = sc;
+		++sc->refs;
+	}
+}
@@ -33,6 +33,23 @@ interface IHBonds
 	virtual void BuildFinalSolvent( uint32 totalFrames ) = 0;
 	virtual	bool PrintFinalTuples( uint32 totalFrames, const char *tupleFile ) const = 0;
 	virtual void PrintPerformanceCounters() = 0;
+	virtual bool SaveState( uint32 totalFrames, const char *stateFile ) const = 0;
+	virtual uint32 MergeState( const char *stateFile ) = 0;
+	virtual uint32 LoadResults( const char *resultsFile ) = 0;
+	virtual void SetCheckpoint( const char *checkpointFile, uint32 everyFrames, real everyMinutes ) = 0;
+	virtual bool IsSnapshotDone( uint32 snapshotNum ) const = 0;
+	virtual void FinishCheckpoint() = 0;
+	virtual void SetCutoffSweep( const real *cutoffs, uint32 count ) = 0;
+	virtual uint32 GetCutoffLevels() const = 0;
+	virtual real SelectCutoffLevel( uint32 level ) = 0;
+	virtual bool BeginBridgeCapture( const char *captureFile ) = 0;
+	virtual void EndBridgeCapture() = 0;
+	virtual uint32 ReplayBridges( const char *captureFile ) = 0;
+	virtual uint32 PrepareCoordsFetch( uint32 totalFrames, real occurenceCutoff ) = 0;
+	virtual bool IsFetchSnapshot( uint32 snapshotNum ) const = 0;
+	virtual void FetchCoords( const uint32 threadNum, const uint32 snapshotNum, const struct coord3_s *coords ) = 0;
+	virtual bool WriteDensityMap( uint32 totalFrames, const char *dxFile ) = 0;
+	virtual void PrintPrecisionReport( uint32 totalFrames ) const = 0;
 };
 
 extern IHBonds *hbonds;
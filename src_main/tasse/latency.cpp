@@ -0,0 +1,99 @@
+/***************************************************************************
+* Copyright (C) 2015-2016 Alexander V. Popov.
+* 
+* This file is part of Tightly Associated Solvent Shell Extractor (TASSE) 
+* source code.
+* 
+* TASSE is free software; you can redistribute it and/or modify it under 
+* the terms of the GNU General Public License as published by the Free 
+* Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+* 
+* TASSE is distributed in the hope that it will be useful, but WITHOUT 
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or 
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+* for more details.
+* 
+* You should have received a copy of the GNU General Public License along
+* with this program; if not, write to the Free Software Foundation, Inc.,
+* 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+***************************************************************************/
+#include <tasse.h>
+#include <latency.h>
+
+void CLatencyHistogram :: Clear()
+{
+	count_ = 0;
+	total_ = 0;
+	max_ = 0;
+	memset( counts_, 0, sizeof(counts_) );
+}
+
+uint32 CLatencyHistogram :: BucketIndex( uint64 value )
+{
+	if ( value < 2 * LATENCY_SUB_BUCKETS )
+		return static_cast<uint32>( value );
+
+	// keep LATENCY_SUB_BITS bits below the top one
+	uint32 shift = 1;
+	while ( ( value >> shift ) >= 2 * LATENCY_SUB_BUCKETS )
+		++shift;
+	return ( shift + 1 ) * LATENCY_SUB_BUCKETS + static_cast<uint32>( value >> shift ) - LATENCY_SUB_BUCKETS;
+}
+
+uint64 CLatencyHistogram :: BucketHighest( uint32 index )
+{
+	if ( index < 2 * LATENCY_SUB_BUCKETS )
+		return index;
+
+	const uint32 shift = index / LATENCY_SUB_BUCKETS - 1;
+	const uint64 sub = index % LATENCY_SUB_BUCKETS + LATENCY_SUB_BUCKETS;
+	return ( ( sub + 1 ) << shift ) - 1;
+}
+
+void CLatencyHistogram :: Add( double milliseconds )
+{
+	const uint64 c_maxValue = ( uint64( 1 ) << LATENCY_MAX_BITS ) - 1;
+	const double us = std::max( milliseconds * 1000.0, 0.0 );
+	const uint64 value = ( us < static_cast<double>( c_maxValue ) ) ? static_cast<uint64>( us + 0.5 ) : c_maxValue;
+
+	++counts_[BucketIndex( value )];
+	++count_;
+	total_ += value;
+	max_ = std::max( max_, value );
+}
+
+void CLatencyHistogram :: Merge( const CLatencyHistogram &other )
+{
+	for ( uint32 i = 0; i < LATENCY_BUCKETS; ++i )
+		counts_[i] += other.counts_[i];
+	count_ += other.count_;
+	total_ += other.total_;
+	max_ = std::max( max_, other.max_ );
+}
+
+double CLatencyHistogram :: Total() const
+{
+	return total_ * 0.001;
+}
+
+double CLatencyHistogram :: Max() const
+{
+	return max_ * 0.001;
+}
+
+double CLatencyHistogram :: Percentile( double percent ) const
+{
+	if ( !count_ )
+		return 0;
+
+	// the smallest value not exceeded by the given percentage of the values
+	const uint64 rank = std::max( static_cast<uint64>( ceil( count_ * percent * 0.01 ) ), uint64( 1 ) );
+	uint64 seen = 0;
+	for ( uint32 i = 0; i < LATENCY_BUCKETS; ++i ) {
+		seen += counts_[i];
+		if ( seen >= rank )
+			return std::min( BucketHighest( i ), max_ ) * 0.001;
+	}
+	return Max();
+}
@@ -0,0 +1,61 @@
+/***************************************************************************
+* Copyright (C) 2015-2016 Alexander V. Popov.
+* 
+* This file is part of Tightly Associated Solvent Shell Extractor (TASSE) 
+* source code.
+* 
+* TASSE is free software; you can redistribute it and/or modify it under 
+* the terms of the GNU General Public License as published by the Free 
+* Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+* 
+* TASSE is distributed in the hope that it will be useful, but WITHOUT 
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or 
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+* for more details.
+* 
+* You should have received a copy of the GNU General Public License along
+* with this program; if not, write to the Free Software Foundation, Inc.,
+* 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+***************************************************************************/
+#ifndef TASSE_LATENCY_H
+#define TASSE_LATENCY_H
+
+// Latency histogram.
+// Values are counted in microseconds in log-linear buckets (as in HDR
+// histograms): values below 2*LATENCY_SUB_BUCKETS have a bucket of their own,
+// larger ones share a bucket with the values of the same power of two that
+// agree in the LATENCY_SUB_BITS bits below the top one, so percentiles are
+// exact to 1/LATENCY_SUB_BUCKETS of the value. A histogram is written by a 
+// single thread and needs no locking; the histograms of the threads are 
+// merged for the report.
+
+#define LATENCY_SUB_BITS	5
+#define LATENCY_SUB_BUCKETS	( 1 << LATENCY_SUB_BITS )
+#define LATENCY_MAX_BITS	36			// longer values are clamped (19 hours)
+#define LATENCY_BUCKETS		( ( LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1 ) * LATENCY_SUB_BUCKETS )
+
+class CLatencyHistogram
+{
+public:
+	CLatencyHistogram() { Clear(); }
+
+	void Clear();
+	void Add( double milliseconds );
+	void Merge( const CLatencyHistogram &other );
+	uint64 Count() const { return count_; }
+	double Total() const;
+	double Max() const;
+	double Percentile( double percent ) const;
+
+private:
+	static uint32 BucketIndex( uint64 value );
+	static uint64 BucketHighest( uint32 index );
+
+	uint64				count_;			// Number of values
+	uint64				total_;			// Sum of the values
+	uint64				max_;			// Largest value
+	uint32				counts_[LATENCY_BUCKETS];
+};
+
+#endif //TASSE_LATENCY_H
@@ -20,10 +20,30 @@
 ***************************************************************************/
 #include <tasse.h>
 
+// asynchronous records
+#define LOG_RECORD_SIZE		256			// bytes per ring slot
+#define LOG_RING_SIZE		256			// slots per thread (power of two)
+#define LOG_DRAIN_SPINS		64			// idle polls before the drain thread sleeps
+
+// a message takes one or more consecutive slots of its thread's ring
+typedef struct {
+	uint64				seq;			// position of the message in the log
+	uint32				length;			// bytes of text in this slot
+	uint32				parts;			// slots of the message (first slot only)
+	char				text[LOG_RECORD_SIZE - 16];
+} logRecord_t;
+
+// single producer (the owner thread), single consumer (the drain thread)
+typedef struct alignas( CACHE_LINE_SIZE ) {
+	std::atomic<uint32>	tail;			// next slot to write
+	logRecord_t			*records;		// LOG_RING_SIZE slots
+	alignas( CACHE_LINE_SIZE ) std::atomic<uint32> head;	// next slot to read
+} logRing_t;
+
 class CLogFile : public ILogFile
 {
 public:
-	CLogFile() : fp_( nullptr ), nolog_( false ) {}
+	CLogFile() : fp_( nullptr ), nolog_( false ), rings_( nullptr ), numRings_( 0 ), async_( false ), stop_( false ), nextSeq_( 0 ), drainedSeq_( 0 ) {}
 	virtual ~CLogFile() { Close(); }
 	virtual void Open( const char *filename );
 	virtual void Print( const char *fmt, ... );
@@ -31,17 +51,31 @@ public:
 	virtual void Write( const char *msg );
 	virtual void Close();
 	virtual void LogTimeElapsed( double elapsed_time );
+	virtual void BeginAsync( uint32 numThreads );
+	virtual void PrintAsync( uint32 threadNum, const char *fmt, ... );
+	virtual void EndAsync();
 private:
 	CLogFile( const CLogFile &other );
 	CLogFile& operator = ( const CLogFile& other );
 	void FormatTimeString( char *buf, size_t bufSize, const time_t *t ) const;
 	void SecondsToDHMS( uint32 elapsed_time, uint32 &days, uint32 &hours, uint32 &minutes, uint32 &seconds ) const;
+	bool WriteText( const char *msg );
+	bool PushRecord( logRing_t *ring, const char *msg, size_t length );
+	bool DrainRecord( char *output );
+	void DrainRecords();
+	static void Stub_DrainRecords( void *param );
 private:
 	static const size_t c_MaxLogFileOutputString;
 	static const char c_DefaultLogFileName[];
 private:
-	FILE	*fp_;
-	bool	nolog_;
+	FILE				*fp_;
+	bool				nolog_;
+	logRing_t			*rings_;
+	uint32				numRings_;
+	std::atomic<bool>	async_;
+	std::atomic<bool>	stop_;
+	std::atomic<uint64>	nextSeq_;		// next message ticket
+	std::atomic<uint64>	drainedSeq_;	// next message to be written
 };
 
 static CLogFile logfileLocal;
@@ -105,6 +139,8 @@ void CLogFile :: Open( const char *filename )
 
 void CLogFile :: Close()
 {
+	EndAsync();
+
 	if ( fp_ ) {
 		time_t t;
 		time( &t );
@@ -121,13 +157,13 @@ void CLogFile :: Close()
 	}
 }
 
-void CLogFile :: Write( const char *msg )
+bool CLogFile :: WriteText( const char *msg )
 {
 	if ( !nolog_ && !fp_ )
 		this->Open( c_DefaultLogFileName );
 
 	if ( nolog_ )
-		return;
+		return false;
 
 	for ( const char *s = msg; *s; ) {
 		if ( 0[s] == '^' ) {
@@ -139,11 +175,29 @@ void CLogFile :: Write( const char *msg )
 		fputc( *s++, fp_ );
 	}
 
-	fflush( fp_ );
-
 #if defined(_WIN32) && defined(_DEBUG)
 	OutputDebugString( msg );
 #endif
+	return true;
+}
+
+void CLogFile :: Write( const char *msg )
+{
+	if ( !async_ ) {
+		if ( WriteText( msg ) )
+			fflush( fp_ );
+		return;
+	}
+
+	// wait until the queued messages before this one are written
+	const uint64 seq = nextSeq_++;
+	while ( drainedSeq_.load( std::memory_order_acquire ) != seq )
+		ThreadYield();
+
+	if ( WriteText( msg ) )
+		fflush( fp_ );
+
+	drainedSeq_.store( seq + 1, std::memory_order_release );
 }
 
 void CLogFile :: Print( const char *fmt, ... )
@@ -196,3 +250,181 @@ void CLogFile :: LogTimeElapsed( double elapsed_time )
 		Print( "%.2f seconds elapsed\n", elapsed_seconds );
 	}
 }
+
+//////////////////////////////////////////////////////////////////////////
+// ASYNCHRONOUS RECORDS
+//////////////////////////////////////////////////////////////////////////
+// Messages printed for every snapshot would otherwise be formatted, written
+// and flushed while the worker holds the global lock. PrintAsync formats the
+// message into the calling thread's own ring and returns; a background
+// thread writes the rings out. Every message, queued or not, takes a ticket
+// from nextSeq_ and is written only when drainedSeq_ reaches it, so the log
+// reads exactly as if everything was written synchronously.
+//////////////////////////////////////////////////////////////////////////
+
+void CLogFile :: BeginAsync( uint32 numThreads )
+{
+	assert( !async_ );
+	assert( numThreads > 0 );
+
+	if ( nolog_ )
+		return;
+
+	rings_ = reinterpret_cast<logRing_t*>( utils->AllocAligned( sizeof(logRing_t) * numThreads, CACHE_LINE_SIZE ) );
+	for ( uint32 i = 0; i < numThreads; ++i ) {
+		logRing_t *ring = new ( &rings_[i] ) logRing_t;
+		ring->head = ring->tail = 0;
+		ring->records = reinterpret_cast<logRecord_t*>( utils->AllocAligned( sizeof(logRecord_t) * LOG_RING_SIZE, CACHE_LINE_SIZE ) );
+	}
+	numRings_ = numThreads;
+
+	nextSeq_ = drainedSeq_.load();
+	stop_ = false;
+	async_ = true;
+
+	if ( !ThreadStartService( Stub_DrainRecords, this ) ) {
+		// no drain thread, keep writing synchronously
+		async_ = false;
+		EndAsync();
+	}
+}
+
+void CLogFile :: EndAsync()
+{
+	if ( async_ ) {
+		// the drain thread writes what is left and exits
+		stop_ = true;
+		ThreadWaitService();
+		async_ = false;
+	}
+
+	if ( rings_ ) {
+		for ( uint32 i = 0; i < numRings_; ++i ) {
+			utils->FreeAligned( rings_[i].records );
+			rings_[i].~logRing_t();
+		}
+		utils->FreeAligned( rings_ );
+		rings_ = nullptr;
+	}
+	numRings_ = 0;
+}
+
+void CLogFile :: PrintAsync( uint32 threadNum, const char *fmt, ... )
+{
+	assert( fmt != nullptr );
+	char output[c_MaxLogFileOutputString];
+
+	va_list argptr;
+	va_start( argptr, fmt );
+	_vsnprintf_s( output, sizeof(output), sizeof(output)-1, fmt, argptr );
+	va_end( argptr );
+
+	if ( async_ && threadNum < numRings_ && PushRecord( &rings_[threadNum], output, strlen( output ) ) )
+		return;
+
+	this->Write( output );
+	if ( gpGlobals->verbose )
+		console->Write( output );
+}
+
+bool CLogFile :: PushRecord( logRing_t *ring, const char *msg, size_t length )
+{
+	const size_t c_slotText = sizeof(ring->records[0].text);
+	const uint32 parts = static_cast<uint32>( std::max<size_t>( ( length + c_slotText - 1 ) / c_slotText, 1 ) );
+	const uint32 tail = ring->tail.load( std::memory_order_relaxed );
+
+	// doesn't fit into the whole ring, the caller writes it directly
+	if ( parts > LOG_RING_SIZE )
+		return false;
+
+	// wait for room; the ticket is taken only then, so nobody waits for a 
+	// message that can't be queued
+	while ( tail + parts - ring->head.load( std::memory_order_acquire ) > LOG_RING_SIZE )
+		ThreadYield();
+
+	const uint64 seq = nextSeq_++;
+	for ( uint32 i = 0; i < parts; ++i ) {
+		logRecord_t *rec = &ring->records[( tail + i ) & ( LOG_RING_SIZE - 1 )];
+		const size_t partLength = std::min( length, c_slotText );
+		rec->seq = seq;
+		rec->length = static_cast<uint32>( partLength );
+		rec->parts = parts;
+		memcpy( rec->text, msg, partLength );
+		msg += partLength;
+		length -= partLength;
+	}
+
+	ring->tail.store( tail + parts, std::memory_order_release );
+	return true;
+}
+
+bool CLogFile :: DrainRecord( char *output )
+{
+	const uint64 seq = drainedSeq_.load( std::memory_order_acquire );
+
+	// find the ring holding the next message
+	for ( uint32 i = 0; i < numRings_; ++i ) {
+		logRing_t *ring = &rings_[i];
+		const uint32 head = ring->head.load( std::memory_order_relaxed );
+		if ( head == ring->tail.load( std::memory_order_acquire ) )
+			continue;
+
+		const logRecord_t *rec = &ring->records[head & ( LOG_RING_SIZE - 1 )];
+		if ( rec->seq != seq )
+			continue;
+
+		const uint32 parts = rec->parts;
+		size_t length = 0;
+		for ( uint32 j = 0; j < parts; ++j ) {
+			rec = &ring->records[( head + j ) & ( LOG_RING_SIZE - 1 )];
+			memcpy( output + length, rec->text, rec->length );
+			length += rec->length;
+		}
+		output[length] = '\0';
+		ring->head.store( head + parts, std::memory_order_release );
+
+		WriteText( output );
+		if ( gpGlobals->verbose )
+			console->Write( output );
+
+		drainedSeq_.store( seq + 1, std::memory_order_release );
+		return true;
+	}
+
+	// the next message is still being queued, or is written by its own thread
+	return false;
+}
+
+void CLogFile :: DrainRecords()
+{
+	char output[c_MaxLogFileOutputString];
+	bool written = false;
+
+	for ( uint32 idle = 0; ; ) {
+		if ( DrainRecord( output ) ) {
+			written = true;
+			idle = 0;
+			continue;
+		}
+
+		// flush once per burst instead of once per message
+		if ( written && fp_ ) {
+			fflush( fp_ );
+			written = false;
+		}
+
+		if ( stop_ && drainedSeq_.load( std::memory_order_acquire ) == nextSeq_.load( std::memory_order_acquire ) )
+			break;
+
+		if ( ++idle < LOG_DRAIN_SPINS ) {
+			ThreadYield();
+		} else {
+			ThreadSleep( 1 );
+		}
+	}
+}
+
+void CLogFile :: Stub_DrainRecords( void *param )
+{
+	reinterpret_cast<CLogFile*>( param )->DrainRecords();
+}
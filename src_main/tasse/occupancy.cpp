@@ -0,0 +1,447 @@
+/***************************************************************************
+* Copyright (C) 2015-2016 Alexander V. Popov.
+* 
+* This file is part of Tightly Associated Solvent Shell Extractor (TASSE) 
+* source code.
+* 
+* TASSE is free software; you can redistribute it and/or modify it under 
+* the terms of the GNU General Public License as published by the Free 
+* Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+* 
+* TASSE is distributed in the hope that it will be useful, but WITHOUT 
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or 
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+* for more details.
+* 
+* You should have received a copy of the GNU General Public License along
+* with this program; if not, write to the Free Software Foundation, Inc.,
+* 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+***************************************************************************/
+#include <tasse.h>
+#include <occupancy.h>
+
+#define OCC_ARRAY			0
+#define OCC_RUNS			1
+#define OCC_BITMAP			2
+
+// sizes are in 16-bit words: the array container never gets larger 
+// than the bitmap (8 kb), a run takes two words
+#define OCC_ARRAY_MAX		4096
+#define OCC_BITMAP_WORDS	4096
+
+// serialized container header (followed by container data words)
+typedef struct {
+	uint16		key;
+	uint16		type;
+	uint32		count;
+	uint32		size;
+} OccupancyHeader;
+
+static inline void AppendRun( std::vector<COccupancy::Run> &runs, uint32 first, uint32 count )
+{
+	if ( runs.size() && runs.back().first + runs.back().count == first ) {
+		runs.back().count += count;
+	} else {
+		COccupancy::Run run;
+		run.first = first;
+		run.count = count;
+		runs.push_back( run );
+	}
+}
+
+COccupancy::Container *COccupancy :: GetContainer( uint16 key )
+{
+	// snapshots come mostly in order, so it's usually the same container
+	if ( last_ < containers_.size() && containers_[last_].key == key )
+		return &containers_[last_];
+
+	auto it = std::lower_bound( containers_.begin(), containers_.end(), key, []( const Container &c, uint16 k ) { return c.key < k; } );
+	if ( it == containers_.end() || it->key != key ) {
+		Container c;
+		c.key = key;
+		c.type = OCC_ARRAY;
+		c.count = 0;
+		it = containers_.insert( it, c );
+	}
+	last_ = static_cast<size_t>( it - containers_.begin() );
+	return &*it;
+}
+
+void COccupancy :: GetContainerRuns( const Container *c, std::vector<Run> &runs ) const
+{
+	const uint32 base = static_cast<uint32>( c->key ) << 16;
+	const uint16 *data = c->data.data();
+	switch ( c->type ) {
+	case OCC_ARRAY:
+		for ( size_t i = 0; i < c->data.size(); ++i )
+			AppendRun( runs, base + data[i], 1 );
+		break;
+	case OCC_RUNS:
+		for ( size_t i = 0; i < c->data.size(); i += 2 )
+			AppendRun( runs, base + data[i], static_cast<uint32>( data[i+1] ) + 1 );
+		break;
+	default:
+		for ( uint32 i = 0; i < OCC_BITMAP_WORDS; ++i ) {
+			const uint16 word = data[i];
+			if ( !word )
+				continue;
+			if ( word == 0xFFFF ) {
+				AppendRun( runs, base + ( i << 4 ), 16 );
+				continue;
+			}
+			for ( uint32 j = 0; j < 16; ++j ) {
+				if ( word & ( 1 << j ) )
+					AppendRun( runs, base + ( i << 4 ) + j, 1 );
+			}
+		}
+		break;
+	}
+}
+
+bool COccupancy :: CheckContainer( const Container *c ) const
+{
+	// data read from a file must be as good as built by Add, the rest of
+	// the code relies on it
+	const uint16 *data = c->data.data();
+	uint32 count = 0;
+	switch ( c->type ) {
+	case OCC_ARRAY:
+		// strictly increasing values
+		if ( c->data.size() > OCC_ARRAY_MAX )
+			return false;
+		for ( size_t i = 1; i < c->data.size(); ++i ) {
+			if ( data[i] <= data[i-1] )
+				return false;
+		}
+		count = static_cast<uint32>( c->data.size() );
+		break;
+	case OCC_RUNS:
+		// ordered runs that don't overlap and stay inside the chunk
+		if ( c->data.size() & 1 )
+			return false;
+		for ( size_t i = 0; i < c->data.size(); i += 2 ) {
+			if ( static_cast<uint32>( data[i] ) + data[i+1] > 0xFFFF )
+				return false;
+			if ( i && data[i] <= static_cast<uint32>( data[i-2] ) + data[i-1] )
+				return false;
+			count += static_cast<uint32>( data[i+1] ) + 1;
+		}
+		break;
+	case OCC_BITMAP:
+		if ( c->data.size() != OCC_BITMAP_WORDS )
+			return false;
+		for ( size_t i = 0; i < c->data.size(); ++i ) {
+			for ( uint32 word = data[i]; word; word &= word - 1 )
+				++count;
+		}
+		break;
+	default:
+		return false;
+	}
+	return count == c->count;
+}
+
+uint32 COccupancy :: CountRuns( const Container *c ) const
+{
+	if ( c->type == OCC_RUNS )
+		return static_cast<uint32>( c->data.size() / 2 );
+
+	if ( c->type == OCC_ARRAY ) {
+		uint32 numRuns = 0;
+		for ( size_t i = 0; i < c->data.size(); ++i ) {
+			if ( !i || c->data[i] != c->data[i-1] + 1 )
+				++numRuns;
+		}
+		return numRuns;
+	}
+
+	std::vector<Run> runs;
+	GetContainerRuns( c, runs );
+	return static_cast<uint32>( runs.size() );
+}
+
+void COccupancy :: SetType( Container *c, uint16 type ) const
+{
+	std::vector<Run> runs;
+	GetContainerRuns( c, runs );
+
+	c->data.clear();
+	switch ( type ) {
+	case OCC_ARRAY:
+		c->data.reserve( c->count );
+		for ( auto it = runs.cbegin(); it != runs.cend(); ++it ) {
+			for ( uint32 i = 0; i < it->count; ++i )
+				c->data.push_back( static_cast<uint16>( it->first + i ) );
+		}
+		break;
+	case OCC_RUNS:
+		c->data.reserve( runs.size() * 2 );
+		for ( auto it = runs.cbegin(); it != runs.cend(); ++it ) {
+			c->data.push_back( static_cast<uint16>( it->first ) );
+			c->data.push_back( static_cast<uint16>( it->count - 1 ) );
+		}
+		break;
+	default:
+		c->data.assign( OCC_BITMAP_WORDS, 0 );
+		for ( auto it = runs.cbegin(); it != runs.cend(); ++it ) {
+			for ( uint32 i = 0; i < it->count; ++i ) {
+				const uint32 value = ( it->first + i ) & 0xFFFF;
+				c->data[value >> 4] |= static_cast<uint16>( 1 << ( value & 15 ) );
+			}
+		}
+		break;
+	}
+	c->data.shrink_to_fit();
+	c->type = type;
+}
+
+void COccupancy :: ChooseType( Container *c ) const
+{
+	// pick the smallest container for the data
+	uint16 type = OCC_BITMAP;
+	uint32 size = OCC_BITMAP_WORDS;
+	if ( c->count <= OCC_ARRAY_MAX && c->count < size ) {
+		type = OCC_ARRAY;
+		size = c->count;
+	}
+	if ( CountRuns( c ) * 2 < size )
+		type = OCC_RUNS;
+	if ( type != c->type )
+		SetType( c, type );
+}
+
+bool COccupancy :: AddToArray( Container *c, uint16 value ) const
+{
+	auto it = std::lower_bound( c->data.begin(), c->data.end(), value );
+	if ( it != c->data.end() && *it == value )
+		return false;
+	c->data.insert( it, value );
+	return true;
+}
+
+bool COccupancy :: AddToRuns( Container *c, uint16 value ) const
+{
+	std::vector<uint16> &data = c->data;
+	const size_t numRuns = data.size() / 2;
+
+	// find the first run that starts after the value
+	size_t lo = 0, hi = numRuns;
+	while ( lo < hi ) {
+		const size_t mid = ( lo + hi ) / 2;
+		if ( data[mid*2] <= value )
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	const uint32 prevEnd = lo ? static_cast<uint32>( data[lo*2-2] ) + data[lo*2-1] : 0;
+	if ( lo && value <= prevEnd )
+		return false;
+
+	const bool joinPrev = lo && value == prevEnd + 1;
+	const bool joinNext = lo < numRuns && static_cast<uint32>( value ) + 1 == data[lo*2];
+	if ( joinPrev && joinNext ) {
+		data[lo*2-1] = static_cast<uint16>( data[lo*2-1] + data[lo*2+1] + 2 );
+		data.erase( data.begin() + lo*2, data.begin() + lo*2 + 2 );
+	} else if ( joinPrev ) {
+		++data[lo*2-1];
+	} else if ( joinNext ) {
+		data[lo*2] = value;
+		++data[lo*2+1];
+	} else {
+		const uint16 run[2] = { value, 0 };
+		data.insert( data.begin() + lo*2, run, run + 2 );
+	}
+	return true;
+}
+
+bool COccupancy :: AddToBitmap( Container *c, uint16 value ) const
+{
+	uint16 &word = c->data[value >> 4];
+	const uint16 mask = static_cast<uint16>( 1 << ( value & 15 ) );
+	if ( word & mask )
+		return false;
+	word |= mask;
+	return true;
+}
+
+void COccupancy :: Add( uint32 index )
+{
+	Container *c = GetContainer( static_cast<uint16>( index >> 16 ) );
+	const uint16 value = static_cast<uint16>( index & 0xFFFF );
+
+	bool added;
+	switch ( c->type ) {
+	case OCC_ARRAY:		added = AddToArray( c, value ); break;
+	case OCC_RUNS:		added = AddToRuns( c, value ); break;
+	default:			added = AddToBitmap( c, value ); break;
+	}
+	if ( !added )
+		return;
+	++c->count;
+
+	// review the container type as it grows: runs as soon as they lose 
+	// to the array, arrays when they double in size or get too large
+	// (bitmaps are reviewed by Optimize only)
+	if ( c->type == OCC_RUNS ) {
+		if ( c->data.size() > std::min( c->count, static_cast<uint32>( OCC_BITMAP_WORDS ) ) )
+			ChooseType( c );
+	} else if ( c->type == OCC_ARRAY ) {
+		if ( c->count > OCC_ARRAY_MAX || ( c->count >= 64 && !( c->count & ( c->count - 1 ) ) ) )
+			ChooseType( c );
+	}
+}
+
+void COccupancy :: Assign( const std::vector<Run> &runs )
+{
+	// rebuild from sorted runs that don't overlap
+	containers_.clear();
+	last_ = 0;
+	for ( auto it = runs.cbegin(); it != runs.cend(); ++it ) {
+		uint32 first = it->first, count = it->count;
+		while ( count ) {
+			// split the run at chunk boundaries
+			const uint16 key = static_cast<uint16>( first >> 16 );
+			const uint32 chunkCount = std::min( count, 0x10000 - ( first & 0xFFFF ) );
+			if ( containers_.empty() || containers_.back().key != key ) {
+				Container c;
+				c.key = key;
+				c.type = OCC_RUNS;
+				c.count = 0;
+				containers_.push_back( c );
+			}
+			Container *c = &containers_.back();
+			c->data.push_back( static_cast<uint16>( first & 0xFFFF ) );
+			c->data.push_back( static_cast<uint16>( chunkCount - 1 ) );
+			c->count += chunkCount;
+			first += chunkCount;
+			count -= chunkCount;
+		}
+	}
+	Optimize();
+}
+
+void COccupancy :: Merge( const COccupancy &other )
+{
+	// union of the runs
+	std::vector<Run> runs, otherRuns, merged;
+	GetRuns( runs );
+	other.GetRuns( otherRuns );
+	merged.reserve( runs.size() + otherRuns.size() );
+	auto it1 = runs.cbegin(), it2 = otherRuns.cbegin();
+	while ( it1 != runs.cend() || it2 != otherRuns.cend() ) {
+		const Run &run = ( it2 == otherRuns.cend() || ( it1 != runs.cend() && it1->first < it2->first ) ) ? *it1++ : *it2++;
+		if ( merged.size() && merged.back().first + merged.back().count >= run.first ) {
+			const uint32 end = std::max( merged.back().first + merged.back().count, run.first + run.count );
+			merged.back().count = end - merged.back().first;
+		} else {
+			merged.push_back( run );
+		}
+	}
+	Assign( merged );
+}
+
+bool COccupancy :: Merge( const uint8 *data, size_t size )
+{
+	// merge serialized set, return false if the data is broken
+	COccupancy other;
+	uint32 numContainers;
+	if ( size < sizeof(numContainers) )
+		return false;
+	memcpy( &numContainers, data, sizeof(numContainers) );
+	size_t pos = sizeof(numContainers);
+
+	for ( uint32 i = 0; i < numContainers; ++i ) {
+		OccupancyHeader header;
+		if ( pos + sizeof(header) > size )
+			return false;
+		memcpy( &header, data + pos, sizeof(header) );
+		pos += sizeof(header);
+		if ( pos + header.size * sizeof(uint16) > size )
+			return false;
+		if ( other.containers_.size() && other.containers_.back().key >= header.key )
+			return false;
+		if ( header.type == OCC_ARRAY && header.size != header.count )
+			return false;
+		if ( ( header.type == OCC_RUNS && ( header.size & 1 ) ) || ( header.type == OCC_BITMAP && header.size != OCC_BITMAP_WORDS ) || header.type > OCC_BITMAP )
+			return false;
+
+		Container c;
+		c.key = header.key;
+		c.type = header.type;
+		c.count = header.count;
+		c.data.resize( header.size );
+		if ( header.size )
+			memcpy( c.data.data(), data + pos, header.size * sizeof(uint16) );
+		pos += header.size * sizeof(uint16);
+		if ( !CheckContainer( &c ) )
+			return false;
+		other.containers_.push_back( c );
+	}
+
+	if ( containers_.empty() )
+		containers_.swap( other.containers_ );
+	else
+		Merge( other );
+	return true;
+}
+
+uint32 COccupancy :: Count() const
+{
+	uint32 count = 0;
+	for ( auto it = containers_.cbegin(); it != containers_.cend(); ++it )
+		count += it->count;
+	return count;
+}
+
+uint32 COccupancy :: Last() const
+{
+	if ( containers_.empty() )
+		return 0;
+
+	std::vector<Run> runs;
+	GetContainerRuns( &containers_.back(), runs );
+	return runs.size() ? runs.back().first + runs.back().count - 1 : 0;
+}
+
+size_t COccupancy :: MemoryUsage() const
+{
+	size_t size = sizeof(*this) + containers_.capacity() * sizeof(Container);
+	for ( auto it = containers_.cbegin(); it != containers_.cend(); ++it )
+		size += it->data.capacity() * sizeof(uint16);
+	return size;
+}
+
+void COccupancy :: GetRuns( std::vector<Run> &runs ) const
+{
+	runs.clear();
+	for ( auto it = containers_.cbegin(); it != containers_.cend(); ++it )
+		GetContainerRuns( &*it, runs );
+}
+
+void COccupancy :: Optimize()
+{
+	for ( auto it = containers_.begin(); it != containers_.end(); ++it )
+		ChooseType( &*it );
+	containers_.shrink_to_fit();
+}
+
+void COccupancy :: Serialize( std::vector<uint8> &buffer ) const
+{
+	const uint32 numContainers = static_cast<uint32>( containers_.size() );
+	const uint8 *bytes = reinterpret_cast<const uint8*>( &numContainers );
+	buffer.insert( buffer.end(), bytes, bytes + sizeof(numContainers) );
+
+	for ( auto it = containers_.cbegin(); it != containers_.cend(); ++it ) {
+		OccupancyHeader header;
+		header.key = it->key;
+		header.type = it->type;
+		header.count = it->count;
+		header.size = static_cast<uint32>( it->data.size() );
+		bytes = reinterpret_cast<const uint8*>( &header );
+		buffer.insert( buffer.end(), bytes, bytes + sizeof(header) );
+		bytes = reinterpret_cast<const uint8*>( it->data.data() );
+		buffer.insert( buffer.end(), bytes, bytes + it->data.size() * sizeof(uint16) );
+	}
+}
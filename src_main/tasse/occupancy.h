@@ -0,0 +1,74 @@
+/***************************************************************************
+* Copyright (C) 2015-2016 Alexander V. Popov.
+* 
+* This file is part of Tightly Associated Solvent Shell Extractor (TASSE) 
+* source code.
+* 
+* TASSE is free software; you can redistribute it and/or modify it under 
+* the terms of the GNU General Public License as published by the Free 
+* Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+* 
+* TASSE is distributed in the hope that it will be useful, but WITHOUT 
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or 
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+* for more details.
+* 
+* You should have received a copy of the GNU General Public License along
+* with this program; if not, write to the Free Software Foundation, Inc.,
+* 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+***************************************************************************/
+#ifndef TASSE_OCCUPANCY_H
+#define TASSE_OCCUPANCY_H
+
+// Compressed set of snapshot indices (roaring-style).
+// Indices are split into chunks of 64K by their high 16 bits, every chunk
+// is kept in a container of its own: a sorted array of the low 16 bits
+// (sparse chunks), a list of runs (continuous presence) or a plain 64K-bit
+// bitmap (dense flickering chunks). The container type follows the data,
+// so the memory stays close to the smallest of the three.
+
+class COccupancy
+{
+	typedef struct {
+		uint16				key;		// High 16 bits of the indices
+		uint16				type;		// Container type (OCC_xxx)
+		uint32				count;		// Number of indices in the container
+		std::vector<uint16>	data;		// Sorted values, (start, length-1) run pairs or bitmap words
+	} Container;
+
+public:
+	typedef struct {
+		uint32				first;		// First index of the run
+		uint32				count;		// Number of consecutive indices
+	} Run;
+
+	COccupancy() : last_( 0 ) {}
+
+	void Add( uint32 index );
+	void Merge( const COccupancy &other );
+	bool Merge( const uint8 *data, size_t size );
+	uint32 Count() const;
+	uint32 Last() const;
+	size_t MemoryUsage() const;
+	void GetRuns( std::vector<Run> &runs ) const;
+	void Optimize();
+	void Serialize( std::vector<uint8> &buffer ) const;
+
+private:
+	Container *GetContainer( uint16 key );
+	void SetType( Container *c, uint16 type ) const;
+	uint32 CountRuns( const Container *c ) const;
+	void ChooseType( Container *c ) const;
+	void Assign( const std::vector<Run> &runs );
+	bool AddToArray( Container *c, uint16 value ) const;
+	bool AddToRuns( Container *c, uint16 value ) const;
+	bool AddToBitmap( Container *c, uint16 value ) const;
+	void GetContainerRuns( const Container *c, std::vector<Run> &runs ) const;
+	bool CheckContainer( const Container *c ) const;
+
+	std::vector<Container>	containers_;	// Containers sorted by key
+	size_t					last_;			// Container of the last added index
+};
+
+#endif //TASSE_OCCUPANCY_H
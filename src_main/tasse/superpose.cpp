@@ -0,0 +1,165 @@
+/***************************************************************************
+* Copyright (C) 2015-2016 Alexander V. Popov.
+* 
+* This file is part of Tightly Associated Solvent Shell Extractor (TASSE) 
+* source code.
+* 
+* TASSE is free software; you can redistribute it and/or modify it under 
+* the terms of the GNU General Public License as published by the Free 
+* Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+* 
+* TASSE is distributed in the hope that it will be useful, but WITHOUT 
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or 
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+* for more details.
+* 
+* You should have received a copy of the GNU General Public License along
+* with this program; if not, write to the Free Software Foundation, Inc.,
+* 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+***************************************************************************/
+#include <tasse.h>
+#include <topology.h>
+#include <superpose.h>
+
+// Jacobi sweeps of the 4x4 eigenproblem (it converges in a few)
+#define MAX_JACOBI_SWEEPS	32
+
+void CSuperposition :: SetReference( const coord3_t *coords, const std::vector<uint32> &indices )
+{
+	indices_ = indices;
+	ref_.resize( indices_.size() );
+	memset( &refCenter_, 0, sizeof(refCenter_) );
+	refSumSq_ = 0;
+	if ( indices_.empty() )
+		return;
+
+	for ( auto it = indices_.cbegin(); it != indices_.cend(); ++it ) {
+		refCenter_.x += coords[*it].x;
+		refCenter_.y += coords[*it].y;
+		refCenter_.z += coords[*it].z;
+	}
+	const real invCount = real( 1.0 ) / indices_.size();
+	refCenter_.x *= invCount;
+	refCenter_.y *= invCount;
+	refCenter_.z *= invCount;
+
+	for ( size_t i = 0; i < indices_.size(); ++i ) {
+		coord3_t *r = &ref_[i];
+		r->x = coords[indices_[i]].x - refCenter_.x;
+		r->y = coords[indices_[i]].y - refCenter_.y;
+		r->z = coords[indices_[i]].z - refCenter_.z;
+		refSumSq_ += r->x * r->x + r->y * r->y + r->z * r->z;
+	}
+}
+
+void CSuperposition :: Fit( const coord3_t *coords, Transform &xf ) const
+{
+	assert( !indices_.empty() );
+
+	// single pass: the reference is centered, so the covariance of the 
+	// centered frame is the plain sum of x * r (independent sums let the
+	// compiler keep them in vector registers)
+	real sx = 0, sy = 0, sz = 0, sq = 0;
+	real sxx = 0, sxy = 0, sxz = 0, syx = 0, syy = 0, syz = 0, szx = 0, szy = 0, szz = 0;
+	const size_t count = indices_.size();
+	for ( size_t i = 0; i < count; ++i ) {
+		const coord3_t *x = &coords[indices_[i]];
+		const coord3_t *r = &ref_[i];
+		sx += x->x;	sy += x->y;	sz += x->z;
+		sq += x->x * x->x + x->y * x->y + x->z * x->z;
+		sxx += x->x * r->x;	sxy += x->x * r->y;	sxz += x->x * r->z;
+		syx += x->y * r->x;	syy += x->y * r->y;	syz += x->y * r->z;
+		szx += x->z * r->x;	szy += x->z * r->y;	szz += x->z * r->z;
+	}
+	const real invCount = real( 1.0 ) / count;
+	xf.center.x = sx * invCount;
+	xf.center.y = sy * invCount;
+	xf.center.z = sz * invCount;
+	xf.refCenter = refCenter_;
+	const real sumSq = sq - ( sx * sx + sy * sy + sz * sz ) * invCount;
+
+	// Horn's quaternion matrix, its largest eigenvector is the rotation
+	real m[4][4] = {
+		{ sxx + syy + szz,	syz - szy,			szx - sxz,			sxy - syx },
+		{ syz - szy,		sxx - syy - szz,	sxy + syx,			szx + sxz },
+		{ szx - sxz,		sxy + syx,			-sxx + syy - szz,	syz + szy },
+		{ sxy - syx,		szx + sxz,			syz + szy,			-sxx - syy + szz } };
+	real q[4];
+	LargestEigenvector( m, q );
+
+	// largest eigenvalue (the diagonal after the sweeps) gives the residual
+	real lambda = m[0][0];
+	for ( int i = 1; i < 4; ++i )
+		lambda = std::max( lambda, m[i][i] );
+	xf.rmsd = sqrt( std::max( real( 0 ), sumSq + refSumSq_ - 2 * lambda ) * invCount );
+
+	const real q00 = q[0] * q[0], q11 = q[1] * q[1], q22 = q[2] * q[2], q33 = q[3] * q[3];
+	const real q01 = q[0] * q[1], q02 = q[0] * q[2], q03 = q[0] * q[3];
+	const real q12 = q[1] * q[2], q13 = q[1] * q[3], q23 = q[2] * q[3];
+	xf.rot[0][0] = q00 + q11 - q22 - q33;
+	xf.rot[0][1] = 2 * ( q12 - q03 );
+	xf.rot[0][2] = 2 * ( q13 + q02 );
+	xf.rot[1][0] = 2 * ( q12 + q03 );
+	xf.rot[1][1] = q00 - q11 + q22 - q33;
+	xf.rot[1][2] = 2 * ( q23 - q01 );
+	xf.rot[2][0] = 2 * ( q13 - q02 );
+	xf.rot[2][1] = 2 * ( q23 + q01 );
+	xf.rot[2][2] = q00 - q11 - q22 + q33;
+}
+
+void CSuperposition :: LargestEigenvector( real m[4][4], real v[4] )
+{
+	// cyclic Jacobi rotations of the symmetric matrix, eigenvectors are
+	// accumulated in the columns of e
+	real e[4][4] = { { 1, 0, 0, 0 }, { 0, 1, 0, 0 }, { 0, 0, 1, 0 }, { 0, 0, 0, 1 } };
+	for ( int sweep = 0; sweep < MAX_JACOBI_SWEEPS; ++sweep ) {
+		real offDiag = 0, diag = 0;
+		for ( int i = 0; i < 4; ++i ) {
+			diag += fabs( m[i][i] );
+			for ( int j = i + 1; j < 4; ++j )
+				offDiag += fabs( m[i][j] );
+		}
+		if ( offDiag <= diag * real( 1e-15 ) )
+			break;
+		for ( int p = 0; p < 3; ++p ) {
+			for ( int r = p + 1; r < 4; ++r ) {
+				if ( m[p][r] == 0 )
+					continue;
+				const real theta = ( m[r][r] - m[p][p] ) / ( 2 * m[p][r] );
+				const real t = ( theta >= 0 ? real( 1 ) : real( -1 ) ) / ( fabs( theta ) + sqrt( theta * theta + 1 ) );
+				const real c = real( 1 ) / sqrt( t * t + 1 );
+				const real s = t * c;
+				for ( int k = 0; k < 4; ++k ) {
+					const real mkp = m[k][p], mkr = m[k][r];
+					m[k][p] = c * mkp - s * mkr;
+					m[k][r] = s * mkp + c * mkr;
+				}
+				for ( int k = 0; k < 4; ++k ) {
+					const real mpk = m[p][k], mrk = m[r][k];
+					m[p][k] = c * mpk - s * mrk;
+					m[r][k] = s * mpk + c * mrk;
+				}
+				for ( int k = 0; k < 4; ++k ) {
+					const real ekp = e[k][p], ekr = e[k][r];
+					e[k][p] = c * ekp - s * ekr;
+					e[k][r] = s * ekp + c * ekr;
+				}
+			}
+		}
+	}
+
+	int best = 0;
+	for ( int i = 1; i < 4; ++i ) {
+		if ( m[i][i] > m[best][best] )
+			best = i;
+	}
+	real norm = 0;
+	for ( int k = 0; k < 4; ++k ) {
+		v[k] = e[k][best];
+		norm += v[k] * v[k];
+	}
+	norm = real( 1.0 ) / sqrt( norm );
+	for ( int k = 0; k < 4; ++k )
+		v[k] *= norm;
+}
@@ -0,0 +1,65 @@
+/***************************************************************************
+* Copyright (C) 2015-2016 Alexander V. Popov.
+* 
+* This file is part of Tightly Associated Solvent Shell Extractor (TASSE) 
+* source code.
+* 
+* TASSE is free software; you can redistribute it and/or modify it under 
+* the terms of the GNU General Public License as published by the Free 
+* Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+* 
+* TASSE is distributed in the hope that it will be useful, but WITHOUT 
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or 
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+* for more details.
+* 
+* You should have received a copy of the GNU General Public License along
+* with this program; if not, write to the Free Software Foundation, Inc.,
+* 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+***************************************************************************/
+#ifndef TASSE_SUPERPOSE_H
+#define TASSE_SUPERPOSE_H
+
+// Least-squares superposition of a frame onto the reference coordinates
+// (Kabsch). The covariance of the fitted atoms is accumulated in a single
+// pass (the reference is kept centered), the rotation comes from the 
+// largest eigenvector of Horn's quaternion matrix, so it is always proper
+// and needs no special handling of reflections.
+
+class CSuperposition
+{
+public:
+	typedef struct {
+		real				rot[3][3];	// Rotation matrix
+		coord3_t			center;		// Centroid of the fitted atoms in the frame
+		coord3_t			refCenter;	// Centroid of the fitted atoms in the reference
+		real				rmsd;		// RMSD of the fitted atoms after superposition
+	} Transform;
+
+	CSuperposition() : refSumSq_( 0 ) { memset( &refCenter_, 0, sizeof(refCenter_) ); }
+
+	void SetReference( const coord3_t *coords, const std::vector<uint32> &indices );
+	size_t Count() const { return indices_.size(); }
+	void Fit( const coord3_t *coords, Transform &xf ) const;
+
+	static void Apply( const Transform &xf, const coord3_t &src, coord3_t &dst )
+	{
+		const real x = src.x - xf.center.x;
+		const real y = src.y - xf.center.y;
+		const real z = src.z - xf.center.z;
+		dst.x = xf.rot[0][0] * x + xf.rot[0][1] * y + xf.rot[0][2] * z + xf.refCenter.x;
+		dst.y = xf.rot[1][0] * x + xf.rot[1][1] * y + xf.rot[1][2] * z + xf.refCenter.y;
+		dst.z = xf.rot[2][0] * x + xf.rot[2][1] * y + xf.rot[2][2] * z + xf.refCenter.z;
+	}
+
+private:
+	static void LargestEigenvector( real m[4][4], real v[4] );
+
+	std::vector<uint32>		indices_;		// Fitted atoms
+	std::vector<coord3_t>	ref_;			// Centered reference coordinates of the fitted atoms
+	coord3_t				refCenter_;		// Centroid of the reference
+	real					refSumSq_;		// Sum of squared centered reference coordinates
+};
+
+#endif //TASSE_SUPERPOSE_H
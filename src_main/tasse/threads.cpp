@@ -51,6 +51,46 @@ static double threadtimes[THREADTIMES_SIZE];
 static uint32 oldf = 0;
 extern void ThreadUpdateGUI( float progress );
 
+// intra-frame task scheduling
+// every thread owns a deque holding a contiguous range of tasks of a single group;
+// the owner pops tasks from the back, idle threads steal a half from the front
+typedef struct {
+	TaskStub_t			func;			// task function
+	void				*param;			// task function parameter
+	std::atomic<uint32>	remaining;		// number of unfinished tasks
+} taskgroup_t;
+
+typedef struct alignas( CACHE_LINE_SIZE ) {
+	std::atomic_flag	lock;			// spin lock guarding the range
+	taskgroup_t			*group;			// group the range belongs to
+	uint32				first;			// first task index
+	uint32				last;			// last task index (exclusive)
+} taskdeque_t;
+
+static taskdeque_t *taskdeques = nullptr;
+static int numtaskdeques = 0;
+static int framesinflight_max = 0;
+static bool tasking = false;
+static std::atomic<int> framesinflight( 0 );
+static std::atomic<bool> workdispatched( false );
+static std::atomic<int> threadsrunning( 0 );
+static std::atomic<bool> jobrunning( false );
+static JobStub_t jobfunction = nullptr;
+static void *jobparam = nullptr;
+static JobStub_t servicefunction = nullptr;
+static void *serviceparam = nullptr;
+
+// thread affinity
+typedef struct {
+	int					id;				// node number
+	std::vector<int>	cpus;			// logical processors of the node
+} numanode_t;
+
+static std::vector<int> threadcpus;		// logical processor for each thread (empty if not pinned)
+static void ThreadGetNodeLayout( std::vector<numanode_t> &nodes );
+static bool ThreadGetAllowedCPUs( std::vector<int> &cpus );
+static int ThreadMaxCPUs();
+
 void ThreadInterrupt()
 {
 	thread_interrupt = true;
@@ -67,16 +107,19 @@ static uint32 ThreadGetWork()
 
 	if ( thread_interrupt ) {
 		ThreadDebug( "ThreadGetWork: thread interrupted\n" );
+		workdispatched = true;
 		ThreadUnlock();
 		return -1;
 	}
 	if ( dispatch > workcount ) {
 		ThreadDebug( "ThreadGetWork: dispatch > workcount!\n" );
+		workdispatched = true;
 		ThreadUnlock();
 		return -1;
 	}
 	if ( dispatch == workcount ) {
 		ThreadDebug( "ThreadGetWork: dispatch == workcount, work is complete\n" );
+		workdispatched = true;
 		ThreadUnlock();
 		return -1;
 	}
@@ -129,13 +172,176 @@ static uint32 ThreadGetWork()
 	}
 
 	uint32 r = dispatch++;
+	++framesinflight;
 	ThreadUnlock();
 
 	return r;
 }
 
+static void TaskDequeLock( taskdeque_t *dq )
+{
+	while ( dq->lock.test_and_set( std::memory_order_acquire ) )
+		;
+}
+
+static void TaskDequeUnlock( taskdeque_t *dq )
+{
+	dq->lock.clear( std::memory_order_release );
+}
+
+static void TaskDequeFree()
+{
+	if ( taskdeques ) {
+		for ( int i = 0; i < numtaskdeques; ++i )
+			taskdeques[i].~taskdeque_t();
+		utils->FreeAligned( taskdeques );
+		taskdeques = nullptr;
+	}
+	numtaskdeques = 0;
+}
+
+static void TaskDequeReset()
+{
+	if ( numtaskdeques != ThreadCount() ) {
+		TaskDequeFree();
+		numtaskdeques = ThreadCount();
+		taskdeques = reinterpret_cast<taskdeque_t*>( utils->AllocAligned( sizeof(taskdeque_t) * numtaskdeques, CACHE_LINE_SIZE ) );
+		for ( int i = 0; i < numtaskdeques; ++i )
+			new ( &taskdeques[i] ) taskdeque_t;
+	}
+	for ( int i = 0; i < numtaskdeques; ++i ) {
+		taskdeques[i].lock.clear();
+		taskdeques[i].group = nullptr;
+		taskdeques[i].first = taskdeques[i].last = 0;
+	}
+}
+
+static bool ThreadRunLocalTask( const uint32 threadnum )
+{
+	taskdeque_t *dq = &taskdeques[threadnum];
+
+	TaskDequeLock( dq );
+	if ( dq->first >= dq->last ) {
+		TaskDequeUnlock( dq );
+		return false;
+	}
+	taskgroup_t *group = dq->group;
+	const uint32 task = --dq->last;
+	TaskDequeUnlock( dq );
+
+	group->func( threadnum, task, group->param );
+
+	// the group may be released by its owner right after this
+	--group->remaining;
+	return true;
+}
+
+static bool ThreadStealTask( const uint32 threadnum )
+{
+	const uint32 count = static_cast<uint32>( ThreadCount() );
+
+	for ( uint32 i = 1; i < count; ++i ) {
+		taskdeque_t *victim = &taskdeques[( threadnum + i ) % count];
+
+		// take a half of the victim's range
+		TaskDequeLock( victim );
+		const uint32 avail = victim->last - victim->first;
+		if ( victim->first >= victim->last ) {
+			TaskDequeUnlock( victim );
+			continue;
+		}
+		const uint32 take = ( avail + 1 ) / 2;
+		taskgroup_t *group = victim->group;
+		const uint32 first = victim->first;
+		victim->first += take;
+		TaskDequeUnlock( victim );
+
+		// put it to our own deque, so it can be stolen further
+		taskdeque_t *dq = &taskdeques[threadnum];
+		TaskDequeLock( dq );
+		assert( dq->first >= dq->last );
+		dq->group = group;
+		dq->first = first;
+		dq->last = first + take;
+		TaskDequeUnlock( dq );
+
+		while ( ThreadRunLocalTask( threadnum ) )
+			;
+		return true;
+	}
+
+	return false;
+}
+
+void ThreadSetFramesInFlight( int count )
+{
+	framesinflight_max = count;
+	logfile->Print( "ThreadSetFramesInFlight: %i frame(s)%s\n", ThreadFramesInFlight(), 
+		( ThreadFramesInFlight() < ThreadCount() ) ? ", intra-frame tasks enabled" : "" );
+}
+
+int ThreadFramesInFlight()
+{
+	if ( framesinflight_max <= 0 || framesinflight_max > ThreadCount() )
+		return ThreadCount();
+	return framesinflight_max;
+}
+
+bool ThreadTasking()
+{
+	return tasking;
+}
+
+bool ThreadJobRunning()
+{
+	return jobrunning;
+}
+
+void RunTasksOn( uint32 threadnum, uint32 taskcnt, TaskStub_t func, void *param )
+{
+	if ( !tasking || taskcnt < 2 ) {
+		// nobody to share the work with
+		for ( uint32 i = 0; i < taskcnt && !thread_interrupt; ++i )
+			func( threadnum, i, param );
+		return;
+	}
+
+	taskgroup_t group;
+	group.func = func;
+	group.param = param;
+	group.remaining = taskcnt;
+
+	taskdeque_t *dq = &taskdeques[threadnum];
+	TaskDequeLock( dq );
+	assert( dq->first >= dq->last );
+	dq->group = &group;
+	dq->first = 0;
+	dq->last = taskcnt;
+	TaskDequeUnlock( dq );
+
+	// run own tasks, then help the others until the whole group is done
+	while ( group.remaining ) {
+		if ( ThreadRunLocalTask( threadnum ) )
+			continue;
+		if ( ThreadStealTask( threadnum ) )
+			continue;
+		ThreadYield();
+	}
+}
+
 static void ThreadWorkerFunction( const uint32 threadnum, const uint32 )
 {
+	if ( tasking && threadnum >= static_cast<uint32>( ThreadFramesInFlight() ) ) {
+		// helper thread: never takes frames, only steals tasks
+		// from the frame owners until all frames are done
+		while ( !workdispatched || framesinflight ) {
+			if ( !ThreadStealTask( threadnum ) )
+				ThreadYield();
+		}
+		ThreadDebug( "ThreadWorkerFunction: helper exit!\n" );
+		return;
+	}
+
 	int work;
 
 	while ( ( work = ThreadGetWork() ) != -1 ) {
@@ -146,15 +352,145 @@ static void ThreadWorkerFunction( const uint32 threadnum, const uint32 )
 		ThreadDebug( msgBuf );
 #endif
 		workfunction( threadnum, work );
+		--framesinflight;
 	}
 
 	ThreadDebug( "ThreadWorkerFunction: exit!\n" );
 }
 
+// parse a processor list like "0-3,8,10-11"
+static bool ParseCPUList( const char *str, std::vector<int> &cpus )
+{
+	cpus.clear();
+	while ( *str ) {
+		char *end;
+		long first = strtol( str, &end, 10 );
+		if ( end == str || first < 0 )
+			return false;
+		long last = first;
+		str = end;
+		if ( *str == '-' ) {
+			last = strtol( str + 1, &end, 10 );
+			if ( end == str + 1 || last < first )
+				return false;
+			str = end;
+		}
+		for ( long i = first; i <= last; ++i )
+			cpus.push_back( static_cast<int>( i ) );
+		if ( *str == ',' )
+			++str;
+		else if ( *str && *str != '\n' && *str != '\r' )
+			return false;
+		else
+			break;
+	}
+	return !cpus.empty();
+}
+
+static void PrintCPUList( char *dst, size_t size, const std::vector<int> &cpus )
+{
+	dst[0] = '\0';
+	for ( size_t i = 0; i < cpus.size(); ) {
+		size_t j = i;
+		while ( j + 1 < cpus.size() && cpus[j+1] == cpus[j] + 1 )
+			++j;
+		char range[32];
+		if ( j > i )
+			sprintf_s( range, sizeof(range), "%s%i-%i", i ? "," : "", cpus[i], cpus[j] );
+		else
+			sprintf_s( range, sizeof(range), "%s%i", i ? "," : "", cpus[i] );
+		strncat_s( dst, size, range, size - strlen( dst ) - 1 );
+		i = j + 1;
+	}
+}
+
+void ThreadSetAffinity( const char *mode )
+{
+	std::vector<numanode_t> nodes;
+	char buf[1024];
+
+	threadcpus.clear();
+
+	// report node layout
+	ThreadGetNodeLayout( nodes );
+	logfile->Print( "ThreadSetAffinity: %u NUMA node(s)\n", static_cast<uint32>( nodes.size() ) );
+	for ( size_t i = 0; i < nodes.size(); ++i ) {
+		PrintCPUList( buf, sizeof(buf), nodes[i].cpus );
+		logfile->Print( "  node %i: %u CPU(s) [%s]\n", nodes[i].id, static_cast<uint32>( nodes[i].cpus.size() ), buf );
+	}
+
+	if ( !mode || !mode[0] || ThreadCount() <= 1 )
+		return;
+
+	std::vector<int> cpus;
+	if ( !_stricmp( mode, "compact" ) ) {
+		// fill the nodes one by one
+		for ( size_t i = 0; i < nodes.size(); ++i )
+			cpus.insert( cpus.end(), nodes[i].cpus.begin(), nodes[i].cpus.end() );
+	} else if ( !_stricmp( mode, "scatter" ) ) {
+		// spread threads evenly across the nodes
+		for ( size_t j = 0; cpus.size() < static_cast<size_t>( ThreadHardwareCount() ); ++j ) {
+			size_t added = 0;
+			for ( size_t i = 0; i < nodes.size(); ++i ) {
+				if ( j < nodes[i].cpus.size() ) {
+					cpus.push_back( nodes[i].cpus[j] );
+					++added;
+				}
+			}
+			if ( !added )
+				break;
+		}
+	} else if ( !ParseCPUList( mode, cpus ) ) {
+		utils->Warning( "invalid thread affinity \"%s\", threads are not pinned\n", mode );
+		return;
+	}
+
+	// CPU numbers can have gaps (offline CPUs), so only the range is checked
+	// here, and the process affinity mask below drops the missing ones
+	for ( size_t i = 0; i < cpus.size(); ++i ) {
+		if ( cpus[i] >= ThreadMaxCPUs() ) {
+			utils->Warning( "thread affinity \"%s\": no CPU %i on this system, threads are not pinned\n", mode, cpus[i] );
+			return;
+		}
+	}
+	if ( cpus.empty() )
+		return;
+
+	// drop CPUs the process is not allowed to run on (taskset, cpusets, Slurm),
+	// otherwise the threads pinned there would fail to start
+	std::vector<int> allowed;
+	if ( ThreadGetAllowedCPUs( allowed ) ) {
+		const size_t count = cpus.size();
+		cpus.erase( std::remove_if( cpus.begin(), cpus.end(), [&allowed]( int cpu ) {
+			return !std::binary_search( allowed.begin(), allowed.end(), cpu ); } ), cpus.end() );
+		if ( cpus.empty() ) {
+			PrintCPUList( buf, sizeof(buf), allowed );
+			utils->Warning( "thread affinity \"%s\": the process may only run on CPU(s) %s, threads are not pinned\n", mode, buf );
+			return;
+		}
+		if ( cpus.size() < count )
+			logfile->Print( "ThreadSetAffinity: %u CPU(s) outside of the process affinity mask skipped\n", static_cast<uint32>( count - cpus.size() ) );
+	}
+
+	// threads wrap around if there are more of them than CPUs
+	threadcpus.resize( ThreadCount() );
+	for ( int i = 0; i < ThreadCount(); ++i )
+		threadcpus[i] = cpus[i % cpus.size()];
+
+	logfile->Print( "ThreadSetAffinity: %s\n", mode );
+	for ( int i = 0; i < ThreadCount(); ++i )
+		logfile->Print( "  thread %i: CPU %i\n", i, threadcpus[i] );
+}
+
 void RunThreadsOnIndividual( uint32 workcnt, uint32 flags, ThreadStub_t func )
 {
 	workfunction = func;
+	framesinflight = 0;
+	workdispatched = false;
+	tasking = ( ThreadFramesInFlight() < ThreadCount() );
+	TaskDequeReset();
 	RunThreadsOn( workcnt, flags, ThreadWorkerFunction );
+	tasking = false;
 }
 
 #if defined(USE_WIN32_THREADS)
@@ -168,21 +504,57 @@ static CRITICAL_SECTION crit;
 static int enter;
 ThreadStub_t thread_entry;
 
+int ThreadHardwareCount()
+{
+	// count processors in all groups (more than 64 logical processors are split into groups)
+	DWORD count = GetActiveProcessorCount( ALL_PROCESSOR_GROUPS );
+	if ( !count ) {
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		count = info.dwNumberOfProcessors;
+	}
+	return static_cast<int>( count );
+}
+
+int ThreadAvailableCount()
+{
+	int count = ThreadHardwareCount();
+
+	// process affinity mask only covers a single processor group
+	if ( GetActiveProcessorGroupCount() == 1 ) {
+		DWORD_PTR processMask = 0, systemMask = 0;
+		if ( GetProcessAffinityMask( GetCurrentProcess(), &processMask, &systemMask ) && processMask ) {
+			int affinity = 0;
+			for ( ; processMask; processMask &= processMask - 1 )
+				++affinity;
+			count = std::min( count, affinity );
+		}
+	}
+
+	// job object CPU rate cap (containers, job schedulers)
+	JOBOBJECT_CPU_RATE_CONTROL_INFORMATION rate;
+	memset( &rate, 0, sizeof(rate) );
+	if ( QueryInformationJobObject( nullptr, JobObjectCpuRateControlInformation, &rate, sizeof(rate), nullptr ) &&
+		( rate.ControlFlags & JOB_OBJECT_CPU_RATE_CONTROL_ENABLE ) && ( rate.ControlFlags & JOB_OBJECT_CPU_RATE_CONTROL_HARD_CAP ) ) {
+		// CpuRate is in 1/100 of a percent of all processors
+		const int quota = static_cast<int>( ceil( ThreadHardwareCount() * rate.CpuRate / 10000.0 ) );
+		count = std::min( count, std::max( quota, 1 ) );
+		logfile->Print( "ThreadAvailableCount: job CPU rate %.2f%%\n", rate.CpuRate / 100.0 );
+	}
+
+	return std::max( count, 1 );
+}
+
 void ThreadSetDefault( int count, bool low_priority )
 {
 	lowpriority = low_priority;
 	numthreads = count;
 
-	if ( numthreads == -1 ) {
-		SYSTEM_INFO info;
-		GetSystemInfo(&info);
-		numthreads = info.dwNumberOfProcessors;
-	}
+	if ( numthreads == -1 )
+		numthreads = ThreadAvailableCount();
 
 	if ( numthreads < 1 )
 		numthreads = 1;
-	else if ( numthreads > MAX_THREADS )
-		numthreads = MAX_THREADS;
 
 	logfile->Print( "ThreadSetDefault: %i thread(s)\n", numthreads );
 
@@ -198,6 +570,8 @@ void ThreadCleanup()
 		DeleteCriticalSection( &crit );
 		crit_init = false;
 	}
+	ThreadWaitJob();
+	TaskDequeFree();
 }
 
 int ThreadCount()
@@ -237,16 +611,173 @@ static void ThreadResetPriority()
 	SetPriorityClass( GetCurrentProcess(), oldpriority );
 }
 
+void ThreadYield()
+{
+	SwitchToThread();
+}
+
+void ThreadSleep( int milliseconds )
+{
+	Sleep( milliseconds );
+}
+
+static void ThreadGetNodeLayout( std::vector<numanode_t> &nodes )
+{
+	// logical processor numbers are global across processor groups
+	std::vector<int> groupbase;
+	WORD numgroups = GetActiveProcessorGroupCount();
+	for ( WORD g = 0, base = 0; g < numgroups; ++g ) {
+		groupbase.push_back( base );
+		base += static_cast<WORD>( GetMaximumProcessorCount( g ) );
+	}
+
+	ULONG highest = 0;
+	if ( GetNumaHighestNodeNumber( &highest ) ) {
+		for ( ULONG n = 0; n <= highest; ++n ) {
+			GROUP_AFFINITY ga;
+			if ( !GetNumaNodeProcessorMaskEx( static_cast<USHORT>( n ), &ga ) || !ga.Mask || ga.Group >= groupbase.size() )
+				continue;
+			numanode_t node;
+			node.id = static_cast<int>( n );
+			for ( int i = 0; i < static_cast<int>( sizeof(KAFFINITY) * 8 ); ++i ) {
+				if ( ga.Mask & ( KAFFINITY( 1 ) << i ) )
+					node.cpus.push_back( groupbase[ga.Group] + i );
+			}
+			nodes.push_back( node );
+		}
+	}
+
+	if ( nodes.empty() ) {
+		numanode_t node;
+		node.id = 0;
+		for ( int i = 0; i < ThreadHardwareCount(); ++i )
+			node.cpus.push_back( i );
+		nodes.push_back( node );
+	}
+}
+
+static int ThreadMaxCPUs()
+{
+	// logical processor numbers are global across processor groups
+	return static_cast<int>( GetMaximumProcessorCount( ALL_PROCESSOR_GROUPS ) );
+}
+
+static bool ThreadGetAllowedCPUs( std::vector<int> &cpus )
+{
+	// process affinity mask only covers a single processor group
+	DWORD_PTR processMask = 0, systemMask = 0;
+	if ( GetActiveProcessorGroupCount() != 1 || !GetProcessAffinityMask( GetCurrentProcess(), &processMask, &systemMask ) )
+		return false;
+
+	cpus.clear();
+	for ( int i = 0; i < static_cast<int>( sizeof(DWORD_PTR) * 8 ); ++i ) {
+		if ( processMask & ( DWORD_PTR( 1 ) << i ) )
+			cpus.push_back( i );
+	}
+	return !cpus.empty();
+}
+
+static void ThreadPin( HANDLE hThread, int cpu )
+{
+	// find processor group of the CPU
+	WORD numgroups = GetActiveProcessorGroupCount();
+	for ( WORD g = 0; g < numgroups; ++g ) {
+		int count = static_cast<int>( GetMaximumProcessorCount( g ) );
+		if ( cpu < count ) {
+			GROUP_AFFINITY ga;
+			memset( &ga, 0, sizeof(ga) );
+			ga.Group = g;
+			ga.Mask = KAFFINITY( 1 ) << cpu;
+			if ( !SetThreadGroupAffinity( hThread, &ga, nullptr ) )
+				ThreadDebug( "Unable to set thread affinity!\n" );
+			return;
+		}
+		cpu -= count;
+	}
+}
+
 static DWORD WINAPI ThreadEntryStub( LPVOID pParam )
 {
 	thread_entry( (uint32)pParam, 0 );
 	return 0;
 }
 
+static HANDLE jobhandle = nullptr;
+
+static DWORD WINAPI ThreadJobStub( LPVOID )
+{
+	jobfunction( jobparam );
+	jobrunning = false;
+	return 0;
+}
+
+bool ThreadStartJob( JobStub_t func, void *param )
+{
+	if ( jobrunning )
+		return false;
+	ThreadWaitJob();
+
+	jobfunction = func;
+	jobparam = param;
+	jobrunning = true;
+	jobhandle = CreateThread( nullptr, 0, (LPTHREAD_START_ROUTINE)ThreadJobStub, nullptr, 0, nullptr );
+	if ( !jobhandle ) {
+		// run it right here
+		ThreadDebug( "Unable to create job thread!\n" );
+		func( param );
+		jobrunning = false;
+	}
+	return true;
+}
+
+void ThreadWaitJob()
+{
+	if ( jobhandle ) {
+		WaitForSingleObject( jobhandle, INFINITE );
+		CloseHandle( jobhandle );
+		jobhandle = nullptr;
+	}
+}
+
+static HANDLE servicehandle = nullptr;
+
+static DWORD WINAPI ThreadServiceStub( LPVOID )
+{
+	servicefunction( serviceparam );
+	return 0;
+}
+
+bool ThreadStartService( JobStub_t func, void *param )
+{
+	if ( servicehandle )
+		return false;
+
+	servicefunction = func;
+	serviceparam = param;
+	servicehandle = CreateThread( nullptr, 0, (LPTHREAD_START_ROUTINE)ThreadServiceStub, nullptr, 0, nullptr );
+	if ( !servicehandle ) {
+		// the caller does the work itself
+		ThreadDebug( "Unable to create service thread!\n" );
+		return false;
+	}
+	return true;
+}
+
+void ThreadWaitService()
+{
+	if ( servicehandle ) {
+		WaitForSingleObject( servicehandle, INFINITE );
+		CloseHandle( servicehandle );
+		servicehandle = nullptr;
+	}
+}
+
 void RunThreadsOn( uint32 workcnt, uint32 flags, ThreadStub_t func )
 {
-	DWORD threadid[MAX_THREADS];
-	HANDLE threadhandle[MAX_THREADS];
+	std::vector<DWORD> threadid;
+	std::vector<HANDLE> threadhandle;
+	std::vector<uint32> threadindex;
+	std::vector<uint32> threadfailed;
 	double start = utils->FloatMilliseconds() * 0.001;
 
 	dispatch = 0;
@@ -270,20 +801,44 @@ void RunThreadsOn( uint32 workcnt, uint32 flags, ThreadStub_t func )
 	thread_entry = func;
 
 	// create threads
+	threadid.resize( numthreads );
+	threadhandle.reserve( numthreads );
+	threadindex.reserve( numthreads );
 	for ( int i = 0; i < numthreads; ++i ) {
 		HANDLE hThread = CreateThread( nullptr, 0, (LPTHREAD_START_ROUTINE)ThreadEntryStub, (LPVOID)i, CREATE_SUSPENDED, &threadid[i] );
-		if ( hThread )
-			threadhandle[i] = hThread;
-		else
-			ThreadDebug( "Unable to create thread!\n" );
+		if ( hThread ) {
+			if ( !threadcpus.empty() )
+				ThreadPin( hThread, threadcpus[i] );
+			threadhandle.push_back( hThread );
+			threadindex.push_back( i );
+		} else {
+			utils->Warning( "unable to create thread %i, its work is done by the main thread\n", i );
+			threadfailed.push_back( i );
+		}
 	}
 
 	// start threads
-	for ( long i = 0; i < numthreads; ++i ) {
-		if ( ResumeThread( threadhandle[i] ) == 0xffffffff )
-			ThreadDebug( "Unable to resume thread!\n" );
+	for ( size_t i = 0; i < threadhandle.size(); ) {
+		if ( ResumeThread( threadhandle[i] ) == 0xffffffff ) {
+			// the thread has never run, so it can be dropped safely
+			utils->Warning( "unable to start thread %u, its work is done by the main thread\n", threadindex[i] );
+			TerminateThread( threadhandle[i], 0 );
+			CloseHandle( threadhandle[i] );
+			threadfailed.push_back( threadindex[i] );
+			threadhandle.erase( threadhandle.begin() + i );
+			threadindex.erase( threadindex.begin() + i );
+		} else {
+			++i;
+		}
 	}
 
+	// a missing frame owner would leave its frames undispatched and the helper
+	// threads spinning forever, so the share of a failed thread runs right here
+	// (frame owners have lower numbers than helpers and go first)
+	std::sort( threadfailed.begin(), threadfailed.end() );
+	for ( size_t i = 0; i < threadfailed.size(); ++i )
+		func( threadfailed[i], 0 );
+
 #if defined(THREAD_DEBUG)
 	char msgBuf[256];
 	memset( msgBuf, 0, sizeof(msgBuf) );
@@ -292,15 +847,26 @@ void RunThreadsOn( uint32 workcnt, uint32 flags, ThreadStub_t func )
 #endif
 
 	// wait for threads to complete
+	// a single wait can't handle more than MAXIMUM_WAIT_OBJECTS handles
 	for ( ;; ) {
-		DWORD dwWaitResult = WaitForMultipleObjects( numthreads, threadhandle, TRUE, THREAD_CHECK_TIMEOUT );
-		if ( dwWaitResult == WAIT_TIMEOUT ) {
+		bool threads_done = true;
+		for ( size_t i = 0; i < threadhandle.size(); i += MAXIMUM_WAIT_OBJECTS ) {
+			const DWORD count = static_cast<DWORD>( std::min<size_t>( MAXIMUM_WAIT_OBJECTS, threadhandle.size() - i ) );
+			if ( WaitForMultipleObjects( count, &threadhandle[i], TRUE, THREAD_CHECK_TIMEOUT ) == WAIT_TIMEOUT ) {
+				threads_done = false;
+				break;
+			}
+		}
+		if ( threads_done )
+			break;
 #if defined(_QTASSE)
-			ThreadUpdateGUI( progress );
+		ThreadUpdateGUI( progress );
 #endif
-		} else break;
 	}
 
+	for ( size_t i = 0; i < threadhandle.size(); ++i )
+		CloseHandle( threadhandle[i] );
+
 	thread_entry = nullptr;
 	threaded = false;
 	ThreadResetPriority();
@@ -351,34 +917,161 @@ static int ThreadMilliseconds()
 	return curtime;
 }
 
-void ThreadSetDefault( int count, bool low_priority )
+int ThreadHardwareCount()
 {
-	lowpriority = low_priority;
-	numthreads = count;
+	// poll /proc/cpuinfo
+	FILE *fp = nullptr;
+	int count = 0;
+	if ( !fopen_s( &fp, "/proc/cpuinfo", "r" ) ) {
+		char buf[1024];
+		memset(buf,0,sizeof(buf));
+		while ( !feof( fp ) ) {
+			if ( !fgets( buf, sizeof(buf)-1, fp ) )
+				break;
+			if ( !_strnicmp( buf, "processor", 9 ) )
+				++count;
+		}
+		fclose( fp );
+	}
+	return std::max( count, 1 );
+}
+
+static bool ThreadReadFileLine( const char *path, char *buf, size_t size )
+{
+	FILE *fp = nullptr;
+	if ( fopen_s( &fp, path, "r" ) )
+		return false;
+	memset( buf, 0, size );
+	bool result = ( fgets( buf, static_cast<int>( size ) - 1, fp ) != nullptr );
+	fclose( fp );
+	return result;
+}
 
-	if ( numthreads == -1 ) {
-		// poll /proc/cpuinfo
-		FILE *fp = nullptr;
-		if ( fopen_s( &fp, "/proc/cpuinfo", "r" ) ) {
-			numthreads = 1;
+// returns CPU quota of the current cgroup (0 if unlimited)
+static double ThreadCGroupQuota()
+{
+	char v1path[MAX_OSPATH], v2path[MAX_OSPATH];
+	memset( v1path, 0, sizeof(v1path) );
+	memset( v2path, 0, sizeof(v2path) );
+
+	// find our cgroup paths: "hierarchy-ID:controller-list:cgroup-path"
+	FILE *fp = nullptr;
+	if ( fopen_s( &fp, "/proc/self/cgroup", "r" ) )
+		return 0;
+	char line[1024];
+	while ( fgets( line, sizeof(line)-1, fp ) ) {
+		char *controllers = strchr( line, ':' );
+		if ( !controllers )
+			continue;
+		char *path = strchr( ++controllers, ':' );
+		if ( !path )
+			continue;
+		*path++ = '\0';
+		path[strcspn( path, "\r\n" )] = '\0';
+		if ( !controllers[0] ) {
+			strncat_s( v2path, path, sizeof(v2path)-1 );
 		} else {
-			char buf[1024];
-			memset(buf,0,sizeof(buf));
-			numthreads = 0;
-			while ( !feof( fp ) ) {
-				if ( !fgets( buf, sizeof(buf)-1, fp ) )
-					break;
-				if ( !_strnicmp( buf, "processor", 9 ) )
-					++numthreads;
+			// v1 "cpu" controller may be mounted together with others
+			for ( char *tok = controllers; tok; ) {
+				char *next = strchr( tok, ',' );
+				if ( next )
+					*next++ = '\0';
+				if ( !strcmp( tok, "cpu" ) ) {
+					memset( v1path, 0, sizeof(v1path) );
+					strncat_s( v1path, path, sizeof(v1path)-1 );
+				}
+				tok = next;
 			}
-			fclose( fp );
 		}
 	}
+	fclose( fp );
+
+	double quota = 0;
+	char file[MAX_OSPATH*2];
+	char buf[256];
+
+	// cgroup v2: "$MAX $PERIOD" in cpu.max, limits of the parents apply too
+	if ( v2path[0] ) {
+		for ( ;; ) {
+			sprintf_s( file, sizeof(file), "/sys/fs/cgroup%s/cpu.max", ( v2path[0] == '/' && !v2path[1] ) ? "" : v2path );
+			if ( ThreadReadFileLine( file, buf, sizeof(buf) ) ) {
+				long long limit = 0, period = 0;
+				if ( buf[0] != 'm' && sscanf( buf, "%lld %lld", &limit, &period ) == 2 && limit > 0 && period > 0 ) {
+					const double q = static_cast<double>( limit ) / period;
+					if ( quota <= 0 || q < quota )
+						quota = q;
+				}
+			}
+			char *slash = strrchr( v2path, '/' );
+			if ( !slash || slash == v2path )
+				break;
+			*slash = '\0';
+		}
+	}
+
+	// cgroup v1: cpu.cfs_quota_us / cpu.cfs_period_us
+	// (inside a container the cgroup is usually mounted as its root)
+	static const char *v1mounts[] = { "/sys/fs/cgroup/cpu,cpuacct", "/sys/fs/cgroup/cpuacct,cpu", "/sys/fs/cgroup/cpu" };
+	for ( size_t i = 0; i < sizeof(v1mounts)/sizeof(v1mounts[0]) && v1path[0]; ++i ) {
+		for ( int j = 0; j < 2; ++j ) {
+			const char *sub = ( j == 0 && strcmp( v1path, "/" ) ) ? v1path : "";
+			long long limit = 0, period = 0;
+			sprintf_s( file, sizeof(file), "%s%s/cpu.cfs_quota_us", v1mounts[i], sub );
+			if ( !ThreadReadFileLine( file, buf, sizeof(buf) ) )
+				continue;
+			limit = atoll( buf );
+			sprintf_s( file, sizeof(file), "%s%s/cpu.cfs_period_us", v1mounts[i], sub );
+			if ( !ThreadReadFileLine( file, buf, sizeof(buf) ) )
+				continue;
+			period = atoll( buf );
+			if ( limit > 0 && period > 0 ) {
+				const double q = static_cast<double>( limit ) / period;
+				if ( quota <= 0 || q < quota )
+					quota = q;
+			}
+			i = sizeof(v1mounts)/sizeof(v1mounts[0]);
+			break;
+		}
+	}
+
+	return quota;
+}
+
+int ThreadAvailableCount()
+{
+	int count = ThreadHardwareCount();
+
+	// CPUs we are allowed to run on (taskset, Slurm, cpusets)
+	cpu_set_t cpuset;
+	CPU_ZERO( &cpuset );
+	if ( !sched_getaffinity( 0, sizeof(cpuset), &cpuset ) ) {
+		const int affinity = CPU_COUNT( &cpuset );
+		if ( affinity > 0 && affinity < count ) {
+			logfile->Print( "ThreadAvailableCount: affinity mask allows %i CPU(s)\n", affinity );
+			count = affinity;
+		}
+	}
+
+	// CPU bandwidth limit (containers, Slurm with cgroup enforcement)
+	const double quota = ThreadCGroupQuota();
+	if ( quota > 0 ) {
+		logfile->Print( "ThreadAvailableCount: cgroup CPU quota %.2f\n", quota );
+		count = std::min( count, static_cast<int>( ceil( quota ) ) );
+	}
+
+	return std::max( count, 1 );
+}
+
+void ThreadSetDefault( int count, bool low_priority )
+{
+	lowpriority = low_priority;
+	numthreads = count;
+
+	if ( numthreads == -1 )
+		numthreads = ThreadAvailableCount();
 
 	if ( numthreads < 1 )
 		numthreads = 1;
-	else if ( numthreads > MAX_THREADS )
-		numthreads = MAX_THREADS;
 
 	logfile->Print( "ThreadSetDefault: %i thread(s)\n", numthreads );
 
@@ -395,6 +1088,8 @@ void ThreadCleanup()
 		free( pth_mutex );
 		pth_mutex = nullptr;
 	}
+	ThreadWaitJob();
+	TaskDequeFree();
 }
 
 int ThreadCount()
@@ -433,17 +1128,154 @@ static void ThreadResetPriority()
 	setpriority( PRIO_PROCESS, 0, 0 );
 }
 
+void ThreadYield()
+{
+	sched_yield();
+}
+
+void ThreadSleep( int milliseconds )
+{
+	usleep( milliseconds * 1000 );
+}
+
+static void ThreadGetNodeLayout( std::vector<numanode_t> &nodes )
+{
+	// poll sysfs for NUMA nodes
+	DIR *dir = opendir( "/sys/devices/system/node" );
+	if ( dir ) {
+		struct dirent *ent;
+		while ( ( ent = readdir( dir ) ) != nullptr ) {
+			if ( strncmp( ent->d_name, "node", 4 ) || ent->d_name[4] < '0' || ent->d_name[4] > '9' )
+				continue;
+			char path[MAX_OSPATH];
+			sprintf_s( path, sizeof(path), "/sys/devices/system/node/%s/cpulist", ent->d_name );
+			FILE *fp = nullptr;
+			if ( fopen_s( &fp, path, "r" ) )
+				continue;
+			char buf[1024];
+			memset( buf, 0, sizeof(buf) );
+			numanode_t node;
+			node.id = atoi( &ent->d_name[4] );
+			if ( fgets( buf, sizeof(buf)-1, fp ) && ParseCPUList( buf, node.cpus ) )
+				nodes.push_back( node );
+			fclose( fp );
+		}
+		closedir( dir );
+		std::sort( nodes.begin(), nodes.end(), []( const numanode_t &a, const numanode_t &b ) { return a.id < b.id; } );
+	}
+
+	if ( nodes.empty() ) {
+		numanode_t node;
+		node.id = 0;
+		for ( int i = 0; i < ThreadHardwareCount(); ++i )
+			node.cpus.push_back( i );
+		nodes.push_back( node );
+	}
+}
+
+static int ThreadMaxCPUs()
+{
+	return CPU_SETSIZE;
+}
+
+static bool ThreadGetAllowedCPUs( std::vector<int> &cpus )
+{
+	cpu_set_t cpuset;
+	CPU_ZERO( &cpuset );
+	if ( sched_getaffinity( 0, sizeof(cpuset), &cpuset ) )
+		return false;
+
+	cpus.clear();
+	for ( int i = 0; i < CPU_SETSIZE; ++i ) {
+		if ( CPU_ISSET( i, &cpuset ) )
+			cpus.push_back( i );
+	}
+	return !cpus.empty();
+}
+
 static void *ThreadEntryStub( void *pParam )
 {
 	long lParam = (long)pParam;
 	thread_entry( (uint32)lParam, 0 );
+	--threadsrunning;
+	return nullptr;
+}
+
+static pthread_t jobhandle;
+static bool jobstarted = false;
+
+static void *ThreadJobStub( void * )
+{
+	jobfunction( jobparam );
+	jobrunning = false;
+	return nullptr;
+}
+
+bool ThreadStartJob( JobStub_t func, void *param )
+{
+	if ( jobrunning )
+		return false;
+	ThreadWaitJob();
+
+	jobfunction = func;
+	jobparam = param;
+	jobrunning = true;
+	if ( pthread_create( &jobhandle, nullptr, ThreadJobStub, nullptr ) != 0 ) {
+		// run it right here
+		ThreadDebug( "Unable to create job thread!\n" );
+		func( param );
+		jobrunning = false;
+	} else {
+		jobstarted = true;
+	}
+	return true;
+}
+
+void ThreadWaitJob()
+{
+	if ( jobstarted ) {
+		pthread_join( jobhandle, nullptr );
+		jobstarted = false;
+	}
+}
+
+static pthread_t servicehandle;
+static bool servicestarted = false;
+
+static void *ThreadServiceStub( void * )
+{
+	servicefunction( serviceparam );
 	return nullptr;
 }
 
+bool ThreadStartService( JobStub_t func, void *param )
+{
+	if ( servicestarted )
+		return false;
+
+	servicefunction = func;
+	serviceparam = param;
+	if ( pthread_create( &servicehandle, nullptr, ThreadServiceStub, nullptr ) != 0 ) {
+		// the caller does the work itself
+		ThreadDebug( "Unable to create service thread!\n" );
+		return false;
+	}
+	servicestarted = true;
+	return true;
+}
+
+void ThreadWaitService()
+{
+	if ( servicestarted ) {
+		pthread_join( servicehandle, nullptr );
+		servicestarted = false;
+	}
+}
+
 void RunThreadsOn( uint32 workcnt, uint32 flags, ThreadStub_t func )
 {
-	pthread_t threadhandle[MAX_THREADS];
-	pthread_attr_t threadattrib;
+	std::vector<pthread_t> threadhandle;
+	std::vector<uint32> threadfailed;
 	double start = utils->FloatMilliseconds() * 0.001;
 	int starttime = 0;
 
@@ -471,13 +1303,39 @@ void RunThreadsOn( uint32 workcnt, uint32 flags, ThreadStub_t func )
 	threaded = true;
 	thread_entry = func;
 
-	pthread_attr_init( &threadattrib );
-
+	threadsrunning = numthreads;
+	threadhandle.resize( numthreads );
 	for ( long i = 0; i < numthreads; ++i ) {
-		if ( pthread_create( &threadhandle[i], &threadattrib, ThreadEntryStub, (void*)i ) == -1 )
-			ThreadDebug( "Unable to create thread!\n" );
+		int result = -1;
+		if ( !threadcpus.empty() ) {
+			// fresh attributes for every thread, so a failure can't leak a CPU mask to the next one
+			pthread_attr_t threadattrib;
+			cpu_set_t cpuset;
+			CPU_ZERO( &cpuset );
+			CPU_SET( threadcpus[i], &cpuset );
+			pthread_attr_init( &threadattrib );
+			if ( pthread_attr_setaffinity_np( &threadattrib, sizeof(cpuset), &cpuset ) == 0 )
+				result = pthread_create( &threadhandle[i], &threadattrib, ThreadEntryStub, (void*)i );
+			pthread_attr_destroy( &threadattrib );
+			if ( result != 0 )
+				utils->Warning( "unable to pin thread %li to CPU %i, thread is not pinned\n", i, threadcpus[i] );
+		}
+		if ( result != 0 )
+			result = pthread_create( &threadhandle[i], nullptr, ThreadEntryStub, (void*)i );
+		if ( result != 0 ) {
+			utils->Warning( "unable to create thread %li (%s), its work is done by the main thread\n", i, strerror( result ) );
+			threadhandle[i] = 0;
+			threadfailed.push_back( static_cast<uint32>( i ) );
+			--threadsrunning;
+		}
 	}
 
+	// a missing frame owner would leave its frames undispatched and the helper
+	// threads spinning forever, so the share of a failed thread runs right here
+	// (frame owners have lower numbers than helpers and go first)
+	for ( size_t i = 0; i < threadfailed.size(); ++i )
+		func( threadfailed[i], 0 );
+
 #if defined(THREAD_DEBUG)
 	char msgBuf[256];
 	memset( msgBuf, 0, sizeof(msgBuf) );
@@ -489,27 +1347,25 @@ void RunThreadsOn( uint32 workcnt, uint32 flags, ThreadStub_t func )
 	starttime = ThreadMilliseconds();
 
 	for ( ;; ) {
+		// check if threads completed
+		// (pthread_kill can't be used here: exited but not joined threads still count as alive)
+		if ( !threadsrunning )
+			break;
+
 		// check timeout
 		int newtime = ThreadMilliseconds();
 		if ( newtime - starttime >= THREAD_CHECK_TIMEOUT ) {
 			starttime = newtime;
-
-			// check if threads completed
-			bool threads_done = true;
-			for ( int i = 0; i < numthreads; ++i ) {
-				if ( !pthread_kill( threadhandle[i], 0 ) ) {
-					// thread alive
-					threads_done = false;
-					break;
-				}
-			}
-
-			if ( threads_done )
-				break;
 #if defined(_QTASSE)
 			ThreadUpdateGUI( progress );
 #endif
 		}
+		usleep( 1000 );
+	}
+
+	for ( int i = 0; i < numthreads; ++i ) {
+		if ( threadhandle[i] )
+			pthread_join( threadhandle[i], nullptr );
 	}
 
 	thread_entry = nullptr;
@@ -540,8 +1396,45 @@ finalmsg:
 
 #else
 
+void ThreadYield() {}
+void ThreadSleep( int ) {}
+void ThreadWaitService() {}
+
+bool ThreadStartService( JobStub_t, void* )
+{
+	// no background threads, the caller does the work itself
+	return false;
+}
 void ThreadSetDefault( int, bool ) {}
-void ThreadCleanup() {}
+void ThreadCleanup() { ThreadWaitJob(); TaskDequeFree(); }
+int ThreadHardwareCount() { return 1; }
+int ThreadAvailableCount() { return 1; }
+void ThreadWaitJob() {}
+
+bool ThreadStartJob( JobStub_t func, void *param )
+{
+	func( param );
+	return true;
+}
+
+static void ThreadGetNodeLayout( std::vector<numanode_t> &nodes )
+{
+	numanode_t node;
+	node.id = 0;
+	node.cpus.push_back( 0 );
+	nodes.push_back( node );
+}
+
+static int ThreadMaxCPUs()
+{
+	return 1;
+}
+
+static bool ThreadGetAllowedCPUs( std::vector<int> &cpus )
+{
+	cpus.assign( 1, 0 );
+	return true;
+}
 void ThreadLock() {}
 void ThreadUnlock() {}
 int ThreadCount() { return 1; }
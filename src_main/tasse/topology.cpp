@@ -28,8 +28,23 @@
 class CTopology : public ITopology
 {
 	typedef struct {
+		uint32 replica;
+		uint32 frame;
 		char *pdbfile;
-	} trajItemPDB_t;
+	} trajItem_t;
+	typedef struct {
+		const char *file;
+		int nature;
+		size_t framebase;
+		size_t framesize;
+	} trajReplica_t;
+	typedef struct alignas( CACHE_LINE_SIZE ) {
+		coord3_t *coords;
+		FILE **files;
+		char *frame;
+		double readTime;	// time spent reading the last frame, in milliseconds
+		double parseTime;	// time spent parsing it (negative if not separate from reading)
+	} trajThread_t;
 public:
 	CTopology();
 	virtual ~CTopology();
@@ -37,14 +52,16 @@ public:
 	virtual void Clear();
 	virtual bool Load( const char *topFile, int topNature, const char *crdFile, int crdNature );
 	virtual bool Save( const char *outFile );
-	virtual uint32 ProcessTrajectory( const char *trajFile, int trajNature, size_t firstSnap, TrajectoryCallback_t func, bool pacifier );
+	virtual uint32 ProcessTrajectory( const char *trajFile, int trajNature, size_t firstSnap, size_t lastSnap, size_t snapStride, TrajectoryCallback_t func, bool pacifier );
+	virtual uint32 ProcessTrajectories( uint32 trajCount, const char *const *trajFiles, const int *trajNatures, size_t firstSnap, size_t lastSnap, size_t snapStride, TrajectoryCallback_t func, bool pacifier );
+	virtual void SetTrajectoryFilter( TrajectoryFilter_t func );
 	virtual size_t GetAtomCount() const { return atcount_; }
 	virtual size_t GetSolventSize() const { return solvsize_; }
 	virtual atom_t *GetAtomArray() const { return atoms_; }
 	virtual coord3_t *GetBaseCoords() const { return coords_base_; }
+	virtual void GetFrameTimes( uint32 threadNum, double &readTime, double &parseTime ) const;
 
-	void ProcessTrajectoryThread_PDB( uint32 threadnum, uint32 num );
-	void ProcessTrajectoryThread_AMBER( uint32 threadnum, uint32 num );
+	void ProcessTrajectoryThread( uint32 threadnum, uint32 num );
 
 private:
 	CTopology( const CTopology &other );
@@ -53,6 +70,9 @@ private:
 	bool LoadCoordinates( const char *crdFile, int crdNature );
 	void PostProcess();
 	void Print() const;
+	void AllocateTrajThreads( int count );
+	void FreeTrajThreads();
+	void CloseTrajFiles();
 
 	void CopyTrimmed( name_t *dst, const name_t *src ) const;
 	void ParseTopology_PDBLine( const char *line, atom_t *top ) const;
@@ -61,8 +81,11 @@ private:
 	bool LoadTopology_AMBER( const char *topFile );
 	bool LoadCoordinates_PDB( const char *crdFile, coord3_t *out_coords );
 	bool LoadCoordinates_AMBER( const char *crdFile, coord3_t *out_coords );
-	uint32 ProcessTrajectory_PDB( const char *trajFile, size_t firstSnap, TrajectoryCallback_t func, bool pacifier );
-	uint32 ProcessTrajectory_AMBER( const char *trajFile, size_t firstSnap, TrajectoryCallback_t func, bool pacifier );
+	uint32 ProcessTrajectoryList( uint32 trajCount, const char *const *trajFiles, const int *trajNatures, size_t firstSnap, size_t lastSnap, size_t snapStride, TrajectoryCallback_t func, bool pacifier );
+	void LoadFrame_AMBER( trajThread_t *tt, uint32 num );
+	void ScanTrajectory_PDB( uint32 replica, std::vector<trajItem_t> &items );
+	void ScanTrajectory_AMBER( uint32 replica, std::vector<trajItem_t> &items );
+	void BuildFrameList( uint32 replica, size_t totalSnaps, std::vector<trajItem_t> &items );
 
 public:
 	typedef std::map<uint64,real> ChargeMap;
@@ -79,17 +102,21 @@ private:
 	size_t					atcount_;
 	atom_t					*atoms_;
 	coord3_t				*coords_base_;
-	coord3_t				*coords_traj_[MAX_THREADS];
 	size_t					remsize_;
 	char					*remarks_;
 	size_t					solvsize_;
 	bool					chargeok_;
 	TrajectoryCallback_t	callback_;
-	trajItemPDB_t			*trajItems_;
-	size_t					framebase_;
-	size_t					framesize_;
-	FILE					*file_traj_[MAX_THREADS];
-	char					*frame_buf_[MAX_THREADS];
+	std::vector<trajItem_t>	trajItems_;
+	std::vector<trajReplica_t>	trajReplicas_;
+	size_t					framefirst_;
+	size_t					framelast_;
+	size_t					framestride_;
+	size_t					framemaxsize_;
+	bool					framelimit_;
+	TrajectoryFilter_t		filter_;
+	trajThread_t			*traj_threads_;
+	int						traj_thread_count_;
 };
 
 static CTopology topologyLocal;
@@ -99,14 +126,9 @@ ITopology *topology = &topologyLocal;
 
 const real CTopology :: c_AmberChargeScale = real( 18.2223 );
 
-static void Stub_ProcessTrajectoryThread_PDB( uint32 threadnum, uint32 num )
-{
-	topologyLocal.ProcessTrajectoryThread_PDB( threadnum, num );
-}
-
-static void Stub_ProcessTrajectoryThread_AMBER( uint32 threadnum, uint32 num )
+static void Stub_ProcessTrajectoryThread( uint32 threadnum, uint32 num )
 {
-	topologyLocal.ProcessTrajectoryThread_AMBER( threadnum, num );
+	topologyLocal.ProcessTrajectoryThread( threadnum, num );
 }
 
 //////////////////////////////////////////////////////////////////////////
@@ -193,11 +215,9 @@ static void SolvRes_LoadResidues( ICfgFile *cfg )
 }
 
 CTopology :: CTopology() : atcount_( 0 ), atoms_( nullptr ), coords_base_( nullptr ),
-						   remsize_( 0 ), remarks_( nullptr ), solvsize_( 0 ), chargeok_( false ), callback_( nullptr )
+						   remsize_( 0 ), remarks_( nullptr ), solvsize_( 0 ), chargeok_( false ), callback_( nullptr ),
+						   framefirst_( 0 ), framelast_( 0 ), framestride_( 1 ), framemaxsize_( 0 ), framelimit_( false ), filter_( nullptr ), traj_threads_( nullptr ), traj_thread_count_( 0 )
 {
-	memset( coords_traj_, 0, sizeof(coords_traj_) );
-	memset( file_traj_, 0, sizeof(file_traj_) );
-	memset( frame_buf_, 0, sizeof(frame_buf_) );
 }
 
 CTopology :: ~CTopology()
@@ -206,10 +226,8 @@ CTopology :: ~CTopology()
 	// we must have all dynamic data already deleted
 	assert( atoms_ == nullptr );
 	assert( coords_base_ == nullptr );
-	assert( coords_traj_[0] == nullptr );
-	assert( file_traj_[0] == nullptr );
+	assert( traj_threads_ == nullptr );
 	assert( remarks_ == nullptr );
-	assert( frame_buf_[0] == nullptr );
 }
 
 void CTopology :: Initialize()
@@ -228,10 +246,6 @@ void CTopology :: Clear()
 	chargeok_ = false;
 	callback_ = nullptr;
 
-	memset( coords_traj_, 0, sizeof(coords_traj_) );
-	memset( file_traj_, 0, sizeof(file_traj_) );
-	memset( frame_buf_, 0, sizeof(frame_buf_) );
-
 	if ( atoms_ ) {
 		utils->Free( atoms_ );
 		atoms_ = nullptr;
@@ -240,22 +254,57 @@ void CTopology :: Clear()
 		utils->Free( coords_base_ );
 		coords_base_ = nullptr;
 	}
-	for ( uint32 i = 0; i < MAX_THREADS; ++i ) {
-		if ( coords_traj_[i] ) {
-			utils->Free( coords_traj_[i] );
-			coords_traj_[i] = nullptr;
-		}
-		if ( frame_buf_[i] ) {
-			utils->Free( frame_buf_[i] );
-			frame_buf_[i] = nullptr;
-		}
-	}
+	FreeTrajThreads();
 	if ( remarks_ ) {
 		utils->Free( remarks_ );
 		remarks_ = nullptr;
 	}
 }
 
+void CTopology :: AllocateTrajThreads( int count )
+{
+	assert( traj_threads_ == nullptr );
+
+	// each thread gets its own cache line(s)
+	traj_threads_ = reinterpret_cast<trajThread_t*>( utils->AllocAligned( sizeof(trajThread_t) * count, CACHE_LINE_SIZE ) );
+	traj_thread_count_ = count;
+}
+
+void CTopology :: FreeTrajThreads()
+{
+	if ( !traj_threads_ )
+		return;
+
+	for ( int i = 0; i < traj_thread_count_; ++i ) {
+		trajThread_t *tt = &traj_threads_[i];
+		assert( tt->files == nullptr );
+		if ( tt->coords )
+			utils->Free( tt->coords );
+		if ( tt->frame )
+			utils->Free( tt->frame );
+	}
+	utils->FreeAligned( traj_threads_ );
+	traj_threads_ = nullptr;
+	traj_thread_count_ = 0;
+}
+
+void CTopology :: CloseTrajFiles()
+{
+	for ( int i = 0; i < traj_thread_count_; ++i ) {
+		trajThread_t *tt = &traj_threads_[i];
+		if ( tt->files ) {
+			for ( size_t j = 0; j < trajReplicas_.size(); ++j )
+				if ( tt->files[j] ) fclose( tt->files[j] );
+			utils->Free( tt->files );
+			tt->files = nullptr;
+		}
+		if ( tt->frame ) {
+			utils->Free( tt->frame );
+			tt->frame = nullptr;
+		}
+	}
+}
+
 bool CTopology :: Load( const char *topFile, int topNature, const char *crdFile, int crdNature )
 {
 	assert( topFile != nullptr );
@@ -419,25 +468,144 @@ bool CTopology :: LoadCoordinates( const char *crdFile, int crdNature )
 	return false;
 }
 
-uint32 CTopology :: ProcessTrajectory( const char *trajFile, int trajNature, size_t firstSnap, TrajectoryCallback_t func, bool pacifier )
+void CTopology :: BuildFrameList( uint32 replica, size_t totalSnaps, std::vector<trajItem_t> &items )
 {
+	// absolute numbers of snapshots in [framefirst_, framelast_) taken with framestride_,
+	// except those rejected by the filter (e.g. already done before a restart);
+	// the filter and the callback get snapshot numbers tagged with the replica (see TRAJ_SNAPSHOT)
+	const char *trajFile = trajReplicas_[replica].file;
+	if ( framelimit_ && totalSnaps > TRAJ_MAX_FRAMES )
+		utils->Fatal( "too many snapshots in \"%s\" (%u max per trajectory)!\n", trajFile, TRAJ_MAX_FRAMES );
+
+	const size_t last = framelast_ ? std::min( framelast_, totalSnaps ) : totalSnaps;
+	uint32 skipped = 0;
+	items.clear();
+	for ( size_t i = framefirst_; i < last; i += framestride_ ) {
+		const trajItem_t item = { replica, static_cast<uint32>( i ), nullptr };
+		if ( !filter_ || filter_( TRAJ_SNAPSHOT( replica, i ) ) )
+			items.push_back( item );
+		else
+			++skipped;
+	}
+
+	if ( skipped )
+		console->Print( "Skipping %u snapshots, %u to process\n", skipped, static_cast<uint32>( items.size() ) );
+	else if ( !items.size() )
+		utils->Warning( "no snapshots to process in \"%s\" (%u total)\n", trajFile, static_cast<uint32>( totalSnaps ) );
+}
+
+void CTopology :: SetTrajectoryFilter( TrajectoryFilter_t func )
+{
+	filter_ = func;
+}
+
+uint32 CTopology :: ProcessTrajectory( const char *trajFile, int trajNature, size_t firstSnap, size_t lastSnap, size_t snapStride, TrajectoryCallback_t func, bool pacifier )
+{
+	// a single trajectory is not limited in length, snapshot numbers are plain frame numbers
+	framelimit_ = false;
+	return ProcessTrajectoryList( 1, &trajFile, &trajNature, firstSnap, lastSnap, snapStride, func, pacifier );
+}
+
+uint32 CTopology :: ProcessTrajectories( uint32 trajCount, const char *const *trajFiles, const int *trajNatures, size_t firstSnap, size_t lastSnap, size_t snapStride, TrajectoryCallback_t func, bool pacifier )
+{
+	// several trajectories (replicas) share the snapshot number space
+	framelimit_ = true;
+	return ProcessTrajectoryList( trajCount, trajFiles, trajNatures, firstSnap, lastSnap, snapStride, func, pacifier );
+}
+
+uint32 CTopology :: ProcessTrajectoryList( uint32 trajCount, const char *const *trajFiles, const int *trajNatures, size_t firstSnap, size_t lastSnap, size_t snapStride, TrajectoryCallback_t func, bool pacifier )
+{
+	const int runFlags = RF_PROGRESS | ( pacifier ? RF_PACIFIER : 0 );
+
 	assert( atcount_ != 0 );
 	assert( func != nullptr );
+	assert( trajCount != 0 );
+
+	if ( trajCount > TRAJ_MAX_REPLICAS )
+		utils->Fatal( "too many trajectories (%u max)!\n", TRAJ_MAX_REPLICAS );
+
+	// snapshot range; callbacks get absolute snapshot numbers
+	framefirst_ = firstSnap;
+	framelast_ = lastSnap;
+	framestride_ = std::max<size_t>( snapStride, 1 );
+	framemaxsize_ = 0;
+
+	// only threads that own frames need coordinate buffers;
+	// these are allocated by the owning thread, so the memory is local to its node
+	if ( traj_thread_count_ != ThreadFramesInFlight() ) {
+		FreeTrajThreads();
+		AllocateTrajThreads( ThreadFramesInFlight() );
+	}
 
-	for ( int i = 0; i < ThreadCount(); ++i ) {
-		if ( !coords_traj_[i] )
-			coords_traj_[i] = reinterpret_cast<coord3_t*>( utils->Alloc( sizeof(coord3_t)*atcount_ ) );
+	// scan the trajectories and build their frame lists
+	std::vector<std::vector<trajItem_t>> replicaItems( trajCount );
+	size_t totalItems = 0;
+	bool supported = true;
+
+	trajReplicas_.resize( trajCount );
+	for ( uint32 i = 0; i < trajCount && supported; ++i ) {
+		trajReplica_t *rep = &trajReplicas_[i];
+		rep->file = trajFiles[i];
+		rep->nature = trajNatures[i];
+		rep->framebase = 0;
+		rep->framesize = 0;
+
+		console->Print( "Loading: \"%s\"...\n", rep->file );
+
+		switch ( rep->nature ) {
+		case TYP_LIST: ScanTrajectory_PDB( i, replicaItems[i] ); break;
+		case TYP_MDCRD: ScanTrajectory_AMBER( i, replicaItems[i] ); break;
+		default:
+			utils->Warning( "unsupported trajectory nature \"%s\" (%i)\n", NatureHelper( rep->nature ).toString(), rep->nature );
+			supported = false;
+			break;
+		}
+		totalItems += replicaItems[i].size();
 	}
 
-	console->Print( "Loading: \"%s\"...\n", trajFile );
+	// interleave the frames of the replicas, so that all of them are processed at the same rate
+	trajItems_.clear();
+	if ( supported ) {
+		trajItems_.reserve( totalItems );
+		for ( size_t j = 0; trajItems_.size() < totalItems; ++j ) {
+			for ( uint32 i = 0; i < trajCount; ++i ) {
+				if ( j < replicaItems[i].size() )
+					trajItems_.push_back( replicaItems[i][j] );
+			}
+		}
+	}
 
-	switch ( trajNature ) {
-	case TYP_LIST: return ProcessTrajectory_PDB( trajFile, firstSnap, func, pacifier );
-	case TYP_MDCRD: return ProcessTrajectory_AMBER( trajFile, firstSnap, func, pacifier );
-	default: break;
+	const uint32 snapshotNum = static_cast<uint32>( trajItems_.size() );
+	if ( snapshotNum ) {
+		callback_ = func;
+
+		// process the trajectory items
+#if defined(_QTASSE)
+		console->Print( "<b>%s:</b>\n", "ProcessTrajectory" );
+#else
+		console->Print( CC_WHITE "%s:\n", "ProcessTrajectory" );
+#endif
+		// per-snapshot records are written by a background thread
+		if ( gpGlobals->log_level >= LOG_LEVEL_SNAPSHOTS )
+			logfile->BeginAsync( static_cast<uint32>( ThreadCount() ) );
+		RunThreadsOnIndividual( snapshotNum, runFlags, Stub_ProcessTrajectoryThread );
+		logfile->EndAsync();
+
+		callback_ = nullptr;
 	}
-	utils->Warning( "unsupported trajectory nature \"%s\" (%i)\n", NatureHelper( trajNature ).toString(), trajNature );
-	return 0;
+
+	// close files of the threads and free trajectory items
+	CloseTrajFiles();
+	for ( auto it = replicaItems.begin(); it != replicaItems.end(); ++it ) {
+		for ( auto itItem = it->begin(); itItem != it->end(); ++itItem ) {
+			if ( itItem->pdbfile )
+				utils->Free( itItem->pdbfile );
+		}
+	}
+	trajItems_.clear();
+	trajReplicas_.clear();
+
+	return ThreadInterrupted() ? 0 : snapshotNum;
 }
 
 void CTopology :: PostProcess()
@@ -981,26 +1149,44 @@ bool CTopology :: LoadCoordinates_AMBER( const char *crdFile, coord3_t *out_coor
 	return true;
 }
 
-void CTopology :: ProcessTrajectoryThread_PDB( uint32 threadnum, uint32 num )
+void CTopology :: ProcessTrajectoryThread( uint32 threadnum, uint32 num )
 {
-	trajItemPDB_t *item = &trajItems_[num];
-	assert( item->pdbfile != nullptr );
-	assert( coords_traj_[threadnum] != nullptr );
+	const trajItem_t *item = &trajItems_[num];
+	assert( static_cast<int>( threadnum ) < traj_thread_count_ );
+	trajThread_t *tt = &traj_threads_[threadnum];
+	if ( !tt->coords )
+		tt->coords = reinterpret_cast<coord3_t*>( utils->Alloc( sizeof(coord3_t)*atcount_ ) );
+
+	if ( trajReplicas_[item->replica].nature == TYP_LIST ) {
+		assert( item->pdbfile != nullptr );
+		// the lines are parsed as they are read, all of it counts as reading
+		const double startTime = utils->FloatMilliseconds();
+		if ( !LoadCoordinates_PDB( item->pdbfile, tt->coords ) )
+			return;
+		tt->readTime = utils->FloatMilliseconds() - startTime;
+		tt->parseTime = -1;
+	} else {
+		LoadFrame_AMBER( tt, num );
+	}
+
+	callback_( threadnum, TRAJ_SNAPSHOT( item->replica, item->frame ), tt->coords );
+}
 
-	if ( LoadCoordinates_PDB( item->pdbfile, coords_traj_[threadnum] ) )
-		callback_( threadnum, num, coords_traj_[threadnum] );
+void CTopology :: GetFrameTimes( uint32 threadNum, double &readTime, double &parseTime ) const
+{
+	assert( static_cast<int>( threadNum ) < traj_thread_count_ );
+	readTime = traj_threads_[threadNum].readTime;
+	parseTime = traj_threads_[threadNum].parseTime;
 }
 
-uint32 CTopology :: ProcessTrajectory_PDB( const char *trajFile, size_t firstSnap, TrajectoryCallback_t func, bool pacifier )
+void CTopology :: ScanTrajectory_PDB( uint32 replica, std::vector<trajItem_t> &items )
 {
 	FILE *fp;
 	char line[MAX_OSPATH];
 	char trimline[MAX_OSPATH];
 	char trajpath[MAX_OSPATH];
 	char fullpath[MAX_OSPATH];
-	const int runFlags = RF_PROGRESS | ( pacifier ? RF_PACIFIER : 0 );
-
-	callback_ = func;
+	const char *trajFile = trajReplicas_[replica].file;
 
 	if ( fopen_s( &fp, trajFile, "rb" ) )
 		utils->Fatal( "failed to open \"%s\" for reading!\n", trajFile );
@@ -1008,32 +1194,31 @@ uint32 CTopology :: ProcessTrajectory_PDB( const char *trajFile, size_t firstSna
 	utils->ExtractFilePath( trajpath, sizeof(trajpath), trajFile );
 	if ( !0[trajpath] ) strcpy_s( trajpath, "." );
 
-	uint32 snapshotNum = 0;
 	size_t c = 0;
 
 	while ( fgets( line, sizeof(line), fp ) ) {
 		// skip empty lines
 		if ( static_cast<uint8>( line[0] ) <= 32 )
 			continue;
-		// skip N first snapshots
-		if ( c++ < firstSnap )
-			continue;
-		++snapshotNum;
+		++c;
 	}
 
-	trajItems_ = reinterpret_cast<trajItemPDB_t*>( utils->Alloc( sizeof(trajItemPDB_t) * snapshotNum ) );
-	assert( trajItems_ != nullptr );
+	BuildFrameList( replica, c, items );
+	if ( !items.size() ) {
+		fclose( fp );
+		return;
+	}
 
 	rewind( fp );
 	c = 0;
 
-	trajItemPDB_t *curItem = trajItems_;
-	while ( fgets( line, sizeof(line), fp ) ) {
+	auto curItem = items.begin();
+	while ( fgets( line, sizeof(line), fp ) && curItem != items.end() ) {
 		// skip empty lines
 		if ( static_cast<uint8>( line[0] ) <= 32 )
 			continue;
-		// skip N first snapshots
-		if ( c++ < firstSnap )
+		// take snapshots from the list only
+		if ( c++ != curItem->frame )
 			continue;
 		// get pdb name
 		utils->Trim( trimline, sizeof(trimline), line );
@@ -1045,43 +1230,35 @@ uint32 CTopology :: ProcessTrajectory_PDB( const char *trajFile, size_t firstSna
 	}
 
 	fclose( fp );
-
-	// process the trajectory items
-#if defined(_QTASSE)
-	console->Print( "<b>%s:</b>\n", "ProcessTrajectory" );
-#else
-	console->Print( CC_WHITE "%s:\n", "ProcessTrajectory" );
-#endif
-	RunThreadsOnIndividual( snapshotNum, runFlags, Stub_ProcessTrajectoryThread_PDB );
-
-	// free trajectory items
-	curItem = trajItems_;
-	for ( uint32 i = 0; i < snapshotNum; ++i, ++curItem ) {
-		assert( curItem->pdbfile != nullptr );
-		utils->Free( curItem->pdbfile );
-	}
-	utils->Free( trajItems_ );
-	trajItems_ = nullptr;
-
-	callback_ = nullptr;
-
-	return ThreadInterrupted() ? 0 : snapshotNum;
 }
 
-void CTopology :: ProcessTrajectoryThread_AMBER( uint32 threadnum, uint32 num )
+void CTopology :: LoadFrame_AMBER( trajThread_t *tt, uint32 num )
 {
-	assert( coords_traj_[threadnum] != nullptr );
-	FILE *fp = file_traj_[threadnum];
-	char *fb = frame_buf_[threadnum];
+	const trajItem_t *item = &trajItems_[num];
+	const trajReplica_t *rep = &trajReplicas_[item->replica];
+	const double startTime = utils->FloatMilliseconds();
+
+	// each thread opens the trajectories it reads on first use
+	// and allocates a frame buffer that fits frames of all of them
+	if ( !tt->files )
+		tt->files = reinterpret_cast<FILE**>( utils->Alloc( sizeof(FILE*) * trajReplicas_.size() ) );
+	if ( !tt->frame )
+		tt->frame = reinterpret_cast<char*>( utils->Alloc( framemaxsize_ ) );
+	FILE *&fp = tt->files[item->replica];
+	if ( !fp && fopen_s( &fp, rep->file, "rb" ) )
+		utils->Fatal( "failed to open \"%s\" for reading (thread %i)!\n", rep->file, static_cast<int>( tt - traj_threads_ ) );
+	char *fb = tt->frame;
 	char line[96];
 
-	fu_seek( fp, framebase_ + framesize_ * num, SEEK_SET );
-	const size_t readsize = fread( fb, 1, framesize_, fp );
+	fu_seek( fp, rep->framebase + rep->framesize * item->frame, SEEK_SET );
+	const size_t readsize = fread( fb, 1, rep->framesize, fp );
+	const double readTime = utils->FloatMilliseconds();
+	tt->readTime = readTime - startTime;
 
 	// parse coords
 	bool eof = false;
 	size_t framepos = 0;
-	real *current_coords = &coords_traj_[threadnum]->x;
+	real *current_coords = &tt->coords->x;
 	for ( size_t i = 0; i < atcount_ && !eof; ++i ) {
 		for ( size_t j = 0; j < 3; ++j, ++current_coords ) {
 			const size_t col = ( i * 3 + j ) % 10;
@@ -1107,20 +1284,19 @@ void CTopology :: ProcessTrajectoryThread_AMBER( uint32 threadnum, uint32 num )
 	}
 
 	if ( eof ) {
-		logfile->Print( "EOF while parsing frame %u at pos %u/%u\n", num, (unsigned)framepos, (unsigned)framesize_ );
+		logfile->Print( "EOF while parsing frame %u at pos %u/%u\n", num, (unsigned)framepos, (unsigned)rep->framesize );
 		utils->Fatal( "unexpected EOF in AMBER trajectory!\n" );
 	}
 
-	callback_( threadnum, num, coords_traj_[threadnum] );
+	tt->parseTime = utils->FloatMilliseconds() - readTime;
 }
 
-uint32 CTopology :: ProcessTrajectory_AMBER( const char *trajFile, size_t firstSnap, TrajectoryCallback_t func, bool pacifier )
+void CTopology :: ScanTrajectory_AMBER( uint32 replica, std::vector<trajItem_t> &items )
 {
 	FILE *fp;
 	char line[96];
-	const int runFlags = RF_PROGRESS | ( pacifier ? RF_PACIFIER : 0 );
-
-	callback_ = func;
+	trajReplica_t *rep = &trajReplicas_[replica];
+	const char *trajFile = rep->file;
 
 	if ( fopen_s( &fp, trajFile, "rb" ) )
 		utils->Fatal( "failed to open \"%s\" for reading!\n", trajFile );
@@ -1150,45 +1326,19 @@ uint32 CTopology :: ProcessTrajectory_AMBER( const char *trajFile, size_t firstS
 	fileOfs_t frameSizeInBytes = frameEnd - frameStart;
 
 	// count total frames
+	// (an incomplete frame at the end of a growing trajectory is left for the next run)
 	fu_seek( fp, 0, SEEK_END );
 	fileOfs_t fileEnd = fu_tell( fp );
 	fileOfs_t totalFrames = ( fileEnd - frameStart ) / frameSizeInBytes;
 	assert( totalFrames > 0 );
 	fclose( fp );
-	uint32 snapshotNum = (uint32)( totalFrames - firstSnap );
 
-	framebase_ = static_cast<size_t>( frameStart + frameSizeInBytes * firstSnap );
-	framesize_ = static_cast<size_t>( frameSizeInBytes );
+	BuildFrameList( replica, static_cast<size_t>( totalFrames ), items );
+	if ( !items.size() )
+		return;
 
-	// open a file for each thread
-	int numthreads = ThreadCount();
-	for ( int i = 0; i < numthreads; ++i ) {
-		if ( fopen_s( &file_traj_[i], trajFile, "rb" ) )
-			utils->Fatal( "failed to open \"%s\" for reading (thread %i)!\n", trajFile, i );
-		frame_buf_[i] = reinterpret_cast<char*>( utils->Alloc( framesize_ ) );
-	}
-
-	// process the trajectory items
-#if defined(_QTASSE)
-	console->Print( "<b>%s:</b>\n", "ProcessTrajectory" );
-#else
-	console->Print( CC_WHITE "%s:\n", "ProcessTrajectory" );
-#endif
-	RunThreadsOnIndividual( snapshotNum, runFlags, Stub_ProcessTrajectoryThread_AMBER );
-
-	// free trajectory items
-	utils->Free( trajItems_ );
-	trajItems_ = nullptr;
-
-	// close a file for each thread
-	for ( int i = 0; i < numthreads; ++i ) {
-		fclose( file_traj_[i] );
-		file_traj_[i] = nullptr;
-		utils->Free( frame_buf_[i] );
-		frame_buf_[i] = nullptr;
-	}
-
-	callback_ = nullptr;
-
-	return ThreadInterrupted() ? 0 : snapshotNum;
+	// trajectories may differ in frame layout (e.g. only some of them have PBC)
+	rep->framebase = static_cast<size_t>( frameStart );
+	rep->framesize = static_cast<size_t>( frameSizeInBytes );
+	framemaxsize_ = std::max( framemaxsize_, rep->framesize );
 }
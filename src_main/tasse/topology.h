@@ -68,21 +68,43 @@ typedef struct coord4_s {
 	real	r;
 } coord4_t;
 
+// single-precision coordinates (for the float32 compute path)
+typedef struct coord3f_s {
+	float	x;
+	float	y;
+	float	z;
+} coord3f_t;
+
 static_assert( sizeof(coord3_t) == ( 3 * sizeof(real) ), "sizeof(coord3_t) must be 3 * sizeof(real)" );
+static_assert( sizeof(coord3f_t) == ( 3 * sizeof(float) ), "sizeof(coord3f_t) must be 3 * sizeof(float)" );
 static_assert( sizeof(coord4_t) == ( 4 * sizeof(real) ), "sizeof(coord4_t) must be 4 * sizeof(real)" );
 
+// snapshot numbers of trajectories processed together (replicas) carry
+// the index of the trajectory in the high bits; the first one (and a single 
+// trajectory) keeps plain frame numbers
+#define TRAJ_REPLICA_SHIFT		24
+#define TRAJ_MAX_REPLICAS		( 1u << ( 32 - TRAJ_REPLICA_SHIFT ) )
+#define TRAJ_MAX_FRAMES			( 1u << TRAJ_REPLICA_SHIFT )
+#define TRAJ_SNAPSHOT( r, f )	( ( static_cast<uint32>( r ) << TRAJ_REPLICA_SHIFT ) | static_cast<uint32>( f ) )
+#define TRAJ_REPLICA( s )		( static_cast<uint32>( s ) >> TRAJ_REPLICA_SHIFT )
+#define TRAJ_FRAME( s )			( static_cast<uint32>( s ) & ( TRAJ_MAX_FRAMES - 1 ) )
+
 interface ITopology
 {
 	typedef void (*TrajectoryCallback_t)( uint32, uint32, const coord3_t* );
+	typedef bool (*TrajectoryFilter_t)( uint32 );
 	virtual void Initialize() = 0;
 	virtual void Clear() = 0;
 	virtual bool Load( const char *topFile, int topNature, const char *crdFile, int crdNature ) = 0;
 	virtual bool Save( const char *outFile ) = 0;
-	virtual uint32 ProcessTrajectory( const char *trajFile, int trajNature, size_t firstSnap, TrajectoryCallback_t func, bool pacifier ) = 0;
+	virtual uint32 ProcessTrajectory( const char *trajFile, int trajNature, size_t firstSnap, size_t lastSnap, size_t snapStride, TrajectoryCallback_t func, bool pacifier ) = 0;
+	virtual uint32 ProcessTrajectories( uint32 trajCount, const char *const *trajFiles, const int *trajNatures, size_t firstSnap, size_t lastSnap, size_t snapStride, TrajectoryCallback_t func, bool pacifier ) = 0;
+	virtual void SetTrajectoryFilter( TrajectoryFilter_t func ) = 0;
 	virtual size_t GetAtomCount() const = 0;
 	virtual size_t GetSolventSize() const = 0;
 	virtual atom_t *GetAtomArray() const = 0;
 	virtual coord3_t *GetBaseCoords() const = 0;
+	virtual void GetFrameTimes( uint32 threadNum, double &readTime, double &parseTime ) const = 0;
 };
 
 extern ITopology *topology;
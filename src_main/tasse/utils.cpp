@@ -25,6 +25,8 @@ class CUtils : public IUtils
 public:
 	virtual void *Alloc( size_t numbytes );
 	virtual void Free( void *ptr );
+	virtual void *AllocAligned( size_t numbytes, size_t alignment );
+	virtual void FreeAligned( void *ptr );
 	virtual char *StrDup( const char *s );
 	virtual void Warning( const char *fmt, ... );
 	virtual void Fatal( const char *fmt, ... );
@@ -38,6 +40,7 @@ public:
 	virtual int ExtractFilePath( char *dst, size_t size, const char *src );
 	virtual	int ExtractFileExtension( char *dest, size_t size, const char *path );
 	virtual int GetMainDirectory( char *out, size_t outSize );
+	virtual bool WriteFileAtomic( const char *path, const void *data, size_t size );
 private:
 	static const size_t c_MaxFoundFiles = 8192;
 };
@@ -62,6 +65,34 @@ void CUtils :: Free( void *ptr )
 		free( ptr );
 }
 
+void *CUtils :: AllocAligned( size_t numbytes, size_t alignment )
+{
+	assert( numbytes != 0 );
+	assert( alignment != 0 && !( alignment & ( alignment - 1 ) ) );
+#if defined(_WIN32)
+	void *result = _aligned_malloc( numbytes, alignment );
+#else
+	void *result = nullptr;
+	if ( posix_memalign( &result, std::max( alignment, sizeof(void*) ), numbytes ) )
+		result = nullptr;
+#endif
+	if ( !result )
+		utils->Fatal( "aligned memory allocation failed on %u bytes!\n", (uint32)numbytes );
+	memset( result, 0, numbytes );
+	return result;
+}
+
+void CUtils :: FreeAligned( void *ptr )
+{
+	if ( !ptr )
+		return;
+#if defined(_WIN32)
+	_aligned_free( ptr );
+#else
+	free( ptr );
+#endif
+}
+
 char *CUtils :: StrDup( const char *s )
 {
 	if ( !s ) return nullptr;
@@ -506,3 +537,35 @@ int CUtils :: GetMainDirectory( char *out, size_t outSize )
 	return 1;
 }
 
+bool CUtils :: WriteFileAtomic( const char *path, const void *data, size_t size )
+{
+	// write a temporary file and replace the target with it,
+	// so the target is never left partially written
+	// (no messages here, this can be called from a background thread)
+	char tmppath[MAX_OSPATH];
+	sprintf_s( tmppath, sizeof(tmppath), "%s.tmp", path );
+
+	FILE *fp;
+	if ( fopen_s( &fp, tmppath, "wb" ) )
+		return false;
+	bool result = ( !size || fwrite( data, 1, size, fp ) == size ) && !fflush( fp );
+#if defined(_WIN32)
+	if ( result )
+		result = !_commit( _fileno( fp ) );
+#else
+	if ( result )
+		result = !fsync( fileno( fp ) );
+#endif
+	fclose( fp );
+
+	if ( result ) {
+#if defined(_WIN32)
+		result = ( MoveFileEx( tmppath, path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH ) != FALSE );
+#else
+		result = !rename( tmppath, path );
+#endif
+	}
+	if ( !result )
+		remove( tmppath );
+	return result;
+}